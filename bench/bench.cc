@@ -0,0 +1,455 @@
+// Microbenchmarks for each stage of the compile pipeline, run over the test
+// corpus and some synthetic scripts. Results are meant to be compared between
+// commits, so everything is run in a fixed order a fixed number of times.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#  include <sys/resource.h>
+#endif
+
+#include "cxxopt.hh"
+
+#include "tailslide.hh"
+#include "bitstream.hh"
+#include "passes/pretty_print.hh"
+#include "passes/tree_simplifier.hh"
+#include "passes/lso/script_compiler.hh"
+#include "passes/mono/script_compiler.hh"
+
+#include "script_generator.hh"
+
+using namespace Tailslide;
+namespace fs = std::filesystem;
+
+// Count every heap allocation made through new, which is nearly all of them.
+// The benchmark is single-threaded so these don't need to be atomic.
+static uint64_t gAllocations = 0;
+static uint64_t gAllocatedBytes = 0;
+
+void *operator new(size_t size) {
+  ++gAllocations;
+  gAllocatedBytes += size;
+  if (void *ptr = malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+
+static uint64_t peak_rss_kb() {
+#ifndef _WIN32
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+#  ifdef __APPLE__
+  return (uint64_t)usage.ru_maxrss / 1024;
+#  else
+  return (uint64_t)usage.ru_maxrss;
+#  endif
+#else
+  return 0;
+#endif
+}
+
+struct BenchInput {
+  std::string name;
+  std::string source;
+};
+
+struct PhaseSamples {
+  std::vector<uint64_t> nanos;
+  uint64_t allocations = 0;
+  uint64_t allocated_bytes = 0;
+};
+
+/// kept in the order the phases first ran so results read like the pipeline
+typedef std::vector<std::pair<std::string, PhaseSamples>> PhaseList;
+
+struct PhaseResult {
+  std::string script;
+  std::string phase;
+  size_t iterations;
+  uint64_t median_ns;
+  uint64_t p99_ns;
+  uint64_t min_ns;
+  uint64_t mean_ns;
+  /// per iteration, they don't vary between runs
+  uint64_t allocations;
+  uint64_t allocated_bytes;
+};
+
+/// Times whatever happens between `start()` and `stop()` and adds it to the named phase.
+class PhaseTimer {
+  public:
+    explicit PhaseTimer(PhaseList *phases, bool recording)
+        : _mPhases(phases), _mRecording(recording) {}
+
+    void start() {
+      _mAllocations = gAllocations;
+      _mAllocatedBytes = gAllocatedBytes;
+      _mStart = std::chrono::steady_clock::now();
+    }
+
+    void stop(const char *phase) {
+      auto elapsed = std::chrono::steady_clock::now() - _mStart;
+      if (!_mRecording)
+        return;
+      auto it = std::find_if(_mPhases->begin(), _mPhases->end(), [&](const auto &entry) {
+        return entry.first == phase;
+      });
+      if (it == _mPhases->end())
+        it = _mPhases->insert(it, {phase, {}});
+      auto &samples = it->second;
+      samples.nanos.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+      samples.allocations += gAllocations - _mAllocations;
+      samples.allocated_bytes += gAllocatedBytes - _mAllocatedBytes;
+    }
+
+  protected:
+    PhaseList *_mPhases;
+    bool _mRecording;
+    std::chrono::steady_clock::time_point _mStart {};
+    uint64_t _mAllocations = 0;
+    uint64_t _mAllocatedBytes = 0;
+};
+
+static const std::pair<const char *, OptimizationOptions> OPTIMIZATION_LEVELS[] = {
+    {"optimize_O1", {.fold_constants = true}},
+    {"optimize_O2", {.fold_constants = true, .prune_unused_locals = true, .prune_unused_globals = true,
+                     .prune_unused_functions = true}},
+    {"optimize_O3", {.fold_constants = true, .prune_unused_locals = true, .prune_unused_globals = true,
+                     .prune_unused_functions = true, .eliminate_common_subexpressions = true}},
+};
+
+/// Run the whole pipeline over the script once, timing each stage. Returns false if
+/// the script has errors, anything past analysis is skipped in that case.
+static bool run_pipeline(const BenchInput &input, PhaseList *phases, bool recording) {
+  PhaseTimer timer(phases, recording);
+  ScopedScriptParser parser(nullptr);
+
+  timer.start();
+  auto *script = parser.parseLSLBytes(input.source.data(), (int)input.source.size());
+  timer.stop("parse");
+  if (!script)
+    return false;
+
+  timer.start();
+  script->collectSymbols();
+  timer.stop("collect_symbols");
+  timer.start();
+  script->determineTypes();
+  timer.stop("determine_types");
+  timer.start();
+  script->recalculateReferenceData();
+  timer.stop("reference_data");
+  timer.start();
+  script->propagateValues();
+  timer.stop("propagate_values");
+  timer.start();
+  script->finalPass();
+  timer.stop("final_pass");
+  if (parser.logger.getErrors())
+    return false;
+
+  // compare with everything from parse through final_pass, which loading replaces
+  timer.start();
+  auto serialized = parser.serializeScript();
+  timer.stop("serialize");
+  {
+    ScopedScriptParser loaded(nullptr);
+    timer.start();
+    loaded.loadSerializedBytes(serialized.data(), serialized.size());
+    timer.stop("load_serialized");
+  }
+
+  // each level gets its own copy of the analyzed tree
+  for (const auto &level : OPTIMIZATION_LEVELS) {
+    auto forked = parser.fork();
+    auto options = level.second;
+    options.mono_semantics = true;
+    timer.start();
+    forked->script->optimize(options);
+    timer.stop(level.first);
+  }
+
+  timer.start();
+  PrettyPrintVisitor print_visitor(PrettyPrintOpts {});
+  script->visit(&print_visitor);
+  print_visitor.mStream.str();
+  timer.stop("pretty_print");
+
+  // the backends may rewrite the tree as they go, give each its own copy.
+  // Some scripts are only valid under one of them.
+  auto lso_fork = parser.fork();
+  lso_fork->script->validateGlobals(false);
+  if (!lso_fork->logger.getErrors()) {
+    timer.start();
+    LSOScriptCompiler lso_visitor(&lso_fork->allocator);
+    lso_fork->script->visit(&lso_visitor);
+    timer.stop("lso");
+  }
+
+  auto mono_fork = parser.fork();
+  mono_fork->script->validateGlobals(true);
+  if (!mono_fork->logger.getErrors()) {
+    timer.start();
+    MonoScriptCompiler mono_visitor(&mono_fork->allocator);
+    mono_fork->script->visit(&mono_visitor);
+    mono_visitor.mCIL.str();
+    timer.stop("mono");
+  }
+  return true;
+}
+
+/// how much each way of filling a `BitStream` costs, for the same 4MB of integers.
+static void run_bitstream_writes(const std::vector<int32_t> &vals, PhaseList *phases, bool recording) {
+  PhaseTimer timer(phases, recording);
+  auto num_vals = (uint32_t)vals.size();
+  {
+    timer.start();
+    BitStream bs(ENDIAN_BIG);
+    for (auto val : vals)
+      bs << val;
+    timer.stop("one_at_a_time");
+  }
+  {
+    timer.start();
+    BitStream bs(ENDIAN_BIG);
+    bs.reserve(num_vals * sizeof(int32_t));
+    for (auto val : vals)
+      bs << val;
+    timer.stop("reserved");
+  }
+  {
+    timer.start();
+    BitStream bs(ENDIAN_BIG);
+    bs.writeSpan(vals.data(), num_vals);
+    timer.stop("span");
+  }
+  {
+    timer.start();
+    BitStream bs(ENDIAN_BIG);
+    BitStream sub_bs(ENDIAN_BIG);
+    sub_bs.writeSpan(vals.data(), num_vals);
+    bs.writeBitStream(sub_bs);
+    timer.stop("copied_substream");
+  }
+  {
+    timer.start();
+    BitStream bs(ENDIAN_BIG);
+    auto child = bs.makeChild(num_vals * sizeof(int32_t));
+    for (auto val : vals)
+      child << val;
+    bs.moveBy((int32_t)child.size());
+    timer.stop("child_stream");
+  }
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double pct) {
+  // nearest rank
+  auto rank = (size_t)std::ceil(pct / 100.0 * (double)sorted.size());
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+static void summarize(const std::string &script, PhaseList &phases,
+                      std::vector<PhaseResult> *results) {
+  for (auto &phase : phases) {
+    auto &nanos = phase.second.nanos;
+    if (nanos.empty())
+      continue;
+    std::sort(nanos.begin(), nanos.end());
+    uint64_t total = 0;
+    for (auto nano : nanos)
+      total += nano;
+    results->push_back({
+        script, phase.first, nanos.size(),
+        percentile(nanos, 50), percentile(nanos, 99), nanos.front(), total / nanos.size(),
+        phase.second.allocations / nanos.size(), phase.second.allocated_bytes / nanos.size(),
+    });
+  }
+}
+
+static std::string json_escape(const std::string &str) {
+  std::string escaped;
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      escaped += buf;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+static void write_json(std::ostream &out, const std::vector<PhaseResult> &results, size_t iterations) {
+  out << "{\n  \"iterations\": " << iterations << ",\n  \"peak_rss_kb\": " << peak_rss_kb() << ",\n";
+  out << "  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto &result = results[i];
+    out << "    {\"script\": \"" << json_escape(result.script) << "\", \"phase\": \"" << result.phase << "\", "
+        << "\"median_ns\": " << result.median_ns << ", \"p99_ns\": " << result.p99_ns << ", "
+        << "\"min_ns\": " << result.min_ns << ", \"mean_ns\": " << result.mean_ns << ", "
+        << "\"allocations\": " << result.allocations << ", \"allocated_bytes\": " << result.allocated_bytes << "}"
+        << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n}\n";
+}
+
+static void write_table(std::ostream &out, const std::vector<PhaseResult> &results) {
+  char line[256];
+  snprintf(line, sizeof(line), "%-40s %-18s %12s %12s %10s %12s\n",
+           "script", "phase", "median (us)", "p99 (us)", "allocs", "alloc KB");
+  out << line;
+  for (const auto &result : results) {
+    auto script = result.script;
+    if (script.size() > 40)
+      script = "..." + script.substr(script.size() - 37);
+    snprintf(line, sizeof(line), "%-40s %-18s %12.1f %12.1f %10llu %12.1f\n",
+             script.c_str(), result.phase.c_str(), (double)result.median_ns / 1000.0,
+             (double)result.p99_ns / 1000.0, (unsigned long long)result.allocations,
+             (double)result.allocated_bytes / 1024.0);
+    out << line;
+  }
+  out << "peak RSS: " << peak_rss_kb() << " KB\n";
+}
+
+// shapes the corpus doesn't cover, at each scale so it's clear how each stage grows.
+static std::vector<BenchInput> synthetic_inputs(const std::vector<uint32_t> &scales) {
+  std::vector<BenchInput> inputs;
+  for (auto scale : scales) {
+    for (const auto &preset : script_shape_presets(scale)) {
+      auto name = std::string("synthetic/") + preset.name + "@x" + std::to_string(scale);
+      inputs.push_back({name, generate_script(preset.shape)});
+    }
+  }
+  return inputs;
+}
+
+int main(int argc, char **argv) {
+  cxxopts::Options options("tailslide_bench", "Benchmark each stage of the compile pipeline");
+  options.add_options()
+      ("help", "Show this message")
+      ("iterations", "Timed runs of each script", cxxopts::value<size_t>()->default_value("20"))
+      ("warmup", "Untimed runs of each script before the timed ones", cxxopts::value<size_t>()->default_value("2"))
+      ("scripts-dir", "Directory of scripts to benchmark", cxxopts::value<std::string>()
+          ->default_value(TAILSLIDE_BENCH_SCRIPTS_DIR))
+      ("filter", "Only benchmark scripts with this in their name", cxxopts::value<std::string>())
+      ("no-synthetic", "Skip the synthetic scripts")
+      ("no-bitstream", "Skip the BitStream write microbenchmarks")
+      ("synthetic-scales", "Sizes to generate each synthetic script at",
+          cxxopts::value<std::vector<uint32_t>>()->default_value("1"))
+      ("json", "Write JSON results to this file, - for stdout", cxxopts::value<std::string>())
+  ;
+
+  cxxopts::ParseResult vm;
+  try {
+    auto parse_result = options.parse(argc, argv);
+    vm = std::move(parse_result);
+  } catch (cxxopts::OptionException &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << options.help() << std::endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    std::cerr << options.help() << std::endl;
+    return 0;
+  }
+
+  tailslide_init_builtins(nullptr);
+
+  std::vector<BenchInput> inputs;
+  fs::path scripts_dir(vm["scripts-dir"].as<std::string>());
+  std::error_code ec;
+  for (const auto &entry : fs::recursive_directory_iterator(scripts_dir, ec)) {
+    if (!entry.is_regular_file() || entry.path().extension() != ".lsl")
+      continue;
+    auto relative = fs::relative(entry.path(), scripts_dir).generic_string();
+    // expected outputs for the tests, not scripts
+    if (relative.rfind("expected/", 0) == 0)
+      continue;
+    std::ifstream f(entry.path(), std::ios::binary);
+    std::stringstream ss;
+    ss << f.rdbuf();
+    inputs.push_back({relative, ss.str()});
+  }
+  if (ec) {
+    fprintf(stderr, "couldn't read %s: %s\n", scripts_dir.string().c_str(), ec.message().c_str());
+    return 1;
+  }
+  std::sort(inputs.begin(), inputs.end(), [](const BenchInput &a, const BenchInput &b) {
+    return a.name < b.name;
+  });
+  if (!vm.count("no-synthetic")) {
+    for (auto &input : synthetic_inputs(vm["synthetic-scales"].as<std::vector<uint32_t>>()))
+      inputs.push_back(std::move(input));
+  }
+  if (vm.count("filter")) {
+    auto filter = vm["filter"].as<std::string>();
+    inputs.erase(std::remove_if(inputs.begin(), inputs.end(), [&](const BenchInput &input) {
+      return input.name.find(filter) == std::string::npos;
+    }), inputs.end());
+  }
+
+  auto iterations = std::max<size_t>(vm["iterations"].as<size_t>(), 1);
+  auto warmup = vm["warmup"].as<size_t>();
+  std::vector<PhaseResult> results;
+  for (const auto &input : inputs) {
+    PhaseList phases;
+    for (size_t i = 0; i < warmup; ++i)
+      run_pipeline(input, &phases, false);
+    for (size_t i = 0; i < iterations; ++i)
+      run_pipeline(input, &phases, true);
+    summarize(input.name, phases, &results);
+  }
+  const std::string bitstream_name = "bitstream/writes";
+  bool want_bitstream = !vm.count("no-bitstream") &&
+      (!vm.count("filter") || bitstream_name.find(vm["filter"].as<std::string>()) != std::string::npos);
+  if (want_bitstream) {
+    std::vector<int32_t> vals(1 << 20);
+    for (size_t i = 0; i < vals.size(); ++i)
+      vals[i] = (int32_t)i;
+    PhaseList phases;
+    for (size_t i = 0; i < warmup; ++i)
+      run_bitstream_writes(vals, &phases, false);
+    for (size_t i = 0; i < iterations; ++i)
+      run_bitstream_writes(vals, &phases, true);
+    summarize(bitstream_name, phases, &results);
+  }
+
+  if (vm.count("json")) {
+    auto dest = vm["json"].as<std::string>();
+    if (dest == "-") {
+      write_json(std::cout, results, iterations);
+    } else {
+      std::ofstream f(dest);
+      if (!f) {
+        fprintf(stderr, "couldn't open %s for writing\n", dest.c_str());
+        return 1;
+      }
+      write_json(f, results, iterations);
+    }
+  } else {
+    write_table(std::cout, results);
+  }
+  return 0;
+}
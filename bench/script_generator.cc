@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <random>
+#include <sstream>
+
+#include "script_generator.hh"
+
+namespace Tailslide {
+
+struct EventSignature {
+  const char *name;
+  const char *params;
+  /// an integer expression made from the params for the handler to work with
+  const char *seed_expr;
+};
+
+static const EventSignature EVENT_SIGNATURES[] = {
+    {"state_entry", "", "0"},
+    {"touch_start", "integer num", "num"},
+    {"touch_end", "integer num", "num"},
+    {"timer", "", "1"},
+    {"listen", "integer chan, string name, key id, string msg", "chan + llStringLength(msg)"},
+    {"changed", "integer change", "change"},
+    {"on_rez", "integer param", "param"},
+    {"attach", "key id", "(id != NULL_KEY)"},
+    {"collision_start", "integer num", "num"},
+    {"money", "key id, integer amount", "amount"},
+    {"sensor", "integer num", "num"},
+    {"no_sensor", "", "2"},
+    {"run_time_permissions", "integer perms", "perms"},
+    {"dataserver", "key query, string data", "(integer)data"},
+    {"link_message", "integer sender, integer num, string str, key id", "sender + num"},
+    {"http_response", "key request, integer status, list meta, string body", "status + llGetListLength(meta)"},
+    {"control", "key id, integer level, integer edge", "level & edge"},
+    {"state_exit", "", "3"},
+};
+
+static const char * const INT_OPERATORS[] = {"+", "-", "*", "&", "|", "^", "<<", ">>"};
+
+class ScriptGenerator {
+  public:
+    explicit ScriptGenerator(const ScriptShape &shape) : _mShape(shape), _mRandom(shape.seed) {}
+
+    std::string generate() {
+      writeGlobals();
+      for (uint32_t i = 0; i < _mShape.functions; ++i)
+        writeFunction(i);
+      uint32_t num_states = std::max<uint32_t>(_mShape.states, 1);
+      for (uint32_t i = 0; i < num_states; ++i)
+        writeState(i, num_states);
+      return _mOut.str();
+    }
+
+  protected:
+    // mt19937's output is the same everywhere, the standard distributions aren't.
+    uint32_t pick(uint32_t range) { return (uint32_t)(_mRandom() % range); }
+
+    const char *intOperator() { return INT_OPERATORS[pick(std::size(INT_OPERATORS))]; }
+
+    std::string intConstant() { return std::to_string(pick(100) + 1); }
+
+    void writeGlobals() {
+      for (uint32_t i = 0; i < _mShape.globals; ++i) {
+        std::string name = "g" + std::to_string(i);
+        switch (i % 7) {
+          case 0:
+            // globals may be initialized from earlier ones
+            if (!_mIntGlobals.empty() && pick(2))
+              _mOut << "integer " << name << " = " << _mIntGlobals[pick(_mIntGlobals.size())] << ";\n";
+            else
+              _mOut << "integer " << name << " = " << intConstant() << ";\n";
+            _mIntGlobals.push_back(name);
+            break;
+          case 1:
+            _mOut << "float " << name << " = " << pick(1000) << ".5;\n";
+            break;
+          case 2:
+            _mOut << "string " << name << " = \"" << name << "\";\n";
+            _mStringGlobals.push_back(name);
+            break;
+          case 3:
+            _mOut << "key " << name << " = \"00000000-0000-0000-0000-" << (100000000000ULL + i) << "\";\n";
+            break;
+          case 4:
+            _mOut << "vector " << name << " = <" << pick(10) << ".0, " << pick(10) << ".0, 1.0>;\n";
+            break;
+          case 5:
+            _mOut << "rotation " << name << " = <0.0, 0.0, 0.0, 1.0>;\n";
+            break;
+          default:
+            _mOut << "list " << name << " = [" << intConstant() << ", \"" << name << "\", 1.5];\n";
+            break;
+        }
+      }
+      if (_mShape.globals)
+        _mOut << "\n";
+    }
+
+    void writeStatement(uint32_t func_num, uint32_t stmt_num) {
+      switch (pick(8)) {
+        case 0:
+          _mBody << "    x = x " << intOperator() << " " << intConstant() << ";\n";
+          break;
+        case 1:
+          _mBody << "    if (x > " << intConstant() << ")\n        x += ";
+          if (func_num)
+            _mBody << "f" << pick(func_num) << "(x, t);\n";
+          else
+            _mBody << "llStringLength(t);\n";
+          _mUsesString = true;
+          _mBody << "    else\n        x -= " << intConstant() << ";\n";
+          break;
+        case 2:
+          _mBody << "    while (x > " << intConstant() << ")\n        x = x >> 1;\n";
+          break;
+        case 3:
+          _mBody << "    t += (string)x";
+          if (!_mStringGlobals.empty())
+            _mBody << " + " << _mStringGlobals[pick(_mStringGlobals.size())];
+          _mBody << ";\n";
+          _mUsesString = true;
+          break;
+        case 4:
+          if (!_mIntGlobals.empty()) {
+            _mBody << "    x += " << _mIntGlobals[pick(_mIntGlobals.size())] << ";\n";
+          } else {
+            _mBody << "    x += llStringLength(t);\n";
+            _mUsesString = true;
+          }
+          break;
+        case 5:
+          _mBody << "    integer y" << stmt_num << " = x * " << intConstant() << ";\n";
+          _mBody << "    x = x ^ y" << stmt_num << ";\n";
+          break;
+        case 6:
+          _mBody << "    for (i = 0; i < " << intConstant() << "; ++i)\n        x += i;\n";
+          _mUsesCounter = true;
+          break;
+        default:
+          _mBody << "    f = (float)x * 1.5;\n    x = (integer)f;\n";
+          _mUsesFloat = true;
+          break;
+      }
+    }
+
+    std::string deepExpression(uint32_t depth) {
+      std::string leaf = pick(2) ? "x" : intConstant();
+      if (!depth)
+        return leaf;
+      // nest on both sides so neither is all the parser sees
+      std::string inner = deepExpression(depth - 1);
+      if (pick(2))
+        return "(" + inner + " " + intOperator() + " " + leaf + ")";
+      return "(" + leaf + " " + intOperator() + " " + inner + ")";
+    }
+
+    std::string listElement(uint32_t i) {
+      switch (i % 4) {
+        case 0:
+          return std::to_string(i);
+        case 1:
+          return std::to_string(i) + ".25";
+        case 2:
+          return "\"e" + std::to_string(i) + "\"";
+        default:
+          return "<" + std::to_string(i) + ".0, 0.0, 0.0>";
+      }
+    }
+
+    void writeFunction(uint32_t func_num) {
+      _mBody.str("");
+      _mUsesCounter = _mUsesFloat = _mUsesString = false;
+      // make every function reachable from the last one
+      if (func_num)
+        _mBody << "    x += f" << func_num - 1 << "(x, s);\n";
+      for (uint32_t i = 0; i < _mShape.statements_per_function; ++i)
+        writeStatement(func_num, i);
+      for (uint32_t i = 0; i < _mShape.jumps; ++i) {
+        _mBody << "    jump l" << i << ";\n    x += " << intConstant() << ";\n    @l" << i << ";\n";
+        _mBody << "    if (x < " << intConstant() << ") {\n        ++x;\n        jump l" << i << ";\n    }\n";
+      }
+      if (_mShape.expression_depth) {
+        auto depth = std::min(_mShape.expression_depth, MAX_EXPRESSION_DEPTH);
+        _mBody << "    x = " << deepExpression(depth) << ";\n";
+      }
+      if (_mShape.list_length) {
+        _mBody << "    list l = ";
+        for (uint32_t i = 0; i < _mShape.list_length; ++i) {
+          if (i % MAX_LIST_LITERAL_LENGTH == 0)
+            _mBody << (i ? "] + [" : "[");
+          else
+            _mBody << ", ";
+          _mBody << listElement(i);
+        }
+        _mBody << "];\n    x += llGetListLength(l);\n";
+      }
+      _mBody << "    return x;\n";
+
+      // only declare the locals that are used so the linter stays quiet
+      _mOut << "integer f" << func_num << "(integer a, string s) {\n";
+      if (func_num || _mUsesString)
+        _mOut << "    integer x = a;\n";
+      else
+        _mOut << "    integer x = a + llStringLength(s);\n";
+      if (_mUsesCounter)
+        _mOut << "    integer i;\n";
+      if (_mUsesFloat)
+        _mOut << "    float f;\n";
+      if (_mUsesString)
+        _mOut << "    string t = s;\n";
+      _mOut << _mBody.str() << "}\n\n";
+    }
+
+    void writeState(uint32_t state_num, uint32_t num_states) {
+      if (state_num)
+        _mOut << "\nstate s" << state_num << " {\n";
+      else
+        _mOut << "default {\n";
+      uint32_t num_handlers = std::min<uint32_t>(
+          std::max<uint32_t>(_mShape.handlers_per_state, 1), std::size(EVENT_SIGNATURES));
+      for (uint32_t i = 0; i < num_handlers; ++i) {
+        const auto &event = EVENT_SIGNATURES[i];
+        _mOut << "    " << event.name << "(" << event.params << ") {\n";
+        _mOut << "        integer x = " << event.seed_expr << ";\n";
+        if (_mShape.functions)
+          _mOut << "        x += f" << _mShape.functions - 1 << "(x, \"" << event.name << "\");\n";
+        _mOut << "        llOwnerSay((string)x);\n";
+        // state changes aren't allowed in state_exit
+        if (num_states > 1 && i == num_handlers - 1 && i != std::size(EVENT_SIGNATURES) - 1) {
+          uint32_t next = (state_num + 1) % num_states;
+          _mOut << "        if (x > " << intConstant() << ")\n            state ";
+          _mOut << (next ? "s" + std::to_string(next) : "default") << ";\n";
+        }
+        _mOut << "    }\n";
+      }
+      _mOut << "}\n";
+    }
+
+    ScriptShape _mShape;
+    std::mt19937 _mRandom;
+    std::stringstream _mOut;
+    /// the function currently being written
+    std::stringstream _mBody;
+    bool _mUsesCounter = false;
+    bool _mUsesFloat = false;
+    bool _mUsesString = false;
+    std::vector<std::string> _mIntGlobals;
+    std::vector<std::string> _mStringGlobals;
+};
+
+std::string generate_script(const ScriptShape &shape) {
+  return ScriptGenerator(shape).generate();
+}
+
+std::vector<ScriptShapePreset> script_shape_presets(uint32_t scale) {
+  scale = std::max<uint32_t>(scale, 1);
+  std::vector<ScriptShapePreset> presets;
+  {
+    ScriptShape shape;
+    shape.globals = 1000 * scale;
+    presets.push_back({"many_globals", shape});
+  }
+  {
+    ScriptShape shape;
+    shape.functions = 250 * scale;
+    presets.push_back({"many_functions", shape});
+  }
+  {
+    ScriptShape shape;
+    shape.statements_per_function = 1000 * scale;
+    presets.push_back({"long_function", shape});
+  }
+  {
+    // depth is capped, so scale the number of deep expressions instead
+    ScriptShape shape;
+    shape.functions = 10 * scale;
+    shape.statements_per_function = 0;
+    shape.expression_depth = MAX_EXPRESSION_DEPTH;
+    presets.push_back({"deep_expressions", shape});
+  }
+  {
+    ScriptShape shape;
+    shape.statements_per_function = 0;
+    shape.list_length = 2000 * scale;
+    presets.push_back({"huge_list", shape});
+  }
+  {
+    ScriptShape shape;
+    shape.functions = 5;
+    shape.states = 50 * scale;
+    shape.handlers_per_state = 8;
+    presets.push_back({"many_states", shape});
+  }
+  {
+    ScriptShape shape;
+    shape.statements_per_function = 0;
+    shape.jumps = 200 * scale;
+    presets.push_back({"many_jumps", shape});
+  }
+  return presets;
+}
+
+}
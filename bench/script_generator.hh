@@ -0,0 +1,55 @@
+#ifndef TAILSLIDE_SCRIPT_GENERATOR_HH
+#define TAILSLIDE_SCRIPT_GENERATOR_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Tailslide {
+
+/// What a generated script should look like. Every knob scales one dimension
+/// of the script independently of the others, so the cost of each pipeline stage
+/// can be plotted against it.
+struct ScriptShape {
+  /// globals of every type, some initialized from earlier ones
+  uint32_t globals = 0;
+  /// user functions, each calling the ones before it
+  uint32_t functions = 1;
+  /// statements in the body of each function
+  uint32_t statements_per_function = 10;
+  /// how deeply the one big expression in each function is nested, clamped to
+  /// `MAX_EXPRESSION_DEPTH`
+  uint32_t expression_depth = 0;
+  /// elements in the list each function builds up. This is spread over several
+  /// literals joined with `+`, since one literal this long wouldn't fit on the
+  /// parser's stack.
+  uint32_t list_length = 0;
+  /// states, `default` included. Each one can switch to the next.
+  uint32_t states = 1;
+  /// clamped to the number of distinct event handlers
+  uint32_t handlers_per_state = 1;
+  /// labels in each function, each jumped to from both before and after it
+  uint32_t jumps = 0;
+  /// picks operators, types and constants, the same seed always gives the same script
+  uint32_t seed = 0;
+};
+
+/// deeper than this and the parser would run out of stack
+const uint32_t MAX_EXPRESSION_DEPTH = 150;
+/// elements in a single list literal before starting another
+const uint32_t MAX_LIST_LITERAL_LENGTH = 100;
+
+/// Write out a valid script of the given shape. Anything of a useful size will
+/// be too big to fit in LSO's 16KB, but it still gives the LSO compiler work to do.
+std::string generate_script(const ScriptShape &shape);
+
+/// A named shape stressing one dimension, `scale` multiplies its size.
+struct ScriptShapePreset {
+  const char *name;
+  ScriptShape shape;
+};
+std::vector<ScriptShapePreset> script_shape_presets(uint32_t scale = 1);
+
+}
+
+#endif
@@ -0,0 +1,83 @@
+// Writes out a synthetic script of a given shape, for feeding to the CLI or
+// anything else that wants large inputs.
+
+#include <algorithm>
+#include <iostream>
+
+#include "cxxopt.hh"
+
+#include "script_generator.hh"
+
+using namespace Tailslide;
+
+int main(int argc, char **argv) {
+  cxxopts::Options options("tailslide_scriptgen", "Generate a synthetic LSL script");
+  options.add_options()
+      ("help", "Show this message")
+      ("preset", "Start from a named preset, see --list-presets", cxxopts::value<std::string>())
+      ("scale", "Multiply the preset's size by this", cxxopts::value<uint32_t>()->default_value("1"))
+      ("list-presets", "List the presets")
+      ("globals", "Number of globals", cxxopts::value<uint32_t>())
+      ("functions", "Number of functions", cxxopts::value<uint32_t>())
+      ("statements", "Statements per function", cxxopts::value<uint32_t>())
+      ("depth", "Nesting depth of an expression in each function", cxxopts::value<uint32_t>())
+      ("list-length", "Length of a list built in each function", cxxopts::value<uint32_t>())
+      ("states", "Number of states", cxxopts::value<uint32_t>())
+      ("handlers", "Event handlers per state", cxxopts::value<uint32_t>())
+      ("jumps", "Labels jumped to in each function", cxxopts::value<uint32_t>())
+      ("seed", "Random seed", cxxopts::value<uint32_t>())
+  ;
+
+  cxxopts::ParseResult vm;
+  try {
+    auto parse_result = options.parse(argc, argv);
+    vm = std::move(parse_result);
+  } catch (cxxopts::OptionException &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << options.help() << std::endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    std::cerr << options.help() << std::endl;
+    return 0;
+  }
+
+  auto presets = script_shape_presets(vm["scale"].as<uint32_t>());
+  if (vm.count("list-presets")) {
+    for (const auto &preset : presets)
+      std::cout << preset.name << "\n";
+    return 0;
+  }
+
+  ScriptShape shape;
+  if (vm.count("preset")) {
+    auto name = vm["preset"].as<std::string>();
+    auto it = std::find_if(presets.begin(), presets.end(), [&](const ScriptShapePreset &preset) {
+      return name == preset.name;
+    });
+    if (it == presets.end()) {
+      std::cerr << "unknown preset " << name << std::endl;
+      return 1;
+    }
+    shape = it->shape;
+  }
+  // anything given explicitly overrides the preset
+  const std::pair<const char *, uint32_t ScriptShape::*> fields[] = {
+      {"globals", &ScriptShape::globals},
+      {"functions", &ScriptShape::functions},
+      {"statements", &ScriptShape::statements_per_function},
+      {"depth", &ScriptShape::expression_depth},
+      {"list-length", &ScriptShape::list_length},
+      {"states", &ScriptShape::states},
+      {"handlers", &ScriptShape::handlers_per_state},
+      {"jumps", &ScriptShape::jumps},
+      {"seed", &ScriptShape::seed},
+  };
+  for (const auto &field : fields) {
+    if (vm.count(field.first))
+      shape.*field.second = vm[field.first].as<uint32_t>();
+  }
+
+  std::cout << generate_script(shape);
+  return 0;
+}
@@ -0,0 +1,127 @@
+// Hunts for inputs that cost more than linear time to compile. Rather than
+// looking for crashes, this measures how many nodes every stage walks over per
+// byte of input, and treats anything over a threshold as a finding so libFuzzer
+// saves it. `-minimize_crash=1` will then shrink it to the smallest input that
+// still does too much work for its size.
+//
+// Walked nodes are used rather than time so findings reproduce and minimize
+// reliably. Loops that rescan something other than the tree, like symbol table
+// removal or the rescans of a block while eliminating subexpressions, count
+// what they look at too. Anything else can still be caught by setting a time limit.
+//
+// Environment variables:
+//   TAILSLIDE_MAX_WALKED_PER_BYTE  walked nodes per byte to report, default 100
+//   TAILSLIDE_MAX_US_PER_BYTE      microseconds per byte to report, off by default
+//   TAILSLIDE_MIN_INPUT_SIZE       don't report inputs smaller than this, default 64
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "tailslide.hh"
+#include "passes/tree_simplifier.hh"
+#include "passes/lso/script_compiler.hh"
+#include "passes/mono/script_compiler.hh"
+
+
+// libFuzzer treats each of these as extra coverage, so an input that lands in a
+// new cost bucket gets kept in the corpus even if it didn't reach any new code.
+// That steers mutation towards inputs that are more and more expensive per byte.
+static uint8_t cost_counters[64] __attribute__((used, section("__libfuzzer_extra_counters")));
+
+static bool initialized = false;
+static double max_walked_per_byte = 100.0;
+static double max_us_per_byte = 0.0;
+static size_t min_input_size = 64;
+// reused between runs so its buffers don't have to be reallocated each time
+static Tailslide::ScopedScriptParser *parser = nullptr;
+static Tailslide::CompileStats stats;
+
+static double env_double(const char *name, double default_val) {
+  const char *val = getenv(name);
+  return val ? strtod(val, nullptr) : default_val;
+}
+
+static size_t cost_bucket(double per_byte) {
+  // a few buckets per doubling
+  size_t bucket = 0;
+  while (per_byte >= 1.0 && bucket < sizeof(cost_counters) - 1) {
+    per_byte /= 1.4;
+    ++bucket;
+  }
+  return bucket;
+}
+
+static void compile(Tailslide::LSLScript *script) {
+  script->collectSymbols();
+  script->determineTypes();
+  script->recalculateReferenceData();
+  script->propagateValues();
+  script->finalPass();
+  if (parser->logger.getErrors())
+    return;
+
+  Tailslide::OptimizationOptions ctx{
+      .fold_constants = true,
+      .prune_unused_locals = true,
+      .prune_unused_globals = true,
+      .prune_unused_functions = true,
+      .eliminate_common_subexpressions = true,
+  };
+  script->optimize(ctx);
+  script->checkSymbols();
+  script->validateGlobals(true);
+  if (parser->logger.getErrors())
+    return;
+
+  // both backends lower their own copy of the tree, so they can share it.
+  Tailslide::LSOScriptCompiler lso_visitor(&parser->allocator);
+  script->visit(&lso_visitor);
+  Tailslide::MonoScriptCompiler mono_visitor(&parser->allocator);
+  script->visit(&mono_visitor);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (!initialized) {
+    Tailslide::tailslide_init_builtins(nullptr);
+    max_walked_per_byte = env_double("TAILSLIDE_MAX_WALKED_PER_BYTE", max_walked_per_byte);
+    max_us_per_byte = env_double("TAILSLIDE_MAX_US_PER_BYTE", max_us_per_byte);
+    min_input_size = (size_t)env_double("TAILSLIDE_MIN_INPUT_SIZE", (double)min_input_size);
+    parser = new Tailslide::ScopedScriptParser(nullptr);
+    parser->context.stats = &stats;
+    initialized = true;
+  }
+
+  parser->reset();
+  stats.reset();
+  auto start = std::chrono::steady_clock::now();
+  try {
+    auto *script = parser->parseLSLBytes((const char *)data, (int)size);
+    if (script)
+      compile(script);
+  } catch (const std::exception& e) {
+    std::cout << e.what() << std::endl;
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // small inputs are all fixed overhead, don't bother scoring them.
+  if (size < min_input_size)
+    return EXIT_SUCCESS;
+
+  double walked_per_byte = (double)stats.getTotal().nodes_walked / (double)size;
+  double us_per_byte = std::chrono::duration<double, std::micro>(elapsed).count() / (double)size;
+  cost_counters[cost_bucket(walked_per_byte)] = 1;
+
+  bool too_many_walked = walked_per_byte > max_walked_per_byte;
+  bool too_slow = max_us_per_byte > 0.0 && us_per_byte > max_us_per_byte;
+  if (too_many_walked || too_slow) {
+    fprintf(stderr, "==%s: super-linear input, %zu bytes, %.1f nodes walked/byte, %.2f us/byte\n",
+            too_many_walked ? "walked" : "time", size, walked_per_byte, us_per_byte);
+    fputs(stats.formatTimeReport().c_str(), stderr);
+    fputs(stats.formatMemoryReport().c_str(), stderr);
+    // make libFuzzer save (and, if asked, minimize) the input
+    abort();
+  }
+  return EXIT_SUCCESS;
+}
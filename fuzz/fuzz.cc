@@ -48,6 +48,7 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
               .prune_unused_locals = true,
               .prune_unused_globals = true,
               .prune_unused_functions = true,
+              .eliminate_common_subexpressions = true,
           };
           script->optimize(ctx);
           script->validateGlobals(true);
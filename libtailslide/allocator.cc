@@ -1,14 +1,29 @@
 #include "allocator.hh"
+#include "lslmini.hh"
 
 namespace Tailslide {
 
 ScriptAllocator::~ScriptAllocator() {
+  reset();
+}
+
+void ScriptAllocator::reset() {
   for(auto &obj_ptr : _mTrackedObjects) {
     delete obj_ptr;
   }
   for(auto &obj_ptr : _mMallocs) {
     free(obj_ptr);
   }
+  // keep the capacity around, the next script is likely to be about as big
+  _mTrackedObjects.clear();
+  _mMallocs.clear();
+}
+
+void ScriptAllocator::chargeContext(size_t size, bool is_node) {
+  if (_mContext->budget)
+    _mContext->budget->charge(size, is_node);
+  if (_mContext->stats)
+    _mContext->stats->countAllocation(size, is_node);
 }
 
 }
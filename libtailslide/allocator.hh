@@ -2,6 +2,7 @@
 #define ALLOCATOR_HH
 
 #include <functional>
+#include <type_traits>
 #include <vector>
 #include <cstring>
 #include <cstdlib>
@@ -9,6 +10,7 @@
 namespace Tailslide {
 
 struct ScriptContext;
+class LSLASTNode;
 
 class TrackableObject {
 public:
@@ -23,26 +25,43 @@ public:
     virtual ~ScriptAllocator();
 
     void setContext(ScriptContext *context) { _mContext = context;};
+    /// free everything that's been allocated so far
+    void reset();
 
     template<typename TClazz, typename... Args>
     inline TClazz * newTracked(Args&&... args) {
       static_assert(std::is_base_of<TrackableObject, TClazz>::value, "Must be based on LLTrackableObject");
       auto *val = new TClazz(_mContext, std::forward<Args>(args)...);
       _mTrackedObjects.emplace_back(val);
+      charge(sizeof(TClazz), std::is_base_of<LSLASTNode, TClazz>::value);
+      return val;
+    }
+
+    /// make a tracked copy of an existing object, moving it to our context
+    template<typename TClazz>
+    inline TClazz * cloneTracked(const TClazz &other) {
+      static_assert(std::is_base_of<TrackableObject, TClazz>::value, "Must be based on LLTrackableObject");
+      auto *val = new TClazz(other);
+      val->mContext = _mContext;
+      _mTrackedObjects.emplace_back(val);
+      charge(sizeof(TClazz), std::is_base_of<LSLASTNode, TClazz>::value);
       return val;
     }
 
     char *alloc(size_t size) {
       char *val = (char *)malloc(size);
       _mMallocs.emplace_back(val);
+      charge(size, false);
       return val;
     }
 
     char *copyStr(const char *old_str) {
-      char *new_str = (char *)malloc(strlen(old_str) + 1);
+      size_t size = strlen(old_str) + 1;
+      char *new_str = (char *)malloc(size);
       if (new_str) {
         strcpy(new_str, old_str);
         trackMalloc(new_str);
+        charge(size, false);
       }
       return new_str;
     }
@@ -51,6 +70,14 @@ public:
       _mMallocs.emplace_back(alloced_data);
     }
 private:
+    /// count an allocation against the context's `CompileBudget` and
+    /// `CompileStats`, if it has them
+    void charge(size_t size, bool is_node) {
+      if (_mContext)
+        chargeContext(size, is_node);
+    }
+    void chargeContext(size_t size, bool is_node);
+
     std::vector<TrackableObject *> _mTrackedObjects {};
     std::vector<void *> _mMallocs {};
     ScriptContext *_mContext = nullptr;
@@ -57,6 +57,7 @@ void LSLASTNode::setParent(LSLASTNode *newparent) {
   }
 
   _mParent = newparent;
+  uint64_t walked = 1;
   // because children are an intrusive linked list updating one child's parent
   // must update the parent of all of its siblings.
   for (auto *next_ptr = _mNext; next_ptr != nullptr; next_ptr=next_ptr->_mNext) {
@@ -64,13 +65,17 @@ void LSLASTNode::setParent(LSLASTNode *newparent) {
     if (next_ptr->_mParent == newparent)
       break;
     next_ptr->_mParent = newparent;
+    ++walked;
   }
   for (auto *prev_ptr = _mPrev; prev_ptr != nullptr; prev_ptr=prev_ptr->_mPrev) {
     assert(prev_ptr != this);
     if (prev_ptr->_mParent == newparent)
       break;
     prev_ptr->_mParent = newparent;
+    ++walked;
   }
+  if (mContext && mContext->stats)
+    mContext->stats->countWalk(walked);
 }
 
 void LSLASTNode::pushChild(LSLASTNode *child) {
@@ -94,6 +99,19 @@ LSLASTNode *LSLASTNode::takeChild(int child_num) {
   return child;
 }
 
+void LSLASTNode::insertChildBefore(LSLASTNode *before, LSLASTNode *child) {
+  assert(before != nullptr && child != nullptr);
+  assert(before->getParent() == this);
+  LSLASTNode *prev_child = before->getPrev();
+
+  child->setParent(this);
+  if (prev_child != nullptr)
+    prev_child->setNext(child);
+  else
+    _mChildren = child;
+  child->setNext(before);
+}
+
 void LSLASTNode::removeChild(LSLASTNode *child) {
   if (child == nullptr) return;
 
@@ -155,6 +173,8 @@ void LSLASTNode::replaceNode(LSLASTNode *old_node, LSLASTNode *replacement) {
 }
 
 void LSLASTNode::visit(ASTVisitor *visitor) {
+  if (mContext && mContext->stats)
+    mContext->stats->countWalk(1);
   if (!visitor->isDepthFirst()) {
     // Use the node type and node subtype retvals to cast and choose
     // a more specific version of the visitor's visit methods to call.
@@ -180,18 +200,27 @@ void LSLASTNode::visit(ASTVisitor *visitor) {
 
 
 void LSLASTNode::propagateValues(bool create_heap_values) {
+  if (mContext->overBudget(getLoc()))
+    return;
+  ScopedPassTimer timer(mContext, "propagate_values");
   TailslideOperationBehavior behavior(mContext->allocator, create_heap_values);
   ConstantDeterminingVisitor visitor(&behavior, mContext->allocator);
   visit(&visitor);
 }
 
 void LSLASTNode::finalPass() {
+  if (mContext->overBudget(getLoc()))
+    return;
+  ScopedPassTimer timer(mContext, "final_pass");
   FinalPassVisitor visitor;
   visit(&visitor);
 }
 
 // walk tree post-order and propagate types
 void LSLASTNode::determineTypes() {
+  if (mContext->overBudget(getLoc()))
+    return;
+  ScopedPassTimer timer(mContext, "determine_types");
   TypeCheckVisitor visitor;
   visit(&visitor);
 }
@@ -73,6 +73,13 @@ enum LSLNodeSubType {
 struct OptimizationOptions;
 class ASTVisitor;
 
+/// Let `TreeCloner` make a shallow copy of a node while keeping its dynamic type,
+/// every concrete node class needs one of these.
+#define NODE_SHALLOW_CLONE(_typ)                                        \
+    virtual LSLASTNode *shallowClone(ScriptAllocator *allocator) {     \
+      return allocator->cloneTracked<_typ>(*this);                     \
+    }
+
 template<class T>
 struct node_child_iterator {
   static_assert(std::is_base_of<class LSLASTNode, T>::value);
@@ -191,6 +198,8 @@ class LSLASTNode : public TrackableObject {
     void setNext(LSLASTNode *newnext);
     /* Set our previous sibling, and ensure it links back to us. */
     void setPrev(LSLASTNode *newprev);
+    /* insert a child into the list of nodes directly before an existing child */
+    void insertChildBefore(LSLASTNode *before, LSLASTNode *child);
     /* remove a child from the list of nodes, shifting other children up */
     void removeChild(LSLASTNode *child);
     /* replace a node from the list of children with null, returning it */
@@ -258,6 +267,8 @@ class LSLASTNode : public TrackableObject {
     bool getSynthesized() const { return _mSynthesized; };
     void setSynthesized(bool synthesized) { _mSynthesized = synthesized; };
 
+    NODE_SHALLOW_CLONE(LSLASTNode)
+
   protected:
     bool _mSynthesized = false;
     class LSLType          *_mType;
@@ -282,6 +293,8 @@ class LSLASTNode : public TrackableObject {
     bool                        _mDeclarationAllowed;
     bool                        _mStaticNode = false;
 
+  friend class TreeCloner;
+
   public:
     node_child_iterator<LSLASTNode> begin() { return node_child_iterator<LSLASTNode>(_mChildren); }
     node_child_iterator<LSLASTNode> end()   { return node_child_iterator<LSLASTNode>(nullptr); }
@@ -292,6 +305,7 @@ class LSLASTNullNode : public LSLASTNode {
     explicit LSLASTNullNode(ScriptContext *ctx): LSLASTNode(ctx) {};
     virtual std::string getNodeName() { return "null"; };
     virtual LSLNodeType getNodeType() { return NODE_NULL; };
+    NODE_SHALLOW_CLONE(LSLASTNullNode)
 };
 
 template<class T>
@@ -306,6 +320,7 @@ class LSLASTNodeList : public LSLASTNode {
     };
     virtual std::string getNodeName() { return "ast node list"; }
     virtual LSLNodeType getNodeType() { return NODE_AST_NODE_LIST; };
+    NODE_SHALLOW_CLONE(LSLASTNodeList<T>)
 
     node_child_iterator<T> begin() { return node_child_iterator<T>(static_cast<T*>(_mChildren)); }
     node_child_iterator<T> end()   { return node_child_iterator<T>(nullptr); }
@@ -71,7 +71,7 @@ class BitStream {
 
   public:
     explicit BitStream(Endianness endian=ENDIAN_BIG) : _mPos(0), _mSize(0), _mAllocSize(0), _mData(nullptr),
-                                                       _mEndianness(endian), _mReadOnly(false) {
+                                                       _mEndianness(endian), _mReadOnly(false), _mBorrowed(false) {
     }
 
     /**
@@ -82,7 +82,8 @@ class BitStream {
      * NOTE: Use assign() if you want to prevent memcpy
      */
     BitStream(const uint8_t *data, const uint32_t length, Endianness endian=ENDIAN_BIG)
-        : _mPos(0), _mSize(0), _mAllocSize(MIN_REALLOC), _mData(nullptr), _mEndianness(endian), _mReadOnly(false) {
+        : _mPos(0), _mSize(0), _mAllocSize(MIN_REALLOC), _mData(nullptr), _mEndianness(endian), _mReadOnly(false),
+          _mBorrowed(false) {
       _mData = reinterpret_cast<uint8_t *>(malloc(_mAllocSize));
       if (_mData == nullptr) {
         throw std::runtime_error("Failed to allocated data");
@@ -96,7 +97,7 @@ class BitStream {
 
     BitStream(BitStream &&other) noexcept
         : _mPos(other._mPos), _mSize(other._mSize), _mAllocSize(other._mAllocSize), _mData(other._mData),
-          _mEndianness(other._mEndianness), _mReadOnly(other._mReadOnly) {
+          _mEndianness(other._mEndianness), _mReadOnly(other._mReadOnly), _mBorrowed(other._mBorrowed) {
       other._mData = nullptr;
     }
 
@@ -124,6 +125,9 @@ class BitStream {
       if (size < _mAllocSize) {
         throw std::runtime_error("Can only increase alloc size");
       }
+      if (_mBorrowed) {
+        throw std::length_error("Cannot grow a child stream past its region");
+      }
 
       size_t old_size = _mAllocSize;
       _mAllocSize = size;
@@ -136,6 +140,36 @@ class BitStream {
       memset(_mData + old_size, 0, size - old_size);
     }
 
+    /**
+     * Hint that at least `capacity` bytes will be written so they
+     * can be allocated up front, never shrinks the buffer.
+     */
+    void reserve(uint32_t capacity) {
+      if (capacity > _mAllocSize)
+        preAlloc(capacity);
+    }
+
+    /**
+     * Return an empty stream that appends directly into this stream's buffer at the
+     * current position, with room for up to `capacity` bytes. Nothing is copied, but
+     * this stream must not be resized or written past its position while the child
+     * is in use, and the child can't grow past its region. Once the child is done,
+     * `moveBy(child.size())` to move past what it wrote.
+     */
+    BitStream makeChild(uint32_t capacity) {
+      if (_mReadOnly) {
+        throw std::runtime_error("Cannot make a child of a read-only stream");
+      }
+      if (_mPos + capacity > size()) {
+        resize(_mPos + capacity);
+      }
+      BitStream child(_mEndianness);
+      child._mData = current();
+      child._mAllocSize = capacity;
+      child._mBorrowed = true;
+      return child;
+    }
+
     /**
      * Create an identical copy of this BitStream
      *
@@ -157,12 +191,13 @@ class BitStream {
 
     void clear() {
       // NOLINTNEXTLINE
-      if (!_mReadOnly && _mData != nullptr) {
+      if (!_mReadOnly && !_mBorrowed && _mData != nullptr) {
         // NOLINTNEXTLINE
         free(_mData);
       }
 
       _mReadOnly = false;
+      _mBorrowed = false;
       _mData = nullptr;
       _mPos = _mSize = _mAllocSize = 0;
     }
@@ -172,6 +207,7 @@ class BitStream {
 
       _mData = other._mData;
       _mReadOnly = other._mReadOnly;
+      _mBorrowed = other._mBorrowed;
       _mPos = other._mPos;
       _mSize = other._mSize;
       _mAllocSize = other._mAllocSize;
@@ -196,6 +232,9 @@ class BitStream {
       }
 
       if (new_size < _mSize) {
+        // the parent would otherwise see whatever was cut off
+        if (_mBorrowed)
+          memset(_mData + new_size, 0, _mSize - new_size);
         _mSize = new_size;
         _mPos = std::min(new_size, _mPos);
         //no reason to change alloc size?
@@ -203,13 +242,15 @@ class BitStream {
       }
 
       if (new_size <= _mAllocSize) {
+        // may have stale data from before a shrink, should read back as zeros.
+        memset(_mData + _mSize, 0, new_size - _mSize);
         _mSize = new_size;
         _mPos = std::min(new_size, _mPos);
         return;
       }
 
-      uint32_t step = std::max(MIN_REALLOC, new_size - _mSize);
-      preAlloc(_mAllocSize + step);
+      // grow geometrically so writing a little at a time doesn't realloc on every write
+      preAlloc(std::max(new_size, std::max(MIN_REALLOC, _mAllocSize * 2)));
 
       _mSize = new_size;
       _mPos = std::min(new_size, _mPos);
@@ -273,6 +314,25 @@ class BitStream {
       _mPos += length;
     }
 
+    /**
+     * Write a run of values, only growing the stream once
+     */
+    template<typename T>
+    BitStream &writeSpan(const T *values, uint32_t count) {
+      static_assert(std::is_trivially_copyable<T>(), "Need a specialized serialized function for non-POD types");
+      if constexpr (sizeof(T) == 1) {
+        return writeRawData(reinterpret_cast<const uint8_t *>(values), count);
+      } else {
+        if (_mPos + (sizeof(T) * count) > size()) {
+          resize((uint32_t)(_mPos + (sizeof(T) * count)));
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+          *this << values[i];
+        }
+        return *this;
+      }
+    }
+
     /**
      * Write virtually any kind of data to the stream
      *
@@ -355,6 +415,9 @@ class BitStream {
     }
 
     void detach(uint8_t *&out, uint32_t &len) {
+      if (_mBorrowed) {
+        throw std::runtime_error("Cannot detach a child stream's data");
+      }
       if (_mSize == 0) {
         out = nullptr;
         // there might be pre-allocated buffer
@@ -401,6 +464,7 @@ class BitStream {
       _mSize = _mAllocSize = len;
       _mPos = 0;
       _mReadOnly = read_only;
+      _mBorrowed = false;
     }
 
     /**
@@ -483,6 +547,9 @@ class BitStream {
     // a read only BitStream cannot modify the underlying data
     // useful to avoid copying and delete
     bool _mReadOnly;
+
+    // writes into a region of another stream's buffer, which it doesn't own
+    bool _mBorrowed;
 };
 
 
@@ -3,6 +3,7 @@
 
 #include "lslmini.hh"
 #include "logger.hh"
+#include "sha256.hh"
 #include "strings.hh"
 
 namespace Tailslide {
@@ -14,6 +15,8 @@ static ScriptAllocator gStaticAllocator {};
 
 // holds the symbols for the default builtins
 LSLSymbolTable gBuiltinsSymbolTable{nullptr, SYMTAB_BUILTINS}; // NOLINT(cert-err58-cpp)
+// hash of the builtins definitions that were loaded
+static std::string gBuiltinsVersion {}; // NOLINT(cert-err58-cpp)
 
 struct LSLTypeMap {
     const char *name;
@@ -30,6 +33,37 @@ struct LSLTypeMap {
         {nullptr,    LST_ERROR}
 };
 
+// Functions whose result depends only on their arguments and that have no side-effects,
+// forced delays or math errors. Calls to these may be freely re-ordered, merged or eliminated.
+// Things like `llSqrt()` and `llPow()` are left out since hoisting them could move a math
+// error ahead of side-effects that should have happened first.
+static const char *PURE_FUNCTIONS[] = {
+    "llAbs", "llFabs", "llSin", "llCos", "llTan", "llAtan2", "llLog", "llLog10", "llFloor", "llCeil", "llRound",
+    "llVecMag", "llVecNorm", "llVecDist", "llRot2Euler", "llEuler2Rot", "llRot2Fwd",
+    "llRot2Left", "llRot2Up", "llAxes2Rot", "llRot2Axis", "llRot2Angle", "llAxisAngle2Rot",
+    "llAngleBetween", "llRotBetween",
+    "llStringLength", "llGetSubString", "llDeleteSubString", "llInsertString",
+    "llSubStringIndex", "llToUpper", "llToLower", "llStringTrim", "llReplaceSubString",
+    "llEscapeURL", "llUnescapeURL", "llChar", "llOrd", "llHash",
+    "llMD5String", "llSHA1String", "llSHA256String", "llComputeHash",
+    "llIntegerToBase64", "llBase64ToInteger", "llStringToBase64", "llBase64ToString", "llXorBase64",
+    "llList2String", "llList2Integer", "llList2Float", "llList2Key", "llList2Vector", "llList2Rot",
+    "llList2List", "llList2ListStrided", "llListFindList", "llGetListLength", "llGetListEntryType",
+    "llDeleteSubList", "llListInsertList", "llListReplaceList", "llDumpList2String",
+    "llList2CSV", "llCSV2List", "llParseString2List", "llParseStringKeepNulls",
+    "llListSort", "llListSortStrided", "llListStatistics",
+    "llJsonGetValue", "llJsonValueType", "llJson2List", "llList2Json", "llJsonSetValue",
+    nullptr,
+};
+
+static bool is_pure_function(const char *name) {
+  for (int i = 0; PURE_FUNCTIONS[i] != nullptr; ++i) {
+    if (!strcmp(PURE_FUNCTIONS[i], name))
+      return true;
+  }
+  return false;
+}
+
 LSLType *str_to_type(const char *str) {
   for (int i = 0; types[i].name != nullptr; ++i) {
     if (strcmp(types[i].name, str) == 0)
@@ -117,6 +151,7 @@ void tailslide_init_builtins(const char *builtins_file) {
   }
 
   init_default_values();
+  SHA256 version_hash;
 
   while (true) {
     if (fp) {
@@ -128,6 +163,9 @@ void tailslide_init_builtins(const char *builtins_file) {
       strncpy(buf, BUILTINS_TXT[line], 1024);
       ++line;
     }
+    // lines from the embedded table don't have their newline
+    version_hash.update(buf, strcspn(buf, "\r\n"));
+    version_hash.update("\n", 1);
 
     // skip blank lines and comment lines
     if (strncmp("//", buf, 2) == 0 || strncmp("\n", buf, 1) == 0)
@@ -279,11 +317,18 @@ if(sscanf(value, (fmt), __VA_ARGS__) != num) { \
         }
       }
 
-      gBuiltinsSymbolTable.define(gStaticAllocator.newTracked<LSLSymbol>(
+      auto *sym = gStaticAllocator.newTracked<LSLSymbol>(
           gStaticAllocator.copyStr(name), str_to_type(ret_type), SYM_FUNCTION, SYM_BUILTIN, dec
-      ));
+      );
+      sym->setPure(is_pure_function(name));
+      gBuiltinsSymbolTable.define(sym);
     }
   }
+  gBuiltinsVersion = SHA256::toHex(version_hash.finish());
+}
+
+const std::string &tailslide_builtins_version() {
+  return gBuiltinsVersion;
 }
 
 }
@@ -0,0 +1,41 @@
+#include "compile_budget.hh"
+
+namespace Tailslide {
+
+CompileBudget::CompileBudget(CompileLimits limits)
+    : _mLimits(limits), _mStart(std::chrono::steady_clock::now()) {}
+
+bool CompileBudget::evaluate(bool read_clock) {
+  if (_mExceeded != BUDGET_OK)
+    return false;
+  if (_mCancelled)
+    _mExceeded = BUDGET_CANCELLED;
+  else if (_mLimits.max_nodes && _mNodes > _mLimits.max_nodes)
+    _mExceeded = BUDGET_NODES;
+  else if (_mLimits.max_bytes && _mBytes > _mLimits.max_bytes)
+    _mExceeded = BUDGET_MEMORY;
+  else if (read_clock && _mLimits.max_time.count() && getElapsed() > _mLimits.max_time)
+    _mExceeded = BUDGET_TIME;
+  return _mExceeded == BUDGET_OK;
+}
+
+const char *CompileBudget::describeExceeded() const {
+  switch (_mExceeded) {
+    case BUDGET_TIME:
+      return "took too long";
+    case BUDGET_MEMORY:
+      return "used too much memory";
+    case BUDGET_NODES:
+      return "created too many nodes";
+    case BUDGET_CANCELLED:
+      return "was cancelled";
+    default:
+      return "is within budget";
+  }
+}
+
+std::chrono::steady_clock::duration CompileBudget::getElapsed() const {
+  return std::chrono::steady_clock::now() - _mStart;
+}
+
+}
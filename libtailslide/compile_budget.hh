@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace Tailslide {
+
+/// Limits on what compiling a single script may cost, zero means unlimited.
+struct CompileLimits {
+  std::chrono::milliseconds max_time {0};
+  /// bytes allocated through the script's `ScriptAllocator`
+  uint64_t max_bytes = 0;
+  /// AST nodes created, including any made by the passes
+  uint64_t max_nodes = 0;
+
+  explicit operator bool() const {
+    return max_time.count() || max_bytes || max_nodes;
+  }
+};
+
+enum CompileBudgetLimit {
+  BUDGET_OK,
+  BUDGET_TIME,
+  BUDGET_MEMORY,
+  BUDGET_NODES,
+  BUDGET_CANCELLED,
+};
+
+/// Tracks how much a compile has cost against its `CompileLimits`. Attach one
+/// to a `ScriptContext` before parsing and the allocator will charge it, while
+/// the parser and passes check it as they go and give up with
+/// `E_COMPILE_BUDGET_EXCEEDED` once it's used up.
+///
+/// Checks are cooperative, so a limit can be overshot by however much work
+/// happens between two checks. The passes check before they start, between
+/// optimization rounds and before each function or handler they optimize, while
+/// the lexer and the optimizers' inner loops poll.
+class CompileBudget {
+  public:
+    /// how many calls to `poll()` go by between looks at the clock
+    static constexpr uint32_t POLL_INTERVAL = 256;
+
+    /// the clock starts as soon as the budget is created
+    explicit CompileBudget(CompileLimits limits = {});
+    CompileBudget(const CompileBudget &other) = delete;
+    CompileBudget &operator=(const CompileBudget &other) = delete;
+
+    void charge(size_t bytes, bool is_node) {
+      _mBytes += bytes;
+      if (is_node)
+        ++_mNodes;
+    }
+    /// returns false once any of the limits has been hit, the first one hit sticks.
+    bool check() { return evaluate(true); }
+    /// like `check()`, but only reads the clock every `POLL_INTERVAL` calls,
+    /// for loops that run far more often than the time limit needs checking.
+    bool poll() { return evaluate(++_mPolls % POLL_INTERVAL == 0); }
+    /// make the next check fail, may be called from any thread.
+    void cancel() { _mCancelled = true; }
+
+    CompileBudgetLimit getExceeded() const { return _mExceeded; }
+    /// what went over the limit, for error messages
+    const char *describeExceeded() const;
+    uint64_t getBytes() const { return _mBytes; }
+    uint64_t getNodes() const { return _mNodes; }
+    std::chrono::steady_clock::duration getElapsed() const;
+
+  protected:
+    bool evaluate(bool read_clock);
+
+    CompileLimits _mLimits;
+    std::chrono::steady_clock::time_point _mStart;
+    uint64_t _mBytes = 0;
+    uint64_t _mNodes = 0;
+    uint32_t _mPolls = 0;
+    std::atomic<bool> _mCancelled {false};
+    CompileBudgetLimit _mExceeded = BUDGET_OK;
+};
+
+}
@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <system_error>
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "compile_cache.hh"
+#include "lslmini.hh"
+#include "passes/pretty_print.hh"
+#include "passes/tree_simplifier.hh"
+#include "passes/lso/script_compiler.hh"
+#include "passes/mono/script_compiler.hh"
+
+namespace Tailslide {
+
+namespace fs = std::filesystem;
+
+/// bump whenever the entry layout or anything that goes into keys changes
+static const uint32_t COMPILE_CACHE_FORMAT_VERSION = 1;
+static const char COMPILE_CACHE_MAGIC[8] = {'T', 'S', 'L', 'C', 'A', 'C', 'H', 'E'};
+static const char *COMPILE_CACHE_EXTENSION = ".tsc";
+
+static void put_le(std::string &out, uint64_t val, int size) {
+  for (int i = 0; i < size; ++i)
+    out += (char)((val >> (8 * i)) & 0xFF);
+}
+
+static uint64_t get_le(const char *data, int size) {
+  uint64_t val = 0;
+  for (int i = 0; i < size; ++i)
+    val |= (uint64_t)(uint8_t)data[i] << (8 * i);
+  return val;
+}
+
+
+CompileCacheKey::CompileCacheKey(std::string_view source) {
+  add("format", std::to_string(COMPILE_CACHE_FORMAT_VERSION));
+#ifdef VERSION
+  add("version", VERSION);
+#endif
+  add("builtins", tailslide_builtins_version());
+  add("source", source);
+}
+
+CompileCacheKey &CompileCacheKey::add(std::string_view name, std::string_view value) {
+  // length-prefix everything so different fields can't run together into the same bytes
+  std::string header;
+  put_le(header, name.size(), 4);
+  put_le(header, value.size(), 8);
+  _mHash.update(header);
+  _mHash.update(name);
+  _mHash.update(value);
+  return *this;
+}
+
+CompileCacheKey &CompileCacheKey::add(const OptimizationOptions &options) {
+  return addFlag("fold_constants", options.fold_constants)
+      .addFlag("prune_unused_locals", options.prune_unused_locals)
+      .addFlag("prune_unused_globals", options.prune_unused_globals)
+      .addFlag("prune_unused_functions", options.prune_unused_functions)
+      .addFlag("may_create_new_strs", options.may_create_new_strs)
+      .addFlag("eliminate_common_subexpressions", options.eliminate_common_subexpressions)
+      .addFlag("mono_semantics", options.mono_semantics);
+}
+
+CompileCacheKey &CompileCacheKey::add(const PrettyPrintOpts &options) {
+  return addFlag("mangle_local_names", options.mangle_local_names)
+      .addFlag("mangle_func_names", options.mangle_func_names)
+      .addFlag("mangle_global_names", options.mangle_global_names)
+      .addFlag("show_unmangled", options.show_unmangled);
+}
+
+CompileCacheKey &CompileCacheKey::add(const LSOCompilationOptions &options) {
+  return addFlag("optimize_bytecode", options.optimize_bytecode)
+      .addFlag("share_heap_constants", options.share_heap_constants)
+      .addFlag("lso_reuse_local_slots", options.reuse_local_slots);
+}
+
+CompileCacheKey &CompileCacheKey::add(const MonoCompilationOptions &options) {
+  return addFlag("optimize_sutractions", options.optimize_sutractions)
+      .addFlag("omit_unnecessary_pushes", options.omit_unnecessary_pushes)
+      .addFlag("peephole_optimize", options.peephole_optimize)
+      .addFlag("emit_assembly", options.emit_assembly)
+      .addFlag("exact_max_stack", options.exact_max_stack)
+      .addFlag("mono_reuse_local_slots", options.reuse_local_slots)
+      .addFlag("switch_dispatch", options.switch_dispatch)
+      .addFlag("flatten_string_concat", options.flatten_string_concat)
+      .addFlag("preallocate_lists", options.preallocate_lists)
+      .addFlag("cache_constant_lists", options.cache_constant_lists);
+}
+
+std::string CompileCacheKey::finish() {
+  return SHA256::toHex(_mHash.finish());
+}
+
+
+CachedCompile::~CachedCompile() {
+#ifndef _WIN32
+  if (_mMapped)
+    munmap((void *)_mData, _mSize);
+#endif
+}
+
+bool CachedCompile::parse() {
+  // magic, format version and section count
+  const size_t header_size = sizeof(COMPILE_CACHE_MAGIC) + 4 + 4;
+  if (_mSize < header_size || memcmp(_mData, COMPILE_CACHE_MAGIC, sizeof(COMPILE_CACHE_MAGIC)) != 0)
+    return false;
+  if (get_le(_mData + sizeof(COMPILE_CACHE_MAGIC), 4) != COMPILE_CACHE_FORMAT_VERSION)
+    return false;
+  auto num_sections = get_le(_mData + sizeof(COMPILE_CACHE_MAGIC) + 4, 4);
+
+  size_t pos = header_size;
+  for (uint64_t i = 0; i < num_sections; ++i) {
+    if (_mSize - pos < 12)
+      return false;
+    auto name_len = get_le(_mData + pos, 4);
+    auto data_len = get_le(_mData + pos + 4, 8);
+    pos += 12;
+    if (_mSize - pos < name_len || _mSize - pos - name_len < data_len)
+      return false;
+    std::string_view name(_mData + pos, name_len);
+    pos += name_len;
+    _mSections.emplace_back(name, std::string_view(_mData + pos, data_len));
+    pos += data_len;
+  }
+  return pos == _mSize;
+}
+
+bool CachedCompile::has(std::string_view name) const {
+  for (const auto &section : _mSections) {
+    if (section.first == name)
+      return true;
+  }
+  return false;
+}
+
+std::string_view CachedCompile::get(std::string_view name) const {
+  for (const auto &section : _mSections) {
+    if (section.first == name)
+      return section.second;
+  }
+  return {};
+}
+
+
+CompileCache::CompileCache(std::string dir, uint64_t max_bytes): _mDir(std::move(dir)), _mMaxBytes(max_bytes) {
+  std::error_code ec;
+  fs::create_directories(_mDir, ec);
+}
+
+std::string CompileCache::entryPath(const std::string &key) const {
+  // keys come from `CompileCacheKey`, don't let anything else escape the cache dir.
+  if (key.empty() || key.find_first_not_of("0123456789abcdef") != std::string::npos)
+    return "";
+  return (fs::path(_mDir) / (key + COMPILE_CACHE_EXTENSION)).string();
+}
+
+std::unique_ptr<CachedCompile> CompileCache::lookup(const std::string &key) {
+  auto path = entryPath(key);
+  if (path.empty())
+    return nullptr;
+
+  auto entry = std::make_unique<CachedCompile>();
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return nullptr;
+  }
+  void *mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+  entry->_mData = (const char *)mapping;
+  entry->_mSize = (size_t)st.st_size;
+  entry->_mMapped = true;
+#else
+  std::ifstream f(path, std::ios::binary);
+  if (!f)
+    return nullptr;
+  entry->_mBuffer.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  entry->_mData = entry->_mBuffer.data();
+  entry->_mSize = entry->_mBuffer.size();
+#endif
+
+  std::error_code ec;
+  if (!entry->parse()) {
+    // probably left over from an older version, get rid of it.
+    if (fs::remove(path, ec))
+      trackSize(entry->_mSize, 0);
+    return nullptr;
+  }
+  // eviction goes by modification time, mark it as recently used.
+  fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+  return entry;
+}
+
+bool CompileCache::store(const std::string &key, const CompileCacheSections &sections) {
+  auto path = entryPath(key);
+  if (path.empty())
+    return false;
+
+  std::string contents(COMPILE_CACHE_MAGIC, sizeof(COMPILE_CACHE_MAGIC));
+  put_le(contents, COMPILE_CACHE_FORMAT_VERSION, 4);
+  put_le(contents, sections.size(), 4);
+  for (const auto &section : sections) {
+    put_le(contents, section.first.size(), 4);
+    put_le(contents, section.second.size(), 8);
+    contents += section.first;
+    contents += section.second;
+  }
+
+  // write it out under a name nobody else will pick, then move it into place.
+  std::random_device rd;
+  auto tmp_path = path + ".tmp" + std::to_string(rd());
+  {
+    std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!f)
+      return false;
+    f.write(contents.data(), (std::streamsize)contents.size());
+    if (!f.flush()) {
+      f.close();
+      std::error_code ec;
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+  }
+  // replacing an existing entry frees up whatever it took
+  std::error_code ec;
+  uint64_t old_size = fs::file_size(path, ec);
+  if (ec)
+    old_size = 0;
+  fs::rename(tmp_path, path, ec);
+  if (ec) {
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mSizeMutex);
+    if (_mSizeKnown) {
+      _mTrackedBytes -= std::min(_mTrackedBytes, old_size);
+      _mTrackedBytes += contents.size();
+      if (_mTrackedBytes <= _mMaxBytes)
+        return true;
+    }
+  }
+  evict();
+  return true;
+}
+
+void CompileCache::trackSize(uint64_t old_size, uint64_t new_size) {
+  std::lock_guard<std::mutex> lock(_mSizeMutex);
+  _mTrackedBytes -= std::min(_mTrackedBytes, old_size);
+  _mTrackedBytes += new_size;
+}
+
+uint64_t CompileCache::evict() {
+  struct Entry {
+    fs::path path;
+    uint64_t size;
+    fs::file_time_type last_used;
+  };
+  std::vector<Entry> entries;
+  uint64_t total_size = 0;
+
+  std::error_code ec;
+  for (const auto &dir_entry : fs::directory_iterator(_mDir, ec)) {
+    if (dir_entry.path().extension() != COMPILE_CACHE_EXTENSION)
+      continue;
+    std::error_code entry_ec;
+    auto size = dir_entry.file_size(entry_ec);
+    auto last_used = dir_entry.last_write_time(entry_ec);
+    // someone else may have evicted it already
+    if (entry_ec)
+      continue;
+    entries.push_back({dir_entry.path(), size, last_used});
+    total_size += size;
+  }
+  if (total_size > _mMaxBytes) {
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+      return a.last_used < b.last_used;
+    });
+    for (const auto &entry : entries) {
+      if (total_size <= _mMaxBytes)
+        break;
+      if (fs::remove(entry.path, ec))
+        total_size -= entry.size;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_mSizeMutex);
+  _mTrackedBytes = total_size;
+  _mSizeKnown = true;
+  return total_size;
+}
+
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "sha256.hh"
+
+namespace Tailslide {
+
+struct OptimizationOptions;
+struct PrettyPrintOpts;
+struct LSOCompilationOptions;
+struct MonoCompilationOptions;
+
+/// Builds the key a compile's outputs get cached under out of everything that
+/// can affect them: the source, the builtins, the library version and the
+/// options each pass was run with.
+class CompileCacheKey {
+  public:
+    explicit CompileCacheKey(std::string_view source);
+
+    /// mix in anything else the outputs depend on, like which backend produced them
+    CompileCacheKey &add(std::string_view name, std::string_view value);
+    CompileCacheKey &addFlag(std::string_view name, bool value) { return add(name, value ? "1" : "0"); }
+    CompileCacheKey &add(const OptimizationOptions &options);
+    CompileCacheKey &add(const PrettyPrintOpts &options);
+    CompileCacheKey &add(const LSOCompilationOptions &options);
+    CompileCacheKey &add(const MonoCompilationOptions &options);
+
+    /// hex digest of everything added so far, nothing can be added afterwards.
+    std::string finish();
+
+  protected:
+    SHA256 _mHash {};
+};
+
+/// (name, contents) for each of the outputs stored in a cache entry
+typedef std::vector<std::pair<std::string_view, std::string_view>> CompileCacheSections;
+
+/// The outputs of a cached compile, read straight out of a mapping of the
+/// cache file where the platform allows it.
+class CachedCompile {
+  public:
+    CachedCompile() = default;
+    CachedCompile(const CachedCompile &other) = delete;
+    CachedCompile &operator=(const CachedCompile &other) = delete;
+    ~CachedCompile();
+
+    bool has(std::string_view name) const;
+    /// contents of the named output, empty if there isn't one.
+    std::string_view get(std::string_view name) const;
+    const CompileCacheSections &getSections() const { return _mSections; }
+
+  protected:
+    friend class CompileCache;
+    /// split the entry into its sections, returns false if it's truncated or not a cache entry.
+    bool parse();
+
+    const char *_mData = nullptr;
+    size_t _mSize = 0;
+    bool _mMapped = false;
+    std::string _mBuffer {};
+    CompileCacheSections _mSections {};
+};
+
+/// On-disk store of compile outputs keyed by `CompileCacheKey`. Each entry is
+/// its own file so concurrent compiles can share a directory, entries are
+/// written to a temporary file and renamed into place so readers never see
+/// a partial one. Once the entries take up more than `max_bytes`, the least
+/// recently used ones are evicted.
+///
+/// The directory is only scanned on the first store and whenever the size this
+/// instance has tracked since goes over the limit. Entries other processes add
+/// in the meantime aren't noticed until then.
+///
+/// Failing to read or write the cache is never an error, the caller can always
+/// just compile the script.
+class CompileCache {
+  public:
+    static constexpr uint64_t DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+
+    explicit CompileCache(std::string dir, uint64_t max_bytes = DEFAULT_MAX_BYTES);
+
+    /// the stored outputs for `key`, or nullptr if there aren't any.
+    std::unique_ptr<CachedCompile> lookup(const std::string &key);
+    /// store the outputs for `key`, replacing any that were there. returns false if they couldn't be written.
+    bool store(const std::string &key, const CompileCacheSections &sections);
+    /// remove the least recently used entries until they fit in the size limit,
+    /// returns how many bytes the remaining entries take up.
+    uint64_t evict();
+
+    const std::string &getDir() const { return _mDir; }
+
+  protected:
+    std::string entryPath(const std::string &key) const;
+
+    /// adjust the tracked size for an entry that changed from `old_size` to `new_size` bytes
+    void trackSize(uint64_t old_size, uint64_t new_size);
+
+    std::string _mDir;
+    uint64_t _mMaxBytes;
+    std::mutex _mSizeMutex {};
+    /// how much the entries took up as of the last scan, plus what's been stored since
+    uint64_t _mTrackedBytes = 0;
+    bool _mSizeKnown = false;
+};
+
+}
@@ -0,0 +1,645 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#endif
+
+#include "compile_server.hh"
+#include "tailslide.hh"
+
+namespace Tailslide {
+
+// frames bigger than this are garbage or hostile, no script gets anywhere near it
+static const uint32_t MAX_COMPILE_FRAME_SIZE = 64 * 1024 * 1024;
+
+static const char *COMPILE_ACTION_NAMES[] = {"lint", "optimize", "lso", "cil", "assemble"};
+
+struct CompileFlag {
+  const char *name;
+  bool *(*get)(CompileRequest *request);
+};
+
+// named the same as the CLI's options
+static const CompileFlag COMPILE_FLAGS[] = {
+    {"fold-constants", [](CompileRequest *r) { return &r->optimization.fold_constants; }},
+    {"prune-globals", [](CompileRequest *r) { return &r->optimization.prune_unused_globals; }},
+    {"prune-locals", [](CompileRequest *r) { return &r->optimization.prune_unused_locals; }},
+    {"prune-funcs", [](CompileRequest *r) { return &r->optimization.prune_unused_functions; }},
+    {"cse", [](CompileRequest *r) { return &r->optimization.eliminate_common_subexpressions; }},
+    {"mono-costs", [](CompileRequest *r) { return &r->optimization.mono_semantics; }},
+    {"mangle-globals", [](CompileRequest *r) { return &r->pretty.mangle_global_names; }},
+    {"mangle-locals", [](CompileRequest *r) { return &r->pretty.mangle_local_names; }},
+    {"mangle-funcs", [](CompileRequest *r) { return &r->pretty.mangle_func_names; }},
+    {"show-unmangled", [](CompileRequest *r) { return &r->pretty.show_unmangled; }},
+    {"lso-peephole", [](CompileRequest *r) { return &r->lso.optimize_bytecode; }},
+    {"lso-share-constants", [](CompileRequest *r) { return &r->lso.share_heap_constants; }},
+    {"lso-reuse-slots", [](CompileRequest *r) { return &r->lso.reuse_local_slots; }},
+    {"mono-peephole", [](CompileRequest *r) { return &r->mono.peephole_optimize; }},
+    {"mono-exact-stack", [](CompileRequest *r) { return &r->mono.exact_max_stack; }},
+    {"mono-reuse-slots", [](CompileRequest *r) { return &r->mono.reuse_local_slots; }},
+    {"mono-switch-dispatch", [](CompileRequest *r) { return &r->mono.switch_dispatch; }},
+    {"mono-flatten-concat", [](CompileRequest *r) { return &r->mono.flatten_string_concat; }},
+    {"mono-preallocate-lists", [](CompileRequest *r) { return &r->mono.preallocate_lists; }},
+    {"mono-cache-lists", [](CompileRequest *r) { return &r->mono.cache_constant_lists; }},
+};
+
+static void put_le(std::string &out, uint64_t val, int size) {
+  for (int i = 0; i < size; ++i)
+    out += (char)((val >> (8 * i)) & 0xFF);
+}
+
+static uint64_t get_le(const char *data, int size) {
+  uint64_t val = 0;
+  for (int i = 0; i < size; ++i)
+    val |= (uint64_t)(uint8_t)data[i] << (8 * i);
+  return val;
+}
+
+typedef std::vector<std::pair<std::string_view, std::string_view>> CompileMessageFields;
+
+// messages are a list of named fields laid out the same way as compile cache entries
+static std::string encode_fields(const CompileMessageFields &fields) {
+  std::string out;
+  put_le(out, fields.size(), 4);
+  for (const auto &field : fields) {
+    put_le(out, field.first.size(), 4);
+    put_le(out, field.second.size(), 8);
+    out += field.first;
+    out += field.second;
+  }
+  return out;
+}
+
+static bool decode_fields(std::string_view payload, CompileMessageFields *fields) {
+  if (payload.size() < 4)
+    return false;
+  auto num_fields = get_le(payload.data(), 4);
+  size_t pos = 4;
+  for (uint64_t i = 0; i < num_fields; ++i) {
+    if (payload.size() - pos < 12)
+      return false;
+    auto name_len = get_le(payload.data() + pos, 4);
+    auto data_len = get_le(payload.data() + pos + 4, 8);
+    pos += 12;
+    if (payload.size() - pos < name_len || payload.size() - pos - name_len < data_len)
+      return false;
+    std::string_view name = payload.substr(pos, name_len);
+    pos += name_len;
+    fields->emplace_back(name, payload.substr(pos, data_len));
+    pos += data_len;
+  }
+  return pos == payload.size();
+}
+
+static bool parse_uint(std::string_view str, uint64_t *val) {
+  if (str.empty() || str.size() > 20 || str.find_first_not_of("0123456789") != std::string_view::npos)
+    return false;
+  *val = strtoull(std::string(str).c_str(), nullptr, 10);
+  return true;
+}
+
+
+bool CompileRequest::setFlag(std::string_view name) {
+  for (const auto &flag : COMPILE_FLAGS) {
+    if (name == flag.name) {
+      *flag.get(this) = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string CompileRequest::encode() const {
+  std::string flags;
+  for (const auto &flag : COMPILE_FLAGS) {
+    if (!*flag.get(const_cast<CompileRequest *>(this)))
+      continue;
+    if (!flags.empty())
+      flags += ' ';
+    flags += flag.name;
+  }
+  auto id_str = std::to_string(id);
+  return encode_fields({
+      {"id", id_str}, {"action", COMPILE_ACTION_NAMES[action]}, {"flags", flags}, {"source", source},
+  });
+}
+
+bool CompileRequest::decode(std::string_view payload, CompileRequest *request, std::string *failure) {
+  CompileMessageFields fields;
+  if (!decode_fields(payload, &fields)) {
+    *failure = "malformed request";
+    return false;
+  }
+  bool have_action = false;
+  for (const auto &field : fields) {
+    if (field.first == "id") {
+      if (!parse_uint(field.second, &request->id)) {
+        *failure = "bad request id";
+        return false;
+      }
+    } else if (field.first == "action") {
+      for (size_t i = 0; i < sizeof(COMPILE_ACTION_NAMES) / sizeof(COMPILE_ACTION_NAMES[0]); ++i) {
+        if (field.second == COMPILE_ACTION_NAMES[i]) {
+          request->action = (CompileAction)i;
+          have_action = true;
+        }
+      }
+      if (!have_action) {
+        *failure = "unknown action " + std::string(field.second);
+        return false;
+      }
+    } else if (field.first == "flags") {
+      auto flags = field.second;
+      while (!flags.empty()) {
+        auto end = flags.find(' ');
+        auto flag = flags.substr(0, end);
+        if (!flag.empty() && !request->setFlag(flag)) {
+          *failure = "unknown flag " + std::string(flag);
+          return false;
+        }
+        flags = (end == std::string_view::npos) ? std::string_view() : flags.substr(end + 1);
+      }
+    } else if (field.first == "source") {
+      request->source = field.second;
+    }
+    // anything else is from a newer client, ignore it.
+  }
+  if (!have_action) {
+    *failure = "missing action";
+    return false;
+  }
+  return true;
+}
+
+std::string CompileResponse::encode() const {
+  auto id_str = std::to_string(id), errors_str = std::to_string(errors);
+  auto queue_str = std::to_string(queue_us), latency_str = std::to_string(latency_us);
+  CompileMessageFields fields {{"id", id_str}};
+  if (!failure.empty()) {
+    fields.emplace_back("failure", failure);
+  } else {
+    fields.emplace_back("errors", errors_str);
+    fields.emplace_back("report", report);
+    fields.emplace_back("output", output);
+    fields.emplace_back("cached", cached ? "1" : "0");
+    fields.emplace_back("over_budget", over_budget ? "1" : "0");
+  }
+  fields.emplace_back("queue_us", queue_str);
+  fields.emplace_back("latency_us", latency_str);
+  return encode_fields(fields);
+}
+
+bool CompileResponse::decode(std::string_view payload, CompileResponse *response) {
+  CompileMessageFields fields;
+  if (!decode_fields(payload, &fields))
+    return false;
+  for (const auto &field : fields) {
+    uint64_t val = 0;
+    if (field.first == "id") {
+      if (!parse_uint(field.second, &response->id))
+        return false;
+    } else if (field.first == "failure") {
+      response->failure = field.second;
+    } else if (field.first == "errors") {
+      if (!parse_uint(field.second, &val))
+        return false;
+      response->errors = (int)val;
+    } else if (field.first == "report") {
+      response->report = field.second;
+    } else if (field.first == "output") {
+      response->output = field.second;
+    } else if (field.first == "cached") {
+      response->cached = field.second == "1";
+    } else if (field.first == "over_budget") {
+      response->over_budget = field.second == "1";
+    } else if (field.first == "queue_us") {
+      if (!parse_uint(field.second, &response->queue_us))
+        return false;
+    } else if (field.first == "latency_us") {
+      if (!parse_uint(field.second, &response->latency_us))
+        return false;
+    }
+  }
+  return true;
+}
+
+
+#ifndef _WIN32
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len) {
+    // don't let a client hanging up take the whole server down with a SIGPIPE
+    ssize_t written = send(fd, data, len, MSG_NOSIGNAL);
+    if (written < 0 && errno == ENOTSOCK)
+      written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return true;
+}
+
+static bool read_all(int fd, char *data, size_t len) {
+  while (len) {
+    ssize_t got = read(fd, data, len);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    data += got;
+    len -= (size_t)got;
+  }
+  return true;
+}
+#endif
+
+bool write_compile_frame(int fd, std::string_view payload) {
+#ifndef _WIN32
+  if (payload.size() > MAX_COMPILE_FRAME_SIZE)
+    return false;
+  std::string frame;
+  frame.reserve(4 + payload.size());
+  put_le(frame, payload.size(), 4);
+  frame += payload;
+  return write_all(fd, frame.data(), frame.size());
+#else
+  return false;
+#endif
+}
+
+bool read_compile_frame(int fd, std::string *payload) {
+#ifndef _WIN32
+  char len_buf[4];
+  if (!read_all(fd, len_buf, sizeof(len_buf)))
+    return false;
+  auto len = get_le(len_buf, 4);
+  if (len > MAX_COMPILE_FRAME_SIZE)
+    return false;
+  payload->resize(len);
+  return read_all(fd, payload->data(), len);
+#else
+  return false;
+#endif
+}
+
+
+CompileServer::CompileServer(CompileServerOptions options): _mOptions(std::move(options)) {
+  if (!_mOptions.cache_dir.empty())
+    _mCache = std::make_unique<CompileCache>(_mOptions.cache_dir, _mOptions.cache_max_bytes);
+
+  auto num_threads = _mOptions.num_threads;
+  if (!num_threads)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned int i = 0; i < num_threads; ++i)
+    _mWorkers.emplace_back(&CompileServer::workerMain, this, i);
+}
+
+CompileServer::~CompileServer() {
+  {
+    std::lock_guard<std::mutex> lock(_mJobsMutex);
+    _mShuttingDown = true;
+  }
+  _mJobsCond.notify_all();
+  for (auto &worker : _mWorkers)
+    worker.join();
+}
+
+void CompileServer::enqueue(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(_mJobsMutex);
+    _mJobs.push_back(std::move(job));
+  }
+  _mJobsCond.notify_one();
+}
+
+void CompileServer::workerMain(unsigned int worker_num) {
+  set_trace_thread_name("worker " + std::to_string(worker_num));
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(_mJobsMutex);
+      _mJobsCond.wait(lock, [this]() { return _mShuttingDown || !_mJobs.empty(); });
+      if (_mJobs.empty())
+        return;
+      job = std::move(_mJobs.front());
+      _mJobs.pop_front();
+    }
+    // jobs report their own failures, this just keeps one that didn't from taking the worker down.
+    try {
+      job();
+    } catch (const std::exception &e) {
+      if (_mOptions.log) {
+        std::lock_guard<std::mutex> lock(_mLogMutex);
+        fprintf(_mOptions.log, "worker %u: job failed: %s\n", worker_num, e.what());
+        fflush(_mOptions.log);
+      }
+    }
+  }
+}
+
+CompileResponse CompileServer::compile(const CompileRequest &request) {
+  return handle(request, std::chrono::steady_clock::now());
+}
+
+std::future<CompileResponse> CompileServer::submit(CompileRequest request) {
+  auto received = std::chrono::steady_clock::now();
+  // std::function needs to be copyable, so the promise can't just be moved into it.
+  auto promise = std::make_shared<std::promise<CompileResponse>>();
+  auto future = promise->get_future();
+  enqueue([this, promise, request = std::move(request), received]() {
+    try {
+      promise->set_value(handle(request, received));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
+  return future;
+}
+
+CompileResponse CompileServer::handle(const CompileRequest &request, std::chrono::steady_clock::time_point received,
+                                      const void *owner) {
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  auto start = std::chrono::steady_clock::now();
+  std::string trace_label;
+  if (is_tracing())
+    trace_label = "request " + std::to_string(request.id) + " (" + COMPILE_ACTION_NAMES[request.action] + ")";
+  TraceScope trace("request", "server", trace_label);
+
+  CompileResponse response;
+  std::string cache_key;
+  if (_mCache) {
+    TraceScope cache_trace("cache_lookup", "server");
+    CompileCacheKey key(request.source);
+    key.add("action", COMPILE_ACTION_NAMES[request.action])
+        .add(request.optimization)
+        .add(request.pretty)
+        .add(request.lso)
+        .add(request.mono);
+    cache_key = key.finish();
+    if (auto cached = _mCache->lookup(cache_key)) {
+      response.errors = atoi(std::string(cached->get("errors")).c_str());
+      response.report = cached->get("report");
+      response.output = cached->get("output");
+      response.cached = true;
+    }
+  }
+  if (!response.cached) {
+    try {
+      response = compileUncached(request, owner);
+    } catch (const std::exception &e) {
+      response.failure = std::string("couldn't compile: ") + e.what();
+    } catch (const char *e) {
+      response.failure = std::string("couldn't compile: ") + e;
+    }
+    // whether it fits in the budget depends on more than the request, don't remember it.
+    if (_mCache && !response.over_budget && response.failure.empty()) {
+      auto errors = std::to_string(response.errors);
+      _mCache->store(cache_key, {
+          {"errors", errors}, {"report", response.report}, {"output", response.output},
+      });
+    }
+  }
+  response.id = request.id;
+
+  auto finished = std::chrono::steady_clock::now();
+  response.queue_us = duration_cast<microseconds>(start - received).count();
+  response.latency_us = duration_cast<microseconds>(finished - received).count();
+  ++_mRequestsServed;
+
+  if (_mOptions.log) {
+    std::lock_guard<std::mutex> lock(_mLogMutex);
+    fprintf(_mOptions.log, "request %llu (%s): %d errors%s%s%s, %llu us queued, %llu us total\n",
+            (unsigned long long)response.id, COMPILE_ACTION_NAMES[request.action], response.errors,
+            response.cached ? ", cached" : "", response.over_budget ? ", over budget" : "",
+            response.failure.empty() ? "" : ", failed",
+            (unsigned long long)response.queue_us,
+            (unsigned long long)response.latency_us);
+    fflush(_mOptions.log);
+  }
+  return response;
+}
+
+CompileResponse CompileServer::compileUncached(const CompileRequest &request, const void *owner) {
+  CompileResponse response;
+  CompileBudget budget(_mOptions.limits);
+  ScopedScriptParser parser(nullptr);
+  // attached even without any limits so the compile can still be cancelled
+  parser.context.budget = &budget;
+  {
+    std::lock_guard<std::mutex> lock(_mBudgetsMutex);
+    _mActiveBudgets.emplace(owner, &budget);
+  }
+  // however we leave, `cancelCompiles()` mustn't see the budget after it's gone
+  struct BudgetRegistration {
+    CompileServer *server;
+    const void *owner;
+    CompileBudget *budget;
+    ~BudgetRegistration() {
+      std::lock_guard<std::mutex> lock(server->_mBudgetsMutex);
+      auto range = server->_mActiveBudgets.equal_range(owner);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == budget) {
+          server->_mActiveBudgets.erase(it);
+          break;
+        }
+      }
+    }
+  } registration {this, owner, &budget};
+  Logger *logger = &parser.logger;
+
+  auto *script = parser.parseLSLBytes(request.source.data(), (int)request.source.size());
+  if (script) {
+    script->collectSymbols();
+    script->determineTypes();
+    script->recalculateReferenceData();
+    script->propagateValues();
+    script->finalPass();
+
+    // Don't try to optimize if we have a possibly broken tree
+    if (!logger->getErrors() && request.action != COMPILE_LINT)
+      script->optimize(request.optimization);
+    // do these last since symbol usage and expressions may change
+    // when rewriting the tree
+    script->validateGlobals(request.action != COMPILE_LSO);
+    script->checkSymbols();
+  }
+
+  if (script && !logger->getErrors()) {
+    switch (request.action) {
+      case COMPILE_OPTIMIZE: {
+        parser.table_manager.setMangledNames();
+        PrettyPrintVisitor print_visitor(request.pretty);
+        script->visit(&print_visitor);
+        response.output = print_visitor.mStream.str() + "\n";
+        break;
+      }
+      case COMPILE_LSO: {
+        // nothing else uses the tree after this, no need to lower a copy
+        auto lso_options = request.lso;
+        lso_options.lower_in_place = true;
+        LSOScriptCompiler lso_visitor(&parser.allocator, lso_options);
+        script->visit(&lso_visitor);
+        response.output.assign((const char *)lso_visitor.mScriptBS.data(), lso_visitor.mScriptBS.size());
+        break;
+      }
+      case COMPILE_CIL:
+      case COMPILE_ASSEMBLE: {
+        auto mono_options = request.mono;
+        mono_options.emit_assembly = request.action == COMPILE_ASSEMBLE;
+        mono_options.lower_in_place = true;
+        MonoScriptCompiler mono_visitor(&parser.allocator, mono_options);
+        script->visit(&mono_visitor);
+        if (request.action == COMPILE_ASSEMBLE)
+          response.output.assign((const char *)mono_visitor.mAssemblyBS.data(), mono_visitor.mAssemblyBS.size());
+        else
+          response.output = mono_visitor.mCIL.str();
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  response.errors = logger->getErrors();
+  response.report = logger->formatReport();
+  response.over_budget = budget.getExceeded() != BUDGET_OK;
+  return response;
+}
+
+void CompileServer::cancelCompiles(const void *owner) {
+  std::lock_guard<std::mutex> lock(_mBudgetsMutex);
+  auto range = _mActiveBudgets.equal_range(owner);
+  for (auto it = range.first; it != range.second; ++it)
+    it->second->cancel();
+}
+
+bool CompileServer::serve(int in_fd, int out_fd) {
+#ifndef _WIN32
+  std::mutex out_mutex;
+  std::mutex pending_mutex;
+  std::condition_variable pending_cond;
+  size_t pending = 0;
+  // set once the client stops taking responses, no point compiling anything else for it.
+  // its address doubles as the owner of this connection's compiles.
+  std::atomic<bool> hung_up {false};
+
+  std::string payload;
+  while (!hung_up && read_compile_frame(in_fd, &payload)) {
+    auto received = std::chrono::steady_clock::now();
+    CompileRequest request;
+    std::string failure;
+    if (!CompileRequest::decode(payload, &request, &failure)) {
+      CompileResponse response;
+      response.id = request.id;
+      response.failure = failure;
+      std::lock_guard<std::mutex> lock(out_mutex);
+      write_compile_frame(out_fd, response.encode());
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      ++pending;
+    }
+    // everything captured by reference outlives the job, we wait for all of them below.
+    enqueue([&, request = std::move(request), received]() {
+      if (!hung_up) {
+        auto response = handle(request, received, &hung_up);
+        std::lock_guard<std::mutex> lock(out_mutex);
+        if (!hung_up && !write_compile_frame(out_fd, response.encode())) {
+          hung_up = true;
+          cancelCompiles(&hung_up);
+        }
+      }
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      if (!--pending)
+        pending_cond.notify_all();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock(pending_mutex);
+  pending_cond.wait(lock, [&]() { return pending == 0; });
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool CompileServer::listen(const std::string &path) {
+#ifndef _WIN32
+  sockaddr_un addr {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return false;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    return false;
+  // probably left behind by a server that didn't shut down cleanly
+  unlink(path.c_str());
+  if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, SOMAXCONN) != 0) {
+    close(listen_fd);
+    return false;
+  }
+  _mListenFD = listen_fd;
+
+  // `stop()` shuts the socket down to wake us up.
+  while (!_mStopped) {
+    int conn_fd = accept(listen_fd, nullptr, nullptr);
+    if (conn_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mConnMutex);
+      _mConnFDs.push_back(conn_fd);
+    }
+    std::thread([this, conn_fd]() {
+      serve(conn_fd, conn_fd);
+      std::lock_guard<std::mutex> lock(_mConnMutex);
+      // take it off the list before the fd can be reused
+      _mConnFDs.erase(std::find(_mConnFDs.begin(), _mConnFDs.end(), conn_fd));
+      close(conn_fd);
+      if (_mConnFDs.empty())
+        _mConnCond.notify_all();
+    }).detach();
+  }
+
+  _mListenFD = -1;
+  close(listen_fd);
+  unlink(path.c_str());
+  std::unique_lock<std::mutex> lock(_mConnMutex);
+  // idle clients would otherwise keep their connections' readers blocked forever.
+  // only shut down reading so responses to requests we've already read still go out.
+  for (int conn_fd : _mConnFDs)
+    shutdown(conn_fd, SHUT_RD);
+  // let the connections we already have finish up
+  _mConnCond.wait(lock, [this]() { return _mConnFDs.empty(); });
+  return true;
+#else
+  return false;
+#endif
+}
+
+void CompileServer::stop() {
+  // this gets called from signal handlers, so no locks or allocations in here.
+  // `listen()` takes care of the open connections once it wakes up.
+  _mStopped = true;
+#ifndef _WIN32
+  int listen_fd = _mListenFD;
+  if (listen_fd >= 0)
+    shutdown(listen_fd, SHUT_RDWR);
+#endif
+}
+
+}
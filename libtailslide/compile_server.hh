@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "compile_cache.hh"
+#include "passes/pretty_print.hh"
+#include "passes/tree_simplifier.hh"
+#include "passes/lso/script_compiler.hh"
+#include "passes/mono/script_compiler.hh"
+
+namespace Tailslide {
+
+/// What a `CompileRequest` should do with its script once it's been analyzed
+enum CompileAction {
+  COMPILE_LINT,
+  /// optimize and pretty print it
+  COMPILE_OPTIMIZE,
+  COMPILE_LSO,
+  COMPILE_CIL,
+  /// compile to a loadable Mono assembly
+  COMPILE_ASSEMBLE,
+};
+
+struct CompileRequest {
+  /// chosen by the client, responses are matched up with requests by it.
+  uint64_t id = 0;
+  CompileAction action = COMPILE_LINT;
+  OptimizationOptions optimization {};
+  PrettyPrintOpts pretty {};
+  LSOCompilationOptions lso {};
+  MonoCompilationOptions mono {};
+  std::string source {};
+
+  /// Set one of the options by its name in the CLI (`fold-constants`, `mono-peephole`, ...).
+  /// returns false if there's no such option.
+  bool setFlag(std::string_view name);
+
+  std::string encode() const;
+  /// returns false and fills in `failure` if `payload` isn't a valid request.
+  static bool decode(std::string_view payload, CompileRequest *request, std::string *failure);
+};
+
+struct CompileResponse {
+  uint64_t id = 0;
+  /// why the request couldn't be handled at all, empty if it was.
+  std::string failure {};
+  int errors = 0;
+  /// diagnostics in the same format the CLI writes them to stderr
+  std::string report {};
+  /// pretty printed source, LSO image, CIL or assembly depending on the action
+  std::string output {};
+  bool cached = false;
+  /// the compile was cut short by the server's `CompileLimits`, the report has the details.
+  bool over_budget = false;
+  /// time spent waiting for a worker, then from receiving the request to finishing it.
+  uint64_t queue_us = 0;
+  uint64_t latency_us = 0;
+
+  std::string encode() const;
+  static bool decode(std::string_view payload, CompileResponse *response);
+};
+
+/// Messages go over the wire as a little-endian u32 length followed by that many bytes.
+/// These return false once the other side goes away.
+bool write_compile_frame(int fd, std::string_view payload);
+bool read_compile_frame(int fd, std::string *payload);
+
+struct CompileServerOptions {
+  /// 0 uses one per hardware thread
+  unsigned int num_threads = 0;
+  /// reuse outputs for identical requests through a `CompileCache` in this directory if set
+  std::string cache_dir {};
+  uint64_t cache_max_bytes = CompileCache::DEFAULT_MAX_BYTES;
+  /// how much each request may cost before it's given up on
+  CompileLimits limits {};
+  /// where to log a line with the latency of each request, if anywhere
+  FILE *log = nullptr;
+};
+
+/// Long-running compile service that keeps the builtins and the compile cache
+/// around between requests, rather than paying for process startup on every
+/// script. Requests are compiled concurrently on a pool of worker threads,
+/// each with its own `ScopedScriptParser`.
+///
+/// `tailslide_init_builtins()` must be called before the server is created.
+class CompileServer {
+  public:
+    explicit CompileServer(CompileServerOptions options = {});
+    CompileServer(const CompileServer &other) = delete;
+    CompileServer &operator=(const CompileServer &other) = delete;
+    /// waits for queued requests to finish.
+    ~CompileServer();
+
+    /// handle a request on the calling thread
+    CompileResponse compile(const CompileRequest &request);
+    /// queue a request up for the worker threads
+    std::future<CompileResponse> submit(CompileRequest request);
+
+    /// Read framed requests from `in_fd` and write framed responses to `out_fd` as they
+    /// finish, which may not be the order they were sent in. Returns once `in_fd` is
+    /// closed and every response has been written. If `out_fd` stops taking responses,
+    /// the compiles still queued or running for it are cancelled.
+    bool serve(int in_fd, int out_fd);
+    /// Listen on a UNIX domain socket at `path`, serving each connection like `serve()`.
+    /// Blocks until `stop()` is called, returns false if the socket couldn't be created.
+    bool listen(const std::string &path);
+    /// Stop accepting connections and stop reading requests from the open ones, may be
+    /// called from any thread or from a signal handler. Requests already read still get
+    /// their responses.
+    void stop();
+
+    uint64_t getRequestsServed() const { return _mRequestsServed; }
+    unsigned int getNumThreads() const { return (unsigned int)_mWorkers.size(); }
+
+  protected:
+    /// `owner` identifies whoever asked for the compile, for `cancelCompiles()`
+    CompileResponse handle(const CompileRequest &request, std::chrono::steady_clock::time_point received,
+                           const void *owner=nullptr);
+    CompileResponse compileUncached(const CompileRequest &request, const void *owner);
+    /// make the compiles in progress for `owner` give up at their next budget check
+    void cancelCompiles(const void *owner);
+    void enqueue(std::function<void()> job);
+    void workerMain(unsigned int worker_num);
+
+    CompileServerOptions _mOptions;
+    std::unique_ptr<CompileCache> _mCache {};
+
+    std::vector<std::thread> _mWorkers {};
+    std::deque<std::function<void()>> _mJobs {};
+    std::mutex _mJobsMutex {};
+    std::condition_variable _mJobsCond {};
+    bool _mShuttingDown = false;
+
+    std::atomic<int> _mListenFD {-1};
+    std::atomic<bool> _mStopped {false};
+    /// connections `listen()` is serving, so it can wake up their readers once stopped
+    std::vector<int> _mConnFDs {};
+    std::mutex _mConnMutex {};
+    std::condition_variable _mConnCond {};
+    /// budgets of the compiles in progress, keyed by their owner
+    std::unordered_multimap<const void *, CompileBudget *> _mActiveBudgets {};
+    std::mutex _mBudgetsMutex {};
+    std::atomic<uint64_t> _mRequestsServed {0};
+    std::mutex _mLogMutex {};
+};
+
+}
@@ -156,15 +156,24 @@ void Logger::finalize() {
 }
 
 void Logger::printReport() {
+  fputs(formatReport().c_str(), stderr);
+}
+
+std::string Logger::formatReport() {
   finalize();
   if (_mSort)
     std::sort(_mMessages.begin(), _mMessages.end(), LogMessageSort());
 
-  std::vector<LogMessage *>::iterator i;
-  for (i = _mMessages.begin(); i != _mMessages.end(); ++i)
-    fprintf(stderr, "%s\n", (*i)->getMessage().c_str());
+  std::string report;
+  for (auto *message : _mMessages) {
+    report += message->getMessage();
+    report += '\n';
+  }
 
-  fprintf(stderr, "TOTAL:: Errors: %d  Warnings: %d\n", _mErrors, _mWarnings);
+  char buf[64];
+  snprintf(buf, sizeof(buf), "TOTAL:: Errors: %d  Warnings: %d\n", _mErrors, _mWarnings);
+  report += buf;
+  return report;
 }
 
 LogMessage::LogMessage(ScriptContext *ctx, LogLevel type, YYLTYPE *loc, const char *message, ErrorCode error)
@@ -215,7 +224,8 @@ const char *Logger::_sErrorMessages[] = {
         "Lists may not contain other lists",
         "May not cast %s to %s",
         "Lists may not contain nulls",
-        "Stack-heap collision"
+        "Stack-heap collision",
+        "Compile %s, giving up",
 };
 
 const char *Logger::_sWarningMessages[] = {
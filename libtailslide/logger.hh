@@ -62,6 +62,7 @@ enum ErrorCode {
     E_ILLEGAL_CAST = 10035,
     E_NULL_IN_LIST = 10036,
     E_STACK_HEAP_COLLISION = 10037,
+    E_COMPILE_BUDGET_EXCEEDED = 10038,
     E_LAST,
 
 
@@ -107,6 +108,8 @@ class Logger {
     void logv(LogLevel type, YYLTYPE *loc, const char *fmt, va_list args, int error=0);
     void error( YYLTYPE *loc, int error, ... );
     void printReport();
+    /// the same text `printReport()` writes out
+    std::string formatReport();
     void reset();
     void finalize();
 
@@ -8,8 +8,10 @@
 #include "ast.hh"
 #include "visitor.hh"
 #include "passes/tree_simplifier.hh"
+#include "passes/subexpression_elimination.hh"
 #include "passes/symbol_resolution.hh"
 #include "passes/globalexpr_validator.hh"
+#include "passes/semantic_fingerprint.hh"
 
 
 namespace Tailslide {
@@ -28,6 +30,21 @@ const char *DEPRECATED_FUNCTIONS[][2] = {
 };
 
 
+bool ScriptContext::overBudget(YYLTYPE *loc, bool polling) {
+  if (!budget)
+    return false;
+  // already reported
+  if (budget->getExceeded() != BUDGET_OK)
+    return true;
+  if (polling ? budget->poll() : budget->check())
+    return false;
+  logger->error(loc, E_COMPILE_BUDGET_EXCEEDED, budget->describeExceeded());
+  // whatever pass noticed may have stopped partway through
+  ast_sane = false;
+  return true;
+}
+
+
 // Lookup a symbol, propagating up the tree until it is found.
 LSLSymbol *LSLASTNode::lookupSymbol(const char *name, LSLSymbolType type) {
   LSLSymbol *sym = nullptr;
@@ -114,6 +131,9 @@ void LSLASTNode::defineSymbol(LSLSymbol *symbol) {
 
 // Define any symbols we have, and ask our children to
 void LSLASTNode::collectSymbols() {
+  if (mContext->overBudget(getLoc()))
+    return;
+  ScopedPassTimer timer(mContext, "collect_symbols");
   SymbolResolutionVisitor visitor(true, mContext->allocator);
   this->visit(&visitor);
 }
@@ -216,13 +236,18 @@ class NodeReferenceUpdatingVisitor : public ASTVisitor {
         }
         upper_node = upper_node->getParent();
       }
-      if (auto *symbol = id->getSymbol())
+      // builtin symbols are shared between scripts, which may be processed concurrently.
+      auto *symbol = id->getSymbol();
+      if (symbol && symbol->getSubType() != SYM_BUILTIN)
         symbol->addReference();
       return false;
     };
 };
 
 void LSLScript::recalculateReferenceData() {
+  if (mContext->overBudget(getLoc()))
+    return;
+  ScopedPassTimer timer(mContext, "reference_data");
   // get updated mutation / reference counts
   mContext->table_manager->resetTracking();
   auto visitor = NodeReferenceUpdatingVisitor();
@@ -230,10 +255,16 @@ void LSLScript::recalculateReferenceData() {
 }
 
 void LSLScript::optimize(const OptimizationOptions &ctx) {
+  ScopedPassTimer timer(mContext, "optimize");
   int optimized;
   // make sure we have updated reference data before we start folding any constants
   recalculateReferenceData();
   do {
+    // each round can be as expensive as the last, don't start one we can't afford
+    if (mContext->overBudget(getLoc()))
+      return;
+    timer.addIteration();
+    TraceScope round_trace("optimize_round", "optimizer");
     TreeSimplifyingVisitor folding_visitor(ctx);
     visit(&folding_visitor);
     optimized = folding_visitor.mFoldedLevel;
@@ -242,14 +273,31 @@ void LSLScript::optimize(const OptimizationOptions &ctx) {
     if (optimized)
       recalculateReferenceData();
   } while (optimized);
+
+  if (ctx.eliminate_common_subexpressions && !mContext->overBudget(getLoc())) {
+    ScopedPassTimer cse_timer(mContext, "eliminate_subexpressions");
+    SubexpressionEliminatingVisitor cse_visitor(mContext->allocator, ctx.mono_semantics);
+    visit(&cse_visitor);
+    if (cse_visitor.mEliminatedCount)
+      recalculateReferenceData();
+  }
 }
 
 
 void LSLScript::validateGlobals(bool mono_semantics) {
+  if (mContext->overBudget(getLoc()))
+    return;
+  ScopedPassTimer timer(mContext, "validate_globals");
   SimpleAssignableValidatingVisitor visitor(mono_semantics);
   visit(&visitor);
 }
 
+std::string LSLScript::getSemanticFingerprint() {
+  SemanticFingerprintVisitor visitor;
+  visit(&visitor);
+  return visitor.finish();
+}
+
 
 LSLConstant *LSLIdentifier::getConstantValue() {
   if (_mSymbol && _mSymbol->getAssignments() == 0)
@@ -325,7 +373,8 @@ LSLIdentifier *LSLIdentifier::clone() {
   id->setSymbol(getSymbol());
   id->setConstantPrecluded(getConstantPrecluded());
   id->setConstantValue(getConstantValue());
-  if (auto *sym = getSymbol()) {
+  auto *sym = getSymbol();
+  if (sym && sym->getSubType() != SYM_BUILTIN) {
     sym->addReference();
   }
   return id;
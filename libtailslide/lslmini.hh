@@ -9,6 +9,9 @@
 #include <functional>
 #include <sstream>
 
+#include "compile_budget.hh"
+#include "pass_stats.hh"
+#include "trace.hh"
 #include "loctype.hh"
 #include "symtab.hh"
 #include "ast.hh"
@@ -47,6 +50,15 @@ struct ScriptContext {
   bool parsing = false;
   Tailslide::TailslideLType glloc {0};
   void *scanner = nullptr;
+  /// limits on how much compiling this script may cost, if any
+  CompileBudget *budget = nullptr;
+  /// where to record what each pass cost, if anywhere
+  CompileStats *stats = nullptr;
+
+  /// whether the compile has used up its budget and should stop,
+  /// reports which limit it hit the first time. `polling` is for hot
+  /// loops, see `CompileBudget::poll()`.
+  bool overBudget(YYLTYPE *loc, bool polling=false);
 };
 
 struct Vector3 {
@@ -78,6 +90,7 @@ struct Quaternion {
 
 class LSLIdentifier : public LSLASTNode {
   public:
+    NODE_SHALLOW_CLONE(LSLIdentifier)
     LSLIdentifier( ScriptContext *ctx, const char *name ) : LSLASTNode(ctx), _mName(name) {};
     LSLIdentifier( ScriptContext *ctx, class LSLType *type, const char *name ) : LSLASTNode(ctx), _mName(name) { _mType = type; };
     LSLIdentifier( ScriptContext *ctx, class LSLType *type, const char *name, YYLTYPE *lloc ) : LSLASTNode(ctx, lloc, 0), _mName(name) { _mType = type; };
@@ -106,6 +119,7 @@ class LSLIdentifier : public LSLASTNode {
 
 class LSLGlobalVariable : public LSLASTNode {
   public:
+    NODE_SHALLOW_CLONE(LSLGlobalVariable)
     LSLGlobalVariable( ScriptContext *ctx, class LSLIdentifier *identifier, class LSLExpression *value )
       : LSLASTNode(ctx, 2, identifier, value) { DEBUG( LOG_DEBUG_SPAM, nullptr, "made a global var\n"); };
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
@@ -139,6 +153,7 @@ class LSLConstant : public LSLASTNode {
 
 class LSLIntegerConstant : public LSLConstant {
   public:
+    NODE_SHALLOW_CLONE(LSLIntegerConstant)
     LSLIntegerConstant( ScriptContext *ctx, int v ) : LSLConstant(ctx), _mValue(v) { _mType = TYPE(LST_INTEGER); }
 
     virtual std::string getNodeName() {
@@ -164,6 +179,7 @@ class LSLIntegerConstant : public LSLConstant {
 
 class LSLFloatConstant : public LSLConstant {
   public:
+    NODE_SHALLOW_CLONE(LSLFloatConstant)
     LSLFloatConstant( ScriptContext *ctx, double v ) : LSLConstant(ctx), _mValue(v) { _mType = TYPE(LST_FLOATINGPOINT); }
 
     virtual std::string getNodeName() {
@@ -190,6 +206,7 @@ class LSLFloatConstant : public LSLConstant {
 
 class LSLStringConstant : public LSLConstant {
   public:
+    NODE_SHALLOW_CLONE(LSLStringConstant)
     LSLStringConstant( ScriptContext *ctx, const char *v ) : LSLConstant(ctx), _mValue(v) { _mType = TYPE(LST_STRING); }
 
     virtual std::string getNodeName() {
@@ -216,6 +233,7 @@ class LSLStringConstant : public LSLConstant {
 
 class LSLKeyConstant : public LSLStringConstant {
   public:
+    NODE_SHALLOW_CLONE(LSLKeyConstant)
     LSLKeyConstant( ScriptContext *ctx, const char *v ) : LSLStringConstant(ctx, v) { _mType = TYPE(LST_KEY); }
     virtual LSLConstant *copy(ScriptAllocator *allocator) {
       return allocator->newTracked<LSLKeyConstant>(_mValue);
@@ -235,6 +253,7 @@ class LSLKeyConstant : public LSLStringConstant {
 
 class LSLListConstant : public LSLConstant {
   public:
+    NODE_SHALLOW_CLONE(LSLListConstant)
     LSLListConstant( ScriptContext *ctx, class LSLConstant *v ) : LSLConstant(ctx) {
       _mType = TYPE(LST_LIST);
       // so we can do symbol resolution inside the list constant
@@ -269,6 +288,7 @@ class LSLListConstant : public LSLConstant {
 
 class LSLVectorConstant : public LSLConstant {
   public:
+    NODE_SHALLOW_CLONE(LSLVectorConstant)
     LSLVectorConstant( ScriptContext *ctx, float x, float y, float z ): LSLConstant(ctx), _mValue({x, y, z}) {
       _mType = TYPE(LST_VECTOR);
     };
@@ -298,6 +318,7 @@ class LSLVectorConstant : public LSLConstant {
 
 class LSLQuaternionConstant : public LSLConstant {
   public:
+    NODE_SHALLOW_CLONE(LSLQuaternionConstant)
     LSLQuaternionConstant( ScriptContext *ctx, float x, float y, float z, float s ): LSLConstant(ctx), _mValue({x, y, z, s}) {
       _mType = TYPE(LST_QUATERNION);
     };
@@ -324,6 +345,7 @@ class LSLQuaternionConstant : public LSLConstant {
 
 class LSLGlobalFunction : public LSLASTNode {
   public:
+    NODE_SHALLOW_CLONE(LSLGlobalFunction)
     LSLGlobalFunction( ScriptContext *ctx, class LSLIdentifier *identifier, class LSLFunctionDec *decl, class LSLStatement *statement )
       : LSLASTNode( ctx, 3, identifier, decl, statement ) {};
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
@@ -337,12 +359,14 @@ class LSLGlobalFunction : public LSLASTNode {
 
 class LSLParamList : public LSLASTNodeList<LSLIdentifier> {
   public:
+    NODE_SHALLOW_CLONE(LSLParamList)
     explicit LSLParamList( ScriptContext *ctx ) : LSLASTNodeList(ctx, nullptr) {};
     LSLParamList( ScriptContext *ctx, class LSLIdentifier *identifiers ) : LSLASTNodeList(ctx, identifiers) {};
 };
 
 class LSLFunctionDec : public LSLParamList {
   public:
+    NODE_SHALLOW_CLONE(LSLFunctionDec)
     explicit LSLFunctionDec(ScriptContext *ctx) : LSLParamList(ctx) {};
     LSLFunctionDec( ScriptContext *ctx, class LSLIdentifier *identifiers ) : LSLParamList(ctx, identifiers) {};
     virtual std::string getNodeName() { return "function decl"; }
@@ -351,6 +375,7 @@ class LSLFunctionDec : public LSLParamList {
 
 class LSLEventDec : public LSLParamList {
   public:
+    NODE_SHALLOW_CLONE(LSLEventDec)
     explicit LSLEventDec(ScriptContext *ctx) : LSLParamList(ctx) {};
     LSLEventDec( ScriptContext *ctx, class LSLIdentifier *identifiers ) : LSLParamList(ctx, identifiers) {};
 
@@ -361,6 +386,7 @@ class LSLEventDec : public LSLParamList {
 
 class LSLEventHandler : public LSLASTNode {
   public:
+    NODE_SHALLOW_CLONE(LSLEventHandler)
   LSLEventHandler( ScriptContext *ctx, class LSLIdentifier *identifier, class LSLEventDec *decl, class LSLStatement *body )
       : LSLASTNode(ctx, 3, identifier, decl, body) {};
   NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
@@ -374,6 +400,7 @@ class LSLEventHandler : public LSLASTNode {
 
 class LSLState : public LSLASTNode {
   public:
+    NODE_SHALLOW_CLONE(LSLState)
     LSLState( ScriptContext *ctx, class LSLIdentifier *identifier, LSLASTNodeList<LSLEventHandler> *event_handlers)
         : LSLASTNode( ctx, 2, identifier, event_handlers) {};
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
@@ -387,6 +414,7 @@ class LSLState : public LSLASTNode {
 
 class LSLExpression : public LSLASTNode {
   public:
+    NODE_SHALLOW_CLONE(LSLExpression)
   explicit LSLExpression(ScriptContext *ctx) : LSLASTNode(ctx, 0), _mOperation(OP_NONE) {};
   LSLExpression(ScriptContext *ctx, int num, ...): LSLASTNode(ctx), _mOperation(OP_NONE) {
     va_list ap;
@@ -413,6 +441,7 @@ class LSLExpression : public LSLASTNode {
 
 class LSLStatement : public LSLASTNode {
   public:
+    NODE_SHALLOW_CLONE(LSLStatement)
     explicit LSLStatement( ScriptContext *ctx ): LSLASTNode(ctx) {}
     LSLStatement( ScriptContext *ctx, int num, ... ): LSLASTNode(ctx) {
       va_list ap;
@@ -426,6 +455,7 @@ class LSLStatement : public LSLASTNode {
 
 class LSLNopStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLNopStatement)
     explicit LSLNopStatement( ScriptContext *ctx) : LSLStatement(ctx, 0) {}
     virtual std::string getNodeName() { return "nop statement"; };
     virtual LSLNodeSubType getNodeSubType() { return NODE_NOP_STATEMENT; };
@@ -433,6 +463,7 @@ class LSLNopStatement : public LSLStatement {
 
 class LSLCompoundStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLCompoundStatement)
     LSLCompoundStatement( ScriptContext *ctx, class LSLStatement *statements ) : LSLStatement(ctx) {
       if (statements)
         pushChild(statements);
@@ -443,6 +474,7 @@ class LSLCompoundStatement : public LSLStatement {
 
 class LSLExpressionStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLExpressionStatement)
   LSLExpressionStatement( ScriptContext *ctx, class LSLExpression *expr ) : LSLStatement(ctx, 1, expr) {}
   NODE_FIELD_GS(LSLExpression, Expr, 0)
 
@@ -452,6 +484,7 @@ class LSLExpressionStatement : public LSLStatement {
 
 class LSLStateStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLStateStatement)
     LSLStateStatement( ScriptContext *ctx, class LSLIdentifier *identifier ) : LSLStatement(ctx, 1, identifier) {};
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
 
@@ -462,6 +495,7 @@ class LSLStateStatement : public LSLStatement {
 
 class LSLJumpStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLJumpStatement)
     LSLJumpStatement( ScriptContext *ctx, class LSLIdentifier *identifier ) : LSLStatement(ctx, 1, identifier) {};
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
 
@@ -493,6 +527,7 @@ class LSLJumpStatement : public LSLStatement {
 
 class LSLLabel : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLLabel)
     LSLLabel( ScriptContext *ctx, class LSLIdentifier *identifier ) : LSLStatement(ctx, 1, identifier) {};
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
 
@@ -503,6 +538,7 @@ class LSLLabel : public LSLStatement {
 
 class LSLReturnStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLReturnStatement)
     LSLReturnStatement( ScriptContext *ctx, class LSLExpression *expression ) : LSLStatement(ctx, 1, expression) {};
     NODE_FIELD_GS(LSLExpression, Expr, 0)
 
@@ -512,6 +548,7 @@ class LSLReturnStatement : public LSLStatement {
 
 class LSLIfStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLIfStatement)
     LSLIfStatement( ScriptContext *ctx, class LSLExpression *expression, class LSLStatement *true_branch, class LSLStatement *false_branch)
       : LSLStatement( ctx, 3, expression, true_branch, false_branch ) {};
     NODE_FIELD_GS(LSLExpression, CheckExpr, 0)
@@ -524,6 +561,7 @@ class LSLIfStatement : public LSLStatement {
 
 class LSLForStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLForStatement)
     LSLForStatement(ScriptContext *ctx, class LSLASTNodeList<LSLExpression> *init, class LSLExpression *condition,
                     class LSLASTNodeList<LSLExpression> *cont, class LSLStatement *body)
       : LSLStatement( ctx, 4, init, condition, cont, body ) {};
@@ -538,6 +576,7 @@ class LSLForStatement : public LSLStatement {
 
 class LSLDoStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLDoStatement)
     LSLDoStatement( ScriptContext *ctx, class LSLStatement *body, class LSLExpression *condition )
       : LSLStatement(ctx, 2, body, condition) {};
     NODE_FIELD_GS(LSLStatement, Body, 0)
@@ -549,6 +588,7 @@ class LSLDoStatement : public LSLStatement {
 
 class LSLWhileStatement : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLWhileStatement)
     LSLWhileStatement( ScriptContext *ctx, class LSLExpression *condition, class LSLStatement *body )
       : LSLStatement(ctx, 2, condition, body) {};
     NODE_FIELD_GS(LSLExpression, CheckExpr, 0)
@@ -561,6 +601,7 @@ class LSLWhileStatement : public LSLStatement {
 
 class LSLDeclaration : public LSLStatement {
   public:
+    NODE_SHALLOW_CLONE(LSLDeclaration)
     LSLDeclaration(ScriptContext *ctx, class LSLIdentifier *identifier, class LSLExpression *value)
       : LSLStatement(ctx, 2, identifier, value) { };
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
@@ -576,6 +617,7 @@ class LSLDeclaration : public LSLStatement {
 
 class LSLConstantExpression: public LSLExpression {
 public:
+  NODE_SHALLOW_CLONE(LSLConstantExpression)
     LSLConstantExpression( ScriptContext *ctx, LSLConstant *constant )
       : LSLExpression(ctx) {
       assert(constant);
@@ -595,6 +637,7 @@ public:
 
 class LSLParenthesisExpression: public LSLExpression {
 public:
+  NODE_SHALLOW_CLONE(LSLParenthesisExpression)
     LSLParenthesisExpression( ScriptContext *ctx, LSLExpression *expr )
       : LSLExpression(ctx, 1, expr) { _mOperation = OP_PARENS; };
     NODE_FIELD_GS(LSLExpression, ChildExpr, 0)
@@ -608,6 +651,7 @@ public:
 
 class LSLBinaryExpression : public LSLExpression {
 public:
+  NODE_SHALLOW_CLONE(LSLBinaryExpression)
     LSLBinaryExpression( ScriptContext *ctx, LSLExpression *lvalue, LSLOperator oper, LSLExpression *rvalue )
     : LSLExpression(ctx, 2, lvalue, rvalue) { _mOperation = oper; };
     NODE_FIELD_GS(LSLExpression, LHS, 0)
@@ -623,6 +667,7 @@ public:
 
 class LSLUnaryExpression : public LSLExpression {
 public:
+  NODE_SHALLOW_CLONE(LSLUnaryExpression)
     LSLUnaryExpression( ScriptContext *ctx, LSLExpression *lvalue, LSLOperator oper )
             : LSLExpression(ctx, 1, lvalue) { _mOperation = oper; };
     NODE_FIELD_GS(LSLExpression, ChildExpr, 0)
@@ -637,6 +682,7 @@ public:
 
 class LSLTypecastExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLTypecastExpression)
     LSLTypecastExpression(ScriptContext *ctx, LSLType *type, LSLExpression *expression )
       : LSLExpression(ctx, 1, expression) { _mType = type;};
     NODE_FIELD_GS(LSLExpression, ChildExpr, 0)
@@ -648,6 +694,7 @@ class LSLTypecastExpression : public LSLExpression {
 /// synthesized node to represent cases where something must be converted to boolean
 class LSLBoolConversionExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLBoolConversionExpression)
   LSLBoolConversionExpression(ScriptContext *ctx, LSLExpression *expression )
       : LSLExpression(ctx, 1, expression) { _mType = TYPE(LST_INTEGER);};
   NODE_FIELD_GS(LSLExpression, ChildExpr, 0)
@@ -658,6 +705,7 @@ class LSLBoolConversionExpression : public LSLExpression {
 
 class LSLPrintExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLPrintExpression)
     LSLPrintExpression( ScriptContext *ctx, LSLExpression *expression )
       : LSLExpression( ctx, 1, expression ) { _mType = TYPE(LST_NULL); };
     NODE_FIELD_GS(LSLExpression, ChildExpr, 0)
@@ -668,6 +716,7 @@ class LSLPrintExpression : public LSLExpression {
 
 class LSLFunctionExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLFunctionExpression)
     LSLFunctionExpression( ScriptContext *ctx, LSLIdentifier *identifier, LSLASTNodeList<LSLExpression> *arguments )
       : LSLExpression( ctx, 2, identifier, arguments) {};
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
@@ -682,6 +731,7 @@ class LSLFunctionExpression : public LSLExpression {
 
 class LSLVectorExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLVectorExpression)
     LSLVectorExpression(ScriptContext *ctx, LSLExpression *x, LSLExpression *y, LSLExpression *z )
       : LSLExpression(ctx, 3, x, y, z) { _mType = TYPE(LST_VECTOR); }
     NODE_FIELD_GS(LSLExpression, X, 0)
@@ -694,6 +744,7 @@ class LSLVectorExpression : public LSLExpression {
 
 class LSLQuaternionExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLQuaternionExpression)
     LSLQuaternionExpression(ScriptContext *ctx, LSLExpression *x, LSLExpression *y, LSLExpression *z, LSLExpression *s )
       : LSLExpression(ctx, 4, x, y, z, s) { _mType = TYPE(LST_QUATERNION); };
     NODE_FIELD_GS(LSLExpression, X, 0)
@@ -707,6 +758,7 @@ class LSLQuaternionExpression : public LSLExpression {
 
 class LSLListExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLListExpression)
     LSLListExpression( ScriptContext *ctx, LSLExpression *c ) : LSLExpression(ctx) {
       _mType = TYPE(LST_LIST);
       if (c)
@@ -725,6 +777,7 @@ class LSLListExpression : public LSLExpression {
 
 class LSLLValueExpression : public LSLExpression {
   public:
+    NODE_SHALLOW_CLONE(LSLLValueExpression)
     LSLLValueExpression( ScriptContext *ctx, LSLIdentifier *identifier, LSLIdentifier *member )
       : LSLExpression(ctx, 2, identifier, member), _mIsFoldable(false) {};
     NODE_FIELD_GS(LSLIdentifier, Identifier, 0)
@@ -749,6 +802,7 @@ class LSLLValueExpression : public LSLExpression {
 
 class LSLScript : public LSLASTNode {
     public:
+      NODE_SHALLOW_CLONE(LSLScript)
     LSLScript( ScriptContext *ctx, LSLASTNodeList<LSLASTNode> *globals, LSLASTNodeList<LSLState> *states )
         : LSLASTNode( ctx, 2, globals, states ) {};
     NODE_FIELD_GS(LSLASTNodeList<LSLASTNode>, Globals, 0)
@@ -761,13 +815,20 @@ class LSLScript : public LSLASTNode {
     void optimize(const OptimizationOptions &ctx);
     void recalculateReferenceData();
     void validateGlobals(bool mono_semantics);
+    /// hash of the script that ignores formatting and user-defined names,
+    /// symbols must have been collected and types determined first.
+    std::string getSemanticFingerprint();
 };
 
 void tailslide_init_builtins(const char *builtins_file);
+/// hash of the builtins definitions loaded by `tailslide_init_builtins()`, anything
+/// that caches analysis or compilation results should treat a change as invalidating them.
+const std::string &tailslide_builtins_version();
 
 }
 
-// make sure our define doesn't leak into the public API
+// make sure our defines don't leak into the public API
 #undef NODE_FIELD_GS
+#undef NODE_SHALLOW_CLONE
 
 #endif
\ No newline at end of file
@@ -31,6 +31,9 @@
             tailslide_get_extra(yyscanner)->logger->error( yylloc, E_PARSER_STACK_DEPTH );
             return 0;
         }
+        // pretend the script ends here once it's too expensive to keep going
+        if ( tailslide_get_extra(yyscanner)->overBudget( yylloc, true ) )
+            return 0;
         return tailslide_lex( yylval, yylloc, yyscanner );
     }
     #ifdef yylex
@@ -1012,7 +1015,11 @@ lvalue
 %%
 
 int yyerror( YYLTYPE *lloc, void *scanner, const char *message ) {
-    tailslide_get_extra(scanner)->logger->error( lloc, E_SYNTAX_ERROR, message );
-    tailslide_get_extra(scanner)->ast_sane = false;
+    auto *ctx = tailslide_get_extra(scanner);
+    ctx->ast_sane = false;
+    // we cut the script off ourselves, the syntax error that causes is just noise.
+    if ( ctx->budget && ctx->budget->getExceeded() != BUDGET_OK )
+        return 0;
+    ctx->logger->error( lloc, E_SYNTAX_ERROR, message );
     return 0;
 }
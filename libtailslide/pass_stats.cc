@@ -0,0 +1,135 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "lslmini.hh"
+#include "pass_stats.hh"
+
+namespace Tailslide {
+
+size_t CompileStats::getPassIndex(const char *name) {
+  for (size_t i = 0; i < _mPasses.size(); ++i) {
+    if (!strcmp(_mPasses[i].name, name))
+      return i;
+  }
+  _mPasses.push_back({name});
+  return _mPasses.size() - 1;
+}
+
+void CompileStats::reset() {
+  assert(!_mDepth);
+  _mPasses.clear();
+  _mTotal = {"total"};
+  _mAllocations = 0;
+  _mBytes = 0;
+  _mNodesCreated = 0;
+  _mNodesWalked = 0;
+}
+
+static double to_ms(std::chrono::steady_clock::duration time) {
+  return std::chrono::duration<double, std::milli>(time).count();
+}
+
+std::string CompileStats::formatTimeReport() const {
+  // nested passes are counted in their own rows and the ones they ran in
+  std::string report = "===-- Pass timings --===\n";
+  char line[256];
+  snprintf(line, sizeof(line), "%-24s %8s %12s %8s %10s\n", "pass", "calls", "time (ms)", "%", "iterations");
+  report += line;
+  double total_ms = to_ms(_mTotal.time);
+  for (const auto &pass : _mPasses) {
+    double ms = to_ms(pass.time);
+    snprintf(line, sizeof(line), "%-24s %8u %12.3f %7.1f%% %10u\n",
+             pass.name, pass.calls, ms, total_ms > 0 ? ms / total_ms * 100.0 : 0.0, pass.iterations);
+    report += line;
+  }
+  snprintf(line, sizeof(line), "%-24s %8s %12.3f\n", "total", "", total_ms);
+  report += line;
+  return report;
+}
+
+std::string CompileStats::formatMemoryReport() const {
+  std::string report = "===-- Pass memory --===\n";
+  char line[256];
+  snprintf(line, sizeof(line), "%-24s %12s %12s %14s %14s %10s %10s\n",
+           "pass", "allocations", "bytes", "nodes created", "nodes walked", "nodes", "symbols");
+  report += line;
+  for (const auto &pass : _mPasses) {
+    snprintf(line, sizeof(line), "%-24s %12llu %12llu %14llu %14llu", pass.name,
+             (unsigned long long)pass.allocations, (unsigned long long)pass.bytes,
+             (unsigned long long)pass.nodes_created, (unsigned long long)pass.nodes_walked);
+    report += line;
+    if (pass.outermost)
+      snprintf(line, sizeof(line), " %10llu %10llu\n", (unsigned long long)pass.nodes, (unsigned long long)pass.symbols);
+    else
+      snprintf(line, sizeof(line), " %10s %10s\n", "-", "-");
+    report += line;
+  }
+  snprintf(line, sizeof(line), "%-24s %12llu %12llu %14llu %14llu\n", "total",
+           (unsigned long long)_mTotal.allocations, (unsigned long long)_mTotal.bytes,
+           (unsigned long long)_mTotal.nodes_created, (unsigned long long)_mTotal.nodes_walked);
+  report += line;
+  return report;
+}
+
+
+ScopedPassTimer::ScopedPassTimer(ScriptContext *context, const char *name)
+    : _mContext(context), _mStats(context ? context->stats : nullptr), _mName(name), _mTracing(is_tracing()) {
+  if (_mTracing)
+    record_trace_event(name, "pass", 'B');
+  if (!_mStats)
+    return;
+  // registered up front so passes are listed in the order they started
+  _mPassIndex = _mStats->getPassIndex(name);
+  ++_mStats->_mDepth;
+  _mAllocations = _mStats->_mAllocations;
+  _mBytes = _mStats->_mBytes;
+  _mNodesCreated = _mStats->_mNodesCreated;
+  _mNodesWalked = _mStats->_mNodesWalked;
+  _mStart = std::chrono::steady_clock::now();
+}
+
+static uint64_t count_nodes(LSLASTNode *node) {
+  uint64_t count = 1;
+  for (auto *child : *node)
+    count += count_nodes(child);
+  return count;
+}
+
+ScopedPassTimer::~ScopedPassTimer() {
+  if (_mTracing)
+    record_trace_event(_mName, "pass", 'E');
+  if (!_mStats)
+    return;
+  auto elapsed = std::chrono::steady_clock::now() - _mStart;
+  auto &pass = _mStats->_mPasses[_mPassIndex];
+  ++pass.calls;
+  pass.time += elapsed;
+  pass.allocations += _mStats->_mAllocations - _mAllocations;
+  pass.bytes += _mStats->_mBytes - _mBytes;
+  pass.nodes_created += _mStats->_mNodesCreated - _mNodesCreated;
+  pass.nodes_walked += _mStats->_mNodesWalked - _mNodesWalked;
+  pass.iterations += _mIterations;
+
+  if (--_mStats->_mDepth == 0) {
+    // Walking the tree would inflate the timings of whatever pass we're nested
+    // in, so only do it between outermost passes.
+    pass.outermost = true;
+    pass.nodes = _mContext->script ? count_nodes(_mContext->script) : 0;
+    pass.symbols = 0;
+    if (_mContext->table_manager) {
+      for (auto *table : _mContext->table_manager->getTables())
+        pass.symbols += table->getMap().size();
+    }
+
+    auto &total = _mStats->_mTotal;
+    ++total.calls;
+    total.time += elapsed;
+    total.allocations += _mStats->_mAllocations - _mAllocations;
+    total.bytes += _mStats->_mBytes - _mBytes;
+    total.nodes_created += _mStats->_mNodesCreated - _mNodesCreated;
+    total.nodes_walked += _mStats->_mNodesWalked - _mNodesWalked;
+  }
+}
+
+}
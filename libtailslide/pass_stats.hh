@@ -0,0 +1,106 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Tailslide {
+
+struct ScriptContext;
+
+/// What one pass cost, summed over every time it ran.
+struct PassStats {
+  const char *name = nullptr;
+  uint32_t calls = 0;
+  /// includes any passes run from inside this one
+  std::chrono::steady_clock::duration time {};
+  /// allocations and bytes through the script's `ScriptAllocator`
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  uint64_t nodes_created = 0;
+  /// nodes stepped over by visitors and by re-parenting, a measure of how much
+  /// work was done that doesn't depend on the clock
+  uint64_t nodes_walked = 0;
+  /// whether it's ever run outside of another pass, `nodes` and `symbols`
+  /// are only counted then
+  bool outermost = false;
+  /// size of the tree and its symbol tables after the last run
+  uint64_t nodes = 0;
+  uint64_t symbols = 0;
+  /// rounds until a fixpoint was hit, for passes that iterate
+  uint32_t iterations = 0;
+};
+
+/// Per-pass instrumentation for a compile. Attach one to a `ScriptContext`
+/// before parsing and each pass will add what it cost, both the parser's own
+/// passes and the backends. Nothing is collected if no stats are attached.
+///
+/// Not thread-safe, forks of a script don't share their parent's stats.
+class CompileStats {
+  public:
+    /// passes in the order they first ran
+    const std::vector<PassStats> &getPasses() const { return _mPasses; }
+    /// totals over the outermost passes, so nested ones aren't counted twice
+    const PassStats &getTotal() const { return _mTotal; }
+    /// a table of per-pass timings, like `--time-passes`
+    std::string formatTimeReport() const;
+    /// a table of per-pass allocations, node and symbol counts, like `--mem-report`
+    std::string formatMemoryReport() const;
+
+    /// called by the allocator
+    void countAllocation(size_t bytes, bool is_node) {
+      ++_mAllocations;
+      _mBytes += bytes;
+      if (is_node)
+        ++_mNodesCreated;
+    }
+    /// called when nodes are visited or re-parented
+    void countWalk(uint64_t nodes) { _mNodesWalked += nodes; }
+
+    /// forget everything collected so far so the stats can be used for
+    /// another compile. Must not be called while any passes are running.
+    void reset();
+
+  protected:
+    /// index of the named pass, adding it if this is its first run
+    size_t getPassIndex(const char *name);
+
+    std::vector<PassStats> _mPasses;
+    PassStats _mTotal {"total"};
+    uint64_t _mAllocations = 0;
+    uint64_t _mBytes = 0;
+    uint64_t _mNodesCreated = 0;
+    uint64_t _mNodesWalked = 0;
+    /// how many passes are running right now
+    uint32_t _mDepth = 0;
+
+  friend class ScopedPassTimer;
+};
+
+/// Adds whatever happens during its lifetime to the named pass in the
+/// context's `CompileStats`, if it has any, and to the trace if tracing.
+class ScopedPassTimer {
+  public:
+    ScopedPassTimer(ScriptContext *context, const char *name);
+    ~ScopedPassTimer();
+    ScopedPassTimer(const ScopedPassTimer &other) = delete;
+    ScopedPassTimer &operator=(const ScopedPassTimer &other) = delete;
+
+    void addIteration() { ++_mIterations; }
+
+  protected:
+    ScriptContext *_mContext;
+    CompileStats *_mStats;
+    const char *_mName;
+    bool _mTracing;
+    size_t _mPassIndex = 0;
+    std::chrono::steady_clock::time_point _mStart {};
+    uint64_t _mAllocations = 0;
+    uint64_t _mBytes = 0;
+    uint64_t _mNodesCreated = 0;
+    uint64_t _mNodesWalked = 0;
+    uint32_t _mIterations = 0;
+};
+
+}
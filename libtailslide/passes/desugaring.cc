@@ -1,4 +1,5 @@
 #include "desugaring.hh"
+#include "tree_cloner.hh"
 #include <vector>
 
 namespace Tailslide {
@@ -354,4 +355,15 @@ LSLASTNode *LLConformantDeSugaringVisitor::rewriteBuiltinLValue(LSLLValueExpress
   return new_expr;
 }
 
+LSLScript *lower_script(LSLScript *script, ScriptAllocator *allocator, bool mono_semantics, bool in_place) {
+  LSLScript *lowered = script;
+  if (!in_place) {
+    TreeCloner cloner(allocator);
+    lowered = cloner.cloneAs(script);
+  }
+  LLConformantDeSugaringVisitor de_sugaring_visitor(allocator, mono_semantics);
+  lowered->visit(&de_sugaring_visitor);
+  return lowered;
+}
+
 }
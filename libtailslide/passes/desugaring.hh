@@ -51,4 +51,14 @@ class LLConformantDeSugaringVisitor : public DeSugaringVisitor {
     LSLASTNode *rewriteBuiltinLValue(LSLLValueExpression *lvalue) override;
 };
 
+/// Lower an analyzed script the way a backend expects it, with explicit
+/// typecasts and boolean conversions and no compound assignments. Unless
+/// `in_place` is set a private copy is lowered and the original is left
+/// untouched, so the same parse may be handed to more than one backend.
+///
+/// What gets lowered depends on the backend, LSO has opcodes for mixed
+/// `int <op> float` and typed branches that Mono has to spell out, so each
+/// backend needs its own lowered tree.
+LSLScript *lower_script(LSLScript *script, ScriptAllocator *allocator, bool mono_semantics, bool in_place=false);
+
 }
@@ -506,7 +506,8 @@ void LSOBytecodeCompiler::pushConstant(LSLConstant *constant) {
 }
 
 void LSOBytecodeCompiler::popLocals() {
-  // pop locals in reverse order
+  // pop locals in reverse order. These are really stack slots, several locals
+  // may share one if they were never in scope at the same time.
   for (auto i = _mFuncSymData->locals.rbegin(); i != _mFuncSymData->locals.rend(); ++i) {
     mCodeBS << LSO_TYPE_POP_OPCODE[*i];
   }
@@ -304,6 +304,11 @@ class LSOBitStream : public BitStream {
   explicit LSOBitStream(Endianness endian=ENDIAN_BIG) : BitStream(endian) {}
   LSOBitStream(LSOBitStream &&other) noexcept: BitStream(std::move(other)) {}
   LSOBitStream(const LSOBitStream &other) = delete;
+  /// lets a child of another stream (see `makeChild()`) be written through as an LSOBitStream
+  LSOBitStream &operator=(BitStream &&other) noexcept {
+    BitStream::operator=(std::move(other));
+    return *this;
+  }
   /// need to help the type system realize that this returns an LSOBitStream.
   /// should be fine because we never refer to BitStream subclasses by their base class.
   template<typename T>
@@ -0,0 +1,371 @@
+#include <cstring>
+#include <unordered_map>
+
+#include "peephole.hh"
+
+namespace Tailslide {
+
+static bool is_jump(LSOOpCode opcode) {
+  return opcode == LOPC_JUMP || opcode == LOPC_JUMPIF || opcode == LOPC_JUMPNIF;
+}
+
+/// size of the operands following an opcode, not including any jump offset.
+/// returns -1 for opcodes we don't know how to decode.
+static int32_t operand_size(LSOOpCode opcode, const uint8_t *operands, size_t remaining) {
+  switch (opcode) {
+    case LOPC_NOOP:
+    case LOPC_POP:
+    case LOPC_POPS:
+    case LOPC_POPL:
+    case LOPC_POPV:
+    case LOPC_POPQ:
+    case LOPC_POPIP:
+    case LOPC_POPBP:
+    case LOPC_POPSP:
+    case LOPC_POPSLR:
+    case LOPC_DUP:
+    case LOPC_DUPS:
+    case LOPC_DUPL:
+    case LOPC_DUPV:
+    case LOPC_DUPQ:
+    case LOPC_PUSHIP:
+    case LOPC_PUSHBP:
+    case LOPC_PUSHSP:
+    case LOPC_PUSHE:
+    case LOPC_PUSHEV:
+    case LOPC_PUSHEQ:
+    case LOPC_BITAND:
+    case LOPC_BITOR:
+    case LOPC_BITXOR:
+    case LOPC_BOOLAND:
+    case LOPC_BOOLOR:
+    case LOPC_BITNOT:
+    case LOPC_BOOLNOT:
+    case LOPC_RETURN:
+    case LOPC_SHL:
+    case LOPC_SHR:
+    case LOPC_JUMP:
+      return 0;
+    case LOPC_PUSHARGB:
+    case LOPC_ADD:
+    case LOPC_SUB:
+    case LOPC_MUL:
+    case LOPC_DIV:
+    case LOPC_MOD:
+    case LOPC_EQ:
+    case LOPC_NEQ:
+    case LOPC_LEQ:
+    case LOPC_GEQ:
+    case LOPC_LESS:
+    case LOPC_GREATER:
+    case LOPC_NEG:
+    case LOPC_CAST:
+    case LOPC_PRINT:
+    case LOPC_CALLLIB:
+    // the type of the condition, the jump offset is handled separately
+    case LOPC_JUMPIF:
+    case LOPC_JUMPNIF:
+      return 1;
+    case LOPC_CALLLIB_TWO_BYTE:
+      return 2;
+    case LOPC_POPARG:
+    case LOPC_PUSHARGI:
+    case LOPC_PUSHARGF:
+    case LOPC_PUSHARGE:
+    case LOPC_STATE:
+    case LOPC_CALL:
+    case LOPC_STACKTOS:
+    case LOPC_STACKTOL:
+      return 4;
+    case LOPC_PUSHARGV:
+      return 12;
+    case LOPC_PUSHARGQ:
+      return 16;
+    case LOPC_PUSHARGS: {
+      const void *nul = memchr(operands, '\0', remaining);
+      if (!nul)
+        return -1;
+      return (int32_t)((const uint8_t *)nul - operands) + 1;
+    }
+    default:
+      break;
+  }
+  // all of the STORE, LOAD and PUSH variants that refer to a variable's offset
+  if (opcode >= LOPC_STORE && opcode <= LOPC_PUSHGQ)
+    return 4;
+  return -1;
+}
+
+/// the pop that exactly undoes a push with no side-effects, or NOOP if there isn't one
+static LSOOpCode undoing_pop(LSOOpCode opcode) {
+  switch (opcode) {
+    case LOPC_PUSH:
+    case LOPC_PUSHG:
+    case LOPC_PUSHARGI:
+    case LOPC_PUSHARGF:
+    case LOPC_PUSHE:
+    case LOPC_DUP:
+      return LOPC_POP;
+    case LOPC_PUSHS:
+    case LOPC_PUSHGS:
+    case LOPC_PUSHARGS:
+    case LOPC_DUPS:
+      return LOPC_POPS;
+    case LOPC_PUSHL:
+    case LOPC_PUSHGL:
+    case LOPC_DUPL:
+      return LOPC_POPL;
+    case LOPC_PUSHV:
+    case LOPC_PUSHGV:
+    case LOPC_PUSHARGV:
+    case LOPC_PUSHEV:
+    case LOPC_DUPV:
+      return LOPC_POPV;
+    case LOPC_PUSHQ:
+    case LOPC_PUSHGQ:
+    case LOPC_PUSHARGQ:
+    case LOPC_PUSHEQ:
+    case LOPC_DUPQ:
+      return LOPC_POPQ;
+    default:
+      return LOPC_NOOP;
+  }
+}
+
+/// STORE leaves the value on the stack, so a STORE followed by the matching
+/// POP is the same as a LOAD, which pops the value it stores.
+static LSOOpCode store_to_load(LSOOpCode store_op, LSOOpCode pop_op) {
+  switch (store_op) {
+    case LOPC_STORE: return (pop_op == LOPC_POP) ? LOPC_LOADP : LOPC_NOOP;
+    case LOPC_STORES: return (pop_op == LOPC_POPS) ? LOPC_LOADSP : LOPC_NOOP;
+    case LOPC_STOREL: return (pop_op == LOPC_POPL) ? LOPC_LOADLP : LOPC_NOOP;
+    case LOPC_STOREV: return (pop_op == LOPC_POPV) ? LOPC_LOADVP : LOPC_NOOP;
+    case LOPC_STOREQ: return (pop_op == LOPC_POPQ) ? LOPC_LOADQP : LOPC_NOOP;
+    case LOPC_STOREG: return (pop_op == LOPC_POP) ? LOPC_LOADGP : LOPC_NOOP;
+    case LOPC_STOREGS: return (pop_op == LOPC_POPS) ? LOPC_LOADGSP : LOPC_NOOP;
+    case LOPC_STOREGL: return (pop_op == LOPC_POPL) ? LOPC_LOADGLP : LOPC_NOOP;
+    case LOPC_STOREGV: return (pop_op == LOPC_POPV) ? LOPC_LOADGVP : LOPC_NOOP;
+    case LOPC_STOREGQ: return (pop_op == LOPC_POPQ) ? LOPC_LOADGQP : LOPC_NOOP;
+    default: return LOPC_NOOP;
+  }
+}
+
+bool LSOPeepholeOptimizer::optimize(LSOBitStream &code) {
+  if (!decode(code))
+    return false;
+
+  bool changed = false;
+  while (runPass())
+    changed = true;
+
+  if (changed)
+    encode(code);
+  return changed;
+}
+
+bool LSOPeepholeOptimizer::decode(LSOBitStream &code) {
+  _mInstructions.clear();
+  const uint8_t *data = code.data();
+  const size_t size = code.size();
+  // instruction index for each byte position an instruction starts at
+  std::unordered_map<uint32_t, uint32_t> position_map;
+  std::vector<uint32_t> jump_positions;
+
+  size_t pos = 0;
+  while (pos < size) {
+    position_map[(uint32_t)pos] = (uint32_t)_mInstructions.size();
+    LSOInstruction insn;
+    insn.opcode = (LSOOpCode)data[pos++];
+
+    int32_t len = operand_size(insn.opcode, data + pos, size - pos);
+    if (len < 0 || pos + len > size)
+      return false;
+    insn.operands.assign(data + pos, data + pos + len);
+    pos += len;
+
+    if (is_jump(insn.opcode)) {
+      if (pos + sizeof(int32_t) > size)
+        return false;
+      LSOBitStream offset_bs(ENDIAN_BIG);
+      offset_bs.assign(data + pos, sizeof(int32_t), true);
+      int32_t offset;
+      offset_bs >> offset;
+      pos += sizeof(int32_t);
+      // stash the absolute byte position until we know every instruction's index
+      insn.target = (uint32_t)((int64_t)pos + offset);
+      jump_positions.push_back((uint32_t)_mInstructions.size());
+    }
+    _mInstructions.push_back(std::move(insn));
+  }
+  position_map[(uint32_t)size] = (uint32_t)_mInstructions.size();
+
+  for (auto idx : jump_positions) {
+    auto &insn = _mInstructions[idx];
+    auto target_iter = position_map.find(insn.target);
+    // jumps into the middle of an instruction or outside the code, don't touch this.
+    if (target_iter == position_map.end())
+      return false;
+    insn.target = target_iter->second;
+  }
+  return true;
+}
+
+void LSOPeepholeOptimizer::encode(LSOBitStream &code) {
+  const auto num_insns = (uint32_t)_mInstructions.size();
+  // figure out where each instruction will end up so we can write jump offsets
+  std::vector<uint32_t> positions(num_insns + 1, 0);
+  uint32_t pos = 0;
+  for (uint32_t i = 0; i < num_insns; ++i) {
+    positions[i] = pos;
+    const auto &insn = _mInstructions[i];
+    if (insn.dead)
+      continue;
+    pos += 1 + (uint32_t)insn.operands.size();
+    if (is_jump(insn.opcode))
+      pos += sizeof(int32_t);
+  }
+  positions[num_insns] = pos;
+
+  code.resize(0);
+  code.reserve(pos);
+  for (uint32_t i = 0; i < num_insns; ++i) {
+    const auto &insn = _mInstructions[i];
+    if (insn.dead)
+      continue;
+    code << insn.opcode;
+    if (!insn.operands.empty())
+      code.writeRawData(insn.operands.data(), (uint32_t)insn.operands.size());
+    if (is_jump(insn.opcode)) {
+      // relative to the end of the operand, which is the end of the instruction.
+      code << (int32_t)(positions[resolveTarget(insn.target)] - (code.pos() + sizeof(int32_t)));
+    }
+  }
+}
+
+uint32_t LSOPeepholeOptimizer::nextLive(uint32_t idx) {
+  while (idx < _mInstructions.size() && _mInstructions[idx].dead)
+    ++idx;
+  return idx;
+}
+
+void LSOPeepholeOptimizer::kill(uint32_t idx) {
+  _mInstructions[idx].dead = true;
+  // anything that jumped here now lands on the next live instruction
+  if (_mIsTarget[idx])
+    _mIsTarget[nextLive(idx + 1)] = true;
+  ++mRewriteCount;
+}
+
+void LSOPeepholeOptimizer::markTargets() {
+  _mIsTarget.assign(_mInstructions.size() + 1, false);
+  for (auto &insn : _mInstructions) {
+    if (!insn.dead && is_jump(insn.opcode))
+      _mIsTarget[resolveTarget(insn.target)] = true;
+  }
+}
+
+bool LSOPeepholeOptimizer::runPass() {
+  const auto num_insns = (uint32_t)_mInstructions.size();
+  bool changed = false;
+  markTargets();
+
+  for (uint32_t i = nextLive(0); i < num_insns; i = nextLive(i + 1)) {
+    auto &insn = _mInstructions[i];
+    const uint32_t next_idx = nextLive(i + 1);
+    LSOInstruction *next = (next_idx < num_insns) ? &_mInstructions[next_idx] : nullptr;
+    // whether `next` can only be reached by falling through from `insn`
+    const bool next_fused = next && !_mIsTarget[next_idx];
+
+    if (is_jump(insn.opcode)) {
+      // thread jumps that land on unconditional jumps, guarding against cycles.
+      uint32_t target = resolveTarget(insn.target);
+      for (uint32_t hops = 0; hops < num_insns; ++hops) {
+        if (target >= num_insns || _mInstructions[target].opcode != LOPC_JUMP)
+          break;
+        uint32_t new_target = resolveTarget(_mInstructions[target].target);
+        if (new_target == target)
+          break;
+        target = new_target;
+      }
+      if (target != resolveTarget(insn.target)) {
+        insn.target = target;
+        _mIsTarget[target] = true;
+        ++mRewriteCount;
+        changed = true;
+      }
+
+      // jumping to the instruction we'd fall through to anyway
+      if (target == next_idx) {
+        if (insn.opcode == LOPC_JUMP) {
+          kill(i);
+        } else {
+          // still need to get rid of the condition
+          insn.opcode = LSO_TYPE_POP_OPCODE[insn.operands[0]];
+          insn.operands.clear();
+          ++mRewriteCount;
+        }
+        changed = true;
+        continue;
+      }
+    }
+
+    if (insn.opcode == LOPC_JUMP || insn.opcode == LOPC_RETURN) {
+      // nothing can reach code following an unconditional transfer until the next jump target.
+      for (uint32_t j = next_idx; j < num_insns && !_mIsTarget[j]; j = nextLive(j + 1)) {
+        kill(j);
+        changed = true;
+      }
+      continue;
+    }
+
+    if (insn.opcode == LOPC_CAST && (insn.operands[0] >> 4) == (insn.operands[0] & 0xF)) {
+      kill(i);
+      changed = true;
+      continue;
+    }
+
+    if (!next_fused)
+      continue;
+
+    // `STORE x; POP` -> `LOADP x`
+    LSOOpCode load_op = store_to_load(insn.opcode, next->opcode);
+    if (load_op != LOPC_NOOP) {
+      insn.opcode = load_op;
+      kill(next_idx);
+      changed = true;
+      continue;
+    }
+
+    // pushing something only to immediately pop it
+    LSOOpCode pop_op = undoing_pop(insn.opcode);
+    if (pop_op != LOPC_NOOP && pop_op == next->opcode) {
+      kill(i);
+      kill(next_idx);
+      changed = true;
+      continue;
+    }
+
+    // conditional jumps on a constant integer, as in `while (TRUE)`
+    if (insn.opcode == LOPC_PUSHARGI && (next->opcode == LOPC_JUMPIF || next->opcode == LOPC_JUMPNIF)
+        && next->operands[0] == LST_INTEGER) {
+      LSOBitStream val_bs(ENDIAN_BIG);
+      val_bs.assign(insn.operands.data(), (uint32_t)insn.operands.size(), true);
+      int32_t val;
+      val_bs >> val;
+      if ((next->opcode == LOPC_JUMPIF) == (val != 0)) {
+        insn.opcode = LOPC_JUMP;
+        insn.operands.clear();
+        insn.target = next->target;
+        ++mRewriteCount;
+      } else {
+        kill(i);
+      }
+      kill(next_idx);
+      changed = true;
+      continue;
+    }
+  }
+  return changed;
+}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bytecode_format.hh"
+
+namespace Tailslide {
+
+/// A single decoded LSO instruction. Jump offsets aren't stored in `operands`,
+/// jumps refer to their destination by instruction index instead so that
+/// instructions may be removed without invalidating them.
+struct LSOInstruction {
+  LSOOpCode opcode = LOPC_NOOP;
+  std::vector<uint8_t> operands {};
+  /// index of the instruction being jumped to, may be one past the end
+  uint32_t target = 0;
+  bool dead = false;
+};
+
+/// Rewrites the bytecode of a single function or event handler. The output
+/// will no longer match what LL's compiler would have generated, so this is
+/// only used when byte-for-byte conformance was explicitly disabled.
+class LSOPeepholeOptimizer {
+  public:
+    /// returns whether the code was rewritten. Code that can't be fully
+    /// understood is left untouched.
+    bool optimize(LSOBitStream &code);
+
+    int mRewriteCount = 0;
+
+  protected:
+    bool decode(LSOBitStream &code);
+    void encode(LSOBitStream &code);
+    bool runPass();
+
+    uint32_t nextLive(uint32_t idx);
+    uint32_t resolveTarget(uint32_t idx) { return nextLive(idx); }
+    void kill(uint32_t idx);
+    void markTargets();
+
+    std::vector<LSOInstruction> _mInstructions {};
+    /// whether anything may jump to the instruction, one past the end is the end of the code
+    std::vector<bool> _mIsTarget {};
+};
+
+}
@@ -32,7 +32,7 @@ bool LSOResourceVisitor::visit(LSLGlobalFunction *glob_func) {
   // enrich function prototype and parameters with sizing information
   handleFuncDecl(func_sym_data, sym->getFunctionDecl());
 
-  _mCurrentFunc = func_sym_data;
+  beginFunction(func_sym_data, sym);
   // pick up local declarations
   visitChildren(glob_func);
   _mCurrentFunc = nullptr;
@@ -62,14 +62,54 @@ bool LSOResourceVisitor::visit(LSLState *state) {
 bool LSOResourceVisitor::visit(LSLDeclaration *decl_stmt) {
   auto *sym = decl_stmt->getSymbol();
   auto *sym_data = getSymbolData(sym);
+  auto itype = sym->getIType();
+
+  if (_mReuseSlotsInFunc) {
+    // Without any jumps, control can never reach a local without passing the
+    // declaration that initializes its slot.
+    // Anything popped with the same opcode is the same size and holds the same
+    // kind of value, so the slot's pop at the end of the function is still correct.
+    for (auto slot_iter = _mFreeSlots.begin(); slot_iter != _mFreeSlots.end(); ++slot_iter) {
+      if (LSO_TYPE_POP_OPCODE[slot_iter->type] != LSO_TYPE_POP_OPCODE[itype])
+        continue;
+      sym_data->index = slot_iter->index;
+      sym_data->offset = slot_iter->offset;
+      sym_data->size = LSO_TYPE_DATA_SIZES[itype];
+      _mLiveSlots.push_back(*slot_iter);
+      _mFreeSlots.erase(slot_iter);
+      return true;
+    }
+  }
+
   sym_data->index = (uint32_t)_mCurrentFunc->locals.size();
   sym_data->offset = _mCurrentFunc->size;
   // local slots are smaller than globals, no overhead for offset to data, type and name.
   _mCurrentFunc->size += sym_data->size = LSO_TYPE_DATA_SIZES[sym->getIType()];
   _mCurrentFunc->locals.push_back(sym->getIType());
+  _mLiveSlots.push_back({sym_data->index, sym_data->offset, itype});
   return true;
 }
 
+bool LSOResourceVisitor::visit(LSLCompoundStatement *compound_stmt) {
+  if (!_mReuseSlotsInFunc)
+    return true;
+  auto scope_start = _mLiveSlots.size();
+  visitChildren(compound_stmt);
+  // locals declared in this scope are dead now, their slots are up for grabs.
+  _mFreeSlots.insert(_mFreeSlots.end(), _mLiveSlots.begin() + (long)scope_start, _mLiveSlots.end());
+  _mLiveSlots.resize(scope_start);
+  return false;
+}
+
+void LSOResourceVisitor::beginFunction(LSOSymbolData *func_sym_data, LSLSymbol *func_sym) {
+  _mCurrentFunc = func_sym_data;
+  // a forward jump can skip a declaration, and the local would then read whatever
+  // an earlier scope left in the slot rather than its type's default.
+  _mReuseSlotsInFunc = _mReuseLocalSlots && !func_sym->getHasJumps();
+  _mLiveSlots.clear();
+  _mFreeSlots.clear();
+}
+
 
 bool LSOResourceVisitor::visit(LSLEventHandler *handler) {
   auto *sym = handler->getSymbol();
@@ -77,7 +117,7 @@ bool LSOResourceVisitor::visit(LSLEventHandler *handler) {
   // enrich handler prototype and parameters with sizing information
   handleFuncDecl(handler_sym_data, sym->getFunctionDecl());
 
-  _mCurrentFunc = handler_sym_data;
+  beginFunction(handler_sym_data, sym);
   // pick up local declarations
   visitChildren(handler);
   _mCurrentFunc = nullptr;
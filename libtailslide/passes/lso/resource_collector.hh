@@ -29,7 +29,8 @@ typedef std::map<Tailslide::LSLSymbol *, LSOSymbolData> LSOSymbolDataMap;
 // and what order to place them in.
 class LSOResourceVisitor : public Tailslide::ASTVisitor {
   public:
-    explicit LSOResourceVisitor(LSOSymbolDataMap *sym_data) : _mSymData(sym_data) {}
+    explicit LSOResourceVisitor(LSOSymbolDataMap *sym_data, bool reuse_local_slots=false)
+      : _mSymData(sym_data), _mReuseLocalSlots(reuse_local_slots) {}
 
   protected:
     bool visit(Tailslide::LSLScript *script) override;
@@ -37,12 +38,20 @@ class LSOResourceVisitor : public Tailslide::ASTVisitor {
     bool visit(Tailslide::LSLGlobalVariable *glob_var) override;
     bool visit(Tailslide::LSLState *state) override;
     bool visit(Tailslide::LSLDeclaration *decl_stmt) override;
+    bool visit(Tailslide::LSLCompoundStatement *compound_stmt) override;
     bool visit(Tailslide::LSLEventHandler *handler) override;
     // not relevant
     bool visit(Tailslide::LSLExpression *expr) override {return false;};
 
     LSOSymbolData *getSymbolData(Tailslide::LSLSymbol *sym);
     void handleFuncDecl(LSOSymbolData *func_sym_data, LSLASTNode *func_decl);
+    void beginFunction(LSOSymbolData *func_sym_data, Tailslide::LSLSymbol *func_sym);
+
+    struct LocalSlot {
+      uint32_t index;
+      uint32_t offset;
+      LSLIType type;
+    };
 
     uint32_t _mGlobalsOffset = 0;
     uint32_t _mFuncCount = 0;
@@ -50,5 +59,12 @@ class LSOResourceVisitor : public Tailslide::ASTVisitor {
     LSOSymbolData *_mCurrentFunc = nullptr;
     LSOSymbolData *_mCurrentState = nullptr;
     LSOSymbolDataMap *_mSymData = nullptr;
+    bool _mReuseLocalSlots;
+    // whether the current function is simple enough to reuse slots in
+    bool _mReuseSlotsInFunc = false;
+    // slots for locals whose scope we're currently in
+    std::vector<LocalSlot> _mLiveSlots {};
+    // slots for locals whose scope has ended, which may be handed out again
+    std::vector<LocalSlot> _mFreeSlots {};
 };
 }
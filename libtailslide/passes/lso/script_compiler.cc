@@ -1,6 +1,7 @@
 #include "../desugaring.hh"
 #include "bytecode_compiler.hh"
 #include "bytecode_format.hh"
+#include "peephole.hh"
 #include "script_compiler.hh"
 
 namespace Tailslide {
@@ -20,66 +21,102 @@ uint64_t pack_handled_events(LSOSymbolData *state_data) {
 LSLExpression *resolve_sa_identifier(LSLExpression *rvalue);
 
 bool LSOScriptCompiler::visit(LSLScript *script) {
-  LLConformantDeSugaringVisitor de_sugaring_visitor(_mAllocator, false);
-  script->visit(&de_sugaring_visitor);
-  LSOResourceVisitor resource_visitor(&_mSymData);
-  script->visit(&resource_visitor);
-
-  _mRegistersBS.makeSpace(LSO_REGISTER_OFFSETS[LREG_MAX]);
+  ScopedPassTimer timer(script->mContext, "lso_compile");
+  // work on a lowered copy so the caller's tree is left as-is, unless they don't need it
+  {
+    TraceScope trace("lower", "lso");
+    script = lower_script(script, _mAllocator, false, _mOptions.lower_in_place);
+    LSOResourceVisitor resource_visitor(&_mSymData, _mOptions.reuse_local_slots);
+    script->visit(&resource_visitor);
+  }
 
   // figure out if we have any functions, and if so what the highest index is.
-  uint32_t num_funcs = 0;
+  _mNumFuncs = 0;
   for (auto &sym_data : _mSymData) {
     auto *sym = sym_data.first;
     if (sym->getSymbolType() != SYM_FUNCTION || sym->getSubType() == SYM_BUILTIN)
       continue;
-    ++num_funcs;
+    ++_mNumFuncs;
   }
 
-  // only need to write the function header if we actually have any functions
-  if (num_funcs) {
-    _mFunctionsBS << num_funcs;
-    _mFunctionsBS.moveBy((int32_t) (sizeof(uint32_t) * num_funcs), true);
+  // allocate all of the script memory and fill with zeros. Every section gets
+  // written straight into its final place, code included.
+  mScriptBS.makeSpace(TOTAL_LSO_MEMORY);
+  // Write in the global variables
+  mScriptBS.moveTo(LSO_REGISTER_OFFSETS[LREG_MAX]);
+  auto *globals = script->getGlobals();
+  {
+    TraceScope trace("globals", "lso");
+    for (auto *global : *globals) {
+      if (global->getNodeType() == NODE_GLOBAL_VARIABLE)
+        global->visit(this);
+    }
+    // Nothing should be writing to the heap after handling global vars, write the terminal block.
+    _mHeapManager.writeTerminalBlock();
   }
 
-  // Collect all the global variables and functions
-  script->getGlobals()->visit(this);
-
   if (checkStackHeapCollision()) {
     NODE_ERROR(script, E_STACK_HEAP_COLLISION);
-    return false;
+    return abandonImage();
   }
 
-  // Nothing should be writing to the heap after handling global vars, write the terminal block.
-  _mHeapManager.writeTerminalBlock();
+  _mFunctionsStart = mScriptBS.pos();
+  // only need to write the function header if we actually have any functions
+  if (_mNumFuncs) {
+    mScriptBS << _mNumFuncs;
+    mScriptBS.moveBy((int32_t) (sizeof(uint32_t) * _mNumFuncs));
+  }
+  {
+    TraceScope trace("functions", "lso");
+    for (auto *global : *globals) {
+      if (global->getNodeType() != NODE_GLOBAL_FUNCTION)
+        continue;
+      // this is where the code gets generated, so where a long compile spends its time
+      if (script->mContext->overBudget(global->getLoc()))
+        return abandonImage();
+      global->visit(this);
+      if (_mOutOfMemory) {
+        NODE_ERROR(script, E_STACK_HEAP_COLLISION);
+        return abandonImage();
+      }
+    }
+  }
 
+  _mStatesStart = mScriptBS.pos();
   auto *states = script->getStates();
   auto num_states = (uint32_t)states->getNumChildren();
-  _mStatesBS << num_states;
+  mScriptBS << num_states;
 
   // skip past the table for state offset and handled events bitfield for each state
-  _mStatesBS.moveTo((int32_t)state_table_pos(num_states), true);
+  mScriptBS.moveTo(_mStatesStart + state_table_pos(num_states));
 
-  for (auto *state : *states) {
-    auto state_pos = _mStatesBS.pos();
-    auto state_data = &_mSymData[state->getSymbol()];
-    // Temporarily seek back to our entry in the state table and write info about the state
-    {
-      ScopedBitStreamSeek seek(_mStatesBS, state_table_pos(state_data->index));
-      // TODO: LSO v1 compat
-      _mStatesBS << (uint32_t)state_pos << pack_handled_events(state_data);
-    }
-    // resize keeps the underlying buffer allocated
-    _mStateBS.resize(0);
-    state->visit(this);
-    _mStatesBS.writeBitStream(_mStateBS);
-    if (checkStackHeapCollision()) {
-      NODE_ERROR(script, E_STACK_HEAP_COLLISION);
-      return false;
+  {
+    TraceScope trace("states", "lso");
+    for (auto *state : *states) {
+      if (script->mContext->overBudget(state->getLoc()))
+        return abandonImage();
+      auto state_data = &_mSymData[state->getSymbol()];
+      _mStateStart = mScriptBS.pos();
+      // Temporarily seek back to our entry in the state table and write info about the state
+      {
+        ScopedBitStreamSeek seek(mScriptBS, _mStatesStart + state_table_pos(state_data->index));
+        // TODO: LSO v1 compat
+        mScriptBS << (uint32_t)(_mStateStart - _mStatesStart) << pack_handled_events(state_data);
+      }
+      state->visit(this);
+      if (_mOutOfMemory) {
+        NODE_ERROR(script, E_STACK_HEAP_COLLISION);
+        return abandonImage();
+      }
     }
   }
 
-  // Write in the registers and the separate bitstreams for different sections of the bytecode
+  if (checkStackHeapCollision()) {
+    NODE_ERROR(script, E_STACK_HEAP_COLLISION);
+    return abandonImage();
+  }
+
+  // Write in the registers
   writeRegister(LREG_TM, TOTAL_LSO_MEMORY);
   writeRegister(LREG_IP, 0);
   writeRegister(LREG_VN, LSO_VERSION_NUM);
@@ -89,18 +126,10 @@ bool LSOScriptCompiler::visit(LSLScript *script) {
   // record where the variables start
   // TODO: This will break if we're writing v1 bytecode, the registers end earlier!
   writeRegister(LREG_GVR, LSO_REGISTER_OFFSETS[LREG_MAX]);
-  // allocate all of the script memory and fill with zeros
-  mScriptBS.makeSpace(TOTAL_LSO_MEMORY);
-  // Write in the global variables
-  mScriptBS.moveTo(LSO_REGISTER_OFFSETS[LREG_MAX]);
-  mScriptBS.writeBitStream(_mGlobalVarManager.mGlobalsBS);
-
   // mark the end of the globals as the start of the functions
-  writeRegister(LREG_GFR, mScriptBS.pos());
-  mScriptBS.writeBitStream(_mFunctionsBS);
+  writeRegister(LREG_GFR, _mFunctionsStart);
   // mark the start of the state entries, marks the end of the functions
-  writeRegister(LREG_SR, mScriptBS.pos());
-  mScriptBS.writeBitStream(_mStatesBS);
+  writeRegister(LREG_SR, _mStatesStart);
 
   // Initial current event is _always_ state_entry, even if there's no state_entry handler
   // defined! The consumer is expected to do a bitwise and against the handled events bitfield.
@@ -109,16 +138,43 @@ bool LSOScriptCompiler::visit(LSLScript *script) {
   writeEventRegister(LREG_NER, pack_handled_events(&_mSymData[states->getChild(0)->getSymbol()]));
 
   // mark where the heap starts
+  TraceScope heap_trace("heap", "lso");
   writeRegister(LREG_HR, mScriptBS.pos());
   mScriptBS.writeBitStream(_mHeapManager.mHeapBS);
   // mark the top of the heap
   writeRegister(LREG_HP, mScriptBS.pos());
-  // go back and write in the registers
-  mScriptBS.moveTo(0);
-  mScriptBS.writeBitStream(_mRegistersBS);
   return false;
 }
 
+bool LSOScriptCompiler::abandonImage() {
+  // don't leave a half-written image behind
+  mScriptBS.clear();
+  return false;
+}
+
+bool LSOScriptCompiler::writeCode(LSLASTNode *node) {
+  // compile straight into the image, the code can have whatever the heap won't need.
+  auto pos = mScriptBS.pos();
+  auto heap_size = _mHeapManager.mHeapBS.size();
+  if (pos + heap_size >= (uint32_t)TOTAL_LSO_MEMORY) {
+    _mOutOfMemory = true;
+    return false;
+  }
+  LSOBytecodeCompiler visitor(_mSymData);
+  visitor.mCodeBS = mScriptBS.makeChild(TOTAL_LSO_MEMORY - pos - heap_size);
+  try {
+    node->visit(&visitor);
+    if (_mOptions.optimize_bytecode)
+      LSOPeepholeOptimizer().optimize(visitor.mCodeBS);
+  } catch (const std::length_error &) {
+    // ran into where the heap has to go
+    _mOutOfMemory = true;
+    return false;
+  }
+  mScriptBS.moveBy((int32_t)visitor.mCodeBS.size());
+  return true;
+}
+
 bool LSOScriptCompiler::visit(LSLGlobalVariable *glob_var) {
   if (checkStackHeapCollision())
     return false;
@@ -179,33 +235,25 @@ bool LSOScriptCompiler::visit(LSLGlobalVariable *glob_var) {
 }
 
 bool LSOScriptCompiler::visit(LSLGlobalFunction *glob_func) {
-  if (checkStackHeapCollision())
-    return false;
   auto *sym = glob_func->getSymbol();
   auto &func_data = _mSymData[sym];
-  auto function_start = _mFunctionsBS.pos();
+  auto function_start = mScriptBS.pos() - _mFunctionsStart;
   {
     // temporarily seek to this function's index in the function table, write in where it starts
-    ScopedBitStreamSeek seek(_mFunctionsBS, (uint32_t)(sizeof(uint32_t) + (sizeof(uint32_t) * func_data.index)));
-    _mFunctionsBS << (uint32_t)function_start;
+    ScopedBitStreamSeek seek(mScriptBS, _mFunctionsStart + (uint32_t)(sizeof(uint32_t) + (sizeof(uint32_t) * func_data.index)));
+    mScriptBS << (uint32_t)function_start;
   }
   // offset to code, name, ret_type, [param_type, '\0', ...], '\0', bytecode
-  _mFunctionsBS << (uint32_t)0 << '\0' << sym->getIType();
+  // the code directly follows the header.
+  auto header_size = sizeof(uint32_t) + 2 + (2 * func_data.function_args.size()) + 1;
+  mScriptBS << (uint32_t)header_size << '\0' << sym->getIType();
   for (auto arg_type : func_data.function_args) {
     // type and null-terminator for the parameter name that isn't there
-    _mFunctionsBS << arg_type << '\0';
+    mScriptBS << arg_type << '\0';
   }
   // indicates end of parameter list
-  _mFunctionsBS << '\0';
-  auto func_header_end = _mFunctionsBS.pos();
-  {
-    // seek back to the function start and tell it where the code starts
-    ScopedBitStreamSeek seek(_mFunctionsBS, function_start);
-    _mFunctionsBS << (uint32_t)(func_header_end - function_start);
-  }
-  LSOBytecodeCompiler visitor(_mSymData);
-  glob_func->visit(&visitor);
-  _mFunctionsBS.writeBitStream(visitor.mCodeBS);
+  mScriptBS << '\0';
+  writeCode(glob_func);
   return false;
 }
 
@@ -215,9 +263,9 @@ bool LSOScriptCompiler::visit(LSLState *state) {
   const uint32_t jump_table_size = sizeof(uint32_t) + sizeof(uint32_t);
   auto *state_data = &_mSymData[state->getSymbol()];
 
-  _mStateBS << jump_table_base << '\0';
+  mScriptBS << jump_table_base << '\0';
   // skip past the jump tables to the start of the first state data struct
-  _mStateBS.moveBy((int32_t)(jump_table_size * state_data->handlers.size()), true);
+  mScriptBS.moveBy((int32_t)(jump_table_size * state_data->handlers.size()));
 
   for (auto *event_handler : *state->getEventHandlers()) {
     auto *event_data = &_mSymData[event_handler->getSymbol()];
@@ -225,48 +273,41 @@ bool LSOScriptCompiler::visit(LSLState *state) {
     auto table_iter = state_data->handlers.find((LSOHandlerType)event_data->index);
     auto table_idx = (uint32_t)std::distance(state_data->handlers.begin(), table_iter);
 
-    auto event_start_pos = _mStateBS.pos();
+    auto event_start_pos = mScriptBS.pos() - _mStateStart;
     {
-      ScopedBitStreamSeek seek(_mStateBS, jump_table_base + (jump_table_size * table_idx));
+      ScopedBitStreamSeek seek(mScriptBS, _mStateStart + jump_table_base + (jump_table_size * table_idx));
       // offset from jump table to state data, stack required for handler's locals + params
-      _mStateBS << (uint32_t)(event_start_pos - jump_table_base) << (uint32_t)event_data->size;
+      mScriptBS << (uint32_t)(event_start_pos - jump_table_base) << (uint32_t)event_data->size;
     }
     event_handler->visit(this);
+    if (_mOutOfMemory)
+      break;
   }
   return false;
 }
 
 bool LSOScriptCompiler::visit(LSLEventHandler *handler) {
   // offset to code + empty name
-  _mStateBS << (uint32_t)5 << '\0';
-  LSOBytecodeCompiler visitor(_mSymData);
-  handler->visit(&visitor);
-  _mStateBS.writeBitStream(visitor.mCodeBS);
+  mScriptBS << (uint32_t)5 << '\0';
+  writeCode(handler);
   return false;
 }
 
 
 
 bool LSOScriptCompiler::checkStackHeapCollision() {
-  auto total_size = (
-      _mRegistersBS.size() +
-      _mGlobalVarManager.mGlobalsBS.size() +
-      _mFunctionsBS.size() +
-      _mStatesBS.size() +
-      _mHeapManager.mHeapBS.size()
-  );
-  return total_size > TOTAL_LSO_MEMORY;
+  return mScriptBS.pos() + _mHeapManager.mHeapBS.size() > (uint32_t)TOTAL_LSO_MEMORY;
 }
 
 void LSOScriptCompiler::writeRegister(LSORegisters reg, uint32_t val) {
-  ScopedBitStreamSeek seek(_mRegistersBS, LSO_REGISTER_OFFSETS[reg]);
-  _mRegistersBS << val;
+  ScopedBitStreamSeek seek(mScriptBS, LSO_REGISTER_OFFSETS[reg]);
+  mScriptBS << val;
 }
 
 void LSOScriptCompiler::writeEventRegister(LSORegisters reg, uint64_t val) {
   // TODO: v1 compatibility
-  ScopedBitStreamSeek seek(_mRegistersBS, LSO_REGISTER_OFFSETS[reg]);
-  _mRegistersBS << val;
+  ScopedBitStreamSeek seek(mScriptBS, LSO_REGISTER_OFFSETS[reg]);
+  mScriptBS << val;
 }
 
 
@@ -289,41 +330,73 @@ LSLExpression *resolve_sa_identifier(LSLExpression *rvalue) {
 
 void LSOGlobalVarManager::writeVar(LSLConstant *constant, const char *name) {
   assert(constant != nullptr);
+  auto &globals_bs = *_mTargetBS;
   // data offset, type, name
-  mGlobalsBS << (uint32_t)6 << constant->getIType() << '\0';
+  globals_bs << (uint32_t)6 << constant->getIType() << '\0';
   switch(constant->getIType()) {
     case LST_INTEGER:
-      mGlobalsBS << ((LSLIntegerConstant *) constant)->getValue();
+      globals_bs << ((LSLIntegerConstant *) constant)->getValue();
       break;
     case LST_FLOATINGPOINT:
-      mGlobalsBS << (F32)((LSLFloatConstant *) constant)->getValue();
+      globals_bs << (F32)((LSLFloatConstant *) constant)->getValue();
       break;
     case LST_KEY:
     case LST_STRING:
-      mGlobalsBS << _mHeapManager->writeConstant((LSLStringConstant *) constant);
+      globals_bs << _mHeapManager->writeConstant((LSLStringConstant *) constant);
       break;
     case LST_VECTOR:
-      mGlobalsBS << *((LSLVectorConstant *) constant)->getValue();
+      globals_bs << *((LSLVectorConstant *) constant)->getValue();
       break;
     case LST_QUATERNION:
-      mGlobalsBS << *((LSLQuaternionConstant *) constant)->getValue();
+      globals_bs << *((LSLQuaternionConstant *) constant)->getValue();
       break;
     case LST_LIST:
-      mGlobalsBS << _mHeapManager->writeConstant((LSLListConstant *) constant);
+      globals_bs << _mHeapManager->writeConstant((LSLListConstant *) constant);
       break;
     default:
       // just write all zeros
-      mGlobalsBS.moveBy((int32_t)LSO_TYPE_DATA_SIZES[constant->getIType()], true);
+      globals_bs.moveBy((int32_t)LSO_TYPE_DATA_SIZES[constant->getIType()], true);
   }
 }
 
 void LSOGlobalVarManager::writePlaceholder(LSLIType type) {
-  mGlobalsBS << (uint32_t)6 << type << '\0';
-  mGlobalsBS.moveBy((int32_t)LSO_TYPE_DATA_SIZES[type], true);
+  auto &globals_bs = *_mTargetBS;
+  globals_bs << (uint32_t)6 << type << '\0';
+  globals_bs.moveBy((int32_t)LSO_TYPE_DATA_SIZES[type], true);
 }
 
 
 uint32_t LSOHeapManager::writeConstant(LSLConstant *constant) {
+  LSLIType itype = constant->getIType();
+  if (!_mShareConstants || (itype != LST_STRING && itype != LST_KEY && itype != LST_LIST))
+    return writeNewConstant(constant);
+
+  // The VM never modifies a heap entry in place, anything that changes a value
+  // allocates a new entry and drops a reference to the old one. That means globals
+  // with identical initial values can point to the same entry as long as its
+  // reference count accounts for all of them.
+  // Serializing the constant on its own gives us a key that doesn't depend on
+  // where it ends up on the heap, even for lists.
+  LSOHeapManager scratch_manager;
+  scratch_manager.writeNewConstant(constant);
+  std::string key((const char *)scratch_manager.mHeapBS.data(), scratch_manager.mHeapBS.size());
+
+  auto shared_iter = _mSharedConstants.find(key);
+  if (shared_iter != _mSharedConstants.end() && shared_iter->second.ref_count < UINT16_MAX) {
+    auto &shared = shared_iter->second;
+    ++shared.ref_count;
+    // patch the reference count in the existing entry's header
+    ScopedBitStreamSeek seek(mHeapBS, shared.heap_idx - 1 + sizeof(uint32_t) + sizeof(LSLIType));
+    mHeapBS << shared.ref_count;
+    return shared.heap_idx;
+  }
+
+  uint32_t heap_idx = writeNewConstant(constant);
+  _mSharedConstants[key] = {heap_idx, 1};
+  return heap_idx;
+}
+
+uint32_t LSOHeapManager::writeNewConstant(LSLConstant *constant) {
   // first byte on the heap has an index of 1, not 0. 0 is completely invalid.
   uint32_t heap_idx = mHeapBS.pos() + 1;
   LSLIType itype = constant->getIType();
@@ -374,7 +447,8 @@ uint32_t LSOHeapManager::writeConstant(LSLConstant *constant) {
       std::vector<uint32_t> child_idxs;
       for (auto *child : *list_val) {
         // write the child, noting where on the heap it was written
-        child_idxs.emplace_back(writeConstant((LSLConstant *) child));
+        // elements are owned by the list, so they're never shared.
+        child_idxs.emplace_back(writeNewConstant((LSLConstant *) child));
       }
 
       {
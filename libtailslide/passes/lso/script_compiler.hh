@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "../../lslmini.hh"
@@ -12,26 +14,56 @@ namespace Tailslide {
 
 class LSOHeapManager {
   public:
+    explicit LSOHeapManager(bool share_constants=false) : _mShareConstants(share_constants) {}
     uint32_t writeConstant(LSLConstant *constant);
     uint32_t writeTerminalBlock();
     LSOBitStream mHeapBS {ENDIAN_BIG};
   protected:
+    uint32_t writeNewConstant(LSLConstant *constant);
     void writeHeader(uint32_t size, LSLIType type, uint16_t ref_count=1);
+
+    struct SharedConstant {
+      uint32_t heap_idx;
+      uint16_t ref_count;
+    };
+    bool _mShareConstants;
+    /// serialized form of a constant -> where it lives on the heap
+    std::unordered_map<std::string, SharedConstant> _mSharedConstants {};
 };
 
 class LSOGlobalVarManager {
   public:
-    explicit LSOGlobalVarManager(LSOHeapManager *heap_manager): _mHeapManager(heap_manager) {}
+    /// globals get written to `mGlobalsBS` unless a `target` stream is given,
+    /// in which case they're written to it at its current position.
+    explicit LSOGlobalVarManager(LSOHeapManager *heap_manager, LSOBitStream *target=nullptr)
+      : _mHeapManager(heap_manager), _mTargetBS(target ? target : &mGlobalsBS) {}
     void writeVar(LSLConstant *constant, const char *name=nullptr);
     void writePlaceholder(LSLIType type);
     LSOBitStream mGlobalsBS {ENDIAN_BIG};
   protected:
     LSOHeapManager *_mHeapManager;
+    LSOBitStream *_mTargetBS;
+};
+
+struct LSOCompilationOptions {
+  /// run a peephole pass over the generated bytecode. The result won't
+  /// be byte-for-byte identical to what LL's compiler would produce.
+  bool optimize_bytecode = false;
+  /// write identical heap constants for globals once, sharing them through
+  /// the entry's reference count. The image won't match LL's compiler.
+  bool share_heap_constants = false;
+  /// let locals in disjoint scopes share the same stack slot, shrinking the
+  /// stack reserved for each function and event handler.
+  bool reuse_local_slots = false;
+  /// lower the caller's tree directly rather than a copy of it. Saves building
+  /// a second tree, but the tree can't be used for anything else afterwards.
+  bool lower_in_place = false;
 };
 
 class LSOScriptCompiler : public ASTVisitor {
   public:
-    explicit LSOScriptCompiler(ScriptAllocator *allocator) : _mAllocator(allocator) {};
+    explicit LSOScriptCompiler(ScriptAllocator *allocator, LSOCompilationOptions options={})
+      : _mOptions(options), _mAllocator(allocator) {};
     LSOBitStream mScriptBS {ENDIAN_BIG};
   protected:
     virtual bool visit(LSLScript *script);
@@ -40,17 +72,24 @@ class LSOScriptCompiler : public ASTVisitor {
     virtual bool visit(LSLEventHandler *handler);
     virtual bool visit(LSLGlobalFunction *glob_func);
 
+    /// compile a function or handler's bytecode directly into the image at the current position
+    bool writeCode(LSLASTNode *node);
+    /// throws away the half-written image, always returns false
+    bool abandonImage();
     void writeRegister(LSORegisters reg, uint32_t val);
     void writeEventRegister(LSORegisters reg, uint64_t val);
     bool checkStackHeapCollision();
 
-    LSOBitStream _mRegistersBS {ENDIAN_BIG};
-    LSOBitStream _mFunctionsBS {ENDIAN_BIG};
-    LSOBitStream _mStatesBS {ENDIAN_BIG};
-    LSOBitStream _mStateBS {ENDIAN_BIG};
-    LSOBitStream _mCodeBS {ENDIAN_BIG};
-    LSOHeapManager _mHeapManager;
-    LSOGlobalVarManager _mGlobalVarManager {&_mHeapManager};
+    // must come before anything that's initialized from it
+    LSOCompilationOptions _mOptions;
+    uint32_t _mNumFuncs = 0;
+    /// code ran into where the heap has to go
+    bool _mOutOfMemory = false;
+    uint32_t _mFunctionsStart = 0;
+    uint32_t _mStatesStart = 0;
+    uint32_t _mStateStart = 0;
+    LSOHeapManager _mHeapManager {_mOptions.share_heap_constants};
+    LSOGlobalVarManager _mGlobalVarManager {&_mHeapManager, &mScriptBS};
     ScriptAllocator *_mAllocator;
     LSOSymbolDataMap _mSymData {};
 };
@@ -0,0 +1,1185 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "assembly_writer.hh"
+
+namespace Tailslide {
+
+static const CILOpcodeInfo CIL_OPCODES[] = {
+    {"nop", 0x00, CIL_OPERAND_NONE, 0, 0, false},
+    {"ldarg.0", 0x02, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldarg.1", 0x03, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldarg.2", 0x04, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldarg.3", 0x05, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldloc.0", 0x06, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldloc.1", 0x07, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldloc.2", 0x08, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldloc.3", 0x09, CIL_OPERAND_NONE, 0, 1, false},
+    {"stloc.0", 0x0A, CIL_OPERAND_NONE, 1, 0, false},
+    {"stloc.1", 0x0B, CIL_OPERAND_NONE, 1, 0, false},
+    {"stloc.2", 0x0C, CIL_OPERAND_NONE, 1, 0, false},
+    {"stloc.3", 0x0D, CIL_OPERAND_NONE, 1, 0, false},
+    {"ldarg.s", 0x0E, CIL_OPERAND_VAR8, 0, 1, false},
+    {"ldarga.s", 0x0F, CIL_OPERAND_VAR8, 0, 1, false},
+    {"starg.s", 0x10, CIL_OPERAND_VAR8, 1, 0, false},
+    {"ldloc.s", 0x11, CIL_OPERAND_VAR8, 0, 1, false},
+    {"ldloca.s", 0x12, CIL_OPERAND_VAR8, 0, 1, false},
+    {"stloc.s", 0x13, CIL_OPERAND_VAR8, 1, 0, false},
+    {"ldnull", 0x14, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.m1", 0x15, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.0", 0x16, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.1", 0x17, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.2", 0x18, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.3", 0x19, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.4", 0x1A, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.5", 0x1B, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.6", 0x1C, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.7", 0x1D, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.8", 0x1E, CIL_OPERAND_NONE, 0, 1, false},
+    {"ldc.i4.s", 0x1F, CIL_OPERAND_INT8, 0, 1, false},
+    {"ldc.i4", 0x20, CIL_OPERAND_INT32, 0, 1, false},
+    {"ldc.r8", 0x23, CIL_OPERAND_FLOAT64, 0, 1, false},
+    {"dup", 0x25, CIL_OPERAND_NONE, 1, 2, false},
+    {"pop", 0x26, CIL_OPERAND_NONE, 1, 0, false},
+    {"call", 0x28, CIL_OPERAND_METHOD, 0, 0, false},
+    {"ret", 0x2A, CIL_OPERAND_NONE, 0, 0, true},
+    {"br.s", 0x2B, CIL_OPERAND_BRANCH8, 0, 0, true},
+    {"brfalse.s", 0x2C, CIL_OPERAND_BRANCH8, 1, 0, false},
+    {"brtrue.s", 0x2D, CIL_OPERAND_BRANCH8, 1, 0, false},
+    {"beq.s", 0x2E, CIL_OPERAND_BRANCH8, 2, 0, false},
+    {"bge.s", 0x2F, CIL_OPERAND_BRANCH8, 2, 0, false},
+    {"bgt.s", 0x30, CIL_OPERAND_BRANCH8, 2, 0, false},
+    {"ble.s", 0x31, CIL_OPERAND_BRANCH8, 2, 0, false},
+    {"blt.s", 0x32, CIL_OPERAND_BRANCH8, 2, 0, false},
+    {"bne.un.s", 0x33, CIL_OPERAND_BRANCH8, 2, 0, false},
+    {"br", 0x38, CIL_OPERAND_BRANCH32, 0, 0, true},
+    {"brfalse", 0x39, CIL_OPERAND_BRANCH32, 1, 0, false},
+    {"brtrue", 0x3A, CIL_OPERAND_BRANCH32, 1, 0, false},
+    {"beq", 0x3B, CIL_OPERAND_BRANCH32, 2, 0, false},
+    {"bge", 0x3C, CIL_OPERAND_BRANCH32, 2, 0, false},
+    {"bgt", 0x3D, CIL_OPERAND_BRANCH32, 2, 0, false},
+    {"ble", 0x3E, CIL_OPERAND_BRANCH32, 2, 0, false},
+    {"blt", 0x3F, CIL_OPERAND_BRANCH32, 2, 0, false},
+    {"bne.un", 0x40, CIL_OPERAND_BRANCH32, 2, 0, false},
+    {"switch", 0x45, CIL_OPERAND_SWITCH, 1, 0, false},
+    {"add", 0x58, CIL_OPERAND_NONE, 2, 1, false},
+    {"sub", 0x59, CIL_OPERAND_NONE, 2, 1, false},
+    {"mul", 0x5A, CIL_OPERAND_NONE, 2, 1, false},
+    {"div", 0x5B, CIL_OPERAND_NONE, 2, 1, false},
+    {"rem", 0x5D, CIL_OPERAND_NONE, 2, 1, false},
+    {"and", 0x5F, CIL_OPERAND_NONE, 2, 1, false},
+    {"or", 0x60, CIL_OPERAND_NONE, 2, 1, false},
+    {"xor", 0x61, CIL_OPERAND_NONE, 2, 1, false},
+    {"shl", 0x62, CIL_OPERAND_NONE, 2, 1, false},
+    {"shr", 0x63, CIL_OPERAND_NONE, 2, 1, false},
+    {"neg", 0x65, CIL_OPERAND_NONE, 1, 1, false},
+    {"not", 0x66, CIL_OPERAND_NONE, 1, 1, false},
+    {"conv.i4", 0x69, CIL_OPERAND_NONE, 1, 1, false},
+    {"conv.r4", 0x6B, CIL_OPERAND_NONE, 1, 1, false},
+    {"conv.r8", 0x6C, CIL_OPERAND_NONE, 1, 1, false},
+    {"callvirt", 0x6F, CIL_OPERAND_METHOD, 0, 0, false},
+    {"ldstr", 0x72, CIL_OPERAND_STRING, 0, 1, false},
+    {"newobj", 0x73, CIL_OPERAND_METHOD, 0, 1, false},
+    {"throw", 0x7A, CIL_OPERAND_NONE, 1, 0, true},
+    {"ldfld", 0x7B, CIL_OPERAND_FIELD, 1, 1, false},
+    {"ldflda", 0x7C, CIL_OPERAND_FIELD, 1, 1, false},
+    {"stfld", 0x7D, CIL_OPERAND_FIELD, 2, 0, false},
+    {"box", 0x8C, CIL_OPERAND_TYPE, 1, 1, false},
+    {"newarr", 0x8D, CIL_OPERAND_TYPE, 1, 1, false},
+    {"stelem.ref", 0xA2, CIL_OPERAND_NONE, 3, 0, false},
+    {"ceq", 0xFE01, CIL_OPERAND_NONE, 2, 1, false},
+    {"cgt", 0xFE02, CIL_OPERAND_NONE, 2, 1, false},
+    {"clt", 0xFE04, CIL_OPERAND_NONE, 2, 1, false},
+    {"ldarg", 0xFE09, CIL_OPERAND_VAR16, 0, 1, false},
+    {"ldarga", 0xFE0A, CIL_OPERAND_VAR16, 0, 1, false},
+    {"starg", 0xFE0B, CIL_OPERAND_VAR16, 1, 0, false},
+    {"ldloc", 0xFE0C, CIL_OPERAND_VAR16, 0, 1, false},
+    {"ldloca", 0xFE0D, CIL_OPERAND_VAR16, 0, 1, false},
+    {"stloc", 0xFE0E, CIL_OPERAND_VAR16, 1, 0, false},
+};
+
+const CILOpcodeInfo *lookup_cil_opcode(const std::string &name) {
+  static const auto by_name = [] {
+    std::unordered_map<std::string, const CILOpcodeInfo *> opcodes;
+    for (const auto &info : CIL_OPCODES)
+      opcodes[info.name] = &info;
+    return opcodes;
+  }();
+  auto op_iter = by_name.find(name);
+  return op_iter == by_name.end() ? nullptr : op_iter->second;
+}
+
+const CILOpcodeInfo *lookup_cil_opcode(uint16_t value) {
+  for (const auto &info : CIL_OPCODES) {
+    if (info.value == value)
+      return &info;
+  }
+  return nullptr;
+}
+
+[[noreturn]] static void assembly_error(const std::string &what) {
+  throw std::runtime_error("Can't assemble " + what);
+}
+
+/// the whole of `text` as an integer in `[min_val, max_val]`
+static int64_t parse_operand_int(std::string_view text, int64_t min_val, int64_t max_val, int base=10) {
+  int64_t val = 0;
+  auto res = std::from_chars(text.data(), text.data() + text.size(), val, base);
+  if (res.ec != std::errc() || res.ptr != text.data() + text.size() || val < min_val || val > max_val)
+    assembly_error("integer operand " + std::string(text));
+  return val;
+}
+
+/// ECMA-335 element types, by their CIL assembly names
+static const std::pair<const char *, uint8_t> CIL_PRIMITIVE_TYPES[] = {
+    {"void", 0x01}, {"bool", 0x02}, {"char", 0x03}, {"int8", 0x04}, {"uint8", 0x05},
+    {"int16", 0x06}, {"uint16", 0x07}, {"int32", 0x08}, {"uint32", 0x09}, {"int64", 0x0A},
+    {"uint64", 0x0B}, {"float32", 0x0C}, {"float64", 0x0D}, {"string", 0x0E}, {"object", 0x1C},
+};
+static const uint8_t ELEMENT_TYPE_VOID = 0x01;
+static const uint8_t ELEMENT_TYPE_STRING = 0x0E;
+static const uint8_t ELEMENT_TYPE_VALUETYPE = 0x11;
+static const uint8_t ELEMENT_TYPE_CLASS = 0x12;
+static const uint8_t ELEMENT_TYPE_OBJECT = 0x1C;
+static const uint8_t ELEMENT_TYPE_SZARRAY = 0x1D;
+
+// metadata table numbers
+enum {
+  TABLE_MODULE = 0x00,
+  TABLE_TYPEREF = 0x01,
+  TABLE_TYPEDEF = 0x02,
+  TABLE_FIELD = 0x04,
+  TABLE_METHODDEF = 0x06,
+  TABLE_PARAM = 0x08,
+  TABLE_MEMBERREF = 0x0A,
+  TABLE_STANDALONESIG = 0x11,
+  TABLE_ASSEMBLY = 0x20,
+  TABLE_ASSEMBLYREF = 0x23,
+};
+
+/// our script class always comes right after <Module>
+static const uint32_t SCRIPT_TYPEDEF_ROW = 2;
+static const uint32_t TEXT_RVA = 0x2000;
+static const uint32_t SECTION_ALIGNMENT = 0x2000;
+static const uint32_t FILE_ALIGNMENT = 0x200;
+static const uint32_t IMAGE_BASE = 0x400000;
+/// IAT and CLI header come before the method bodies
+static const uint32_t CODE_OFFSET = 8 + 72;
+
+static void write_compressed(std::string &out, uint32_t val) {
+  if (val < 0x80) {
+    out += (char)val;
+  } else if (val < 0x4000) {
+    out += (char)(0x80 | (val >> 8));
+    out += (char)(val & 0xFF);
+  } else {
+    out += (char)(0xC0 | (val >> 24));
+    out += (char)((val >> 16) & 0xFF);
+    out += (char)((val >> 8) & 0xFF);
+    out += (char)(val & 0xFF);
+  }
+}
+
+static void put_le(std::string &out, uint32_t val, int size) {
+  for (int i = 0; i < size; ++i)
+    out += (char)((val >> (8 * i)) & 0xFF);
+}
+
+static void pad_to_4(std::string &out) {
+  while (out.size() % 4)
+    out += '\0';
+}
+
+static void skip_space(std::string_view &text) {
+  while (!text.empty() && text.front() == ' ')
+    text.remove_prefix(1);
+}
+
+static bool consume(std::string_view &text, std::string_view prefix) {
+  skip_space(text);
+  if (text.substr(0, prefix.size()) != prefix)
+    return false;
+  text.remove_prefix(prefix.size());
+  return true;
+}
+
+/// read a possibly quoted type or member name
+static std::string_view read_name(std::string_view &text) {
+  skip_space(text);
+  if (!text.empty() && text.front() == '\'') {
+    auto end = text.find('\'', 1);
+    if (end == std::string_view::npos)
+      assembly_error("unterminated name " + std::string(text));
+    auto name = text.substr(1, end - 1);
+    text.remove_prefix(end + 1);
+    return name;
+  }
+  size_t len = 0;
+  while (len < text.size() && !strchr(" ,()", text[len]) && text.substr(len, 2) != "::")
+    ++len;
+  auto name = text.substr(0, len);
+  text.remove_prefix(len);
+  return name;
+}
+
+/// decode the escapes `escape_string()` produces and convert the result to UTF-16
+static std::u16string decode_string_literal(std::string_view text) {
+  if (text.size() < 2 || text.front() != '"' || text.back() != '"')
+    assembly_error("string literal " + std::string(text));
+  text = text.substr(1, text.size() - 2);
+  std::string utf8;
+  for (size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    if (c == '\\' && i + 1 < text.size()) {
+      c = text[++i];
+      if (c == 'n')
+        c = '\n';
+      else if (c == 't')
+        c = '\t';
+      else if (c == 'r')
+        c = '\r';
+    }
+    utf8 += c;
+  }
+
+  std::u16string utf16;
+  for (size_t i = 0; i < utf8.size();) {
+    auto lead = (uint8_t)utf8[i];
+    uint32_t code_point;
+    size_t len;
+    if (lead < 0x80) {
+      code_point = lead;
+      len = 1;
+    } else if ((lead & 0xE0) == 0xC0) {
+      code_point = lead & 0x1F;
+      len = 2;
+    } else if ((lead & 0xF0) == 0xE0) {
+      code_point = lead & 0x0F;
+      len = 3;
+    } else if ((lead & 0xF8) == 0xF0) {
+      code_point = lead & 0x07;
+      len = 4;
+    } else {
+      code_point = 0xFFFD;
+      len = 1;
+    }
+    if (len > 1) {
+      if (i + len > utf8.size()) {
+        code_point = 0xFFFD;
+        len = 1;
+      } else {
+        for (size_t j = 1; j < len; ++j) {
+          auto cont = (uint8_t)utf8[i + j];
+          if ((cont & 0xC0) != 0x80) {
+            code_point = 0xFFFD;
+            len = j;
+            break;
+          }
+          code_point = (code_point << 6) | (cont & 0x3F);
+        }
+      }
+    }
+    i += len;
+    if (code_point >= 0x10000) {
+      code_point -= 0x10000;
+      utf16 += (char16_t)(0xD800 | (code_point >> 10));
+      utf16 += (char16_t)(0xDC00 | (code_point & 0x3FF));
+    } else {
+      utf16 += (char16_t)code_point;
+    }
+  }
+  return utf16;
+}
+
+bool cil_stack_effect(const CILInstruction &insn, bool returns_value, int &pops, int &pushes) {
+  auto *info = lookup_cil_opcode(insn.opcode);
+  if (!info)
+    return false;
+  pops = info->pops;
+  pushes = info->pushes;
+  if (insn.opcode == "ret") {
+    pops = returns_value;
+  } else if (info->operand == CIL_OPERAND_METHOD) {
+    // `[instance] <return type> <owner>::<name>(<param>, ...)`, none of our types have parens or commas.
+    std::string_view sig {insn.operand};
+    bool has_this = consume(sig, "instance ");
+    auto params_start = sig.rfind('(');
+    if (params_start == std::string_view::npos)
+      return false;
+    auto params = sig.substr(params_start + 1);
+    pops = has_this;
+    if (params.substr(0, 1) != ")")
+      pops += 1 + (int)std::count(params.begin(), params.end(), ',');
+    pushes = sig.substr(0, 5) != "void ";
+    // constructors make their own `this` and leave it on the stack
+    if (insn.opcode == "newobj") {
+      pops -= has_this;
+      pushes = 1;
+    }
+  }
+  return true;
+}
+
+int cil_max_stack(const std::vector<CILInstruction> &instructions, bool returns_value) {
+  // Code following an unconditional branch can only be reached through a label,
+  // which must have been branched to with the stack in the same state, or the
+  // stack is assumed to be empty.
+  std::unordered_map<std::string, int> label_depths;
+  int depth = 0, max_depth = 0;
+  bool reachable = true;
+  for (const auto &insn : instructions) {
+    if (insn.dead)
+      continue;
+    if (insn.is_label) {
+      auto depth_iter = label_depths.find(insn.opcode);
+      if (!reachable)
+        depth = depth_iter == label_depths.end() ? 0 : depth_iter->second;
+      else if (depth_iter == label_depths.end())
+        label_depths[insn.opcode] = depth;
+      reachable = true;
+      continue;
+    }
+    if (!reachable) {
+      depth = 0;
+      reachable = true;
+    }
+    int pops, pushes;
+    if (!cil_stack_effect(insn, returns_value, pops, pushes))
+      return -1;
+    depth = std::max(0, depth - pops) + pushes;
+    max_depth = std::max(max_depth, depth);
+    auto *info = lookup_cil_opcode(insn.opcode);
+    if (info->operand == CIL_OPERAND_BRANCH8 || info->operand == CIL_OPERAND_BRANCH32) {
+      label_depths.emplace(insn.operand, depth);
+    } else if (info->operand == CIL_OPERAND_SWITCH) {
+      for (const auto &target : cil_switch_targets(insn.operand))
+        label_depths.emplace(target, depth);
+    }
+    if (info->ends_block)
+      reachable = false;
+  }
+  return max_depth;
+}
+
+void CILAssemblyWriter::addAssemblyRef(const std::string &name, const std::array<uint16_t, 4> &version) {
+  _mAssemblyRefs.emplace_back(name, version);
+}
+
+void CILAssemblyWriter::setClass(std::string name, std::string base_class) {
+  _mClassName = std::move(name);
+  _mBaseClass = std::move(base_class);
+}
+
+void CILAssemblyWriter::addField(std::string type, std::string name) {
+  _mFields.emplace_back(std::move(type), std::move(name));
+}
+
+void CILAssemblyWriter::addMethod(CILMethod method) {
+  _mMethods.push_back(std::move(method));
+}
+
+uint32_t CILAssemblyWriter::addString(const std::string &str) {
+  if (str.empty())
+    return 0;
+  if (_mStrings.empty())
+    _mStrings += '\0';
+  auto str_iter = _mStringIndices.find(str);
+  if (str_iter != _mStringIndices.end())
+    return str_iter->second;
+  auto idx = (uint32_t)_mStrings.size();
+  _mStrings.append(str.c_str(), str.size() + 1);
+  _mStringIndices[str] = idx;
+  return idx;
+}
+
+uint32_t CILAssemblyWriter::addBlob(const std::string &blob) {
+  if (_mBlobs.empty())
+    _mBlobs += '\0';
+  if (blob.empty())
+    return 0;
+  auto blob_iter = _mBlobIndices.find(blob);
+  if (blob_iter != _mBlobIndices.end())
+    return blob_iter->second;
+  auto idx = (uint32_t)_mBlobs.size();
+  write_compressed(_mBlobs, (uint32_t)blob.size());
+  _mBlobs += blob;
+  _mBlobIndices[blob] = idx;
+  return idx;
+}
+
+uint32_t CILAssemblyWriter::typeRef(const std::string &assembly, const std::string &full_name) {
+  auto key = assembly + "]" + full_name;
+  auto ref_iter = _mTypeRefIndices.find(key);
+  if (ref_iter != _mTypeRefIndices.end())
+    return ref_iter->second;
+
+  uint32_t assembly_row = 0;
+  for (size_t i = 0; i < _mAssemblyRefs.size(); ++i) {
+    if (_mAssemblyRefs[i].first == assembly)
+      assembly_row = (uint32_t)i + 1;
+  }
+  if (!assembly_row)
+    assembly_error("reference to unknown assembly " + assembly);
+
+  auto dot_pos = full_name.rfind('.');
+  std::string name_space = dot_pos == std::string::npos ? "" : full_name.substr(0, dot_pos);
+  std::string name = dot_pos == std::string::npos ? full_name : full_name.substr(dot_pos + 1);
+  _mTypeRefs.push_back({assembly_row, addString(name_space), addString(name)});
+  auto row = (uint32_t)_mTypeRefs.size();
+  _mTypeRefIndices[key] = row;
+  return row;
+}
+
+CILAssemblyWriter::TypeSig CILAssemblyWriter::parseTypeName(std::string_view &text, uint8_t element_type) {
+  TypeSig sig;
+  std::string assembly;
+  if (consume(text, "[")) {
+    auto end = text.find(']');
+    if (end == std::string_view::npos)
+      assembly_error("type " + std::string(text));
+    assembly = text.substr(0, end);
+    text.remove_prefix(end + 1);
+  }
+  std::string full_name {read_name(text)};
+  if (assembly.empty()) {
+    if (full_name != _mClassName)
+      assembly_error("reference to unknown type " + full_name);
+    sig.coded_token = (SCRIPT_TYPEDEF_ROW << 2) | 0;
+    sig.is_own_class = true;
+  } else {
+    sig.coded_token = (typeRef(assembly, full_name) << 2) | 1;
+  }
+  sig.blob += (char)element_type;
+  write_compressed(sig.blob, sig.coded_token);
+  return sig;
+}
+
+CILAssemblyWriter::TypeSig CILAssemblyWriter::parseType(std::string_view &text) {
+  if (consume(text, "class "))
+    return parseTypeName(text, ELEMENT_TYPE_CLASS);
+  if (consume(text, "valuetype "))
+    return parseTypeName(text, ELEMENT_TYPE_VALUETYPE);
+
+  auto name = read_name(text);
+  // single-dimensional arrays of primitives, like `string[]`
+  std::string array_prefix;
+  while (name.size() > 2 && name.substr(name.size() - 2) == "[]") {
+    name.remove_suffix(2);
+    array_prefix += (char)ELEMENT_TYPE_SZARRAY;
+  }
+  for (auto &prim : CIL_PRIMITIVE_TYPES) {
+    if (name == prim.first) {
+      TypeSig sig;
+      sig.blob = array_prefix;
+      sig.blob += (char)prim.second;
+      sig.is_void = prim.second == ELEMENT_TYPE_VOID;
+      return sig;
+    }
+  }
+  // our own class may be referred to without the `class` keyword
+  std::string_view name_text {name};
+  return parseTypeName(name_text, ELEMENT_TYPE_CLASS);
+}
+
+uint32_t CILAssemblyWriter::parseOwnerType(std::string_view &text) {
+  auto owner = parseType(text);
+  if (owner.is_own_class)
+    return 0;
+  uint32_t row;
+  if (owner.coded_token) {
+    row = owner.coded_token >> 2;
+  } else if (owner.blob[0] == ELEMENT_TYPE_STRING) {
+    row = typeRef("mscorlib", "System.String");
+  } else if (owner.blob[0] == ELEMENT_TYPE_OBJECT) {
+    row = typeRef("mscorlib", "System.Object");
+  } else {
+    assembly_error("member of a primitive type");
+  }
+  // MemberRefParent coded index, tagged as a TypeRef
+  return (row << 3) | 1;
+}
+
+CILAssemblyWriter::MemberSig CILAssemblyWriter::parseMethodRef(std::string_view text) {
+  MemberSig sig;
+  sig.has_this = consume(text, "instance ");
+  auto ret_type = parseType(text);
+  sig.returns_value = !ret_type.is_void;
+  sig.parent = parseOwnerType(text);
+  if (!consume(text, "::"))
+    assembly_error("method reference " + std::string(text));
+  sig.name = read_name(text);
+  if (!consume(text, "("))
+    assembly_error("method reference " + std::string(text));
+  std::string params;
+  while (!consume(text, ")")) {
+    if (sig.num_params && !consume(text, ","))
+      assembly_error("parameter list " + std::string(text));
+    params += parseType(text).blob;
+    ++sig.num_params;
+  }
+  sig.blob += (char)(sig.has_this ? 0x20 : 0x00);
+  write_compressed(sig.blob, sig.num_params);
+  sig.blob += ret_type.blob + params;
+  return sig;
+}
+
+CILAssemblyWriter::MemberSig CILAssemblyWriter::parseFieldRef(std::string_view text) {
+  MemberSig sig;
+  auto field_type = parseType(text);
+  sig.parent = parseOwnerType(text);
+  if (!consume(text, "::"))
+    assembly_error("field reference " + std::string(text));
+  sig.name = read_name(text);
+  sig.blob = "\x06" + field_type.blob;
+  return sig;
+}
+
+std::string CILAssemblyWriter::methodSignature(const CILMethod &method) {
+  std::string_view ret_text {method.return_type};
+  std::string sig;
+  // everything on the script class is an instance method
+  sig += (char)0x20;
+  write_compressed(sig, (uint32_t)method.params.size());
+  sig += parseType(ret_text).blob;
+  for (const auto &param : method.params) {
+    std::string_view param_text {param.first};
+    sig += parseType(param_text).blob;
+  }
+  return sig;
+}
+
+uint32_t CILAssemblyWriter::memberRef(const MemberSig &sig) {
+  auto key = std::to_string(sig.parent) + ":" + sig.name + ":" + sig.blob;
+  auto ref_iter = _mMemberRefIndices.find(key);
+  if (ref_iter != _mMemberRefIndices.end())
+    return ref_iter->second;
+  _mMemberRefs.push_back({sig.parent, addString(sig.name), addBlob(sig.blob)});
+  auto row = (uint32_t)_mMemberRefs.size();
+  _mMemberRefIndices[key] = row;
+  return row;
+}
+
+uint32_t CILAssemblyWriter::methodToken(const std::string &operand) {
+  auto sig = parseMethodRef(operand);
+  if (sig.parent)
+    return 0x0A000000 | memberRef(sig);
+  for (size_t i = 0; i < _mMethods.size(); ++i) {
+    if (_mMethods[i].name == sig.name && _mMethods[i].params.size() == sig.num_params)
+      return 0x06000000 | (uint32_t)(i + 1);
+  }
+  assembly_error("call to unknown method " + sig.name);
+}
+
+uint32_t CILAssemblyWriter::fieldToken(const std::string &operand) {
+  auto sig = parseFieldRef(operand);
+  if (sig.parent)
+    return 0x0A000000 | memberRef(sig);
+  for (size_t i = 0; i < _mFields.size(); ++i) {
+    if (_mFields[i].second == sig.name)
+      return 0x04000000 | (uint32_t)(i + 1);
+  }
+  assembly_error("reference to unknown field " + sig.name);
+}
+
+uint32_t CILAssemblyWriter::stringToken(const std::string &operand) {
+  if (_mUserStrings.empty())
+    _mUserStrings += '\0';
+  auto str_iter = _mUserStringIndices.find(operand);
+  if (str_iter != _mUserStringIndices.end())
+    return 0x70000000 | str_iter->second;
+
+  auto utf16 = decode_string_literal(operand);
+  auto idx = (uint32_t)_mUserStrings.size();
+  write_compressed(_mUserStrings, (uint32_t)(utf16.size() * 2 + 1));
+  // the trailing byte marks whether the string needs anything more than a bytewise comparison
+  bool special = false;
+  for (auto c : utf16) {
+    _mUserStrings += (char)(c & 0xFF);
+    _mUserStrings += (char)(c >> 8);
+    if (c >= 0x7F || (c >= 0x01 && c <= 0x08) || (c >= 0x0E && c <= 0x1F) || c == 0x27 || c == 0x2D)
+      special = true;
+  }
+  _mUserStrings += (char)special;
+  _mUserStringIndices[operand] = idx;
+  return 0x70000000 | idx;
+}
+
+namespace {
+struct AssembledInsn {
+  const CILOpcodeInfo *info = nullptr;
+  /// set for labels instead of `info`
+  const std::string *label = nullptr;
+  const std::string *target = nullptr;
+  /// set for switches instead of `target`
+  std::vector<std::string> switch_targets {};
+  std::string operand {};
+};
+}
+
+uint32_t CILAssemblyWriter::encodeMethod(const CILMethod &method, BitStream &code) {
+  std::vector<AssembledInsn> insns;
+  for (const auto &insn : method.instructions) {
+    if (insn.dead)
+      continue;
+    AssembledInsn asm_insn;
+    if (insn.is_label) {
+      asm_insn.label = &insn.opcode;
+      insns.push_back(std::move(asm_insn));
+      continue;
+    }
+    asm_insn.info = lookup_cil_opcode(insn.opcode);
+    if (!asm_insn.info)
+      assembly_error("unknown opcode " + insn.opcode);
+
+    const auto &operand = insn.operand;
+    auto &bytes = asm_insn.operand;
+    switch (asm_insn.info->operand) {
+      case CIL_OPERAND_NONE:
+        break;
+      case CIL_OPERAND_INT8:
+        put_le(bytes, (uint32_t)parse_operand_int(operand, INT8_MIN, UINT8_MAX), 1);
+        break;
+      case CIL_OPERAND_INT32:
+        put_le(bytes, (uint32_t)parse_operand_int(operand, INT32_MIN, UINT32_MAX), 4);
+        break;
+      case CIL_OPERAND_FLOAT64: {
+        // raw bytes of the double in the order they're stored, as in `(00 00 00 00 00 00 f0 3f)`
+        std::string_view hex {operand};
+        if (!consume(hex, "("))
+          assembly_error("float literal " + operand);
+        for (int i = 0; i < 8; ++i) {
+          skip_space(hex);
+          if (hex.size() < 2)
+            assembly_error("float literal " + operand);
+          bytes += (char)parse_operand_int(hex.substr(0, 2), 0, UINT8_MAX, 16);
+          hex.remove_prefix(2);
+        }
+        break;
+      }
+      case CIL_OPERAND_VAR8:
+      case CIL_OPERAND_VAR16: {
+        long idx = -1;
+        if (!operand.empty() && isdigit(operand[0])) {
+          idx = (long)parse_operand_int(operand, 0, UINT16_MAX - 1);
+        } else {
+          // arguments may be referred to by name, `this` is argument 0.
+          std::string_view name_text {operand};
+          auto name = read_name(name_text);
+          for (size_t i = 0; i < method.params.size(); ++i) {
+            if (method.params[i].second == name)
+              idx = (long)i + 1;
+          }
+        }
+        if (idx < 0)
+          assembly_error("variable reference " + operand);
+        if (asm_insn.info->operand == CIL_OPERAND_VAR8 && idx > UINT8_MAX) {
+          // doesn't fit in the short form's operand, `ldloc.s` -> `ldloc`
+          std::string long_name {asm_insn.info->name};
+          asm_insn.info = lookup_cil_opcode(long_name.substr(0, long_name.size() - 2));
+        }
+        put_le(bytes, (uint32_t)idx, asm_insn.info->operand == CIL_OPERAND_VAR8 ? 1 : 2);
+        break;
+      }
+      case CIL_OPERAND_BRANCH8:
+      case CIL_OPERAND_BRANCH32:
+        asm_insn.target = &operand;
+        break;
+      case CIL_OPERAND_METHOD:
+        put_le(bytes, methodToken(operand), 4);
+        break;
+      case CIL_OPERAND_FIELD:
+        put_le(bytes, fieldToken(operand), 4);
+        break;
+      case CIL_OPERAND_TYPE: {
+        std::string_view type_text {operand};
+        uint32_t coded = (type_text.substr(0, 1) == "[")
+            ? parseTypeName(type_text, ELEMENT_TYPE_CLASS).coded_token
+            : parseType(type_text).coded_token;
+        if (!coded)
+          assembly_error("type operand " + operand);
+        // TypeDefOrRef coded index -> token
+        put_le(bytes, ((coded & 3) == 0 ? 0x02000000 : 0x01000000) | (coded >> 2), 4);
+        break;
+      }
+      case CIL_OPERAND_STRING:
+        put_le(bytes, stringToken(operand), 4);
+        break;
+      case CIL_OPERAND_SWITCH:
+        asm_insn.switch_targets = cil_switch_targets(operand);
+        put_le(bytes, (uint32_t)asm_insn.switch_targets.size(), 4);
+        break;
+    }
+    insns.push_back(std::move(asm_insn));
+  }
+
+  // lay the code out, widening any short branches whose targets turn out to be too far away.
+  std::unordered_map<std::string, uint32_t> label_positions;
+  std::vector<uint32_t> ends(insns.size(), 0);
+  bool widened;
+  do {
+    widened = false;
+    uint32_t pos = 0;
+    label_positions.clear();
+    for (size_t i = 0; i < insns.size(); ++i) {
+      auto &insn = insns[i];
+      if (insn.label) {
+        label_positions[*insn.label] = pos;
+      } else {
+        pos += (insn.info->value > 0xFF ? 2 : 1) + (uint32_t)insn.operand.size();
+        if (insn.info->operand == CIL_OPERAND_BRANCH8)
+          pos += 1;
+        else if (insn.info->operand == CIL_OPERAND_BRANCH32)
+          pos += 4;
+        pos += 4 * (uint32_t)insn.switch_targets.size();
+      }
+      ends[i] = pos;
+    }
+    for (size_t i = 0; i < insns.size(); ++i) {
+      auto &insn = insns[i];
+      for (const auto &target : insn.switch_targets) {
+        if (!label_positions.count(target))
+          assembly_error("switch to unknown label " + target);
+      }
+      if (!insn.target)
+        continue;
+      auto label_iter = label_positions.find(*insn.target);
+      if (label_iter == label_positions.end())
+        assembly_error("branch to unknown label " + *insn.target);
+      long offset = (long)label_iter->second - (long)ends[i];
+      if (insn.info->operand == CIL_OPERAND_BRANCH8 && (offset < -128 || offset > 127)) {
+        std::string long_name {insn.info->name};
+        insn.info = lookup_cil_opcode(long_name.substr(0, long_name.size() - 2));
+        widened = true;
+      }
+    }
+  } while (widened);
+  const uint32_t code_size = insns.empty() ? 0 : ends.back();
+
+  const int max_depth = cil_max_stack(method.instructions, method.return_type != "void");
+  if (max_depth < 0)
+    assembly_error("stack depth of " + method.name);
+
+  // method header
+  uint32_t header_pos = code.pos();
+  if (code_size < 64 && max_depth <= 8 && method.locals.empty()) {
+    code << (uint8_t)((code_size << 2) | 0x2);
+  } else {
+    while (code.pos() % 4)
+      code << (uint8_t)0;
+    header_pos = code.pos();
+    uint32_t locals_token = 0;
+    if (!method.locals.empty()) {
+      std::string sig;
+      sig += (char)0x07;
+      write_compressed(sig, (uint32_t)method.locals.size());
+      for (const auto &local : method.locals) {
+        std::string_view local_text {local};
+        sig += parseType(local_text).blob;
+      }
+      _mLocalSigs.push_back(addBlob(sig));
+      locals_token = 0x11000000 | (uint32_t)_mLocalSigs.size();
+    }
+    // fat format, header is 3 dwords, zero-initialize locals
+    code << (uint16_t)(0x3003 | (method.locals.empty() ? 0 : 0x10));
+    code << (uint16_t)max_depth << code_size << locals_token;
+  }
+
+  for (size_t i = 0; i < insns.size(); ++i) {
+    auto &insn = insns[i];
+    if (insn.label)
+      continue;
+    if (insn.info->value > 0xFF)
+      code << (uint8_t)(insn.info->value >> 8);
+    code << (uint8_t)(insn.info->value & 0xFF);
+    code.writeRawData((const uint8_t *)insn.operand.data(), (uint32_t)insn.operand.size());
+    if (insn.target) {
+      auto offset = (int32_t)(label_positions[*insn.target] - ends[i]);
+      if (insn.info->operand == CIL_OPERAND_BRANCH8)
+        code << (int8_t)offset;
+      else
+        code << offset;
+    }
+    // jump table offsets are all relative to the end of the whole switch
+    for (const auto &target : insn.switch_targets)
+      code << (int32_t)(label_positions[target] - ends[i]);
+  }
+  return header_pos;
+}
+
+std::string CILAssemblyWriter::buildTables(const std::vector<uint32_t> &method_rvas) {
+  const uint32_t num_params = [this] {
+    uint32_t count = 0;
+    for (const auto &method : _mMethods)
+      count += (uint32_t)method.params.size();
+    return count;
+  }();
+  std::vector<std::pair<int, uint32_t>> row_counts = {
+      {TABLE_MODULE, 1},
+      {TABLE_TYPEREF, (uint32_t)_mTypeRefs.size()},
+      {TABLE_TYPEDEF, 2},
+      {TABLE_FIELD, (uint32_t)_mFields.size()},
+      {TABLE_METHODDEF, (uint32_t)_mMethods.size()},
+      {TABLE_PARAM, num_params},
+      {TABLE_MEMBERREF, (uint32_t)_mMemberRefs.size()},
+      {TABLE_STANDALONESIG, (uint32_t)_mLocalSigs.size()},
+      {TABLE_ASSEMBLY, 1},
+      {TABLE_ASSEMBLYREF, (uint32_t)_mAssemblyRefs.size()},
+  };
+
+  const int string_size = _mStrings.size() >= 0x10000 ? 4 : 2;
+  const int blob_size = _mBlobs.size() >= 0x10000 ? 4 : 2;
+  const int guid_size = 2;
+  auto index_size = [](uint32_t rows, int tag_bits) {
+    return rows >= (1u << (16 - tag_bits)) ? 4 : 2;
+  };
+  const int field_idx = index_size((uint32_t)_mFields.size() + 1, 0);
+  const int method_idx = index_size((uint32_t)_mMethods.size() + 1, 0);
+  const int param_idx = index_size(num_params + 1, 0);
+  const int type_def_or_ref = index_size(std::max<uint32_t>(2, (uint32_t)_mTypeRefs.size()), 2);
+  const int resolution_scope = index_size((uint32_t)std::max(_mAssemblyRefs.size(), _mTypeRefs.size()), 2);
+  const int member_ref_parent = index_size(
+      std::max<uint32_t>((uint32_t)_mMethods.size(), (uint32_t)_mTypeRefs.size()), 3);
+
+  std::string tables;
+  put_le(tables, 0, 4);
+  // schema version 2.0
+  tables += (char)2;
+  tables += (char)0;
+  tables += (char)((string_size == 4 ? 0x01 : 0) | (blob_size == 4 ? 0x04 : 0));
+  tables += (char)1;
+  uint64_t valid = 0;
+  for (auto &row_count : row_counts) {
+    if (row_count.second)
+      valid |= (uint64_t)1 << row_count.first;
+  }
+  put_le(tables, (uint32_t)valid, 4);
+  put_le(tables, (uint32_t)(valid >> 32), 4);
+  // which tables are sorted, this is the set every writer uses.
+  const uint64_t sorted = 0x000016003301FA00;
+  put_le(tables, (uint32_t)sorted, 4);
+  put_le(tables, (uint32_t)(sorted >> 32), 4);
+  for (auto &row_count : row_counts) {
+    if (row_count.second)
+      put_le(tables, row_count.second, 4);
+  }
+
+  // Module
+  put_le(tables, 0, 2);
+  put_le(tables, addString(_mClassName + ".dll"), string_size);
+  put_le(tables, 1, guid_size);
+  put_le(tables, 0, guid_size);
+  put_le(tables, 0, guid_size);
+
+  // TypeRef
+  for (auto &type_ref : _mTypeRefs) {
+    // ResolutionScope coded index, tagged as an AssemblyRef
+    put_le(tables, (type_ref[0] << 2) | 2, resolution_scope);
+    put_le(tables, type_ref[2], string_size);
+    put_le(tables, type_ref[1], string_size);
+  }
+
+  // TypeDef, <Module> first, and then the script class which owns every field and method.
+  put_le(tables, 0, 4);
+  put_le(tables, addString("<Module>"), string_size);
+  put_le(tables, 0, string_size);
+  put_le(tables, 0, type_def_or_ref);
+  put_le(tables, 1, field_idx);
+  put_le(tables, 1, method_idx);
+  std::string_view base_text {_mBaseClass};
+  // public auto ansi serializable beforefieldinit
+  put_le(tables, 0x00102001, 4);
+  put_le(tables, addString(_mClassName), string_size);
+  put_le(tables, 0, string_size);
+  put_le(tables, parseType(base_text).coded_token, type_def_or_ref);
+  put_le(tables, 1, field_idx);
+  put_le(tables, 1, method_idx);
+
+  // Field, all public
+  for (auto &field : _mFields) {
+    std::string_view type_text {field.first};
+    put_le(tables, 0x0006, 2);
+    put_le(tables, addString(field.second), string_size);
+    put_le(tables, addBlob("\x06" + parseType(type_text).blob), blob_size);
+  }
+
+  // MethodDef
+  uint32_t next_param = 1;
+  for (size_t i = 0; i < _mMethods.size(); ++i) {
+    auto &method = _mMethods[i];
+    put_le(tables, method_rvas[i], 4);
+    // cil managed
+    put_le(tables, 0, 2);
+    // public hidebysig, plus specialname rtspecialname for constructors
+    put_le(tables, method.is_ctor ? 0x1886 : 0x0086, 2);
+    put_le(tables, addString(method.name), string_size);
+    put_le(tables, addBlob(methodSignature(method)), blob_size);
+    put_le(tables, next_param, param_idx);
+    next_param += (uint32_t)method.params.size();
+  }
+
+  // Param
+  for (auto &method : _mMethods) {
+    for (size_t i = 0; i < method.params.size(); ++i) {
+      put_le(tables, 0, 2);
+      put_le(tables, (uint32_t)i + 1, 2);
+      put_le(tables, addString(method.params[i].second), string_size);
+    }
+  }
+
+  // MemberRef
+  for (auto &member_ref : _mMemberRefs) {
+    put_le(tables, member_ref.parent, member_ref_parent);
+    put_le(tables, member_ref.name, string_size);
+    put_le(tables, member_ref.signature, blob_size);
+  }
+
+  // StandAloneSig
+  for (auto local_sig : _mLocalSigs)
+    put_le(tables, local_sig, blob_size);
+
+  // Assembly, SHA1 hash algorithm and version 0:0:0:0
+  put_le(tables, 0x8004, 4);
+  put_le(tables, 0, 2 * 4);
+  put_le(tables, 0, 4);
+  put_le(tables, 0, blob_size);
+  put_le(tables, addString(_mClassName), string_size);
+  put_le(tables, 0, string_size);
+
+  // AssemblyRef
+  for (auto &assembly_ref : _mAssemblyRefs) {
+    for (auto ver : assembly_ref.second)
+      put_le(tables, ver, 2);
+    put_le(tables, 0, 4);
+    put_le(tables, 0, blob_size);
+    put_le(tables, addString(assembly_ref.first), string_size);
+    put_le(tables, 0, string_size);
+    put_le(tables, 0, blob_size);
+  }
+
+  pad_to_4(tables);
+  return tables;
+}
+
+std::string CILAssemblyWriter::buildMetadata(const std::vector<uint32_t> &method_rvas) {
+  // make sure everything the tables refer to is in the heaps first,
+  // the tables' index sizes depend on how big the heaps end up.
+  addString(_mClassName + ".dll");
+  addString("<Module>");
+  addString(_mClassName);
+  std::string_view base_text {_mBaseClass};
+  parseType(base_text);
+  for (auto &field : _mFields) {
+    std::string_view type_text {field.first};
+    addString(field.second);
+    addBlob("\x06" + parseType(type_text).blob);
+  }
+  for (auto &method : _mMethods) {
+    addString(method.name);
+    addBlob(methodSignature(method));
+    for (auto &param : method.params)
+      addString(param.second);
+  }
+  for (auto &assembly_ref : _mAssemblyRefs)
+    addString(assembly_ref.first);
+  addBlob("");
+  if (_mUserStrings.empty())
+    _mUserStrings += '\0';
+
+  std::string tables = buildTables(method_rvas);
+
+  // derive the module's GUID from its contents so output is reproducible
+  uint64_t hash_lo = 0xcbf29ce484222325, hash_hi = 0x84222325cbf29ce4;
+  for (const auto *heap : {&tables, &_mStrings, &_mUserStrings, &_mBlobs}) {
+    for (char c : *heap) {
+      hash_lo = (hash_lo ^ (uint8_t)c) * 0x100000001b3;
+      hash_hi = (hash_hi ^ (uint8_t)c) * 0x100000001b3;
+    }
+  }
+  std::string guids;
+  put_le(guids, (uint32_t)hash_lo, 4);
+  put_le(guids, (uint32_t)(hash_lo >> 32), 4);
+  put_le(guids, (uint32_t)hash_hi, 4);
+  put_le(guids, (uint32_t)(hash_hi >> 32), 4);
+
+  std::string strings = _mStrings, user_strings = _mUserStrings, blobs = _mBlobs;
+  pad_to_4(strings);
+  pad_to_4(user_strings);
+  pad_to_4(blobs);
+
+  const std::pair<const char *, const std::string *> streams[] = {
+      {"#~", &tables},
+      {"#Strings", &strings},
+      {"#US", &user_strings},
+      {"#GUID", &guids},
+      {"#Blob", &blobs},
+  };
+  const std::string version = "v2.0.50727";
+
+  std::string header;
+  put_le(header, 0x424A5342, 4);
+  put_le(header, 1, 2);
+  put_le(header, 1, 2);
+  put_le(header, 0, 4);
+  put_le(header, 12, 4);
+  header += version;
+  header.resize(header.size() + (12 - version.size()), '\0');
+  put_le(header, 0, 2);
+  put_le(header, (uint32_t)(sizeof(streams) / sizeof(streams[0])), 2);
+
+  uint32_t headers_size = (uint32_t)header.size();
+  for (auto &stream : streams)
+    headers_size += 8 + (uint32_t)((strlen(stream.first) + 4) & ~3);
+
+  std::string metadata = header;
+  uint32_t offset = headers_size;
+  for (auto &stream : streams) {
+    put_le(metadata, offset, 4);
+    put_le(metadata, (uint32_t)stream.second->size(), 4);
+    metadata += stream.first;
+    metadata += '\0';
+    pad_to_4(metadata);
+    offset += (uint32_t)stream.second->size();
+  }
+  for (auto &stream : streams)
+    metadata += *stream.second;
+  return metadata;
+}
+
+static uint32_t align_up(uint32_t val, uint32_t alignment) {
+  return (val + alignment - 1) & ~(alignment - 1);
+}
+
+static void pad_stream_to(BitStream &out, uint32_t pos) {
+  while (out.pos() < pos)
+    out << (uint8_t)0;
+}
+
+void CILAssemblyWriter::write(BitStream &out) {
+  _mStrings.clear();
+  _mStringIndices.clear();
+  _mBlobs.clear();
+  _mBlobIndices.clear();
+  _mUserStrings.clear();
+  _mUserStringIndices.clear();
+  _mTypeRefs.clear();
+  _mTypeRefIndices.clear();
+  _mMemberRefs.clear();
+  _mMemberRefIndices.clear();
+  _mLocalSigs.clear();
+
+  // method bodies go right after the IAT and CLI header in .text
+  BitStream code(ENDIAN_LITTLE);
+  std::vector<uint32_t> method_rvas;
+  for (auto &method : _mMethods)
+    method_rvas.push_back(TEXT_RVA + CODE_OFFSET + encodeMethod(method, code));
+  std::string metadata = buildMetadata(method_rvas);
+
+  // rest of the .text layout
+  const uint32_t metadata_offset = align_up(CODE_OFFSET + code.size(), 4);
+  const uint32_t import_dir_offset = align_up(metadata_offset + (uint32_t)metadata.size(), 4);
+  const uint32_t lookup_table_offset = import_dir_offset + 40;
+  const uint32_t hint_name_offset = lookup_table_offset + 8;
+  const uint32_t dll_name_offset = hint_name_offset + 16;
+  // the stub's jump target address needs to be 4-byte aligned for the relocation
+  const uint32_t entry_offset = align_up(dll_name_offset + 12 + 2, 4) - 2;
+  const uint32_t text_size = entry_offset + 6;
+  const uint32_t text_raw_size = align_up(text_size, FILE_ALIGNMENT);
+  const uint32_t reloc_rva = align_up(TEXT_RVA + text_size, SECTION_ALIGNMENT);
+  const uint32_t reloc_size = 12;
+  const uint32_t reloc_raw_size = align_up(reloc_size, FILE_ALIGNMENT);
+  const uint32_t image_size = align_up(reloc_rva + reloc_size, SECTION_ALIGNMENT);
+  const uint32_t text_file_offset = FILE_ALIGNMENT;
+  const uint32_t reloc_file_offset = text_file_offset + text_raw_size;
+
+  const uint32_t base = out.pos();
+  // DOS header and stub, just points to the PE header
+  static const uint8_t DOS_HEADER[128] = {
+      0x4D, 0x5A, 0x90, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00,
+      0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00,
+      0x0E, 0x1F, 0xBA, 0x0E, 0x00, 0xB4, 0x09, 0xCD, 0x21, 0xB8, 0x01, 0x4C, 0xCD, 0x21, 0x54, 0x68,
+      0x69, 0x73, 0x20, 0x70, 0x72, 0x6F, 0x67, 0x72, 0x61, 0x6D, 0x20, 0x63, 0x61, 0x6E, 0x6E, 0x6F,
+      0x74, 0x20, 0x62, 0x65, 0x20, 0x72, 0x75, 0x6E, 0x20, 0x69, 0x6E, 0x20, 0x44, 0x4F, 0x53, 0x20,
+      0x6D, 0x6F, 0x64, 0x65, 0x2E, 0x0D, 0x0D, 0x0A, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  };
+  out.reserve(base + reloc_file_offset + reloc_raw_size);
+  out.writeRawData(DOS_HEADER, sizeof(DOS_HEADER));
+
+  // PE signature and COFF header for an i386 DLL
+  out.writeRawData((const uint8_t *)"PE\0\0", 4);
+  out << (uint16_t)0x014C << (uint16_t)2 << (uint32_t)0 << (uint32_t)0 << (uint32_t)0;
+  out << (uint16_t)0xE0 << (uint16_t)0x2102;
+
+  // PE32 optional header
+  out << (uint16_t)0x010B << (uint8_t)8 << (uint8_t)0;
+  out << text_raw_size << reloc_raw_size << (uint32_t)0;
+  out << (uint32_t)(TEXT_RVA + entry_offset) << TEXT_RVA << reloc_rva;
+  out << IMAGE_BASE << SECTION_ALIGNMENT << FILE_ALIGNMENT;
+  out << (uint16_t)4 << (uint16_t)0 << (uint16_t)0 << (uint16_t)0 << (uint16_t)4 << (uint16_t)0;
+  out << (uint32_t)0 << image_size << FILE_ALIGNMENT << (uint32_t)0;
+  // console subsystem, dynamic base | NX compatible | no SEH | terminal server aware
+  out << (uint16_t)3 << (uint16_t)0x8540;
+  out << (uint32_t)0x100000 << (uint32_t)0x1000 << (uint32_t)0x100000 << (uint32_t)0x1000;
+  out << (uint32_t)0 << (uint32_t)16;
+  // data directories
+  const std::pair<uint32_t, uint32_t> directories[16] = {
+      {0, 0},
+      {TEXT_RVA + import_dir_offset, 40},
+      {0, 0}, {0, 0}, {0, 0},
+      {reloc_rva, reloc_size},
+      {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+      {TEXT_RVA, 8},
+      {0, 0},
+      {TEXT_RVA + 8, 72},
+      {0, 0},
+  };
+  for (auto &directory : directories)
+    out << directory.first << directory.second;
+
+  // section headers
+  out.writeRawData((const uint8_t *)".text\0\0\0", 8);
+  out << text_size << TEXT_RVA << text_raw_size << text_file_offset;
+  out << (uint32_t)0 << (uint32_t)0 << (uint16_t)0 << (uint16_t)0 << (uint32_t)0x60000020;
+  out.writeRawData((const uint8_t *)".reloc\0\0", 8);
+  out << reloc_size << reloc_rva << reloc_raw_size << reloc_file_offset;
+  out << (uint32_t)0 << (uint32_t)0 << (uint16_t)0 << (uint16_t)0 << (uint32_t)0x42000040;
+  pad_stream_to(out, base + text_file_offset);
+
+  // .text, starting with the import address table
+  out << (uint32_t)(TEXT_RVA + hint_name_offset) << (uint32_t)0;
+  // CLI header, IL only
+  out << (uint32_t)72 << (uint16_t)2 << (uint16_t)5;
+  out << (uint32_t)(TEXT_RVA + metadata_offset) << (uint32_t)metadata.size();
+  out << (uint32_t)1 << (uint32_t)0;
+  for (int i = 0; i < 6; ++i)
+    out << (uint32_t)0 << (uint32_t)0;
+  out.writeBitStream(code);
+  pad_stream_to(out, base + text_file_offset + metadata_offset);
+  out.writeRawData((const uint8_t *)metadata.data(), (uint32_t)metadata.size());
+  pad_stream_to(out, base + text_file_offset + import_dir_offset);
+  // import directory for mscoree.dll's _CorDllMain
+  out << (uint32_t)(TEXT_RVA + lookup_table_offset) << (uint32_t)0 << (uint32_t)0;
+  out << (uint32_t)(TEXT_RVA + dll_name_offset) << TEXT_RVA;
+  for (int i = 0; i < 5; ++i)
+    out << (uint32_t)0;
+  out << (uint32_t)(TEXT_RVA + hint_name_offset) << (uint32_t)0;
+  out << (uint16_t)0;
+  out.writeRawData((const uint8_t *)"_CorDllMain\0\0", 14);
+  out.writeRawData((const uint8_t *)"mscoree.dll\0", 12);
+  pad_stream_to(out, base + text_file_offset + entry_offset);
+  // entry point stub, jmp [_CorDllMain]
+  out << (uint8_t)0xFF << (uint8_t)0x25 << (uint32_t)(IMAGE_BASE + TEXT_RVA);
+  pad_stream_to(out, base + reloc_file_offset);
+
+  // .reloc, fixes up the stub's jump target
+  const uint32_t fixup_rva = TEXT_RVA + entry_offset + 2;
+  out << (fixup_rva & ~0xFFFu) << reloc_size;
+  out << (uint16_t)((3 << 12) | (fixup_rva & 0xFFF)) << (uint16_t)0;
+  pad_stream_to(out, base + reloc_file_offset + reloc_raw_size);
+}
+
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../../bitstream.hh"
+#include "instruction_list.hh"
+
+namespace Tailslide {
+
+enum CILOperandKind : uint8_t {
+  CIL_OPERAND_NONE,
+  CIL_OPERAND_INT8,
+  CIL_OPERAND_INT32,
+  CIL_OPERAND_FLOAT64,
+  /// local or argument index
+  CIL_OPERAND_VAR8,
+  CIL_OPERAND_VAR16,
+  CIL_OPERAND_BRANCH8,
+  CIL_OPERAND_BRANCH32,
+  CIL_OPERAND_METHOD,
+  CIL_OPERAND_FIELD,
+  CIL_OPERAND_TYPE,
+  CIL_OPERAND_STRING,
+  /// jump table, a count followed by that many branch offsets
+  CIL_OPERAND_SWITCH,
+};
+
+struct CILOpcodeInfo {
+  const char *name;
+  /// two-byte opcodes are 0xFExx
+  uint16_t value;
+  CILOperandKind operand;
+  /// how many values are popped and pushed, calls also pop their arguments and push their result
+  int8_t pops;
+  int8_t pushes;
+  /// doesn't continue on to the next instruction
+  bool ends_block;
+};
+
+/// look up one of the opcodes the compiler knows how to emit by its mnemonic
+const CILOpcodeInfo *lookup_cil_opcode(const std::string &name);
+/// look up an opcode by its encoded value, for reading code back in
+const CILOpcodeInfo *lookup_cil_opcode(uint16_t value);
+
+/// how many values `insn` pops off the evaluation stack and pushes back on,
+/// returns false if it's not an instruction we know the effects of.
+bool cil_stack_effect(const CILInstruction &insn, bool returns_value, int &pops, int &pushes);
+/// how deep the evaluation stack gets in a method body, or -1 if it can't be worked out
+int cil_max_stack(const std::vector<CILInstruction> &instructions, bool returns_value);
+
+/// A single method of the script class, using the same syntax for types and
+/// instructions as the textual CIL output.
+struct CILMethod {
+  std::string name;
+  std::string return_type;
+  /// (type, name) pairs
+  std::vector<std::pair<std::string, std::string>> params {};
+  std::vector<std::string> locals {};
+  std::vector<CILInstruction> instructions {};
+  bool is_ctor = false;
+};
+
+/// Assembles the script class into a loadable PE / ECMA-335 image so the
+/// output doesn't need to go through an external assembler. Only handles the
+/// subset of CIL assembly that MonoScriptCompiler generates.
+class CILAssemblyWriter {
+  public:
+    void addAssemblyRef(const std::string &name, const std::array<uint16_t, 4> &version);
+    void setClass(std::string name, std::string base_class);
+    void addField(std::string type, std::string name);
+    void addMethod(CILMethod method);
+    /// write the whole image to `out`, throws if there's anything it can't encode.
+    void write(BitStream &out);
+
+  protected:
+    struct TypeSig {
+      std::string blob;
+      /// TypeDefOrRef coded index for class and valuetypes, 0 for primitives
+      uint32_t coded_token = 0;
+      bool is_void = false;
+      bool is_own_class = false;
+    };
+    struct MemberSig {
+      std::string name;
+      std::string blob;
+      /// MemberRefParent coded index of the owning type, 0 for our own class
+      uint32_t parent = 0;
+      uint32_t num_params = 0;
+      bool has_this = false;
+      bool returns_value = false;
+    };
+    struct MemberRefRow {
+      uint32_t parent;
+      uint32_t name;
+      uint32_t signature;
+    };
+
+    TypeSig parseType(std::string_view &text);
+    TypeSig parseTypeName(std::string_view &text, uint8_t element_type);
+    uint32_t parseOwnerType(std::string_view &text);
+    MemberSig parseMethodRef(std::string_view text);
+    MemberSig parseFieldRef(std::string_view text);
+    std::string methodSignature(const CILMethod &method);
+
+    uint32_t typeRef(const std::string &assembly, const std::string &full_name);
+    uint32_t memberRef(const MemberSig &sig);
+    uint32_t methodToken(const std::string &operand);
+    uint32_t fieldToken(const std::string &operand);
+    uint32_t stringToken(const std::string &operand);
+
+    uint32_t addString(const std::string &str);
+    uint32_t addBlob(const std::string &blob);
+    /// returns where the method's header starts in `code`
+    uint32_t encodeMethod(const CILMethod &method, BitStream &code);
+    std::string buildTables(const std::vector<uint32_t> &method_rvas);
+    std::string buildMetadata(const std::vector<uint32_t> &method_rvas);
+
+    std::string _mClassName;
+    std::string _mBaseClass;
+    std::vector<std::pair<std::string, std::array<uint16_t, 4>>> _mAssemblyRefs {};
+    std::vector<std::pair<std::string, std::string>> _mFields {};
+    std::vector<CILMethod> _mMethods {};
+
+    std::string _mStrings {};
+    std::unordered_map<std::string, uint32_t> _mStringIndices {};
+    std::string _mBlobs {};
+    std::unordered_map<std::string, uint32_t> _mBlobIndices {};
+    std::string _mUserStrings {};
+    std::unordered_map<std::string, uint32_t> _mUserStringIndices {};
+    /// (assembly ref row, namespace, name)
+    std::vector<std::array<uint32_t, 3>> _mTypeRefs {};
+    std::unordered_map<std::string, uint32_t> _mTypeRefIndices {};
+    std::vector<MemberRefRow> _mMemberRefs {};
+    std::unordered_map<std::string, uint32_t> _mMemberRefIndices {};
+    std::vector<uint32_t> _mLocalSigs {};
+};
+
+}
@@ -0,0 +1,80 @@
+#include <cassert>
+
+#include "instruction_list.hh"
+
+namespace Tailslide {
+
+std::vector<std::string> cil_switch_targets(const std::string &operand) {
+  std::vector<std::string> targets;
+  size_t pos = operand.find('(');
+  if (pos == std::string::npos)
+    return targets;
+  ++pos;
+  while (pos < operand.size()) {
+    while (pos < operand.size() && operand[pos] == ' ')
+      ++pos;
+    size_t end = operand.find_first_of(",)", pos);
+    if (end == std::string::npos)
+      break;
+    if (end != pos)
+      targets.push_back(operand.substr(pos, operand.find_last_not_of(' ', end - 1) + 1 - pos));
+    pos = end + 1;
+  }
+  return targets;
+}
+
+void CILInstructionList::writeInstruction(std::string opcode, std::string operand) {
+  _mInstructions.push_back({std::move(opcode), std::move(operand)});
+}
+
+void CILInstructionList::writeLabel(std::string name) {
+  _mInstructions.push_back({std::move(name), "", true});
+}
+
+void CILInstructionList::splitPendingLines() {
+  size_t line_start = 0;
+  size_t line_end;
+  while ((line_end = _mPendingLine.find('\n', line_start)) != std::string::npos) {
+    std::string line = _mPendingLine.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+    if (line.empty())
+      continue;
+
+    size_t space_pos = line.find(' ');
+    if (space_pos == std::string::npos) {
+      // label names never contain spaces, and no opcode ends with a colon.
+      if (line.back() == ':') {
+        line.pop_back();
+        writeLabel(std::move(line));
+      } else {
+        writeInstruction(std::move(line));
+      }
+    } else {
+      writeInstruction(line.substr(0, space_pos), line.substr(space_pos + 1));
+    }
+  }
+  _mPendingLine.erase(0, line_start);
+}
+
+void CILInstructionList::serialize(TextWriter &writer) const {
+  // everything written should have been a complete line
+  assert(_mPendingLine.empty());
+  for (const auto &insn : _mInstructions) {
+    if (insn.dead)
+      continue;
+    if (insn.is_label) {
+      writer << insn.opcode << ":\n";
+    } else if (insn.operand.empty()) {
+      writer << insn.opcode << '\n';
+    } else {
+      writer << insn.opcode << ' ' << insn.operand << '\n';
+    }
+  }
+}
+
+void CILInstructionList::clear() {
+  _mInstructions.clear();
+  _mPendingLine.clear();
+}
+
+}
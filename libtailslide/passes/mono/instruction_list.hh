@@ -0,0 +1,66 @@
+#pragma once
+
+#include <charconv>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../../text_writer.hh"
+
+namespace Tailslide {
+
+struct CILInstruction {
+  /// opcode mnemonic, or the label's name if this is a label
+  std::string opcode;
+  std::string operand {};
+  bool is_label = false;
+  bool dead = false;
+};
+
+/// labels a `switch` can jump to, given its operand as in `(L1, L2, L3)`
+std::vector<std::string> cil_switch_targets(const std::string &operand);
+
+/// Collects the body of a single method as a list of instructions so it can
+/// be inspected and rewritten before being serialized. Code gets written to it
+/// just like a stream of CIL assembly, each line is either an instruction
+/// (opcode and optional operand) or a label definition.
+class CILInstructionList {
+  public:
+    template<typename T>
+    CILInstructionList &operator<<(const T &val) {
+      if constexpr (std::is_convertible_v<const T&, const char*> || std::is_same_v<T, std::string>) {
+        _mPendingLine += val;
+      } else if constexpr (std::is_same_v<T, char>) {
+        _mPendingLine += val;
+      } else if constexpr (std::is_integral_v<T>) {
+        // can't contain a newline, no need to look for complete lines.
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), val);
+        _mPendingLine.append(buf, res.ptr - buf);
+        return *this;
+      } else {
+        std::ostringstream ss;
+        ss << val;
+        _mPendingLine += ss.str();
+      }
+      splitPendingLines();
+      return *this;
+    }
+
+    void writeInstruction(std::string opcode, std::string operand = "");
+    void writeLabel(std::string name);
+    /// write the CIL assembly for all live instructions
+    void serialize(TextWriter &writer) const;
+    void clear();
+
+    std::vector<CILInstruction> &getInstructions() { return _mInstructions; }
+
+  protected:
+    void splitPendingLines();
+
+    std::vector<CILInstruction> _mInstructions {};
+    std::string _mPendingLine {};
+};
+
+}
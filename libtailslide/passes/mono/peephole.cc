@@ -0,0 +1,456 @@
+#include <cctype>
+#include <cstdlib>
+#include <unordered_set>
+
+#include "peephole.hh"
+
+namespace Tailslide {
+
+static bool is_unconditional_branch(const CILInstruction &insn) {
+  return insn.opcode == "br" || insn.opcode == "br.s";
+}
+
+static bool is_conditional_branch(const CILInstruction &insn) {
+  return insn.opcode == "brtrue" || insn.opcode == "brtrue.s"
+      || insn.opcode == "brfalse" || insn.opcode == "brfalse.s";
+}
+
+/// branches comparing the top two values on the stack, like `beq` or `blt`
+static bool is_compare_branch(const CILInstruction &insn) {
+  static const std::unordered_set<std::string> COMPARE_BRANCHES {
+    "beq", "bne.un", "bge", "bgt", "ble", "blt",
+    "beq.s", "bne.un.s", "bge.s", "bgt.s", "ble.s", "blt.s",
+  };
+  return COMPARE_BRANCHES.count(insn.opcode) != 0;
+}
+
+static bool is_branch(const CILInstruction &insn) {
+  return is_unconditional_branch(insn) || is_conditional_branch(insn) || is_compare_branch(insn);
+}
+
+static bool is_short_branch(const CILInstruction &insn) {
+  return insn.opcode.size() > 2 && insn.opcode.compare(insn.opcode.size() - 2, 2, ".s") == 0;
+}
+
+static bool is_brtrue(const CILInstruction &insn) {
+  return insn.opcode == "brtrue" || insn.opcode == "brtrue.s";
+}
+
+/// pushes a value without any side-effects, so it's fine to not push it at all.
+static bool is_pure_push(const CILInstruction &insn) {
+  static const std::unordered_set<std::string> PURE_PUSHES {
+    "dup", "ldnull", "ldstr", "ldc.i4", "ldc.i4.s", "ldc.r4", "ldc.r8",
+    "ldloc", "ldloc.s", "ldloca", "ldloca.s", "ldarg", "ldarg.s", "ldarga", "ldarga.s",
+  };
+  if (PURE_PUSHES.count(insn.opcode))
+    return true;
+  // ldc.i4.0, ldloc.1, ldarg.2 and friends
+  return (insn.opcode.rfind("ldc.i4.", 0) == 0 || insn.opcode.rfind("ldloc.", 0) == 0
+      || insn.opcode.rfind("ldarg.", 0) == 0) && insn.operand.empty();
+}
+
+/// local index referenced by a `base` (ldloc or stloc) instruction in any of its forms, or -1
+static long local_index(const CILInstruction &insn, const std::string &base) {
+  if (insn.opcode.rfind(base, 0) != 0)
+    return -1;
+  std::string suffix = insn.opcode.substr(base.size());
+  if (suffix.empty() || suffix == ".s") {
+    // parameters may be referenced by name instead
+    if (insn.operand.empty() || !isdigit(insn.operand[0]))
+      return -1;
+    return strtol(insn.operand.c_str(), nullptr, 10);
+  }
+  if (suffix.size() == 2 && suffix[0] == '.' && suffix[1] >= '0' && suffix[1] <= '3')
+    return suffix[1] - '0';
+  return -1;
+}
+
+/// whether `a` and `b` are a load and store (or store and load) of the same variable
+static bool same_variable(const CILInstruction &a, const char *a_base, const CILInstruction &b, const char *b_base) {
+  long a_idx = local_index(a, a_base);
+  if (a_idx != -1)
+    return a_idx == local_index(b, b_base);
+  // parameters are only referenced by name
+  return a.opcode == std::string(a_base) + ".s" && b.opcode == std::string(b_base) + ".s"
+      && !a.operand.empty() && a.operand == b.operand;
+}
+
+/// the value pushed by an integer constant load, if `insn` is one
+static bool int_constant_value(const CILInstruction &insn, int32_t &val) {
+  if (insn.opcode == "ldc.i4.m1") {
+    val = -1;
+    return true;
+  }
+  if (insn.opcode == "ldc.i4" || insn.opcode == "ldc.i4.s") {
+    val = (int32_t)strtol(insn.operand.c_str(), nullptr, 10);
+    return true;
+  }
+  if (insn.opcode.size() == 8 && insn.opcode.rfind("ldc.i4.", 0) == 0 && isdigit(insn.opcode[7])) {
+    val = insn.opcode[7] - '0';
+    return true;
+  }
+  return false;
+}
+
+/// encoded size of an instruction in bytes, or -1 if we don't know it
+static int instruction_size(const CILInstruction &insn) {
+  static const std::unordered_set<std::string> ONE_BYTE {
+    "nop", "dup", "pop", "ret", "add", "sub", "mul", "div", "rem", "neg", "not", "and", "or", "xor",
+    "shl", "shr", "conv.r8", "conv.r4", "conv.i4", "ldnull", "throw",
+    "ldarg.0", "ldarg.1", "ldarg.2", "ldarg.3", "ldloc.0", "ldloc.1", "ldloc.2", "ldloc.3",
+    "stloc.0", "stloc.1", "stloc.2", "stloc.3", "ldc.i4.m1", "ldc.i4.0", "ldc.i4.1", "ldc.i4.2",
+    "ldc.i4.3", "ldc.i4.4", "ldc.i4.5", "ldc.i4.6", "ldc.i4.7", "ldc.i4.8",
+  };
+  static const std::unordered_set<std::string> TWO_BYTE {
+    "ceq", "cgt", "clt", "ldloc.s", "stloc.s", "ldloca.s", "ldarg.s", "starg.s", "ldarga.s",
+    "ldc.i4.s", "br.s", "brtrue.s", "brfalse.s",
+    "beq.s", "bne.un.s", "bge.s", "bgt.s", "ble.s", "blt.s",
+  };
+  static const std::unordered_set<std::string> FOUR_BYTE {
+    "ldloc", "stloc", "ldloca", "ldarg", "starg", "ldarga",
+  };
+  static const std::unordered_set<std::string> FIVE_BYTE {
+    "ldc.i4", "ldc.r4", "call", "callvirt", "newobj", "ldfld", "stfld", "ldflda", "ldsfld", "stsfld",
+    "ldstr", "box", "unbox.any", "castclass", "isinst", "br", "brtrue", "brfalse",
+    "beq", "bne.un", "bge", "bgt", "ble", "blt",
+  };
+  if (insn.is_label)
+    return 0;
+  if (ONE_BYTE.count(insn.opcode))
+    return 1;
+  if (TWO_BYTE.count(insn.opcode))
+    return 2;
+  if (FOUR_BYTE.count(insn.opcode))
+    return 4;
+  if (FIVE_BYTE.count(insn.opcode))
+    return 5;
+  if (insn.opcode == "ldc.r8")
+    return 9;
+  if (insn.opcode == "switch")
+    return 5 + 4 * (int)cil_switch_targets(insn.operand).size();
+  return -1;
+}
+
+bool CILPeepholeOptimizer::optimize(CILInstructionList &insns) {
+  _mInsns = &insns.getInstructions();
+  int start_count = mRewriteCount;
+  while (runPass()) {}
+  useShortForms();
+  shortenBranches();
+
+  // actually drop the dead instructions
+  auto &insn_vec = *_mInsns;
+  size_t new_size = 0;
+  for (size_t i = 0; i < insn_vec.size(); ++i) {
+    if (insn_vec[i].dead)
+      continue;
+    if (i != new_size)
+      insn_vec[new_size] = std::move(insn_vec[i]);
+    ++new_size;
+  }
+  insn_vec.resize(new_size);
+  _mInsns = nullptr;
+  return mRewriteCount != start_count;
+}
+
+size_t CILPeepholeOptimizer::nextLive(size_t idx) {
+  while (idx < _mInsns->size() && (*_mInsns)[idx].dead)
+    ++idx;
+  return idx;
+}
+
+size_t CILPeepholeOptimizer::nextExecuted(size_t idx) {
+  while (idx < _mInsns->size() && ((*_mInsns)[idx].dead || (*_mInsns)[idx].is_label))
+    ++idx;
+  return idx;
+}
+
+bool CILPeepholeOptimizer::fusedWithNext(size_t idx) {
+  size_t next_idx = nextLive(idx + 1);
+  return next_idx < _mInsns->size() && !(*_mInsns)[next_idx].is_label;
+}
+
+void CILPeepholeOptimizer::kill(size_t idx) {
+  auto &insn = (*_mInsns)[idx];
+  if (is_branch(insn)) {
+    --_mLabelRefs[insn.operand];
+  } else if (insn.opcode == "switch") {
+    for (const auto &target : cil_switch_targets(insn.operand))
+      --_mLabelRefs[target];
+  }
+  insn.dead = true;
+  ++mRewriteCount;
+}
+
+void CILPeepholeOptimizer::retarget(CILInstruction &insn, const std::string &label) {
+  --_mLabelRefs[insn.operand];
+  ++_mLabelRefs[label];
+  insn.operand = label;
+  ++mRewriteCount;
+}
+
+void CILPeepholeOptimizer::countLabelRefs() {
+  _mLabelRefs.clear();
+  _mLabelIndices.clear();
+  for (size_t i = 0; i < _mInsns->size(); ++i) {
+    auto &insn = (*_mInsns)[i];
+    if (insn.dead)
+      continue;
+    if (insn.is_label) {
+      _mLabelIndices[insn.opcode] = i;
+      _mLabelRefs.insert({insn.opcode, 0});
+    } else if (is_branch(insn)) {
+      ++_mLabelRefs[insn.operand];
+    } else if (insn.opcode == "switch") {
+      for (const auto &target : cil_switch_targets(insn.operand))
+        ++_mLabelRefs[target];
+    }
+  }
+}
+
+bool CILPeepholeOptimizer::runPass() {
+  auto &insns = *_mInsns;
+  const size_t num_insns = insns.size();
+  int start_count = mRewriteCount;
+
+  countLabelRefs();
+  // labels nothing jumps to only get in the way of the other rules
+  for (auto &insn : insns) {
+    if (!insn.dead && insn.is_label && !_mLabelRefs[insn.opcode]) {
+      insn.dead = true;
+      ++mRewriteCount;
+    }
+  }
+
+  if (threadBranches())
+    return true;
+
+  for (size_t i = nextExecuted(0); i < num_insns; i = nextExecuted(i + 1)) {
+    auto &insn = insns[i];
+    if (insn.dead)
+      continue;
+
+    if (is_unconditional_branch(insn) || insn.opcode == "ret") {
+      // nothing can reach the code following an unconditional transfer until the next label
+      for (size_t j = nextLive(i + 1); j < num_insns && !insns[j].is_label; j = nextLive(j + 1))
+        kill(j);
+    }
+
+    // compare branches would need to pop both operands, leave them be.
+    if (is_unconditional_branch(insn) || is_conditional_branch(insn)) {
+      // is the branch target between us and the instruction we'd fall through to?
+      bool branches_to_next = false;
+      for (size_t j = nextLive(i + 1); j < num_insns && insns[j].is_label; j = nextLive(j + 1)) {
+        if (insns[j].opcode == insn.operand) {
+          branches_to_next = true;
+          break;
+        }
+      }
+      if (branches_to_next) {
+        if (is_unconditional_branch(insn)) {
+          kill(i);
+        } else {
+          // still need to get rid of the condition
+          --_mLabelRefs[insn.operand];
+          insn.opcode = "pop";
+          insn.operand.clear();
+          ++mRewriteCount;
+        }
+        continue;
+      }
+    }
+
+    if (!fusedWithNext(i))
+      continue;
+    const size_t next_idx = nextLive(i + 1);
+    auto &next = insns[next_idx];
+    const bool next_fused = fusedWithNext(next_idx);
+    const size_t third_idx = nextLive(next_idx + 1);
+    CILInstruction *third = next_fused ? &insns[third_idx] : nullptr;
+
+    // `dup; stloc.s 1; pop` -> `stloc.s 1`
+    if (insn.opcode == "dup" && third && third->opcode == "pop"
+        && (local_index(next, "stloc") != -1 || next.opcode == "starg.s")) {
+      kill(i);
+      kill(third_idx);
+      continue;
+    }
+
+    // `brtrue L1; br L2; L1:` -> `brfalse L2; L1:`
+    if (is_conditional_branch(insn) && is_unconditional_branch(next)) {
+      bool skips_next = false;
+      for (size_t j = nextLive(next_idx + 1); j < num_insns && insns[j].is_label; j = nextLive(j + 1)) {
+        if (insns[j].opcode == insn.operand) {
+          skips_next = true;
+          break;
+        }
+      }
+      if (skips_next) {
+        insn.opcode = is_brtrue(insn) ? "brfalse" : "brtrue";
+        retarget(insn, next.operand);
+        kill(next_idx);
+        continue;
+      }
+    }
+
+    // loading a field from `this` only to pop it
+    if (insn.opcode == "ldarg.0" && next.opcode == "ldfld" && third && third->opcode == "pop") {
+      kill(i);
+      kill(next_idx);
+      kill(third_idx);
+      continue;
+    }
+
+    // pushing something only to immediately pop it
+    if (is_pure_push(insn) && next.opcode == "pop") {
+      kill(i);
+      kill(next_idx);
+      continue;
+    }
+
+    // storing a variable's value right back into it
+    if (same_variable(insn, "ldloc", next, "stloc") || same_variable(insn, "ldarg", next, "starg")) {
+      kill(i);
+      kill(next_idx);
+      continue;
+    }
+
+    // reloading what we just stored, `stloc.s 1; ldloc.s 1` -> `dup; stloc.s 1`
+    if (same_variable(insn, "stloc", next, "ldloc") || same_variable(insn, "starg", next, "ldarg")) {
+      next = insn;
+      insn = CILInstruction {"dup"};
+      ++mRewriteCount;
+      continue;
+    }
+
+    // branching on a constant condition
+    int32_t const_val;
+    if (is_conditional_branch(next) && int_constant_value(insn, const_val)) {
+      if (is_brtrue(next) == (const_val != 0)) {
+        insn = CILInstruction {"br", next.operand};
+        ++_mLabelRefs[next.operand];
+        ++mRewriteCount;
+      } else {
+        kill(i);
+      }
+      kill(next_idx);
+      continue;
+    }
+
+    // `ldc.i4.0; ceq; brfalse L` -> `brtrue L`
+    if (int_constant_value(insn, const_val) && const_val == 0 && next.opcode == "ceq"
+        && third && is_conditional_branch(*third)) {
+      third->opcode = is_brtrue(*third) ? "brfalse" : "brtrue";
+      kill(i);
+      kill(next_idx);
+      continue;
+    }
+  }
+  return mRewriteCount != start_count;
+}
+
+bool CILPeepholeOptimizer::threadBranches() {
+  auto &insns = *_mInsns;
+  const size_t num_insns = insns.size();
+  bool changed = false;
+  for (auto &insn : insns) {
+    if (insn.dead || !is_branch(insn))
+      continue;
+
+    std::string target = insn.operand;
+    for (size_t hops = 0; hops < num_insns; ++hops) {
+      auto label_iter = _mLabelIndices.find(target);
+      if (label_iter == _mLabelIndices.end())
+        break;
+      size_t landing_idx = nextExecuted(label_iter->second);
+      if (landing_idx >= num_insns)
+        break;
+      auto &landing = insns[landing_idx];
+      // unconditional branches landing on a return may as well return
+      if (landing.opcode == "ret" && is_unconditional_branch(insn)) {
+        --_mLabelRefs[insn.operand];
+        insn.opcode = "ret";
+        insn.operand.clear();
+        ++mRewriteCount;
+        changed = true;
+        break;
+      }
+      if (!is_unconditional_branch(landing) || landing.operand == target)
+        break;
+      target = landing.operand;
+    }
+    if (is_branch(insn) && target != insn.operand) {
+      retarget(insn, target);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+void CILPeepholeOptimizer::useShortForms() {
+  for (auto &insn : *_mInsns) {
+    if (insn.dead)
+      continue;
+    for (const char *base : {"ldloc", "stloc"}) {
+      long idx = local_index(insn, base);
+      if (idx == -1 || insn.operand.empty())
+        continue;
+      if (idx <= 3) {
+        insn.opcode = std::string(base) + "." + std::to_string(idx);
+        insn.operand.clear();
+        ++mRewriteCount;
+      } else if (idx > 255 && insn.opcode != base) {
+        // doesn't fit in the short form's operand
+        insn.opcode = base;
+        ++mRewriteCount;
+      }
+    }
+  }
+}
+
+bool CILPeepholeOptimizer::shortenBranches() {
+  auto &insns = *_mInsns;
+  bool changed = false;
+  // shortening one branch can only bring other branches' targets closer,
+  // so keep going until nothing else will fit in a short branch.
+  bool shortened;
+  do {
+    shortened = false;
+    std::unordered_map<std::string, long> label_positions;
+    std::vector<long> positions(insns.size(), 0);
+    long pos = 0;
+    for (size_t i = 0; i < insns.size(); ++i) {
+      auto &insn = insns[i];
+      if (insn.dead)
+        continue;
+      int size = instruction_size(insn);
+      // can't know the distance of any branch if we can't size everything.
+      if (size == -1)
+        return changed;
+      if (insn.is_label)
+        label_positions[insn.opcode] = pos;
+      pos += size;
+      positions[i] = pos;
+    }
+
+    for (size_t i = 0; i < insns.size(); ++i) {
+      auto &insn = insns[i];
+      if (insn.dead || !is_branch(insn) || is_short_branch(insn))
+        continue;
+      auto label_iter = label_positions.find(insn.operand);
+      if (label_iter == label_positions.end())
+        continue;
+      // relative to the end of the instruction. Shortening only ever moves backward
+      // targets closer, so this is conservative.
+      long offset = label_iter->second - positions[i];
+      if (offset >= -128 && offset <= 127) {
+        insn.opcode += ".s";
+        ++mRewriteCount;
+        shortened = changed = true;
+      }
+    }
+  } while (shortened);
+  return changed;
+}
+
+}
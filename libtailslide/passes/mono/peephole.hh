@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "instruction_list.hh"
+
+namespace Tailslide {
+
+/// Rewrites a single method's instruction list into smaller, equivalent code.
+/// The result won't match what LL's compiler would have generated.
+class CILPeepholeOptimizer {
+  public:
+    /// returns whether anything was rewritten
+    bool optimize(CILInstructionList &insns);
+
+    int mRewriteCount = 0;
+
+  protected:
+    bool runPass();
+    bool threadBranches();
+    bool shortenBranches();
+    void useShortForms();
+
+    size_t nextLive(size_t idx);
+    /// next live instruction that isn't a label, so execution can fall through to it
+    size_t nextExecuted(size_t idx);
+    /// whether the live instruction after `idx` can only be reached by falling through from `idx`
+    bool fusedWithNext(size_t idx);
+    void kill(size_t idx);
+    void retarget(CILInstruction &insn, const std::string &label);
+    void countLabelRefs();
+
+    std::vector<CILInstruction> *_mInsns = nullptr;
+    std::unordered_map<std::string, size_t> _mLabelIndices {};
+    std::unordered_map<std::string, int> _mLabelRefs {};
+};
+
+}
@@ -5,8 +5,7 @@ namespace Tailslide {
 
 bool MonoResourceVisitor::visit(LSLGlobalFunction *glob_func) {
   auto *sym = glob_func->getSymbol();
-  auto *func_sym_data = getSymbolData(sym);
-  _mCurrentFunc = func_sym_data;
+  beginFunction(getSymbolData(sym), sym);
   // pick up local declarations
   visitChildren(glob_func);
   _mCurrentFunc = nullptr;
@@ -15,8 +14,7 @@ bool MonoResourceVisitor::visit(LSLGlobalFunction *glob_func) {
 
 bool MonoResourceVisitor::visit(LSLEventHandler *handler) {
   auto *sym = handler->getSymbol();
-  auto *handler_sym_data = getSymbolData(sym);
-  _mCurrentFunc = handler_sym_data;
+  beginFunction(getSymbolData(sym), sym);
   // pick up local declarations
   visitChildren(handler);
   _mCurrentFunc = nullptr;
@@ -26,11 +24,48 @@ bool MonoResourceVisitor::visit(LSLEventHandler *handler) {
 bool MonoResourceVisitor::visit(LSLDeclaration *decl_stmt) {
   auto *sym = decl_stmt->getSymbol();
   auto *sym_data = getSymbolData(sym);
+  auto itype = sym->getIType();
+
+  if (_mReuseSlotsInFunc) {
+    // Without any jumps, control can never reach a local without passing the
+    // declaration that stores to its slot.
+    // Slots are typed in CIL, so only a local of the exact same type can take one over.
+    for (auto slot_iter = _mFreeSlots.begin(); slot_iter != _mFreeSlots.end(); ++slot_iter) {
+      if (_mCurrentFunc->locals[*slot_iter] != itype)
+        continue;
+      sym_data->index = *slot_iter;
+      _mLiveSlots.push_back(*slot_iter);
+      _mFreeSlots.erase(slot_iter);
+      return true;
+    }
+  }
+
   sym_data->index = (uint32_t)_mCurrentFunc->locals.size();
-  _mCurrentFunc->locals.push_back(sym->getIType());
+  _mCurrentFunc->locals.push_back(itype);
+  _mLiveSlots.push_back(sym_data->index);
   return true;
 }
 
+bool MonoResourceVisitor::visit(LSLCompoundStatement *compound_stmt) {
+  if (!_mReuseSlotsInFunc)
+    return true;
+  auto scope_start = _mLiveSlots.size();
+  visitChildren(compound_stmt);
+  // locals declared in this scope are dead now, their slots are up for grabs.
+  _mFreeSlots.insert(_mFreeSlots.end(), _mLiveSlots.begin() + (long)scope_start, _mLiveSlots.end());
+  _mLiveSlots.resize(scope_start);
+  return false;
+}
+
+void MonoResourceVisitor::beginFunction(MonoSymbolData *func_sym_data, LSLSymbol *func_sym) {
+  _mCurrentFunc = func_sym_data;
+  // jumping past a declaration would leave its local holding whatever an earlier
+  // scope stored in the shared slot, rather than the default value.
+  _mReuseSlotsInFunc = _mReuseLocalSlots && !func_sym->getHasJumps();
+  _mLiveSlots.clear();
+  _mFreeSlots.clear();
+}
+
 MonoSymbolData *MonoResourceVisitor::getSymbolData(LSLSymbol *sym) {
   auto sym_iter = _mSymData->find(sym);
   if (sym_iter != _mSymData->end())
@@ -19,19 +19,29 @@ typedef std::map<Tailslide::LSLSymbol *, MonoSymbolData> MonoSymbolDataMap;
 // and what order to place them in.
 class MonoResourceVisitor : public ASTVisitor {
   public:
-    explicit MonoResourceVisitor(MonoSymbolDataMap *sym_data) : _mSymData(sym_data) {}
+    explicit MonoResourceVisitor(MonoSymbolDataMap *sym_data, bool reuse_local_slots=false)
+      : _mSymData(sym_data), _mReuseLocalSlots(reuse_local_slots) {}
 
   protected:
     bool visit(Tailslide::LSLGlobalFunction *glob_func) override;
     bool visit(Tailslide::LSLEventHandler *handler) override;
     bool visit(Tailslide::LSLDeclaration *decl_stmt) override;
+    bool visit(Tailslide::LSLCompoundStatement *compound_stmt) override;
     // not relevant
     bool visit(Tailslide::LSLExpression *expr) override { return false; };
 
     MonoSymbolData *getSymbolData(Tailslide::LSLSymbol *sym);
+    void beginFunction(MonoSymbolData *func_sym_data, Tailslide::LSLSymbol *func_sym);
 
     MonoSymbolData *_mCurrentFunc = nullptr;
     MonoSymbolDataMap *_mSymData = nullptr;
+    bool _mReuseLocalSlots;
+    // whether the current function is simple enough to reuse slots in
+    bool _mReuseSlotsInFunc = false;
+    // indices of locals whose scope we're currently in
+    std::vector<uint32_t> _mLiveSlots {};
+    // indices of locals whose scope has ended, which may be handed out again
+    std::vector<uint32_t> _mFreeSlots {};
 };
 
 }
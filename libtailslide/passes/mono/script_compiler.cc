@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <map>
+#include <set>
+
 #include "script_compiler.hh"
+#include "peephole.hh"
 #include "../desugaring.hh"
 
 namespace Tailslide {
@@ -6,6 +11,13 @@ namespace Tailslide {
 static const char *CIL_USERSCRIPT_CLASS = "class [LslUserScript]LindenLab.SecondLife.LslUserScript";
 static const char *CIL_LSL_RUNTIME_CLASS = "class [LslLibrary]LindenLab.SecondLife.LslRunTime";
 static const char *CIL_LSL_LIBRARY_CLASS = "class [LslLibrary]LindenLab.SecondLife.Library";
+/// assemblies the script class refers to, and the versions it expects
+static const std::pair<const char *, std::array<uint16_t, 4>> CIL_ASSEMBLY_REFS[] = {
+    {"mscorlib", {1, 0, 5000, 0}},
+    {"LslLibrary", {0, 1, 0, 0}},
+    {"LslUserScript", {0, 1, 0, 0}},
+    {"ScriptTypes", {0, 1, 0, 0}},
+};
 static const std::string CIL_LIST_INITIALIZER = std::string("call ") + CIL_TYPE_NAMES[LST_LIST] + " " + CIL_USERSCRIPT_CLASS + "::CreateList()";
 
 /// LSL name -> CIL name
@@ -56,74 +68,115 @@ static std::unordered_map<std::string, std::string> CIL_HANDLER_NAMES {
 /// of the output of LL's lscript LSL->CIL compiler circa 2009 (when public
 /// lscript source had its last functional update.)
 bool MonoScriptCompiler::visit(LSLScript *script) {
-  LLConformantDeSugaringVisitor de_sugaring_visitor(_mAllocator, true);
-  script->visit(&de_sugaring_visitor);
-
-  MonoResourceVisitor resource_visitor(&_mSymData);
-  script->visit(&resource_visitor);
+  ScopedPassTimer timer(script->mContext, "mono_compile");
+  // work on a lowered copy so the caller's tree is left as-is, unless they don't need it
+  {
+    TraceScope trace("lower", "mono");
+    script = lower_script(script, _mAllocator, true, _mOptions.lower_in_place);
+    MonoResourceVisitor resource_visitor(&_mSymData, _mOptions.reuse_local_slots);
+    script->visit(&resource_visitor);
+  }
   _mScriptClassName = "LSL_00000000_0000_0000_0000_000000000000";
 
-  mCIL << ".assembly extern mscorlib {.ver 1:0:5000:0}\n"
-          ".assembly extern LslLibrary {.ver 0:1:0:0}\n"
-          ".assembly extern LslUserScript {.ver 0:1:0:0}\n"
-          ".assembly extern ScriptTypes {.ver 0:1:0:0}\n"
-          ".assembly '" << _mScriptClassName << "' {.ver 0:0:0:0}\n"
+  for (const auto &assembly_ref : CIL_ASSEMBLY_REFS) {
+    const auto &ver = assembly_ref.second;
+    mCIL << ".assembly extern " << assembly_ref.first
+         << " {.ver " << ver[0] << ':' << ver[1] << ':' << ver[2] << ':' << ver[3] << "}\n";
+    if (_mOptions.emit_assembly)
+      _mAssembly.addAssemblyRef(assembly_ref.first, ver);
+  }
+  if (_mOptions.emit_assembly)
+    _mAssembly.setClass(_mScriptClassName, CIL_USERSCRIPT_CLASS);
+  mCIL << ".assembly '" << _mScriptClassName << "' {.ver 0:0:0:0}\n"
           ".class public auto ansi serializable beforefieldinit " << _mScriptClassName << " extends " << CIL_USERSCRIPT_CLASS << "\n"
           "{\n";
 
-  // declare the global variables first
-  auto *globals = script->getGlobals();
-  for (auto *global : *globals) {
-    if (global->getNodeType() != NODE_GLOBAL_VARIABLE)
-      continue;
-    auto *id = ((LSLGlobalVariable *) global)->getIdentifier();
-    mCIL << ".field public " << CIL_TYPE_NAMES[id->getIType()] << " '" << id->getName() << "'\n";
-  }
+  {
+    TraceScope trace("globals", "mono");
+    // declare the global variables first
+    auto *globals = script->getGlobals();
+    for (auto *global : *globals) {
+      if (global->getNodeType() != NODE_GLOBAL_VARIABLE)
+        continue;
+      auto *id = ((LSLGlobalVariable *) global)->getIdentifier();
+      mCIL << ".field public " << CIL_TYPE_NAMES[id->getIType()] << " '" << id->getName() << "'\n";
+      if (_mOptions.emit_assembly)
+        _mAssembly.addField(CIL_TYPE_NAMES[id->getIType()], id->getName());
+    }
+    if (_mOptions.cache_constant_lists)
+      cacheConstantLists(script);
+
+    // now define the globals' values in the ctor for the script
+    mCIL << ".method public hidebysig specialname rtspecialname instance default void .ctor () cil managed\n"
+            "{\n";
+    _mMethod = {".ctor", "void"};
+    _mMethod.is_ctor = true;
+
+    _mInGlobalExpr = true;
+    for (auto *global: *globals) {
+      if (global->getNodeType() != NODE_GLOBAL_VARIABLE)
+        continue;
+      global->visit(this);
+    }
+    _mInGlobalExpr = false;
 
-  // now define the globals' values in the ctor for the script
-  mCIL << ".method public hidebysig specialname rtspecialname instance default void .ctor () cil managed\n"
-          "{\n"
-          ".maxstack 500\n";
+    for (auto &cached : _mCachedListFields) {
+      _mBody << "ldarg.0\n";
+      buildList(cached.second, true);
+      _mBody << "stfld " << cached.first << "\n";
+    }
 
-  _mInGlobalExpr = true;
-  for (auto *global: *globals) {
-    if (global->getNodeType() != NODE_GLOBAL_VARIABLE)
-      continue;
-    global->visit(this);
+    // call the base constructor for the script class and return
+    _mBody << "ldarg.0\n"
+            "call instance void " << CIL_USERSCRIPT_CLASS << "::.ctor()\n"
+            "ret\n";
+    writeMethodBody();
+    mCIL << "}\n";
   }
-  _mInGlobalExpr = false;
-
-  // call the base constructor for the script class and return
-  mCIL << "ldarg.0\n"
-          "call instance void " << CIL_USERSCRIPT_CLASS << "::.ctor()\n"
-          "ret\n"
-          "}\n";
 
   // now go over the globals _again_ to pick up all the functions
-  for (auto *global : *globals) {
-    if (global->getNodeType() != NODE_GLOBAL_FUNCTION)
-      continue;
-    global->visit(this);
+  {
+    TraceScope trace("functions", "mono");
+    for (auto *global : *script->getGlobals()) {
+      if (global->getNodeType() != NODE_GLOBAL_FUNCTION)
+        continue;
+      // the CIL is only partly written if we stop here, but the error says why.
+      if (script->mContext->overBudget(global->getLoc()))
+        return false;
+      global->visit(this);
+    }
   }
 
   // now look at the event handlers
-  script->getStates()->visit(this);
+  {
+    TraceScope trace("states", "mono");
+    for (auto *state : *script->getStates()) {
+      if (script->mContext->overBudget(state->getLoc()))
+        return false;
+      state->visit(this);
+    }
+  }
 
   mCIL << "}\n";
 
+  if (_mOptions.emit_assembly) {
+    TraceScope trace("assembly", "mono");
+    _mAssembly.write(mAssemblyBS);
+  }
+
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLGlobalVariable *glob_var) {
   // push a reference to `this` for the later stfld
-  mCIL << "ldarg.0\n";
+  _mBody << "ldarg.0\n";
   auto *sym = glob_var->getSymbol();
   if (auto *initializer = glob_var->getInitializer()) {
     initializer->visit(this);
   } else {
     pushConstant(sym->getType()->getDefaultValue());
   }
-  mCIL << "stfld " << getGlobalVarSpecifier(sym) << "\n";
+  _mBody << "stfld " << getGlobalVarSpecifier(sym) << "\n";
   return false;
 }
 
@@ -134,17 +187,17 @@ void MonoScriptCompiler::pushLValueContainer(LSLLValueExpression *lvalue) {
   if (sym->getSubType() == SYM_GLOBAL) {
     // push a reference to `this` since this is an attribute of the class
     // and we'll need to `ldfld`
-    mCIL << "ldarg.0\n";
+    _mBody << "ldarg.0\n";
   }
   // have an accessor, we need to push the containing object's address!
   if (lvalue->getMember()) {
     if (sym->getSubType() == SYM_GLOBAL) {
-      mCIL << "ldflda " << getGlobalVarSpecifier(sym) << "\n";
+      _mBody << "ldflda " << getGlobalVarSpecifier(sym) << "\n";
     } else if (sym->getSubType() == SYM_LOCAL) {
-      mCIL << "ldloca.s " << _mSymData[sym].index << "\n";
+      _mBody << "ldloca.s " << _mSymData[sym].index << "\n";
     } else {
       // event or function param
-      mCIL << "ldarga.s '" << sym->getName() << "'\n";
+      _mBody << "ldarga.s '" << sym->getName() << "'\n";
     }
   }
 }
@@ -156,19 +209,19 @@ void MonoScriptCompiler::pushLValue(LSLLValueExpression *lvalue) {
   if (lvalue->getMember()) {
     // accessor case, containing object is already on the stack and
     // we just have to load the field.
-    mCIL << "ldfld " << getLValueAccessorSpecifier(lvalue) << "\n";
+    _mBody << "ldfld " << getLValueAccessorSpecifier(lvalue) << "\n";
   } else {
     if (sym->getSubType() == SYM_GLOBAL) {
       // LslUserScript `this` should already on the stack, load the given field from `this`.
-      mCIL << "ldfld " << getGlobalVarSpecifier(sym) << "\n";
+      _mBody << "ldfld " << getGlobalVarSpecifier(sym) << "\n";
     } else if (sym->getSubType() == SYM_LOCAL) {
       // must be a local, reference by index
       // Seems that UThreadInjector may rewrite these to ldloc.0, ldloc.1, ...
       // but we aren't aiming for conformance with its output, only lscript's.
-      mCIL << "ldloc.s " << _mSymData[sym].index << "\n";
+      _mBody << "ldloc.s " << _mSymData[sym].index << "\n";
     } else {
       // event or function param
-      mCIL << "ldarg.s '" << sym->getName() << "'\n";
+      _mBody << "ldarg.s '" << sym->getName() << "'\n";
     }
   }
 }
@@ -177,36 +230,25 @@ void MonoScriptCompiler::pushConstant(LSLConstant *cv) {
   if (!cv)
     return;
   switch(cv->getIType()) {
-    case LST_INTEGER: {
-      auto int_val = ((LSLIntegerConstant *) cv)->getValue();
-      // These values have a single-byte push form
-      if (int_val >= 0 && int_val <= 8)
-        mCIL << "ldc.i4." << int_val << '\n';
-      else if (int_val == -1)
-        mCIL << "ldc.i4.m1\n";
-      // can use the single-byte operand version of ldc.i4
-      else if (int_val >= -128 && int_val <= 127)
-        mCIL << "ldc.i4.s " << int_val << '\n';
-      else
-        mCIL << "ldc.i4 " << int_val << "\n";
+    case LST_INTEGER:
+      pushIntegerLiteral(((LSLIntegerConstant *) cv)->getValue());
       return;
-    }
     case LST_FLOATINGPOINT:
       pushFloatLiteral(((LSLFloatConstant *) cv)->getValue());
       return;
     case LST_STRING:
-      mCIL << "ldstr \"" << escape_string(((LSLStringConstant *) cv)->getValue()) << "\"\n";
+      _mBody << "ldstr \"" << escape_string(((LSLStringConstant *) cv)->getValue()) << "\"\n";
       return;
     case LST_KEY:
-      mCIL << "ldstr \"" << escape_string(((LSLKeyConstant *) cv)->getValue()) << "\"\n";
-      mCIL << "call " << CIL_TYPE_NAMES[LST_KEY] << " " << CIL_USERSCRIPT_CLASS << "::'CreateKey'(string)\n";
+      _mBody << "ldstr \"" << escape_string(((LSLKeyConstant *) cv)->getValue()) << "\"\n";
+      _mBody << "call " << CIL_TYPE_NAMES[LST_KEY] << " " << CIL_USERSCRIPT_CLASS << "::'CreateKey'(string)\n";
       return;
     case LST_VECTOR: {
       auto *vec_val = ((LSLVectorConstant *) cv)->getValue();
       pushFloatLiteral(vec_val->x);
       pushFloatLiteral(vec_val->y);
       pushFloatLiteral(vec_val->z);
-      mCIL << "call " << CIL_TYPE_NAMES[LST_VECTOR] << " " << CIL_USERSCRIPT_CLASS << "::'CreateVector'(float32, float32, float32)\n";
+      _mBody << "call " << CIL_TYPE_NAMES[LST_VECTOR] << " " << CIL_USERSCRIPT_CLASS << "::'CreateVector'(float32, float32, float32)\n";
       return;
     }
     case LST_QUATERNION: {
@@ -215,13 +257,13 @@ void MonoScriptCompiler::pushConstant(LSLConstant *cv) {
       pushFloatLiteral(vec_val->y);
       pushFloatLiteral(vec_val->z);
       pushFloatLiteral(vec_val->s);
-      mCIL << "call " << CIL_TYPE_NAMES[LST_QUATERNION] << " " << CIL_USERSCRIPT_CLASS << "::'CreateQuaternion'(float32, float32, float32, float32)\n";
+      _mBody << "call " << CIL_TYPE_NAMES[LST_QUATERNION] << " " << CIL_USERSCRIPT_CLASS << "::'CreateQuaternion'(float32, float32, float32, float32)\n";
       return;
     }
     case LST_LIST: {
       // only know how to write the default empty list as a constant
       assert(!((LSLListConstant *) cv)->getLength());
-      mCIL << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::CreateList()\n";
+      _mBody << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::CreateList()\n";
       return;
     }
     default:
@@ -229,6 +271,20 @@ void MonoScriptCompiler::pushConstant(LSLConstant *cv) {
   }
 }
 
+/// push an integer constant using the shortest ldc.i4 form that can hold it
+void MonoScriptCompiler::pushIntegerLiteral(int32_t int_val) {
+  // These values have a single-byte push form
+  if (int_val >= 0 && int_val <= 8)
+    _mBody << "ldc.i4." << int_val << '\n';
+  else if (int_val == -1)
+    _mBody << "ldc.i4.m1\n";
+  // can use the single-byte operand version of ldc.i4
+  else if (int_val >= -128 && int_val <= 127)
+    _mBody << "ldc.i4.s " << int_val << '\n';
+  else
+    _mBody << "ldc.i4 " << int_val << "\n";
+}
+
 /// used for a number of cases, including pushing float constants and vec/quat components
 void MonoScriptCompiler::pushFloatLiteral(double value) {
   // pushed as a double for some reason
@@ -245,14 +301,14 @@ void MonoScriptCompiler::pushFloatLiteral(double value) {
       "%02x %02x %02x %02x %02x %02x %02x %02x",
       b_val[0], b_val[1], b_val[2], b_val[3], b_val[4], b_val[5], b_val[6], b_val[7]
   );
-  mCIL << "ldc.r8 (" << (const char*)&s_val << ")\n";
+  _mBody << "ldc.r8 (" << (const char*)&s_val << ")\n";
 }
 
 void MonoScriptCompiler::storeToLValue(LSLLValueExpression *lvalue, bool push_result) {
   auto *sym = lvalue->getSymbol();
   // coordinate accessor case
   if (lvalue->getMember()) {
-    mCIL << "stfld " << getLValueAccessorSpecifier(lvalue) << "\n";
+    _mBody << "stfld " << getLValueAccessorSpecifier(lvalue) << "\n";
     // Expression assignments need to return their result, load what we just stored onto the stack
     // TODO: This seems really wasteful in many cases, but this is how LL's compiler does it.
     //  I guess `dup` isn't an option because of the `this` reference, but wouldn't creating a
@@ -260,7 +316,7 @@ void MonoScriptCompiler::storeToLValue(LSLLValueExpression *lvalue, bool push_re
     if (push_result)
       pushLValue(lvalue);
   } else if (sym->getSubType() == SYM_GLOBAL) {
-    mCIL << "stfld " << getGlobalVarSpecifier(lvalue->getSymbol()) << "\n";
+    _mBody << "stfld " << getGlobalVarSpecifier(lvalue->getSymbol()) << "\n";
     // same caveat as above
     if (push_result)
       pushLValue(lvalue);
@@ -268,13 +324,13 @@ void MonoScriptCompiler::storeToLValue(LSLLValueExpression *lvalue, bool push_re
     // We can avoid reloading the lvalue from its storage container in these cases by just duplicating
     // the result of the expression on the stack. All we need on the stack for these stores is the value.
     if (push_result)
-      mCIL << "dup\n";
+      _mBody << "dup\n";
 
     if (sym->getSubType() == SYM_LOCAL) {
-      mCIL << "stloc.s " << _mSymData[sym].index << "\n";
+      _mBody << "stloc.s " << _mSymData[sym].index << "\n";
     } else {
       // event or function param
-      mCIL << "starg.s '" << sym->getName() << "'\n";
+      _mBody << "starg.s '" << sym->getName() << "'\n";
     }
   }
 }
@@ -287,10 +343,10 @@ void MonoScriptCompiler::castTopOfStack(LSLIType from_type, LSLIType to_type) {
     case LST_INTEGER:
       switch(from_type) {
         case LST_FLOATINGPOINT:
-          mCIL << "call int32 " << CIL_LSL_RUNTIME_CLASS << "::ToInteger(float32)\n";
+          _mBody << "call int32 " << CIL_LSL_RUNTIME_CLASS << "::ToInteger(float32)\n";
           return;
         case LST_STRING:
-          mCIL << "call int32 " << CIL_LSL_RUNTIME_CLASS << "::StringToInt(string)\n";
+          _mBody << "call int32 " << CIL_LSL_RUNTIME_CLASS << "::StringToInt(string)\n";
           return;
         default:
           assert(0);
@@ -298,10 +354,10 @@ void MonoScriptCompiler::castTopOfStack(LSLIType from_type, LSLIType to_type) {
     case LST_FLOATINGPOINT:
       switch(from_type) {
         case LST_INTEGER:
-          mCIL << "conv.r8\n";
+          _mBody << "conv.r8\n";
           return;
         case LST_STRING:
-          mCIL << "call float32 " << CIL_LSL_RUNTIME_CLASS << "::StringToFloat(string)\n";
+          _mBody << "call float32 " << CIL_LSL_RUNTIME_CLASS << "::StringToFloat(string)\n";
           return;
         default:
           assert(0);
@@ -309,34 +365,34 @@ void MonoScriptCompiler::castTopOfStack(LSLIType from_type, LSLIType to_type) {
     case LST_STRING:
       switch (from_type) {
         case LST_LIST:
-          mCIL << "call string " << CIL_LSL_RUNTIME_CLASS << "::ListToString(" << CIL_TYPE_NAMES[LST_LIST] << ")\n";
+          _mBody << "call string " << CIL_LSL_RUNTIME_CLASS << "::ListToString(" << CIL_TYPE_NAMES[LST_LIST] << ")\n";
           return;
         case LST_INTEGER:
-          mCIL << "call string class [mscorlib]System.Convert::ToString(" << CIL_TYPE_NAMES[LST_INTEGER] << ")\n";
+          _mBody << "call string class [mscorlib]System.Convert::ToString(" << CIL_TYPE_NAMES[LST_INTEGER] << ")\n";
           return;
         case LST_FLOATINGPOINT:
-          mCIL << "call string " << CIL_LSL_RUNTIME_CLASS << "::'ToString'(" << CIL_TYPE_NAMES[from_type] << ")\n";
+          _mBody << "call string " << CIL_LSL_RUNTIME_CLASS << "::'ToString'(" << CIL_TYPE_NAMES[from_type] << ")\n";
           return;
         default:
-          mCIL << "call string " << CIL_USERSCRIPT_CLASS << "::'ToString'(" << CIL_VALUE_TYPE_NAMES[from_type] << ")\n";
+          _mBody << "call string " << CIL_USERSCRIPT_CLASS << "::'ToString'(" << CIL_VALUE_TYPE_NAMES[from_type] << ")\n";
           return;
       }
     case LST_KEY:
       if (from_type == LST_STRING)
-        mCIL << "call " << CIL_TYPE_NAMES[LST_KEY] << " " << CIL_USERSCRIPT_CLASS << "::'CreateKey'(string)\n";
+        _mBody << "call " << CIL_TYPE_NAMES[LST_KEY] << " " << CIL_USERSCRIPT_CLASS << "::'CreateKey'(string)\n";
       return;
     case LST_VECTOR:
       if (from_type == LST_STRING)
-        mCIL << "call " << CIL_TYPE_NAMES[LST_VECTOR] << " " << CIL_USERSCRIPT_CLASS << "::'ParseVector'(string)\n";
+        _mBody << "call " << CIL_TYPE_NAMES[LST_VECTOR] << " " << CIL_USERSCRIPT_CLASS << "::'ParseVector'(string)\n";
       return;
     case LST_QUATERNION:
       if (from_type == LST_STRING)
-        mCIL << "call " << CIL_TYPE_NAMES[LST_QUATERNION] << " " << CIL_USERSCRIPT_CLASS << "::'ParseQuaternion'(string)\n";
+        _mBody << "call " << CIL_TYPE_NAMES[LST_QUATERNION] << " " << CIL_USERSCRIPT_CLASS << "::'ParseQuaternion'(string)\n";
       return;
     case LST_LIST:
       // All casts to list are the same, box if necessary and then `CreateList(object)`.
-      mCIL << CIL_BOXING_INSTRUCTIONS[from_type];
-      mCIL << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::CreateList(object)\n";
+      _mBody << CIL_BOXING_INSTRUCTIONS[from_type];
+      _mBody << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::CreateList(object)\n";
       return;
     default:
       assert(0);
@@ -364,6 +420,7 @@ bool MonoScriptCompiler::visit(LSLEventHandler *handler) {
   // We're parented to a node list which is parented to the state.
   auto *state_sym = handler->getParent()->getParent()->getSymbol();
   mCIL << ".method public hidebysig instance default void e" << state_sym->getName() << CIL_HANDLER_NAMES[handler->getSymbol()->getName()];
+  _mMethod = {std::string("e") + state_sym->getName() + CIL_HANDLER_NAMES[handler->getSymbol()->getName()], "void"};
   // parameter list will be handled by `buildFunction()`
   buildFunction(handler);
   return false;
@@ -373,6 +430,7 @@ bool MonoScriptCompiler::visit(LSLGlobalFunction *glob_func) {
   auto *node_sym = glob_func->getSymbol();
   mCIL << ".method public hidebysig instance default " << CIL_TYPE_NAMES[glob_func->getIdentifier()->getIType()]
        << " 'g" << node_sym->getName() << "'";
+  _mMethod = {std::string("g") + node_sym->getName(), CIL_TYPE_NAMES[glob_func->getIdentifier()->getIType()]};
   buildFunction(glob_func);
   return false;
 }
@@ -385,29 +443,51 @@ void MonoScriptCompiler::buildFunction(LSLASTNode *func) {
   for (auto *func_param : *func_decl) {
     auto *param_sym = func_param->getSymbol();
     mCIL << CIL_TYPE_NAMES[param_sym->getIType()] << " '" << param_sym->getName() << "'";
+    _mMethod.params.emplace_back(CIL_TYPE_NAMES[param_sym->getIType()], param_sym->getName());
     if (func_param->getNext())
       mCIL << ", ";
   }
   mCIL << ") cil managed\n";
   mCIL << "{\n";
-  mCIL << ".maxstack 500\n";
-  std::string locals_string;
-  for (auto param_type : _mSymData[func_sym].locals) {
-    if (!locals_string.empty()) {
-      locals_string += ", ";
-    }
-    locals_string += CIL_TYPE_NAMES[param_type];
-  }
-  if (!locals_string.empty())
-    mCIL << ".locals init (" << locals_string << ")\n";
+  for (auto local_type : _mSymData[func_sym].locals)
+    _mMethod.locals.emplace_back(CIL_TYPE_NAMES[local_type]);
   _mCurrentFuncSym = func->getSymbol();
   visitChildren(func);
   _mCurrentFuncSym = nullptr;
   if (!func_sym->getAllPathsReturn())
-    mCIL << "ret\n";
+    _mBody << "ret\n";
+  writeMethodBody();
   mCIL << "}\n";
 }
 
+/// write out the frame declarations and instructions collected for the current method
+void MonoScriptCompiler::writeMethodBody() {
+  if (_mOptions.peephole_optimize)
+    CILPeepholeOptimizer().optimize(_mBody);
+
+  int max_stack = -1;
+  if (_mOptions.exact_max_stack)
+    max_stack = cil_max_stack(_mBody.getInstructions(), _mMethod.return_type != "void");
+  // anything we can't analyze gets the same declaration LL's compiler uses
+  mCIL << ".maxstack " << (max_stack < 0 ? 500 : max_stack) << "\n";
+  if (!_mMethod.locals.empty()) {
+    mCIL << ".locals init (";
+    for (size_t i = 0; i < _mMethod.locals.size(); ++i) {
+      if (i)
+        mCIL << ", ";
+      mCIL << _mMethod.locals[i];
+    }
+    mCIL << ")\n";
+  }
+  if (_mOptions.emit_assembly) {
+    _mMethod.instructions = _mBody.getInstructions();
+    _mAssembly.addMethod(std::move(_mMethod));
+  }
+  _mMethod = {};
+  _mBody.serialize(mCIL);
+  _mBody.clear();
+}
+
 
 
 bool MonoScriptCompiler::visit(LSLDeclaration *decl_stmt) {
@@ -417,7 +497,7 @@ bool MonoScriptCompiler::visit(LSLDeclaration *decl_stmt) {
   } else {
     pushConstant(sym->getType()->getDefaultValue());
   }
-  mCIL << "stloc.s " << _mSymData[sym].index << "\n";
+  _mBody << "stloc.s " << _mSymData[sym].index << "\n";
   return false;
 }
 
@@ -425,7 +505,7 @@ bool MonoScriptCompiler::visit(LSLExpressionStatement *expr_stmt) {
   auto *expr = expr_stmt->getExpr();
   expr->visit(this);
   if (expr->getIType() && !_mPushOmitted)
-    mCIL << "pop\n";
+    _mBody << "pop\n";
   _mPushOmitted = false;
   return false;
 }
@@ -433,25 +513,27 @@ bool MonoScriptCompiler::visit(LSLExpressionStatement *expr_stmt) {
 bool MonoScriptCompiler::visit(LSLReturnStatement *ret_stmt) {
   if (auto *expr = ret_stmt->getExpr())
     expr->visit(this);
-  mCIL << "ret\n";
+  _mBody << "ret\n";
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLLabel *label_stmt) {
   // TODO: right now this roughly matches LL's behavior, but label names
   //  should be mangled to prevent collisions.
-  mCIL << "'ul" << label_stmt->getSymbol()->getName() << "':\n";
+  _mBody << "'ul" << label_stmt->getSymbol()->getName() << "':\n";
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLJumpStatement*jump_stmt) {
   // TODO: right now this roughly matches LL's behavior, but label names
   //  should be mangled to prevent collisions.
-  mCIL << "br 'ul" << jump_stmt->getSymbol()->getName() << "'\n";
+  _mBody << "br 'ul" << jump_stmt->getSymbol()->getName() << "'\n";
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLIfStatement*if_stmt) {
+  if (_mOptions.switch_dispatch && compileDispatchChain(if_stmt))
+    return false;
   auto jump_past_true_num = _mJumpNum++;
   uint32_t jump_past_false_num = 0;
   auto *false_node = if_stmt->getFalseBranch();
@@ -459,80 +541,277 @@ bool MonoScriptCompiler::visit(LSLIfStatement*if_stmt) {
     jump_past_false_num = _mJumpNum++;
 
   if_stmt->getCheckExpr()->visit(this);
-  mCIL << "brfalse LabelTempJump" << jump_past_true_num << "\n";
+  _mBody << "brfalse LabelTempJump" << jump_past_true_num << "\n";
   if_stmt->getTrueBranch()->visit(this);
   if (false_node) {
-    mCIL << "br LabelTempJump" << jump_past_false_num << "\n";
-    mCIL << "LabelTempJump" << jump_past_true_num << ":\n";
+    _mBody << "br LabelTempJump" << jump_past_false_num << "\n";
+    _mBody << "LabelTempJump" << jump_past_true_num << ":\n";
     false_node->visit(this);
-    mCIL << "LabelTempJump" << jump_past_false_num << ":\n";
+    _mBody << "LabelTempJump" << jump_past_false_num << ":\n";
   } else {
-    mCIL << "LabelTempJump" << jump_past_true_num << ":\n";
+    _mBody << "LabelTempJump" << jump_past_true_num << ":\n";
   }
   return false;
 }
 
+/// chains with fewer branches than this are just as well off comparing against each value
+static const size_t MIN_DISPATCH_CASES = 4;
+
+static LSLExpression *strip_parens(LSLExpression *expr) {
+  while (expr->getNodeSubType() == NODE_PARENTHESIS_EXPRESSION)
+    expr = ((LSLParenthesisExpression *) expr)->getChildExpr();
+  return expr;
+}
+
+/// a literal, or a negated one since that's how negative numbers get written.
+static bool is_literal(LSLExpression *expr) {
+  if (expr->getNodeSubType() == NODE_UNARY_EXPRESSION && expr->getOperation() == OP_MINUS)
+    expr = strip_parens(((LSLUnaryExpression *) expr)->getChildExpr());
+  return expr->getNodeSubType() == NODE_CONSTANT_EXPRESSION;
+}
+
+/// match `var == constant` or `constant == var` where `var` is a whole integer or string variable.
+/// reading a variable has no side-effects, so it doesn't matter how often we end up reading it.
+static bool match_dispatch_test(LSLExpression *check, LSLLValueExpression *&lvalue, LSLConstant *&constant) {
+  check = strip_parens(check);
+  // `==` already gives 0 or 1, converting that to a bool doesn't change anything.
+  if (check->getNodeSubType() == NODE_BOOL_CONVERSION_EXPRESSION)
+    check = strip_parens(((LSLBoolConversionExpression *) check)->getChildExpr());
+  if (check->getNodeSubType() != NODE_BINARY_EXPRESSION || check->getOperation() != OP_EQ)
+    return false;
+  auto *lhs = strip_parens(((LSLBinaryExpression *) check)->getLHS());
+  auto *rhs = strip_parens(((LSLBinaryExpression *) check)->getRHS());
+  if (lhs->getNodeSubType() != NODE_LVALUE_EXPRESSION)
+    std::swap(lhs, rhs);
+  if (lhs->getNodeSubType() != NODE_LVALUE_EXPRESSION || !is_literal(rhs))
+    return false;
+  lvalue = (LSLLValueExpression *) lhs;
+  constant = rhs->getConstantValue();
+  if (lvalue->getMember() || !constant)
+    return false;
+  auto itype = lvalue->getIType();
+  return (itype == LST_INTEGER || itype == LST_STRING) && constant->getIType() == itype;
+}
+
+/// length of a UTF-8 string once it's a .NET string
+static int32_t utf16_length(const std::string &str) {
+  int32_t len = 0;
+  for (auto c : str) {
+    auto byte = (uint8_t) c;
+    if ((byte & 0xC0) != 0x80)
+      ++len;
+    // needs a surrogate pair
+    if (byte >= 0xF0)
+      ++len;
+  }
+  return len;
+}
+
+/// Compile a chain like `if (x == 1) ... else if (x == 2) ... else ...` as a
+/// single dispatch on `x` followed by each of the branches' bodies.
+bool MonoScriptCompiler::compileDispatchChain(LSLIfStatement *if_stmt) {
+  LSLLValueExpression *lvalue;
+  LSLConstant *constant;
+  if (!match_dispatch_test(if_stmt->getCheckExpr(), lvalue, constant))
+    return false;
+
+  std::vector<std::pair<LSLConstant *, LSLStatement *>> branches;
+  LSLStatement *default_branch;
+  for (auto *cur_if = if_stmt;;) {
+    branches.emplace_back(constant, cur_if->getTrueBranch());
+    default_branch = cur_if->getFalseBranch();
+    LSLLValueExpression *next_lvalue;
+    if (!default_branch || default_branch->getNodeSubType() != NODE_IF_STATEMENT)
+      break;
+    auto *next_if = (LSLIfStatement *) default_branch;
+    if (!match_dispatch_test(next_if->getCheckExpr(), next_lvalue, constant))
+      break;
+    if (next_lvalue->getSymbol() != lvalue->getSymbol())
+      break;
+    cur_if = next_if;
+  }
+  if (branches.size() < MIN_DISPATCH_CASES)
+    return false;
+
+  std::vector<uint32_t> branch_nums;
+  for (size_t i = 0; i < branches.size(); ++i)
+    branch_nums.push_back(_mJumpNum++);
+  auto default_num = _mJumpNum++;
+  auto end_num = _mJumpNum++;
+  auto push_var = [this, lvalue]() { pushLValue(lvalue); };
+
+  if (lvalue->getIType() == LST_INTEGER) {
+    // only the first branch testing a given value can ever be taken
+    std::vector<std::pair<int32_t, uint32_t>> cases;
+    std::set<int32_t> seen_values;
+    for (size_t i = 0; i < branches.size(); ++i) {
+      auto val = ((LSLIntegerConstant *) branches[i].first)->getValue();
+      if (seen_values.insert(val).second)
+        cases.emplace_back(val, branch_nums[i]);
+    }
+    compileIntegerDispatch(push_var, std::move(cases), default_num);
+  } else {
+    // .NET's string hashes aren't stable between runtimes, so dispatch on the length
+    // instead and only compare against the strings that could possibly match.
+    std::map<int32_t, std::vector<std::pair<const char *, uint32_t>>> buckets;
+    std::set<std::string> seen_values;
+    for (size_t i = 0; i < branches.size(); ++i) {
+      const char *val = ((LSLStringConstant *) branches[i].first)->getValue();
+      if (seen_values.insert(val).second)
+        buckets[utf16_length(val)].emplace_back(val, branch_nums[i]);
+    }
+    std::vector<std::pair<int32_t, uint32_t>> length_cases;
+    for (auto &bucket : buckets)
+      length_cases.emplace_back(bucket.first, _mJumpNum++);
+    compileIntegerDispatch([&]() {
+      pushLValue(lvalue);
+      _mBody << "call instance int32 string::get_Length()\n";
+    }, length_cases, default_num);
+
+    size_t bucket_idx = 0;
+    for (auto &bucket : buckets) {
+      _mBody << "LabelTempJump" << length_cases[bucket_idx++].second << ":\n";
+      for (auto &str_case : bucket.second) {
+        pushLValue(lvalue);
+        _mBody << "ldstr \"" << escape_string(str_case.first) << "\"\n";
+        _mBody << "call bool valuetype [mscorlib]System.String::op_Equality(string, string)\n";
+        _mBody << "brtrue LabelTempJump" << str_case.second << "\n";
+      }
+      _mBody << "br LabelTempJump" << default_num << "\n";
+    }
+  }
+
+  // now the bodies, in their original order.
+  for (size_t i = 0; i < branches.size(); ++i) {
+    _mBody << "LabelTempJump" << branch_nums[i] << ":\n";
+    branches[i].second->visit(this);
+    _mBody << "br LabelTempJump" << end_num << "\n";
+  }
+  _mBody << "LabelTempJump" << default_num << ":\n";
+  if (default_branch)
+    default_branch->visit(this);
+  _mBody << "LabelTempJump" << end_num << ":\n";
+  return true;
+}
+
+/// jump to the label for whichever of `cases` matches the key, or to the default label.
+/// `cases` must be sorted by value with no duplicates.
+void MonoScriptCompiler::compileIntegerDispatch(
+    const std::function<void()> &push_key, std::vector<std::pair<int32_t, uint32_t>> cases, uint32_t default_num) {
+  std::sort(cases.begin(), cases.end());
+  const int64_t min_val = cases.front().first;
+  const int64_t range = (int64_t)cases.back().first - min_val + 1;
+  if (range > (int64_t)cases.size() * 2) {
+    // too sparse for a jump table
+    compileIntegerSearch(push_key, cases, 0, cases.size(), default_num);
+    return;
+  }
+  // `switch` treats its index as unsigned, so anything below the minimum
+  // wraps around and lands past the end of the table along with everything above it.
+  push_key();
+  if (min_val) {
+    pushIntegerLiteral((int32_t)min_val);
+    _mBody << "sub\n";
+  }
+  _mBody << "switch (";
+  size_t case_idx = 0;
+  for (int64_t val = min_val; val < min_val + range; ++val) {
+    if (val != min_val)
+      _mBody << ", ";
+    if (cases[case_idx].first == val)
+      _mBody << "LabelTempJump" << cases[case_idx++].second;
+    else
+      _mBody << "LabelTempJump" << default_num;
+  }
+  _mBody << ")\n";
+  _mBody << "br LabelTempJump" << default_num << "\n";
+}
+
+/// binary search over `cases[start:end]`, which are sorted by value
+void MonoScriptCompiler::compileIntegerSearch(
+    const std::function<void()> &push_key, const std::vector<std::pair<int32_t, uint32_t>> &cases,
+    size_t start, size_t end, uint32_t default_num) {
+  // a few compares in a row are cheaper than splitting any further
+  if (end - start <= 3) {
+    for (size_t i = start; i < end; ++i) {
+      push_key();
+      pushIntegerLiteral(cases[i].first);
+      _mBody << "beq LabelTempJump" << cases[i].second << "\n";
+    }
+    _mBody << "br LabelTempJump" << default_num << "\n";
+    return;
+  }
+  const size_t mid = start + (end - start) / 2;
+  const auto upper_num = _mJumpNum++;
+  push_key();
+  pushIntegerLiteral(cases[mid].first);
+  _mBody << "bge LabelTempJump" << upper_num << "\n";
+  compileIntegerSearch(push_key, cases, start, mid, default_num);
+  _mBody << "LabelTempJump" << upper_num << ":\n";
+  compileIntegerSearch(push_key, cases, mid, end, default_num);
+}
+
 bool MonoScriptCompiler::visit(LSLForStatement*for_stmt) {
   // execute instructions to initialize vars
   for(auto *init_expr : *for_stmt->getInitExprs()) {
     init_expr->visit(this);
     if (init_expr->getIType() && !_mPushOmitted)
-      mCIL << "pop\n";
+      _mBody << "pop\n";
     _mPushOmitted = false;
   }
   auto jump_to_start_num = _mJumpNum++;
   auto jump_to_end_num = _mJumpNum++;
-  mCIL << "LabelTempJump" << jump_to_start_num << ":\n";
+  _mBody << "LabelTempJump" << jump_to_start_num << ":\n";
   // run the check expression, exiting the loop if it fails
   for_stmt->getCheckExpr()->visit(this);
-  mCIL << "brfalse LabelTempJump" << jump_to_end_num << "\n";
+  _mBody << "brfalse LabelTempJump" << jump_to_end_num << "\n";
   // run the body of the loop
   for_stmt->getBody()->visit(this);
   // run the increment expressions
   for(auto *incr_expr : *for_stmt->getIncrExprs()) {
     incr_expr->visit(this);
     if (incr_expr->getIType() && !_mPushOmitted)
-      mCIL << "pop\n";
+      _mBody << "pop\n";
     _mPushOmitted = false;
   }
   // jump back up to the check expression at the top
-  mCIL << "br LabelTempJump" << jump_to_start_num << "\n";
-  mCIL << "LabelTempJump" << jump_to_end_num << ":\n";
+  _mBody << "br LabelTempJump" << jump_to_start_num << "\n";
+  _mBody << "LabelTempJump" << jump_to_end_num << ":\n";
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLWhileStatement*while_stmt) {
   auto jump_to_start_num = _mJumpNum++;
   auto jump_to_end_num = _mJumpNum++;
-  mCIL << "LabelTempJump" << jump_to_start_num << ":\n";
+  _mBody << "LabelTempJump" << jump_to_start_num << ":\n";
   // run the check expression, exiting the loop if it fails
   while_stmt->getCheckExpr()->visit(this);
-  mCIL << "brfalse LabelTempJump" << jump_to_end_num << "\n";
+  _mBody << "brfalse LabelTempJump" << jump_to_end_num << "\n";
   // run the body of the loop
   while_stmt->getBody()->visit(this);
   // jump back up to the check expression at the top
-  mCIL << "br LabelTempJump" << jump_to_start_num << "\n";
-  mCIL << "LabelTempJump" << jump_to_end_num << ":\n";
+  _mBody << "br LabelTempJump" << jump_to_start_num << "\n";
+  _mBody << "LabelTempJump" << jump_to_end_num << ":\n";
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLDoStatement*do_stmt) {
   auto jump_to_start_num = _mJumpNum++;
-  mCIL << "LabelTempJump" << jump_to_start_num << ":\n";
+  _mBody << "LabelTempJump" << jump_to_start_num << ":\n";
   // run the body of the loop
   do_stmt->getBody()->visit(this);
   // run the check expression, jumping back up if it succeeds
   do_stmt->getCheckExpr()->visit(this);
-  mCIL << "brtrue LabelTempJump" << jump_to_start_num << "\n";
+  _mBody << "brtrue LabelTempJump" << jump_to_start_num << "\n";
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLStateStatement *state_stmt) {
-  mCIL << "ldarg.0\n"
+  _mBody << "ldarg.0\n"
        << "ldstr \"" << escape_string(state_stmt->getSymbol()->getName()) << "\"\n"
        << "call instance void " << CIL_USERSCRIPT_CLASS << "::ChangeState(string)\n";
   pushConstant(_mCurrentFuncSym->getType()->getDefaultValue());
-  mCIL << "ret\n";
+  _mBody << "ret\n";
   return false;
 }
 
@@ -560,14 +839,14 @@ bool MonoScriptCompiler::visit(LSLBoolConversionExpression *bool_expr) {
       return false;
     case LST_FLOATINGPOINT:
       pushConstant(TYPE(LST_FLOATINGPOINT)->getDefaultValue());
-      mCIL << "ceq\n"
+      _mBody << "ceq\n"
            // TODO: LL's compiler does this, is it necessary?
            << "ldc.i4.0\n"
            << "ceq\n";
       return false;
     case LST_STRING:
       pushConstant(TYPE(LST_STRING)->getDefaultValue());
-      mCIL << "call bool string::op_Equality(string, string)\n"
+      _mBody << "call bool string::op_Equality(string, string)\n"
            // TODO: LL's compiler does this, is it necessary?
            << "ldc.i4.0\n"
            << "ceq\n";
@@ -575,17 +854,17 @@ bool MonoScriptCompiler::visit(LSLBoolConversionExpression *bool_expr) {
     case LST_VECTOR:
     case LST_QUATERNION:
       pushConstant(TYPE(type)->getDefaultValue());
-      mCIL << "call bool " << CIL_USERSCRIPT_CLASS << "::'Equals'(" << CIL_TYPE_NAMES[type] << ", " << CIL_TYPE_NAMES[type] << ")\n"
+      _mBody << "call bool " << CIL_USERSCRIPT_CLASS << "::'Equals'(" << CIL_TYPE_NAMES[type] << ", " << CIL_TYPE_NAMES[type] << ")\n"
            // TODO: LL's compiler does this, is it necessary?
            << "ldc.i4.0\n"
            << "ceq\n";
       return false;
     case LST_KEY:
-      mCIL << "call bool " << CIL_USERSCRIPT_CLASS <<"::'IsNonNullUuid'(" << CIL_TYPE_NAMES[LST_KEY] << ")\n";
+      _mBody << "call bool " << CIL_USERSCRIPT_CLASS <<"::'IsNonNullUuid'(" << CIL_TYPE_NAMES[LST_KEY] << ")\n";
       return false;
     case LST_LIST:
       pushConstant(TYPE(LST_LIST)->getDefaultValue());
-      mCIL << "call bool " << CIL_USERSCRIPT_CLASS << "::'Equals'(" << CIL_TYPE_NAMES[LST_LIST] << ", " << CIL_TYPE_NAMES[LST_LIST] << ")\n"
+      _mBody << "call bool " << CIL_USERSCRIPT_CLASS << "::'Equals'(" << CIL_TYPE_NAMES[LST_LIST] << ", " << CIL_TYPE_NAMES[LST_LIST] << ")\n"
            << "ldc.i4.0\n"
            << "ceq\n";
       return false;
@@ -597,13 +876,13 @@ bool MonoScriptCompiler::visit(LSLBoolConversionExpression *bool_expr) {
 
 bool MonoScriptCompiler::visit(LSLVectorExpression *vec_expr) {
   visitChildren(vec_expr);
-  mCIL << "call " << CIL_TYPE_NAMES[LST_VECTOR] << " " << CIL_USERSCRIPT_CLASS << "::'CreateVector'(float32, float32, float32)\n";
+  _mBody << "call " << CIL_TYPE_NAMES[LST_VECTOR] << " " << CIL_USERSCRIPT_CLASS << "::'CreateVector'(float32, float32, float32)\n";
   return false;
 }
 
 bool MonoScriptCompiler::visit(LSLQuaternionExpression *quat_expr) {
   visitChildren(quat_expr);
-  mCIL << "call " << CIL_TYPE_NAMES[LST_QUATERNION] << " " << CIL_USERSCRIPT_CLASS << "::'CreateQuaternion'(float32, float32, float32, float32)\n";
+  _mBody << "call " << CIL_TYPE_NAMES[LST_QUATERNION] << " " << CIL_USERSCRIPT_CLASS << "::'CreateQuaternion'(float32, float32, float32, float32)\n";
   return false;
 }
 
@@ -612,39 +891,146 @@ bool MonoScriptCompiler::visit(LSLLValueExpression *lvalue) {
   return false;
 }
 
+/// Finds the constant list expressions in functions and event handlers, global
+/// initializers only run once so there's nothing to gain by caching theirs.
+class ConstantListCollector : public ASTVisitor {
+  public:
+    std::vector<LSLListExpression *> lists {};
+
+  protected:
+    virtual bool visit(LSLGlobalVariable *glob_var) { return false; }
+    virtual bool visit(LSLListExpression *list_expr) {
+      // not much point caching an empty list
+      if (list_expr->getConstantValue() && list_expr->hasChildren())
+        lists.push_back(list_expr);
+      return false;
+    }
+};
+
+void MonoScriptCompiler::cacheConstantLists(LSLScript *script) {
+  ConstantListCollector collector;
+  script->visit(&collector);
+
+  // lists that would be built with the same code can share a field
+  std::unordered_map<std::string, std::string> fields_by_code;
+  for (auto *list_expr : collector.lists) {
+    CILInstructionList list_code;
+    std::swap(_mBody, list_code);
+    buildList(list_expr, true);
+    std::swap(_mBody, list_code);
+    TextWriter code_writer;
+    list_code.serialize(code_writer);
+
+    auto &field = fields_by_code[code_writer.str()];
+    if (field.empty()) {
+      // can't collide with anything from the script, LSL identifiers can't contain brackets
+      std::string field_name = "<list>" + std::to_string(_mCachedListFields.size());
+      field = std::string(CIL_TYPE_NAMES[LST_LIST]) + " " + _mScriptClassName + "::'" + field_name + "'";
+      _mCachedListFields.emplace_back(field, list_expr);
+      mCIL << ".field public " << CIL_TYPE_NAMES[LST_LIST] << " '" << field_name << "'\n";
+      if (_mOptions.emit_assembly)
+        _mAssembly.addField(CIL_TYPE_NAMES[LST_LIST], field_name);
+    }
+    _mCachedLists[list_expr] = field;
+  }
+}
+
+/// whether whatever uses the list's value only reads it, so it doesn't need its own copy
+static bool list_only_read(LSLExpression *expr) {
+  auto *parent = expr->getParent();
+  while (parent && parent->getNodeSubType() == NODE_PARENTHESIS_EXPRESSION)
+    parent = parent->getParent();
+  if (!parent)
+    return false;
+  switch (parent->getNodeSubType()) {
+    case NODE_BOOL_CONVERSION_EXPRESSION:
+      return true;
+    case NODE_TYPECAST_EXPRESSION:
+      return parent->getIType() != LST_LIST;
+    case NODE_BINARY_EXPRESSION: {
+      auto op = ((LSLBinaryExpression *) parent)->getOperation();
+      return op == OP_EQ || op == OP_NEQ;
+    }
+    default:
+      break;
+  }
+  // library functions never modify their arguments, user-defined functions may hang on to them.
+  auto *grandparent = parent->getParent();
+  if (grandparent && grandparent->getNodeSubType() == NODE_FUNCTION_EXPRESSION) {
+    auto *func_expr = (LSLFunctionExpression *) grandparent;
+    return func_expr->getArguments() == parent && func_expr->getSymbol()->getSubType() == SYM_BUILTIN;
+  }
+  return false;
+}
+
 bool MonoScriptCompiler::visit(LSLListExpression *list_expr) {
+  if (!_mInGlobalExpr) {
+    auto cached_iter = _mCachedLists.find(list_expr);
+    if (cached_iter != _mCachedLists.end()) {
+      _mBody << "ldarg.0\n"
+             << "ldfld " << cached_iter->second << "\n";
+      // anything that might hang on to the list gets a copy of its own
+      if (!list_only_read(list_expr))
+        _mBody << "newobj instance void " << CIL_TYPE_NAMES[LST_LIST] << "::.ctor(class [mscorlib]System.Collections.ICollection)\n";
+      return false;
+    }
+  }
+  buildList(list_expr);
+  return false;
+}
+
+/// `from_constants` pushes each element's folded value rather than evaluating it,
+/// elements may refer to locals that don't exist outside of their function.
+void MonoScriptCompiler::buildList(LSLListExpression *list_expr, bool from_constants) {
+  auto push_element = [&](LSLExpression *child) {
+    if (from_constants)
+      pushConstant(child->getConstantValue());
+    else
+      child->visit(this);
+  };
   // LL's compiler pushes lists in a different order in globexprs for some reason,
   // maybe something about order of evaluation being important there.
   // match their behavior so it's less annoying to compare output.
   if (_mInGlobalExpr) {
-    mCIL << CIL_LIST_INITIALIZER << "\n";
+    _mBody << CIL_LIST_INITIALIZER << "\n";
     for (auto child : *list_expr) {
-      child->visit(this);
-      mCIL << CIL_BOXING_INSTRUCTIONS[child->getIType()]
+      push_element(child);
+      _mBody << CIL_BOXING_INSTRUCTIONS[child->getIType()]
            << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::Append(" << CIL_TYPE_NAMES[LST_LIST] << ", object)\n";
     }
+  } else if (_mOptions.preallocate_lists && list_expr->hasChildren()) {
+    // elements are still evaluated left to right, but each is added as it's
+    // evaluated to a list that already has room for all of them.
+    pushIntegerLiteral(list_expr->getNumChildren());
+    _mBody << "newobj instance void " << CIL_TYPE_NAMES[LST_LIST] << "::.ctor(int32)\n";
+    for (auto *child : *list_expr) {
+      _mBody << "dup\n";
+      push_element(child);
+      _mBody << CIL_BOXING_INSTRUCTIONS[child->getIType()]
+             << "callvirt instance int32 " << CIL_TYPE_NAMES[LST_LIST] << "::Add(object)\n"
+             << "pop\n";
+    }
   } else {
     // list elements get evaluated and pushed FIRST
     size_t num_children = 0;
     for (auto *child : *list_expr) {
-      child->visit(this);
-      mCIL << CIL_BOXING_INSTRUCTIONS[child->getIType()];
+      push_element(child);
+      _mBody << CIL_BOXING_INSTRUCTIONS[child->getIType()];
       ++num_children;
     }
     // then they get added to the list
-    mCIL << CIL_LIST_INITIALIZER << "\n";
+    _mBody << CIL_LIST_INITIALIZER << "\n";
     for (size_t i=0; i<num_children; ++i) {
-      mCIL << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::Prepend(object, " << CIL_TYPE_NAMES[LST_LIST] << ")\n";
+      _mBody << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::Prepend(object, " << CIL_TYPE_NAMES[LST_LIST] << ")\n";
     }
   }
-  return false;
 }
 
 bool MonoScriptCompiler::visit(LSLFunctionExpression *func_expr) {
   auto *func_sym = func_expr->getSymbol();
   // this will be a method on the script instance, push `this` onto the stack
   if (func_sym->getSubType() != SYM_BUILTIN)
-    mCIL << "ldarg.0\n";
+    _mBody << "ldarg.0\n";
 
   // push the arguments onto the stack
   for (auto *child_expr : *func_expr->getArguments()) {
@@ -652,22 +1038,22 @@ bool MonoScriptCompiler::visit(LSLFunctionExpression *func_expr) {
   }
 
   if (func_sym->getSubType() == SYM_BUILTIN) {
-    mCIL << "call " << CIL_TYPE_NAMES[func_expr->getIType()] << " "
+    _mBody << "call " << CIL_TYPE_NAMES[func_expr->getIType()] << " "
          << CIL_LSL_LIBRARY_CLASS << "::'" << func_sym->getName() << "'";
   } else {
-    mCIL << "call instance " << CIL_TYPE_NAMES[func_expr->getIType()] << " class "
+    _mBody << "call instance " << CIL_TYPE_NAMES[func_expr->getIType()] << " class "
          << _mScriptClassName + "::'g" + func_sym->getName() + "'";
   }
 
   // write in the functions' expected parameter types
   auto *func_decl = func_sym->getFunctionDecl();
-  mCIL << "(";
+  _mBody << "(";
   for (auto *func_param : *func_decl) {
-    mCIL << CIL_TYPE_NAMES[func_param->getIType()];
+    _mBody << CIL_TYPE_NAMES[func_param->getIType()];
     if (func_param->getNext())
-      mCIL << ", ";
+      _mBody << ", ";
   }
-  mCIL << ")\n";
+  _mBody << ")\n";
   return false;
 }
 
@@ -757,7 +1143,7 @@ bool MonoScriptCompiler::visit(LSLBinaryExpression *bin_expr) {
     lvalue->visit(this);
     // cast the integer lvalue to a float first
     castTopOfStack(LST_INTEGER, LST_FLOATINGPOINT);
-    mCIL << "mul\n";
+    _mBody << "mul\n";
     // cast the result to an integer so we can store it in the lvalue
     castTopOfStack(LST_FLOATINGPOINT, LST_INTEGER);
     // This will return the wrong type because things expect this expression to return a float.
@@ -766,10 +1152,52 @@ bool MonoScriptCompiler::visit(LSLBinaryExpression *bin_expr) {
     return false;
   }
 
+  if (op == '+' && _mOptions.flatten_string_concat && compileStringConcat(bin_expr))
+    return false;
   compileBinaryExpression(op, left, right, bin_expr->getIType());
   return false;
 }
 
+/// chains with fewer pieces than this only make one intermediate string anyway
+static const size_t MIN_CONCAT_PIECES = 3;
+
+/// collect the operands of a tree of string `+`s, in left to right order
+static void collect_concat_pieces(LSLExpression *expr, std::vector<LSLExpression *> &pieces) {
+  auto *inner = strip_parens(expr);
+  if (inner->getNodeSubType() == NODE_BINARY_EXPRESSION && inner->getOperation() == '+') {
+    auto *bin_expr = (LSLBinaryExpression *) inner;
+    if (bin_expr->getLHS()->getIType() == LST_STRING && bin_expr->getRHS()->getIType() == LST_STRING) {
+      collect_concat_pieces(bin_expr->getLHS(), pieces);
+      collect_concat_pieces(bin_expr->getRHS(), pieces);
+      return;
+    }
+  }
+  pieces.push_back(expr);
+}
+
+/// Concatenate a chain of strings with one call instead of making an intermediate
+/// string for every `+`. The pieces are stored into an array so they can still be
+/// evaluated right to left like LSL expects while ending up in the right order.
+bool MonoScriptCompiler::compileStringConcat(LSLBinaryExpression *bin_expr) {
+  if (bin_expr->getIType() != LST_STRING)
+    return false;
+  std::vector<LSLExpression *> pieces;
+  collect_concat_pieces(bin_expr, pieces);
+  if (pieces.size() < MIN_CONCAT_PIECES)
+    return false;
+
+  pushIntegerLiteral((int32_t)pieces.size());
+  _mBody << "newarr [mscorlib]System.String\n";
+  for (size_t i = pieces.size(); i-- > 0;) {
+    _mBody << "dup\n";
+    pushIntegerLiteral((int32_t)i);
+    pieces[i]->visit(this);
+    _mBody << "stelem.ref\n";
+  }
+  _mBody << "call string class [mscorlib]System.String::Concat(string[])\n";
+  return true;
+}
+
 void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *left, LSLExpression *right, LSLIType ret_type) {
   const auto left_type = left->getIType();
   const auto right_type = right->getIType();
@@ -783,7 +1211,7 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       right->visit(this);
       left->visit(this);
       // right is first argument due to reversed order of evaluation in LSL
-      mCIL << "call " << CIL_TYPE_NAMES[ret_type] << " " << CIL_USERSCRIPT_CLASS << "::'"
+      _mBody << "call " << CIL_TYPE_NAMES[ret_type] << " " << CIL_USERSCRIPT_CLASS << "::'"
            << simple_op->second.first << "'(" << CIL_TYPE_NAMES[right_type] << ", " << CIL_TYPE_NAMES[left_type] << ")\n";
       return;
     }
@@ -796,12 +1224,12 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       left->visit(this);
       if (right_type == LST_LIST && left_type != LST_LIST) {
         // prepend whatever this is to the right list
-        mCIL << CIL_BOXING_INSTRUCTIONS[left_type];
-        mCIL << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::Prepend(" << CIL_TYPE_NAMES[LST_LIST] << ", object)\n";
+        _mBody << CIL_BOXING_INSTRUCTIONS[left_type];
+        _mBody << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::Prepend(" << CIL_TYPE_NAMES[LST_LIST] << ", object)\n";
         return;
       } else if (left_type == LST_LIST) {
         // append to the left list (will also join lists)
-        mCIL << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::Append("
+        _mBody << "call " << CIL_TYPE_NAMES[LST_LIST] << " " << CIL_USERSCRIPT_CLASS << "::Append("
              << CIL_VALUE_TYPE_NAMES[right_type] << ", " << CIL_VALUE_TYPE_NAMES[LST_LIST] << ")\n";
         return;
       }
@@ -809,7 +1237,7 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       switch (left_type) {
         case LST_INTEGER:
         case LST_FLOATINGPOINT:
-          mCIL << "add\n";
+          _mBody << "add\n";
           return;
         default:
           assert(0);
@@ -830,12 +1258,12 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
         // Skimming through the IEEE-754 spec there shouldn't be any semantic
         // difference. It's faster and serializes to fewer bytes.
         right->visit(this);
-        mCIL << "neg\n";
+        _mBody << "neg\n";
         left->visit(this);
         switch (left_type) {
           case LST_FLOATINGPOINT:
           case LST_INTEGER:
-            mCIL << "add\n";
+            _mBody << "add\n";
             return;
           default:
             assert(0);
@@ -846,10 +1274,10 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
         left->visit(this);
         switch (left_type) {
           case LST_FLOATINGPOINT:
-            mCIL << "call float64 " << CIL_USERSCRIPT_CLASS << "::'Subtract'(float64, float64)\n";
+            _mBody << "call float64 " << CIL_USERSCRIPT_CLASS << "::'Subtract'(float64, float64)\n";
             return;
           case LST_INTEGER:
-            mCIL << "call int32 " << CIL_USERSCRIPT_CLASS << "::'Subtract'(int32, int32)\n";
+            _mBody << "call int32 " << CIL_USERSCRIPT_CLASS << "::'Subtract'(int32, int32)\n";
             return;
           default:
             assert(0);
@@ -863,7 +1291,7 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       switch (left_type) {
         case LST_INTEGER:
         case LST_FLOATINGPOINT:
-          mCIL << "mul\n";
+          _mBody << "mul\n";
           return;
         default:
           assert(0);
@@ -875,7 +1303,7 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       left->visit(this);
       switch (left_type) {
         case LST_FLOATINGPOINT:
-          mCIL << "call float64 " << CIL_USERSCRIPT_CLASS << "::'Divide'(float64, float64)\n";
+          _mBody << "call float64 " << CIL_USERSCRIPT_CLASS << "::'Divide'(float64, float64)\n";
           return;
         default:
           assert(0);
@@ -888,18 +1316,18 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       switch (right_type) {
         case LST_INTEGER:
         case LST_FLOATINGPOINT:
-          mCIL << "ceq\n";
+          _mBody << "ceq\n";
           return;
         case LST_STRING:
           // note the key == string and string == key asymmetry here...
           // left is top of stack, so convert left to a string if it isn't one already
           castTopOfStack(left_type, right_type);
-          mCIL << "call bool valuetype [mscorlib]System.String::op_Equality(string, string)\n";
+          _mBody << "call bool valuetype [mscorlib]System.String::op_Equality(string, string)\n";
           return;
         case LST_KEY:
           // these really should have been pre-casted if necessary, but this is what LL's compiler does
           castTopOfStack(left_type, right_type);
-          mCIL << "call int32 " << CIL_USERSCRIPT_CLASS << "::'Equals'(" << CIL_TYPE_NAMES[LST_KEY] << ", " << CIL_TYPE_NAMES[LST_KEY] << ")\n";
+          _mBody << "call int32 " << CIL_USERSCRIPT_CLASS << "::'Equals'(" << CIL_TYPE_NAMES[LST_KEY] << ", " << CIL_TYPE_NAMES[LST_KEY] << ")\n";
           return;
         default:
           assert(0);
@@ -910,33 +1338,33 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       // EQ will visit right and left in the correct order for us
       compileBinaryExpression(OP_EQ, left, right, ret_type);
       // check if result == 0
-      mCIL << "ldc.i4.0\n"
+      _mBody << "ldc.i4.0\n"
            << "ceq\n";
       return;
     case OP_GEQ:
       right->visit(this);
       left->visit(this);
       // not very nice, but operands are swapped from how CIL would like them
-      mCIL << "cgt\n"
+      _mBody << "cgt\n"
            << "ldc.i4.0\n"
            << "ceq\n";
       return;
     case OP_LEQ:
       right->visit(this);
       left->visit(this);
-      mCIL << "clt\n"
+      _mBody << "clt\n"
            << "ldc.i4.0\n"
            << "ceq\n";
       return;
     case '>':
       right->visit(this);
       left->visit(this);
-      mCIL << "clt\n";
+      _mBody << "clt\n";
       return;
     case '<':
       right->visit(this);
       left->visit(this);
-      mCIL << "cgt\n";
+      _mBody << "cgt\n";
       return;
     case OP_BOOLEAN_AND:
       // We need to interleave our codegen with the code of the expressions,
@@ -944,16 +1372,16 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       right->visit(this);
       // push whether this returned false
       // necessary because everything EXCEPT 0 is truthy!
-      mCIL << "ldc.i4.0\n"
+      _mBody << "ldc.i4.0\n"
            << "ceq\n";
 
       left->visit(this);
-      mCIL << "ldc.i4.0\n"
+      _mBody << "ldc.i4.0\n"
            << "ceq\n";
 
       // binary OR the results together and compare against zero
       // will push whether neither had the false bit set
-      mCIL << "or\n"
+      _mBody << "or\n"
            << "ldc.i4.0\n"
            << "ceq\n";
       return;
@@ -961,7 +1389,7 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
       right->visit(this);
       left->visit(this);
       // binary OR the sides together and compare against zero
-      mCIL << "or\n"
+      _mBody << "or\n"
            << "ldc.i4.0\n"
            << "ceq\n"
            // TODO: LL's codegen compares against zero again. Copy & paste error in their code?
@@ -971,17 +1399,17 @@ void MonoScriptCompiler::compileBinaryExpression(LSLOperator op, LSLExpression *
     case '&':
       right->visit(this);
       left->visit(this);
-      mCIL << "and\n";
+      _mBody << "and\n";
       return;
     case '|':
       right->visit(this);
       left->visit(this);
-      mCIL << "or\n";
+      _mBody << "or\n";
       return;
     case '^':
       right->visit(this);
       left->visit(this);
-      mCIL << "xor\n";
+      _mBody << "xor\n";
       return;
     default:
       assert(0);
@@ -1007,9 +1435,9 @@ bool MonoScriptCompiler::visit(LSLUnaryExpression *unary_expr) {
     // push "one" for the given type
     pushConstant(lvalue->getType()->getOneValue());
     if (op == OP_POST_DECR) {
-      mCIL << "sub\n";
+      _mBody << "sub\n";
     } else {
-      mCIL << "add\n";
+      _mBody << "add\n";
     }
 
     // This store + push, then subsequent pop is totally unnecessary, but matches what LL's
@@ -1018,7 +1446,7 @@ bool MonoScriptCompiler::visit(LSLUnaryExpression *unary_expr) {
       storeToLValue(lvalue, false);
     } else {
       storeToLValue(lvalue, true);
-      mCIL << "pop\n";
+      _mBody << "pop\n";
     }
 
     return false;
@@ -1030,9 +1458,9 @@ bool MonoScriptCompiler::visit(LSLUnaryExpression *unary_expr) {
     pushLValue(lvalue);
     pushConstant(lvalue->getType()->getOneValue());
     if (op == OP_PRE_DECR) {
-      mCIL << "sub\n";
+      _mBody << "sub\n";
     } else {
-      mCIL << "add\n";
+      _mBody << "add\n";
     }
 
     storeToLValue(lvalue, maybeOmitPush(unary_expr));
@@ -1046,23 +1474,23 @@ bool MonoScriptCompiler::visit(LSLUnaryExpression *unary_expr) {
       switch(child_type) {
         case LST_INTEGER:
         case LST_FLOATINGPOINT:
-          mCIL << "neg\n";
+          _mBody << "neg\n";
           return false;
         case LST_QUATERNION:
         case LST_VECTOR:
-          mCIL << "call " << CIL_TYPE_NAMES[child_type] << " " << CIL_USERSCRIPT_CLASS << "::'Negate'(" << CIL_TYPE_NAMES[child_type] << ")\n";
+          _mBody << "call " << CIL_TYPE_NAMES[child_type] << " " << CIL_USERSCRIPT_CLASS << "::'Negate'(" << CIL_TYPE_NAMES[child_type] << ")\n";
           return false;
         default:
           assert(0);
           return false;
       }
     case '!': {
-      mCIL << "ldc.i4.0\n"
+      _mBody << "ldc.i4.0\n"
            << "ceq\n";
       return false;
     }
     case '~': {
-      mCIL << "not\n";
+      _mBody << "not\n";
       return false;
     }
     default:
@@ -1077,7 +1505,7 @@ bool MonoScriptCompiler::visit(LSLPrintExpression *print_expr) {
   auto *child_expr = print_expr->getChildExpr();
   child_expr->visit(this);
   castTopOfStack(child_expr->getIType(), LST_STRING);
-  mCIL << "call void " << CIL_LSL_LIBRARY_CLASS << "::Print(string)\n";
+  _mBody << "call void " << CIL_LSL_LIBRARY_CLASS << "::Print(string)\n";
   return false;
 }
 
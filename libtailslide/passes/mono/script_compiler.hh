@@ -1,10 +1,16 @@
 #pragma once
 
+#include <functional>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "../../lslmini.hh"
 #include "../../visitor.hh"
 #include "../../bitstream.hh"
+#include "../../text_writer.hh"
+#include "assembly_writer.hh"
+#include "instruction_list.hh"
 #include "resource_collector.hh"
 
 namespace Tailslide {
@@ -12,6 +18,25 @@ namespace Tailslide {
 struct MonoCompilationOptions {
   bool optimize_sutractions = false;
   bool omit_unnecessary_pushes = false;
+  /// run a peephole pass over each method's instructions before serializing them
+  bool peephole_optimize = false;
+  /// also assemble the script into a loadable .NET assembly in `mAssemblyBS`
+  bool emit_assembly = false;
+  /// declare how deep each method's stack actually gets rather than a conservative `.maxstack 500`
+  bool exact_max_stack = false;
+  /// let locals of the same type in disjoint scopes share a slot
+  bool reuse_local_slots = false;
+  /// lower long `if (x == 1) ... else if (x == 2) ...` chains to jump tables rather than a compare per branch
+  bool switch_dispatch = false;
+  /// build `a + b + c + ...` on strings with a single `String.Concat()` rather than a call per `+`
+  bool flatten_string_concat = false;
+  /// create lists with room for all their elements up front rather than prepending to an empty list
+  bool preallocate_lists = false;
+  /// build each distinct constant list in a function or event handler once when the script is created
+  bool cache_constant_lists = false;
+  /// lower the caller's tree directly rather than a copy of it. Saves building
+  /// a second tree, but the tree can't be used for anything else afterwards.
+  bool lower_in_place = false;
 };
 
 class MonoScriptCompiler : public ASTVisitor {
@@ -19,7 +44,8 @@ class MonoScriptCompiler : public ASTVisitor {
     explicit MonoScriptCompiler(ScriptAllocator *allocator, MonoCompilationOptions options={}) :
         _mAllocator(allocator), _mOptions(options) {};
 
-    std::stringstream mCIL {};
+    TextWriter mCIL {};
+    BitStream mAssemblyBS {ENDIAN_LITTLE};
   protected:
     virtual bool visit(LSLScript *script);
     virtual bool visit(LSLGlobalVariable *glob_var);
@@ -27,6 +53,7 @@ class MonoScriptCompiler : public ASTVisitor {
     void pushLValueContainer(LSLLValueExpression *lvalue);
     void pushLValue(LSLLValueExpression *lvalue);
     void pushConstant(LSLConstant *cv);
+    void pushIntegerLiteral(int32_t value);
     void pushFloatLiteral(double value);
     void storeToLValue(LSLLValueExpression *lvalue, bool push_result);
     void castTopOfStack(LSLIType from_type, LSLIType to_type);
@@ -36,6 +63,7 @@ class MonoScriptCompiler : public ASTVisitor {
     virtual bool visit(LSLEventHandler *handler);
     virtual bool visit(LSLGlobalFunction *glob_func);
     void buildFunction(LSLASTNode *func);
+    void writeMethodBody();
 
     virtual bool visit(LSLExpressionStatement *expr_stmt);
     virtual bool visit(LSLReturnStatement *ret_stmt);
@@ -43,6 +71,12 @@ class MonoScriptCompiler : public ASTVisitor {
     virtual bool visit(LSLJumpStatement *jump_stmt);
     virtual bool visit(LSLDeclaration *decl_stmt);
     virtual bool visit(LSLIfStatement *if_stmt);
+    bool compileDispatchChain(LSLIfStatement *if_stmt);
+    void compileIntegerDispatch(
+        const std::function<void()> &push_key, std::vector<std::pair<int32_t, uint32_t>> cases, uint32_t default_num);
+    void compileIntegerSearch(
+        const std::function<void()> &push_key, const std::vector<std::pair<int32_t, uint32_t>> &cases,
+        size_t start, size_t end, uint32_t default_num);
     virtual bool visit(LSLForStatement *for_stmt);
     virtual bool visit(LSLWhileStatement *while_stmt);
     virtual bool visit(LSLDoStatement *do_stmt);
@@ -55,9 +89,12 @@ class MonoScriptCompiler : public ASTVisitor {
     virtual bool visit(LSLQuaternionExpression *quat_expr);
     virtual bool visit(LSLLValueExpression *lvalue);
     virtual bool visit(LSLListExpression *list_expr);
+    void buildList(LSLListExpression *list_expr, bool from_constants=false);
+    void cacheConstantLists(LSLScript *script);
     virtual bool visit(LSLFunctionExpression *func_expr);
     virtual bool visit(LSLBinaryExpression *bin_expr);
     void compileBinaryExpression(LSLOperator op, LSLExpression *left, LSLExpression *right, LSLIType ret_type);
+    bool compileStringConcat(LSLBinaryExpression *bin_expr);
     virtual bool visit(LSLUnaryExpression *unary_expr);
     virtual bool visit(LSLPrintExpression *print_expr);
 
@@ -71,6 +108,15 @@ class MonoScriptCompiler : public ASTVisitor {
 
     ScriptAllocator *_mAllocator;
     MonoSymbolDataMap _mSymData {};
+    /// instructions for the method currently being compiled
+    CILInstructionList _mBody {};
+    /// signature of the method currently being compiled, for the assembly writer
+    CILMethod _mMethod {};
+    CILAssemblyWriter _mAssembly {};
+    /// constant list expression -> field specifier for the instance built in the ctor
+    std::unordered_map<LSLListExpression *, std::string> _mCachedLists {};
+    /// (field specifier, list to build) for each distinct cached list
+    std::vector<std::pair<std::string, LSLListExpression *>> _mCachedListFields {};
     LSLSymbol *_mCurrentFuncSym = nullptr;
     std::string _mScriptClassName;
     bool _mInGlobalExpr = false;
@@ -1,4 +1,5 @@
 #include <iomanip>
+#include <sstream>
 #include <cmath>
 
 #include "pretty_print.hh"
@@ -61,8 +62,7 @@ void PrettyPrintVisitor::prettifyChildrenSep(LSLASTNode *parent, const char *sep
 // expressions in the members in a context where the brackets could be interpreted
 // as shift operators
 void PrettyPrintVisitor::prettifyCoordinateMembers(LSLASTNode *coord_node) {
-  std::stringstream orig_stream(std::move(mStream));
-  mStream = std::stringstream();
+  TextWriter orig_stream(std::move(mStream));
   prettifyChildrenSep(coord_node, ", ");
   std::string innards {mStream.str()};
   mStream = std::move(orig_stream);
@@ -472,9 +472,8 @@ static std::string format_float(double v) {
       return "-2.0e+999";
     }
   }
-  char pretty_buf[256];
-  snprintf(pretty_buf, 256, "%#.6g", v);
-  return pretty_buf;
+  char pretty_buf[32];
+  return {pretty_buf, format_float(pretty_buf, sizeof(pretty_buf), v, 6, true)};
 }
 
 bool PrettyPrintVisitor::visit(LSLVectorConstant *vec_const) {
@@ -1,8 +1,8 @@
 #ifndef TAILSLIDE_PRETTY_PRINT_HH
 #define TAILSLIDE_PRETTY_PRINT_HH
 
-#include <sstream>
 #include "../lslmini.hh"
+#include "../text_writer.hh"
 #include "../visitor.hh"
 
 namespace Tailslide {
@@ -65,7 +65,7 @@ public:
     void prettifyChildrenSep(LSLASTNode *node, const char *separator);
     void prettifyCoordinateMembers(LSLASTNode *coord_node);
     void doTabs();
-    std::stringstream mStream {};
+    TextWriter mStream {};
 protected:
     const PrettyPrintOpts &_mOpts;
 };
@@ -0,0 +1,101 @@
+#include <cstring>
+
+#include "semantic_fingerprint.hh"
+
+namespace Tailslide {
+
+template <typename T>
+static void hash_pod(SHA256 &hash, T val) {
+  hash.update(&val, sizeof(val));
+}
+
+static void hash_str(SHA256 &hash, const char *str) {
+  auto len = (uint32_t)strlen(str);
+  hash_pod(hash, len);
+  hash.update(str, len);
+}
+
+bool SemanticFingerprintVisitor::visit(LSLASTNode *node) {
+  // The child count goes in first so the preorder walk can't be ambiguous
+  // about where one node's children end and its sibling starts.
+  hash_pod(_mHash, (uint8_t)node->getNodeType());
+  hash_pod(_mHash, (uint8_t)node->getNodeSubType());
+  hash_pod(_mHash, (uint8_t)node->getIType());
+  hash_pod(_mHash, (uint32_t)node->getNumChildren());
+
+  switch (node->getNodeType()) {
+    case NODE_IDENTIFIER:
+      hashIdentifier((LSLIdentifier *)node);
+      break;
+    case NODE_CONSTANT:
+      hashConstant((LSLConstant *)node);
+      break;
+    case NODE_EXPRESSION:
+      hash_pod(_mHash, (int32_t)((LSLExpression *)node)->getOperation());
+      break;
+    default:
+      break;
+  }
+  visitChildren(node);
+  return false;
+}
+
+bool SemanticFingerprintVisitor::visit(LSLParenthesisExpression *parens_expr) {
+  // the tree's shape already says how the expression groups
+  visitChildren(parens_expr);
+  return false;
+}
+
+void SemanticFingerprintVisitor::hashIdentifier(LSLIdentifier *id) {
+  LSLSymbol *sym = id->getSymbol();
+  // Builtins and vector / rotation members (which don't have symbols)
+  // behave differently depending on their names. So does the default state.
+  if (!sym || sym->getSubType() == SYM_BUILTIN
+      || (sym->getSymbolType() == SYM_STATE && !strcmp(sym->getName(), "default"))) {
+    hash_pod(_mHash, (uint8_t)0);
+    hash_str(_mHash, id->getName());
+    return;
+  }
+  auto sym_id = _mSymbolIds.emplace(sym, (uint32_t)_mSymbolIds.size()).first->second;
+  hash_pod(_mHash, (uint8_t)1);
+  hash_pod(_mHash, sym_id);
+}
+
+void SemanticFingerprintVisitor::hashConstant(LSLConstant *constant) {
+  switch (constant->getIType()) {
+    case LST_INTEGER:
+      hash_pod(_mHash, (int32_t)((LSLIntegerConstant *)constant)->getValue());
+      break;
+    case LST_FLOATINGPOINT:
+      hash_pod(_mHash, ((LSLFloatConstant *)constant)->getValue());
+      break;
+    case LST_STRING:
+    case LST_KEY:
+      hash_str(_mHash, ((LSLStringConstant *)constant)->getValue());
+      break;
+    case LST_VECTOR: {
+      auto *vec = ((LSLVectorConstant *)constant)->getValue();
+      hash_pod(_mHash, vec->x);
+      hash_pod(_mHash, vec->y);
+      hash_pod(_mHash, vec->z);
+      break;
+    }
+    case LST_QUATERNION: {
+      auto *quat = ((LSLQuaternionConstant *)constant)->getValue();
+      hash_pod(_mHash, quat->x);
+      hash_pod(_mHash, quat->y);
+      hash_pod(_mHash, quat->z);
+      hash_pod(_mHash, quat->s);
+      break;
+    }
+    default:
+      // list constants are described by their children
+      break;
+  }
+}
+
+std::string SemanticFingerprintVisitor::finish() {
+  return SHA256::toHex(_mHash.finish());
+}
+
+}
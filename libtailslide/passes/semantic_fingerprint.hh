@@ -0,0 +1,38 @@
+#ifndef TAILSLIDE_SEMANTIC_FINGERPRINT_HH
+#define TAILSLIDE_SEMANTIC_FINGERPRINT_HH
+
+#include <string>
+#include <unordered_map>
+
+#include "../sha256.hh"
+#include "../visitor.hh"
+
+namespace Tailslide {
+
+/// Hashes the tree with everything that can't affect behavior left out, so
+/// scripts that only differ in formatting, comments, redundant parentheses
+/// or the names of user-defined symbols get the same fingerprint.
+///
+/// User-defined symbols are hashed as the order they're first referenced in,
+/// so symbols must have been resolved and types determined beforehand.
+class SemanticFingerprintVisitor : public ASTVisitor {
+  public:
+    bool visit(LSLASTNode *node) override;
+    bool visit(LSLASTNullNode *node) override { return visit((LSLASTNode *)node); }
+    bool visit(LSLASTNodeList<LSLASTNode> *node) override { return visit((LSLASTNode *)node); }
+    bool visit(LSLParenthesisExpression *parens_expr) override;
+
+    /// hex digest of the tree visited so far.
+    std::string finish();
+
+  protected:
+    void hashIdentifier(LSLIdentifier *id);
+    void hashConstant(LSLConstant *constant);
+
+    SHA256 _mHash {};
+    std::unordered_map<LSLSymbol *, uint32_t> _mSymbolIds {};
+};
+
+}
+
+#endif //TAILSLIDE_SEMANTIC_FINGERPRINT_HH
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include "subexpression_elimination.hh"
+
+namespace Tailslide {
+
+static std::string constant_key(LSLConstant *cv) {
+  char buf[128];
+  switch (cv->getNodeSubType()) {
+    case NODE_INTEGER_CONSTANT:
+      snprintf(buf, sizeof(buf), "i%d", ((LSLIntegerConstant *) cv)->getValue());
+      return buf;
+    case NODE_FLOAT_CONSTANT:
+      snprintf(buf, sizeof(buf), "f%a", ((LSLFloatConstant *) cv)->getValue());
+      return buf;
+    case NODE_STRING_CONSTANT:
+      return std::string("s\"") + escape_string(((LSLStringConstant *) cv)->getValue()) + "\"";
+    case NODE_KEY_CONSTANT:
+      return std::string("k\"") + escape_string(((LSLKeyConstant *) cv)->getValue()) + "\"";
+    case NODE_VECTOR_CONSTANT: {
+      auto *val = ((LSLVectorConstant *) cv)->getValue();
+      snprintf(buf, sizeof(buf), "v<%a,%a,%a>", val->x, val->y, val->z);
+      return buf;
+    }
+    case NODE_QUATERNION_CONSTANT: {
+      auto *val = ((LSLQuaternionConstant *) cv)->getValue();
+      snprintf(buf, sizeof(buf), "q<%a,%a,%a,%a>", val->x, val->y, val->z, val->s);
+      return buf;
+    }
+    default:
+      // list constants aren't worth comparing
+      return "";
+  }
+}
+
+static bool is_simple_numeric(LSLIType type) {
+  return type == LST_INTEGER || type == LST_FLOATINGPOINT;
+}
+
+/// Get the expression a statement unconditionally evaluates, if any
+static LSLExpression *get_evaluated_expr(LSLStatement *stmt) {
+  switch (stmt->getNodeSubType()) {
+    case NODE_EXPRESSION_STATEMENT:
+      return ((LSLExpressionStatement *) stmt)->getExpr();
+    case NODE_DECLARATION:
+      return ((LSLDeclaration *) stmt)->getInitializer();
+    case NODE_RETURN_STATEMENT:
+      return ((LSLReturnStatement *) stmt)->getExpr();
+    case NODE_IF_STATEMENT:
+      return ((LSLIfStatement *) stmt)->getCheckExpr();
+    default:
+      return nullptr;
+  }
+}
+
+/// Collect the symbols an expression may assign to, and whether it may call user functions
+static void collect_side_effects(LSLASTNode *node, std::set<LSLSymbol *> &mutated, bool &calls_user_funcs) {
+  if (node->getNodeType() == NODE_EXPRESSION) {
+    auto *expr = (LSLExpression *) node;
+    if (operation_mutates(expr->getOperation())) {
+      if (auto *sym = expr->getChild(0)->getSymbol())
+        mutated.insert(sym);
+    } else if (expr->getNodeSubType() == NODE_FUNCTION_EXPRESSION) {
+      auto *sym = expr->getSymbol();
+      if (!sym || sym->getSubType() != SYM_BUILTIN)
+        calls_user_funcs = true;
+    }
+  }
+  for (auto *child : *node)
+    collect_side_effects(child, mutated, calls_user_funcs);
+}
+
+static bool uses_globals(const std::set<LSLSymbol *> &symbols) {
+  return std::any_of(symbols.begin(), symbols.end(), [](LSLSymbol *sym) {
+    return sym->getSubType() == SYM_GLOBAL;
+  });
+}
+
+bool SubexpressionEliminatingVisitor::visit(LSLCompoundStatement *compound_stmt) {
+  if (compound_stmt->mContext->overBudget(compound_stmt->getLoc(), true))
+    return false;
+  // take a copy since we'll be inserting declarations as we go
+  std::vector<LSLStatement *> stmts;
+  for (auto *child : *compound_stmt)
+    stmts.push_back((LSLStatement *) child);
+
+  // split the statement list into basic blocks. Labels start a new block, anything
+  // that branches or contains nested statements ends one.
+  std::vector<LSLStatement *> block;
+  for (auto *stmt : stmts) {
+    switch (stmt->getNodeSubType()) {
+      case NODE_EXPRESSION_STATEMENT:
+      case NODE_DECLARATION:
+        block.push_back(stmt);
+        break;
+      case NODE_NOP_STATEMENT:
+        break;
+      case NODE_RETURN_STATEMENT:
+      case NODE_IF_STATEMENT:
+        // the expression is still evaluated before leaving the block
+        block.push_back(stmt);
+        processBlock(compound_stmt, block);
+        block.clear();
+        break;
+      default:
+        processBlock(compound_stmt, block);
+        block.clear();
+        break;
+    }
+  }
+  processBlock(compound_stmt, block);
+  return true;
+}
+
+void SubexpressionEliminatingVisitor::processBlock(
+    LSLCompoundStatement *compound_stmt, const std::vector<LSLStatement *> &block) {
+  std::vector<Candidate> candidates;
+  // candidates whose operands haven't been clobbered yet
+  std::unordered_map<std::string, size_t> open_candidates;
+  ExpressionInfoList found;
+
+  for (auto *stmt : block) {
+    // nothing's been changed yet, so the block can just be left as it is
+    if (stmt->mContext->overBudget(stmt->getLoc(), true))
+      return;
+    auto *expr = get_evaluated_expr(stmt);
+    if (!expr)
+      continue;
+
+    std::set<LSLSymbol *> mutated;
+    bool calls_user_funcs = false;
+    collect_side_effects(expr, mutated, calls_user_funcs);
+    auto clobbers = [&](const std::set<LSLSymbol *> &symbols) {
+      if (calls_user_funcs && uses_globals(symbols))
+        return true;
+      return std::any_of(symbols.begin(), symbols.end(), [&](LSLSymbol *sym) {
+        return mutated.find(sym) != mutated.end();
+      });
+    };
+
+    found.clear();
+    analyze(expr, found);
+    for (auto &entry : found) {
+      auto *sub_expr = entry.first;
+      auto &info = entry.second;
+      // nothing to gain over a plain local load
+      if (info.cost <= 1)
+        continue;
+      // leave constant expressions to the constant folder
+      if (sub_expr->getConstantValue())
+        continue;
+      // result of the statement's expression is just thrown away
+      if (sub_expr == expr && stmt->getNodeSubType() == NODE_EXPRESSION_STATEMENT)
+        continue;
+      // we can only hoist this if its operands aren't touched by the statement itself
+      if (clobbers(info.symbols))
+        continue;
+
+      auto cand_iter = open_candidates.find(info.key);
+      if (cand_iter == open_candidates.end()) {
+        cand_iter = open_candidates.emplace(info.key, candidates.size()).first;
+        candidates.push_back({sub_expr->getType(), info.cost, info.symbols, {}});
+      }
+      candidates[cand_iter->second].occurrences.push_back(sub_expr);
+    }
+
+    // any later occurrences of an expression depending on something this statement
+    // changed won't have the same value.
+    countWalk(compound_stmt, open_candidates.size());
+    for (auto iter = open_candidates.begin(); iter != open_candidates.end();) {
+      if (clobbers(candidates[iter->second].symbols))
+        iter = open_candidates.erase(iter);
+      else
+        ++iter;
+    }
+  }
+
+  // handle the most expensive expressions first so their subexpressions don't get split out
+  // of them needlessly.
+  std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+    return a.cost > b.cost;
+  });
+  for (auto &candidate : candidates) {
+    // each elimination stands on its own, stopping between them is fine
+    if (compound_stmt->mContext->overBudget(compound_stmt->getLoc(), true))
+      break;
+    if (candidate.occurrences.size() >= 2 && eliminate(compound_stmt, candidate))
+      ++mEliminatedCount;
+  }
+}
+
+bool SubexpressionEliminatingVisitor::eliminate(LSLCompoundStatement *compound_stmt, Candidate &candidate) {
+  std::vector<LSLExpression *> live;
+  for (auto *occurrence : candidate.occurrences) {
+    if (_mDeadNodes.find(occurrence) == _mDeadNodes.end())
+      live.push_back(occurrence);
+  }
+
+  // loading the result `n - 1` times must at least be cheaper than evaluating
+  // the expression `n - 1` extra times.
+  int num_live = (int) live.size();
+  if (num_live < 2 || (num_live - 1) * candidate.cost <= num_live - 1)
+    return false;
+
+  auto *symtab = compound_stmt->getSymbolTable();
+  if (!symtab)
+    return false;
+
+  // find the earliest statement that contains an occurrence, the temporary
+  // will be declared right before it.
+  std::unordered_map<LSLASTNode *, int> stmt_positions;
+  int pos = 0;
+  for (auto *child : *compound_stmt)
+    stmt_positions[child] = pos++;
+  // this happens once per candidate, so it's quadratic in the size of the block.
+  countWalk(compound_stmt, pos);
+
+  LSLExpression *first = nullptr;
+  LSLASTNode *first_stmt = nullptr;
+  int first_pos = pos;
+  for (auto *occurrence : live) {
+    LSLASTNode *stmt = occurrence;
+    while (stmt->getParent() != compound_stmt)
+      stmt = stmt->getParent();
+    if (stmt_positions[stmt] < first_pos) {
+      first_pos = stmt_positions[stmt];
+      first_stmt = stmt;
+      first = occurrence;
+    }
+  }
+  assert(first != nullptr);
+
+  // if the first occurrence is a whole declaration's initializer then that local
+  // already holds the result, as long as nothing ever assigns to it.
+  if (first_stmt->getNodeSubType() == NODE_DECLARATION) {
+    auto *decl = (LSLDeclaration *) first_stmt;
+    auto *sym = decl->getSymbol();
+    if (decl->getInitializer() == first && sym && sym->getAssignments() == 0
+        && sym->getType() == candidate.type) {
+      for (auto *occurrence : live) {
+        if (occurrence == first)
+          continue;
+        markDead(occurrence);
+        LSLASTNode::replaceNode(occurrence, makeTempReference(sym));
+      }
+      return true;
+    }
+  }
+
+  // otherwise loading the temporary `n` times plus the initial store must be
+  // cheaper than evaluating the expression `n - 1` extra times.
+  if ((num_live - 1) * candidate.cost <= num_live + 1)
+    return false;
+
+  auto *type = candidate.type;
+  const char *name = pickTempName(compound_stmt);
+  auto *identifier = _mAllocator->newTracked<LSLIdentifier>(type, name);
+  auto *decl = _mAllocator->newTracked<LSLDeclaration>(identifier, nullptr);
+  decl->setLoc(first_stmt->getLoc());
+  auto *sym = _mAllocator->newTracked<LSLSymbol>(
+      name, type, SYM_VARIABLE, SYM_LOCAL, first_stmt->getLoc(), nullptr, decl
+  );
+  identifier->setSymbol(sym);
+  symtab->define(sym);
+
+  // move the first occurrence into the declaration, any subexpressions in it
+  // are still live.
+  LSLASTNode::replaceNode(first, makeTempReference(sym));
+  first->setResultNeeded(true);
+  decl->setInitializer(first);
+  compound_stmt->insertChildBefore(first_stmt, decl);
+
+  for (auto *occurrence : live) {
+    if (occurrence == first)
+      continue;
+    markDead(occurrence);
+    LSLASTNode::replaceNode(occurrence, makeTempReference(sym));
+  }
+  return true;
+}
+
+LSLLValueExpression *SubexpressionEliminatingVisitor::makeTempReference(LSLSymbol *sym) {
+  auto *identifier = _mAllocator->newTracked<LSLIdentifier>(sym->getType(), sym->getName());
+  identifier->setSymbol(sym);
+  auto *lvalue = _mAllocator->newTracked<LSLLValueExpression>(identifier, nullptr);
+  lvalue->setType(sym->getType());
+  return lvalue;
+}
+
+const char *SubexpressionEliminatingVisitor::pickTempName(LSLCompoundStatement *compound_stmt) {
+  char buf[30];
+  while (true) {
+    snprintf(buf, sizeof(buf), "_cse%d", _mTempNum++);
+    // Make sure this doesn't collide with or shadow anything visible from here
+    if (!compound_stmt->lookupSymbol(buf, SYM_ANY))
+      return _mAllocator->copyStr(buf);
+  }
+}
+
+void SubexpressionEliminatingVisitor::countWalk(LSLASTNode *node, uint64_t walked) {
+  if (node->mContext && node->mContext->stats)
+    node->mContext->stats->countWalk(walked);
+}
+
+void SubexpressionEliminatingVisitor::markDead(LSLASTNode *node) {
+  _mDeadNodes.insert(node);
+  for (auto *child : *node)
+    markDead(child);
+}
+
+/// rough cost of the operation itself, not including its operands
+int SubexpressionEliminatingVisitor::operationCost(LSLExpression *expr) {
+  if (!_mMonoSemantics) {
+    // every operation is a single opcode dispatch, library calls are considerably more expensive.
+    if (expr->getNodeSubType() == NODE_FUNCTION_EXPRESSION)
+      return 4;
+    return 1;
+  }
+
+  // In Mono, anything other than simple numeric operations is a call into the runtime.
+  switch (expr->getNodeSubType()) {
+    case NODE_FUNCTION_EXPRESSION:
+      return 3;
+    case NODE_VECTOR_EXPRESSION:
+    case NODE_QUATERNION_EXPRESSION:
+      return 2;
+    case NODE_LIST_EXPRESSION:
+      // each element has to be boxed
+      return 1 + 2 * expr->getNumChildren();
+    default:
+      break;
+  }
+  if (!is_simple_numeric(expr->getIType()))
+    return 3;
+  for (auto *child : *expr) {
+    if (!is_simple_numeric(child->getIType()))
+      return 3;
+  }
+  return 1;
+}
+
+SubexpressionEliminatingVisitor::ExpressionInfo SubexpressionEliminatingVisitor::analyze(
+    LSLExpression *expr, ExpressionInfoList &found) {
+  ExpressionInfo info;
+  auto sub_type = expr->getNodeSubType();
+
+  switch (sub_type) {
+    case NODE_CONSTANT_EXPRESSION:
+      info.key = constant_key(expr->getConstantValue());
+      info.pure = !info.key.empty();
+      info.cost = 1;
+      return info;
+    case NODE_LVALUE_EXPRESSION: {
+      auto *lvalue = (LSLLValueExpression *) expr;
+      auto *sym = lvalue->getSymbol();
+      if (!sym) {
+        info.pure = false;
+        return info;
+      }
+      char buf[64];
+      snprintf(buf, sizeof(buf), "l%p", (void *) sym);
+      info.key = buf;
+      info.cost = 1;
+      if (auto *member = lvalue->getMember()) {
+        info.key += std::string(".") + member->getName();
+        // Mono needs an extra field load
+        if (_mMonoSemantics)
+          info.cost = 2;
+      }
+      info.symbols.insert(sym);
+      return info;
+    }
+    case NODE_PARENTHESIS_EXPRESSION:
+      // parentheses have no effect on the value
+      return analyze(((LSLParenthesisExpression *) expr)->getChildExpr(), found);
+    default:
+      break;
+  }
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%d:%d:%d(", (int) sub_type, (int) expr->getIType(), (int) expr->getOperation());
+  info.key = buf;
+  info.cost = operationCost(expr);
+
+  LSLASTNode *operands = expr;
+  switch (sub_type) {
+    case NODE_BINARY_EXPRESSION:
+    case NODE_UNARY_EXPRESSION: {
+      auto op = expr->getOperation();
+      // division and modulus may raise math errors, they can't be evaluated early.
+      if (operation_mutates(op) || op == OP_DIV || op == OP_MOD)
+        info.pure = false;
+      break;
+    }
+    case NODE_TYPECAST_EXPRESSION:
+    case NODE_BOOL_CONVERSION_EXPRESSION:
+    case NODE_VECTOR_EXPRESSION:
+    case NODE_QUATERNION_EXPRESSION:
+    case NODE_LIST_EXPRESSION:
+      break;
+    case NODE_FUNCTION_EXPRESSION: {
+      auto *func_expr = (LSLFunctionExpression *) expr;
+      auto *sym = func_expr->getSymbol();
+      if (!sym || sym->getSubType() != SYM_BUILTIN || !sym->getPure())
+        info.pure = false;
+      snprintf(buf, sizeof(buf), "%p", (void *) sym);
+      info.key += buf;
+      operands = func_expr->getArguments();
+      break;
+    }
+    default:
+      info.pure = false;
+      break;
+  }
+
+  if (operands) {
+    for (auto *child : *operands) {
+      if (child->getNodeType() != NODE_EXPRESSION) {
+        info.pure = false;
+        continue;
+      }
+      auto child_info = analyze((LSLExpression *) child, found);
+      info.pure = info.pure && child_info.pure;
+      info.cost += child_info.cost;
+      info.key += child_info.key + ",";
+      info.symbols.insert(child_info.symbols.begin(), child_info.symbols.end());
+    }
+  }
+  info.key += ")";
+
+  auto itype = expr->getIType();
+  if (itype == LST_NULL || itype == LST_ERROR)
+    info.pure = false;
+
+  if (info.pure)
+    found.emplace_back(expr, info);
+  return info;
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "../lslmini.hh"
+#include "../visitor.hh"
+
+namespace Tailslide {
+
+/// Replaces pure subexpressions repeated within a basic block with a reference to a
+/// temporary local, when evaluating them repeatedly is costlier than loading the local.
+class SubexpressionEliminatingVisitor : public ASTVisitor {
+  public:
+    SubexpressionEliminatingVisitor(ScriptAllocator *allocator, bool mono_semantics)
+      : _mAllocator(allocator), _mMonoSemantics(mono_semantics) {}
+
+    int mEliminatedCount = 0;
+
+  protected:
+    struct ExpressionInfo {
+      // structurally equal expressions with the same key always evaluate to the same value
+      std::string key;
+      // no side-effects and no way to fail, so it may be evaluated early
+      bool pure = true;
+      // rough cost of evaluating the expression, in units of a local variable load
+      int cost = 0;
+      std::set<LSLSymbol *> symbols;
+    };
+    struct Candidate {
+      LSLType *type;
+      int cost;
+      std::set<LSLSymbol *> symbols;
+      std::vector<LSLExpression *> occurrences;
+    };
+    typedef std::vector<std::pair<LSLExpression *, ExpressionInfo>> ExpressionInfoList;
+
+    virtual bool visit(LSLCompoundStatement *compound_stmt);
+    virtual bool visit(LSLExpression *expr) { return false; };
+
+    void processBlock(LSLCompoundStatement *compound_stmt, const std::vector<LSLStatement *> &block);
+    bool eliminate(LSLCompoundStatement *compound_stmt, Candidate &candidate);
+    ExpressionInfo analyze(LSLExpression *expr, ExpressionInfoList &found);
+    int operationCost(LSLExpression *expr);
+    void markDead(LSLASTNode *node);
+    static void countWalk(LSLASTNode *node, uint64_t walked);
+    const char *pickTempName(LSLCompoundStatement *compound_stmt);
+    LSLLValueExpression *makeTempReference(LSLSymbol *sym);
+
+    ScriptAllocator *_mAllocator;
+    bool _mMonoSemantics;
+    int _mTempNum = 0;
+    // expressions that were detached from the tree by an earlier replacement
+    std::unordered_set<LSLASTNode *> _mDeadNodes;
+};
+
+}
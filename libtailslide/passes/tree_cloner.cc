@@ -0,0 +1,98 @@
+#include "tree_cloner.hh"
+
+namespace Tailslide {
+
+LSLASTNode *TreeCloner::clone(LSLASTNode *node) {
+  _mNodeMap.clear();
+  _mSymbolMap.clear();
+  _mTableMap.clear();
+
+  auto *new_node = cloneNode(node);
+
+  // Now that everything has been copied we can point the copied symbols
+  // and tables at the copied nodes instead of the originals.
+  for (auto &sym_pair : _mSymbolMap) {
+    auto *new_sym = sym_pair.second;
+    new_sym->_mFunctionDecl = (LSLParamList *)mapNode(new_sym->_mFunctionDecl);
+    new_sym->_mVarDecl = mapNode(new_sym->_mVarDecl);
+    new_sym->_mLabelDecl = (LSLLabel *)mapNode(new_sym->_mLabelDecl);
+    new_sym->_mConstantValue = mapConstant(new_sym->_mConstantValue);
+  }
+  for (auto &table_pair : _mTableMap) {
+    auto *new_table = table_pair.second;
+    for (auto &entry : new_table->_mSymbols)
+      entry.second = mapSymbol(entry.second);
+    for (auto &label : new_table->_mLabels)
+      label = (LSLLabel *)mapNode(label);
+  }
+  fixupNode(new_node);
+  return new_node;
+}
+
+LSLASTNode *TreeCloner::cloneNode(LSLASTNode *node) {
+  auto *new_node = node->shallowClone(_mAllocator);
+  _mNodeMap[node] = new_node;
+  new_node->_mParent = nullptr;
+  new_node->_mNext = nullptr;
+  new_node->_mPrev = nullptr;
+  new_node->_mChildren = nullptr;
+  new_node->_mChildrenTail = nullptr;
+  // even if the original was shared, the copy only belongs to the new tree.
+  new_node->_mStaticNode = false;
+
+  if (auto *table = node->getSymbolTable()) {
+    auto *new_table = _mAllocator->cloneTracked(*table);
+    _mTableMap[table] = new_table;
+    for (auto &entry : table->getMap()) {
+      if (_mSymbolMap.find(entry.second) == _mSymbolMap.end())
+        _mSymbolMap[entry.second] = _mAllocator->cloneTracked(*entry.second);
+    }
+    if (auto *table_manager = new_node->mContext->table_manager)
+      table_manager->registerTable(new_table);
+  }
+
+  for (auto *child : *node)
+    new_node->pushChild(cloneNode(child));
+  return new_node;
+}
+
+void TreeCloner::fixupNode(LSLASTNode *new_node) {
+  if (auto *table = new_node->_mSymbolTable)
+    new_node->_mSymbolTable = _mTableMap[table];
+  new_node->_mConstantValue = mapConstant(new_node->_mConstantValue);
+  if (new_node->getNodeType() == NODE_IDENTIFIER) {
+    auto *id = (LSLIdentifier *)new_node;
+    id->setSymbol(mapSymbol(id->getSymbol()));
+  }
+  for (auto *child : *new_node)
+    fixupNode(child);
+}
+
+LSLSymbol *TreeCloner::mapSymbol(LSLSymbol *sym) {
+  auto sym_iter = _mSymbolMap.find(sym);
+  if (sym_iter == _mSymbolMap.end())
+    return sym;
+  return sym_iter->second;
+}
+
+LSLConstant *TreeCloner::mapConstant(LSLConstant *constant) {
+  if (!constant || constant->isStatic())
+    return constant;
+  auto node_iter = _mNodeMap.find(constant);
+  if (node_iter != _mNodeMap.end())
+    return (LSLConstant *)node_iter->second;
+  // Constant values that aren't part of the tree still need to be copied,
+  // later passes may decide to splice them into the tree.
+  auto *new_constant = cloneNode(constant);
+  fixupNode(new_constant);
+  return (LSLConstant *)new_constant;
+}
+
+LSLASTNode *TreeCloner::mapNode(LSLASTNode *node) {
+  auto node_iter = _mNodeMap.find(node);
+  if (node_iter == _mNodeMap.end())
+    return node;
+  return node_iter->second;
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "../lslmini.hh"
+
+namespace Tailslide {
+
+/// Makes deep copies of subtrees that can be freely rewritten without affecting
+/// the original. Symbols and symbol tables declared within the subtree are copied
+/// along with it, anything declared outside of it (builtins included) is shared.
+class TreeCloner {
+  public:
+    explicit TreeCloner(ScriptAllocator *allocator): _mAllocator(allocator) {};
+
+    LSLASTNode *clone(LSLASTNode *node);
+    template<typename T>
+    T *cloneAs(T *node) { return (T *)clone(node); }
+
+  protected:
+    LSLASTNode *cloneNode(LSLASTNode *node);
+    void fixupNode(LSLASTNode *new_node);
+    LSLSymbol *mapSymbol(LSLSymbol *sym);
+    LSLConstant *mapConstant(LSLConstant *constant);
+    LSLASTNode *mapNode(LSLASTNode *node);
+
+    ScriptAllocator *_mAllocator;
+    std::unordered_map<LSLASTNode *, LSLASTNode *> _mNodeMap {};
+    std::unordered_map<LSLSymbol *, LSLSymbol *> _mSymbolMap {};
+    std::unordered_map<LSLSymbolTable *, LSLSymbolTable *> _mTableMap {};
+};
+
+}
@@ -32,9 +32,16 @@ bool TreeSimplifyingVisitor::visit(LSLDeclaration *decl_stmt) {
 }
 
 bool TreeSimplifyingVisitor::visit(LSLGlobalFunction *glob_func) {
+  // leave the rest of the script alone once we can't afford it
+  if (glob_func->mContext->overBudget(glob_func->getLoc()))
+    return false;
   return handleGlobal(glob_func);
 }
 
+bool TreeSimplifyingVisitor::visit(LSLEventHandler *handler) {
+  return !handler->mContext->overBudget(handler->getLoc());
+}
+
 bool TreeSimplifyingVisitor::visit(LSLGlobalVariable *glob_var) {
   return handleGlobal(glob_var);
 }
@@ -42,6 +49,8 @@ bool TreeSimplifyingVisitor::visit(LSLGlobalVariable *glob_var) {
 bool TreeSimplifyingVisitor::visit(LSLExpression *expr) {
   if (!mOpts.fold_constants)
     return true;
+  if (expr->mContext->overBudget(expr->getLoc(), true))
+    return false;
 
   LSLConstant *cv = expr->getConstantValue();
   if(!cv)
@@ -11,8 +11,12 @@ struct OptimizationOptions {
     bool prune_unused_globals = false;
     bool prune_unused_functions = false;
     bool may_create_new_strs = false;
+    bool eliminate_common_subexpressions = false;
+    // whether costs should be estimated for Mono rather than LSO
+    bool mono_semantics = false;
     explicit operator bool() const {
-      return fold_constants || prune_unused_functions || prune_unused_locals || prune_unused_globals;
+      return fold_constants || prune_unused_functions || prune_unused_locals || prune_unused_globals
+          || eliminate_common_subexpressions;
     }
 };
 
@@ -25,6 +29,7 @@ class TreeSimplifyingVisitor: public ASTVisitor {
     virtual bool visit(LSLDeclaration *decl_stmt);
     virtual bool visit(LSLGlobalVariable *glob_var);
     virtual bool visit(LSLGlobalFunction *glob_func);
+    virtual bool visit(LSLEventHandler *handler);
     virtual bool visit(LSLExpression *expr);
     virtual bool visit(LSLLValueExpression *lvalue);
     virtual bool visit(LSLConstantExpression *constant_expr);
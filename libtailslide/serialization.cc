@@ -0,0 +1,974 @@
+#include <cstring>
+
+#include "serialization.hh"
+
+namespace Tailslide {
+
+static const char SERIALIZED_SCRIPT_MAGIC[8] = {'T', 'S', 'L', 'S', 'C', 'R', 'P', 'T'};
+static const uint8_t NO_TYPE = 0xFF;
+
+enum SerializedNodeFlags : uint8_t {
+  NODE_FLAG_SYNTHESIZED = 1 << 0,
+  NODE_FLAG_CONSTANT_PRECLUDED = 1 << 1,
+  NODE_FLAG_DECLARATION_ALLOWED = 1 << 2,
+  NODE_FLAG_WAS_NEGATED = 1 << 3,
+  NODE_FLAG_RESULT_NEEDED = 1 << 4,
+  NODE_FLAG_FOLDABLE = 1 << 5,
+  NODE_FLAG_BREAK_LIKE = 1 << 6,
+  NODE_FLAG_CONTINUE_LIKE = 1 << 7,
+};
+
+enum SerializedSymbolFlags : uint8_t {
+  SYMBOL_FLAG_CONSTANT_PRECLUDED = 1 << 0,
+  SYMBOL_FLAG_ALL_PATHS_RETURN = 1 << 1,
+  SYMBOL_FLAG_HAS_JUMPS = 1 << 2,
+  SYMBOL_FLAG_HAS_UNSTRUCTURED_JUMPS = 1 << 3,
+  SYMBOL_FLAG_PURE = 1 << 4,
+};
+
+enum SerializedSymbolRef : uint8_t {
+  SYMBOL_REF_NONE = 0,
+  SYMBOL_REF_SCRIPT = 1,
+  SYMBOL_REF_BUILTIN = 2,
+};
+
+/// constants that aren't part of the tree are shared with the builtins
+/// and types, so they're referred to by what owns them.
+enum SerializedConstantRef : uint8_t {
+  CONSTANT_REF_NONE = 0,
+  CONSTANT_REF_NODE = 1,
+  CONSTANT_REF_TYPE_DEFAULT = 2,
+  CONSTANT_REF_TYPE_ONE = 3,
+  CONSTANT_REF_BUILTIN = 4,
+  CONSTANT_REF_KIND_BITS = 3,
+};
+
+// the header is all that's needed to tell if a serialized script is usable.
+static void write_header(std::string &out) {
+  out.append(SERIALIZED_SCRIPT_MAGIC, sizeof(SERIALIZED_SCRIPT_MAGIC));
+  for (int i = 0; i < 4; ++i)
+    out += (char)((SERIALIZED_SCRIPT_VERSION >> (8 * i)) & 0xFF);
+  const auto &builtins_version = tailslide_builtins_version();
+  out += (char)builtins_version.size();
+  out += builtins_version;
+}
+
+
+std::string ScriptSerializer::serialize(LSLScript *script, bool ast_sane) {
+  for (auto &entry : script->mContext->builtins->getMap()) {
+    _mBuiltinSymbols.insert(entry.second);
+    if (auto *constant = entry.second->getConstantValue())
+      _mBuiltinConstants.emplace(constant, entry.first);
+  }
+  // keep the tables in the order they were registered in, mangled names depend on it.
+  if (auto *table_manager = script->mContext->table_manager) {
+    for (auto *table : table_manager->getTables())
+      indexSymbolTable(table);
+  }
+  indexNode(script);
+
+  // anything the tree holds onto that isn't in it needs to be written out too.
+  std::vector<LSLASTNode *> tree_nodes(_mNodeIds.size());
+  for (auto &node_pair : _mNodeIds)
+    tree_nodes[node_pair.second] = node_pair.first;
+  for (auto *node : tree_nodes)
+    indexConstant(node->LSLASTNode::getConstantValue());
+  for (auto *sym : _mSymbols)
+    indexConstant(sym->getConstantValue());
+
+  writeVarInt(ast_sane);
+  writeVarInt(_mNodeIds.size());
+  writeVarInt(1 + _mDetachedConstants.size());
+  writeNode(script);
+  for (auto *constant : _mDetachedConstants)
+    writeNode(constant);
+  writeVarInt(_mSymbols.size());
+  for (auto *sym : _mSymbols)
+    writeSymbol(sym);
+  writeVarInt(_mTables.size());
+  for (auto *table : _mTables)
+    writeSymbolTable(table);
+  if (_mFailed)
+    return "";
+
+  std::string body(std::move(_mOut));
+  _mOut.clear();
+  write_header(_mOut);
+  writeVarInt(_mStrings.size());
+  for (auto &str : _mStrings) {
+    writeVarInt(str.size());
+    _mOut += str;
+  }
+  _mOut += body;
+  return std::move(_mOut);
+}
+
+void ScriptSerializer::indexNode(LSLASTNode *node) {
+  _mNodeIds.emplace(node, (uint32_t)_mNodeIds.size());
+  if (auto *table = node->getSymbolTable())
+    indexSymbolTable(table);
+  if (node->getNodeType() == NODE_IDENTIFIER) {
+    if (auto *sym = ((LSLIdentifier *)node)->getSymbol())
+      indexSymbol(sym);
+  }
+  for (auto *child : *node)
+    indexNode(child);
+}
+
+void ScriptSerializer::indexConstant(LSLConstant *constant) {
+  if (!constant || constant->isStatic() || _mNodeIds.find(constant) != _mNodeIds.end())
+    return;
+  _mDetachedConstants.push_back(constant);
+  indexNode(constant);
+}
+
+void ScriptSerializer::indexSymbolTable(LSLSymbolTable *table) {
+  if (_mTableIds.emplace(table, (uint32_t)_mTables.size()).second) {
+    _mTables.push_back(table);
+    for (auto &entry : table->getMap())
+      indexSymbol(entry.second);
+  }
+}
+
+void ScriptSerializer::indexSymbol(LSLSymbol *sym) {
+  if (_mBuiltinSymbols.count(sym))
+    return;
+  if (_mSymbolIds.emplace(sym, (uint32_t)_mSymbols.size()).second)
+    _mSymbols.push_back(sym);
+}
+
+void ScriptSerializer::writeNode(LSLASTNode *node) {
+  auto node_type = node->getNodeType();
+  auto sub_type = node->getNodeSubType();
+  uint8_t flags = 0;
+  if (node->getSynthesized())
+    flags |= NODE_FLAG_SYNTHESIZED;
+  if (node->getConstantPrecluded())
+    flags |= NODE_FLAG_CONSTANT_PRECLUDED;
+  if (node->getDeclarationAllowed())
+    flags |= NODE_FLAG_DECLARATION_ALLOWED;
+  if (node_type == NODE_CONSTANT && ((LSLConstant *)node)->wasNegated())
+    flags |= NODE_FLAG_WAS_NEGATED;
+  if (node_type == NODE_EXPRESSION && ((LSLExpression *)node)->getResultNeeded())
+    flags |= NODE_FLAG_RESULT_NEEDED;
+  if (sub_type == NODE_LVALUE_EXPRESSION && ((LSLLValueExpression *)node)->getIsFoldable())
+    flags |= NODE_FLAG_FOLDABLE;
+  if (sub_type == NODE_JUMP_STATEMENT) {
+    auto *jump = (LSLJumpStatement *)node;
+    if (jump->getIsBreakLike())
+      flags |= NODE_FLAG_BREAK_LIKE;
+    if (jump->getIsContinueLike())
+      flags |= NODE_FLAG_CONTINUE_LIKE;
+  }
+
+  writeRaw<uint8_t>(node_type);
+  writeRaw<uint8_t>(sub_type);
+  writeRaw<uint8_t>(flags);
+  writeType(node->getType());
+  writeLoc(node->getLoc());
+  // LSLIdentifier and friends compute their constant values, we want what's actually stored.
+  writeConstantRef(node->LSLASTNode::getConstantValue());
+  auto *table = node->getSymbolTable();
+  writeVarInt(table ? _mTableIds[table] + 1 : 0);
+
+  switch (node_type) {
+    case NODE_IDENTIFIER:
+      writeString(((LSLIdentifier *)node)->getName());
+      writeSymbolRef(((LSLIdentifier *)node)->getSymbol());
+      break;
+    case NODE_EXPRESSION:
+      writeRaw<uint8_t>(((LSLExpression *)node)->getOperation());
+      break;
+    case NODE_CONSTANT:
+      switch (sub_type) {
+        case NODE_INTEGER_CONSTANT:
+          writeSignedVarInt(((LSLIntegerConstant *)node)->getValue());
+          break;
+        case NODE_FLOAT_CONSTANT:
+          writeRaw<double>(((LSLFloatConstant *)node)->getValue());
+          break;
+        case NODE_STRING_CONSTANT:
+        case NODE_KEY_CONSTANT:
+          writeString(((LSLStringConstant *)node)->getValue());
+          break;
+        case NODE_VECTOR_CONSTANT: {
+          auto *vec = ((LSLVectorConstant *)node)->getValue();
+          writeRaw<float>(vec->x);
+          writeRaw<float>(vec->y);
+          writeRaw<float>(vec->z);
+          break;
+        }
+        case NODE_QUATERNION_CONSTANT: {
+          auto *quat = ((LSLQuaternionConstant *)node)->getValue();
+          writeRaw<float>(quat->x);
+          writeRaw<float>(quat->y);
+          writeRaw<float>(quat->z);
+          writeRaw<float>(quat->s);
+          break;
+        }
+        default:
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+
+  writeVarInt(node->getNumChildren());
+  for (auto *child : *node)
+    writeNode(child);
+}
+
+void ScriptSerializer::writeSymbol(LSLSymbol *sym) {
+  uint8_t flags = 0;
+  if (sym->getConstantPrecluded())
+    flags |= SYMBOL_FLAG_CONSTANT_PRECLUDED;
+  if (sym->getAllPathsReturn())
+    flags |= SYMBOL_FLAG_ALL_PATHS_RETURN;
+  if (sym->getHasJumps())
+    flags |= SYMBOL_FLAG_HAS_JUMPS;
+  if (sym->getHasUnstructuredJumps())
+    flags |= SYMBOL_FLAG_HAS_UNSTRUCTURED_JUMPS;
+  if (sym->getPure())
+    flags |= SYMBOL_FLAG_PURE;
+
+  writeString(sym->getName());
+  writeType(sym->getType());
+  writeRaw<uint8_t>(sym->getSymbolType());
+  writeRaw<uint8_t>(sym->getSubType());
+  writeRaw<uint8_t>(flags);
+  writeLoc(sym->getLoc());
+  writeNodeRef(sym->getFunctionDecl());
+  writeNodeRef(sym->getVarDecl());
+  writeNodeRef((LSLASTNode *)sym->getLabelDecl());
+  writeConstantRef(sym->getConstantValue());
+  writeVarInt(sym->getReferences());
+  writeVarInt(sym->getAssignments());
+}
+
+void ScriptSerializer::writeSymbolTable(LSLSymbolTable *table) {
+  writeRaw<uint8_t>(table->getTableType());
+  auto &symbols = table->getMap();
+  writeVarInt(symbols.size());
+  for (auto &entry : symbols)
+    writeSymbolRef(entry.second);
+  if (table->getTableType() == SYMTAB_FUNCTION) {
+    auto &labels = table->getLabels();
+    writeVarInt(labels.size());
+    for (auto *label : labels)
+      writeNodeRef((LSLASTNode *)label);
+  }
+}
+
+void ScriptSerializer::writeSymbolRef(LSLSymbol *sym) {
+  if (!sym) {
+    writeRaw<uint8_t>(SYMBOL_REF_NONE);
+  } else if (_mBuiltinSymbols.count(sym)) {
+    writeRaw<uint8_t>(SYMBOL_REF_BUILTIN);
+    writeString(sym->getName());
+    writeRaw<uint8_t>(sym->getSymbolType());
+  } else {
+    writeRaw<uint8_t>(SYMBOL_REF_SCRIPT);
+    writeVarInt(_mSymbolIds[sym]);
+  }
+}
+
+void ScriptSerializer::writeConstantRef(LSLConstant *constant) {
+  if (!constant) {
+    writeVarInt(CONSTANT_REF_NONE);
+    return;
+  }
+  auto node_iter = _mNodeIds.find(constant);
+  if (node_iter != _mNodeIds.end()) {
+    writeVarInt(((uint64_t)node_iter->second << CONSTANT_REF_KIND_BITS) | CONSTANT_REF_NODE);
+    return;
+  }
+  // must be one of the static constants then
+  auto *type = constant->getType();
+  if (type && type->getDefaultValue() == constant) {
+    writeVarInt(((uint64_t)type->getIType() << CONSTANT_REF_KIND_BITS) | CONSTANT_REF_TYPE_DEFAULT);
+    return;
+  }
+  if (type && type->getOneValue() == constant) {
+    writeVarInt(((uint64_t)type->getIType() << CONSTANT_REF_KIND_BITS) | CONSTANT_REF_TYPE_ONE);
+    return;
+  }
+  auto builtin_iter = _mBuiltinConstants.find(constant);
+  if (builtin_iter != _mBuiltinConstants.end()) {
+    writeVarInt(CONSTANT_REF_BUILTIN);
+    writeString(builtin_iter->second);
+    return;
+  }
+  _mFailed = true;
+}
+
+void ScriptSerializer::writeNodeRef(LSLASTNode *node) {
+  auto node_iter = _mNodeIds.find(node);
+  // declarations can be pruned out from under their symbols
+  writeVarInt(node_iter == _mNodeIds.end() ? 0 : node_iter->second + 1);
+}
+
+void ScriptSerializer::writeLoc(const YYLTYPE *loc) {
+  writeSignedVarInt(loc->first_line);
+  writeSignedVarInt(loc->first_column);
+  writeSignedVarInt(loc->last_line);
+  writeSignedVarInt(loc->last_column);
+}
+
+void ScriptSerializer::writeType(LSLType *type) {
+  writeRaw<uint8_t>(type ? type->getIType() : NO_TYPE);
+}
+
+void ScriptSerializer::writeVarInt(uint64_t val) {
+  do {
+    uint8_t byte = val & 0x7F;
+    val >>= 7;
+    if (val)
+      byte |= 0x80;
+    _mOut += (char)byte;
+  } while (val);
+}
+
+void ScriptSerializer::writeSignedVarInt(int64_t val) {
+  // zigzag encode so small negative numbers stay small
+  writeVarInt(((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+}
+
+void ScriptSerializer::writeString(const char *str) {
+  auto str_iter = _mStringIds.find(str);
+  if (str_iter == _mStringIds.end()) {
+    str_iter = _mStringIds.emplace(str, (uint32_t)_mStrings.size()).first;
+    _mStrings.emplace_back(str);
+  }
+  writeVarInt(str_iter->second);
+}
+
+template<typename T>
+void ScriptSerializer::writeRaw(T val) {
+  char buf[sizeof(T)];
+  memcpy(buf, &val, sizeof(T));
+  _mOut.append(buf, sizeof(T));
+}
+
+
+LSLScript *ScriptDeserializer::deserialize(const char *buf, size_t buf_len, bool *ast_sane) {
+  _mPos = buf;
+  _mEnd = buf + buf_len;
+
+  std::string expected_header;
+  write_header(expected_header);
+  if (buf_len < expected_header.size() || memcmp(buf, expected_header.data(), expected_header.size()) != 0)
+    return nullptr;
+  _mPos += expected_header.size();
+
+  auto num_strings = readVarInt();
+  // every string takes at least one byte, don't let a bad count make us allocate the world
+  if (num_strings > (uint64_t)(_mEnd - _mPos))
+    return nullptr;
+  _mStrings.reserve(num_strings);
+  for (uint64_t i = 0; i < num_strings && !_mFailed; ++i) {
+    auto len = readVarInt();
+    if (len > (uint64_t)(_mEnd - _mPos)) {
+      fail();
+      break;
+    }
+    char *str = _mAllocator->alloc(len + 1);
+    memcpy(str, _mPos, len);
+    str[len] = '\0';
+    _mPos += len;
+    _mStrings.push_back(str);
+  }
+
+  *ast_sane = readVarInt() != 0;
+  auto num_tree_nodes = readVarInt();
+  auto num_roots = readVarInt();
+  if (_mFailed || num_tree_nodes > (uint64_t)(_mEnd - _mPos))
+    return nullptr;
+  _mNodes.reserve(num_tree_nodes);
+  _mNodeConstants.reserve(num_tree_nodes);
+  _mNodeTables.reserve(num_tree_nodes);
+
+  LSLASTNode *root = nullptr;
+  for (uint64_t i = 0; i < num_roots && !_mFailed; ++i) {
+    auto *node = readNode();
+    if (!i)
+      root = node;
+    else if (node && node->getNodeType() != NODE_CONSTANT)
+      fail();
+  }
+  if (_mFailed || !root || root->getNodeType() != NODE_SCRIPT)
+    return nullptr;
+
+  auto num_symbols = readVarInt();
+  if (num_symbols > (uint64_t)(_mEnd - _mPos))
+    return nullptr;
+  for (uint64_t i = 0; i < num_symbols && !_mFailed; ++i)
+    readSymbol();
+  auto num_tables = readVarInt();
+  if (num_tables > (uint64_t)(_mEnd - _mPos))
+    return nullptr;
+  for (uint64_t i = 0; i < num_tables && !_mFailed; ++i)
+    readSymbolTable();
+  if (_mFailed || _mPos != _mEnd)
+    return nullptr;
+
+  // now that everything exists the cross-references can be filled in
+  for (size_t i = 0; i < _mNodes.size(); ++i) {
+    auto *node = _mNodes[i];
+    bool precluded = node->getConstantPrecluded();
+    node->setConstantValue(resolveConstantRef(_mNodeConstants[i]));
+    node->setConstantPrecluded(precluded);
+    if (auto table_ref = _mNodeTables[i]) {
+      if (table_ref > _mTables.size())
+        return nullptr;
+      node->setSymbolTable(_mTables[table_ref - 1]);
+    }
+  }
+  for (size_t i = 0; i < _mSymbols.size(); ++i)
+    _mSymbols[i]->setConstantValue(resolveConstantRef(_mSymbolConstants[i]));
+  for (auto &id_pair : _mIdentifierSymbols) {
+    if (id_pair.second >= _mSymbols.size())
+      return nullptr;
+    id_pair.first->setSymbol(_mSymbols[id_pair.second]);
+  }
+  if (_mFailed)
+    return nullptr;
+  for (auto *table : _mTables)
+    _mContext->table_manager->registerTable(table);
+  return (LSLScript *)root;
+}
+
+LSLASTNode *ScriptDeserializer::readNode() {
+  auto node_type = readRaw<uint8_t>();
+  auto sub_type = readRaw<uint8_t>();
+  auto flags = readRaw<uint8_t>();
+  LSLType *type = nullptr;
+  readType(&type);
+  auto loc = readLoc();
+  auto constant_ref = readConstantRef();
+  auto table_ref = readVarInt();
+
+  const char *name = nullptr;
+  LSLSymbol *builtin_sym = nullptr;
+  uint64_t script_sym = UINT64_MAX;
+  auto operation = OP_NONE;
+  int int_val = 0;
+  double float_val = 0.0;
+  const char *str_val = nullptr;
+  float components[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+  switch (node_type) {
+    case NODE_IDENTIFIER: {
+      name = readString();
+      auto sym_kind = readRaw<uint8_t>();
+      if (sym_kind == SYMBOL_REF_BUILTIN) {
+        auto *sym_name = readString();
+        auto sym_type = (LSLSymbolType)readRaw<uint8_t>();
+        if (sym_name)
+          builtin_sym = _mContext->builtins->lookup(sym_name, sym_type);
+        if (!builtin_sym)
+          fail();
+      } else if (sym_kind == SYMBOL_REF_SCRIPT) {
+        script_sym = readVarInt();
+      } else if (sym_kind != SYMBOL_REF_NONE) {
+        fail();
+      }
+      break;
+    }
+    case NODE_EXPRESSION:
+      operation = (LSLOperator)readRaw<uint8_t>();
+      break;
+    case NODE_CONSTANT:
+      switch (sub_type) {
+        case NODE_INTEGER_CONSTANT:
+          int_val = (int)readSignedVarInt();
+          break;
+        case NODE_FLOAT_CONSTANT:
+          float_val = readRaw<double>();
+          break;
+        case NODE_STRING_CONSTANT:
+        case NODE_KEY_CONSTANT:
+          str_val = readString();
+          break;
+        case NODE_VECTOR_CONSTANT:
+          for (int i = 0; i < 3; ++i)
+            components[i] = readRaw<float>();
+          break;
+        case NODE_QUATERNION_CONSTANT:
+          for (float &component : components)
+            component = readRaw<float>();
+          break;
+        default:
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+
+  auto node_idx = _mNodes.size();
+  _mNodes.push_back(nullptr);
+  _mNodeConstants.push_back(constant_ref);
+  _mNodeTables.push_back(table_ref);
+
+  auto num_children = readVarInt();
+  // every node takes at least a few bytes
+  if (_mFailed || num_children > (uint64_t)(_mEnd - _mPos))
+    return nullptr;
+  std::vector<LSLASTNode *> children;
+  children.reserve(num_children);
+  for (uint64_t i = 0; i < num_children; ++i) {
+    auto *child = readNode();
+    if (!child)
+      return nullptr;
+    children.push_back(child);
+  }
+
+  LSLASTNode *node;
+  switch (node_type) {
+    case NODE_IDENTIFIER:
+      if (!name || !children.empty())
+        return nullptr;
+      node = _mAllocator->newTracked<LSLIdentifier>(name);
+      if (builtin_sym)
+        ((LSLIdentifier *)node)->setSymbol(builtin_sym);
+      else if (script_sym != UINT64_MAX)
+        _mIdentifierSymbols.emplace_back((LSLIdentifier *)node, script_sym);
+      break;
+    case NODE_CONSTANT:
+      if (sub_type != NODE_LIST_CONSTANT && !children.empty())
+        return nullptr;
+      switch (sub_type) {
+        case NODE_INTEGER_CONSTANT:
+          node = _mAllocator->newTracked<LSLIntegerConstant>(int_val);
+          break;
+        case NODE_FLOAT_CONSTANT:
+          node = _mAllocator->newTracked<LSLFloatConstant>(float_val);
+          break;
+        case NODE_STRING_CONSTANT:
+          if (!str_val)
+            return nullptr;
+          node = _mAllocator->newTracked<LSLStringConstant>(str_val);
+          break;
+        case NODE_KEY_CONSTANT:
+          if (!str_val)
+            return nullptr;
+          node = _mAllocator->newTracked<LSLKeyConstant>(str_val);
+          break;
+        case NODE_VECTOR_CONSTANT:
+          node = _mAllocator->newTracked<LSLVectorConstant>(components[0], components[1], components[2]);
+          break;
+        case NODE_QUATERNION_CONSTANT:
+          node = _mAllocator->newTracked<LSLQuaternionConstant>(
+              components[0], components[1], components[2], components[3]
+          );
+          break;
+        case NODE_LIST_CONSTANT:
+          node = _mAllocator->newTracked<LSLListConstant>(nullptr);
+          for (auto *child : children) {
+            if (child->getNodeType() != NODE_CONSTANT)
+              return nullptr;
+            node->pushChild(child);
+          }
+          break;
+        default:
+          return nullptr;
+      }
+      ((LSLConstant *)node)->setWasNegated(flags & NODE_FLAG_WAS_NEGATED);
+      break;
+    default:
+      node = constructNode(node_type, sub_type, children);
+      if (!node)
+        return nullptr;
+      break;
+  }
+
+  if (node_type == NODE_EXPRESSION) {
+    auto *expr = (LSLExpression *)node;
+    expr->setOperation(operation);
+    expr->setResultNeeded(flags & NODE_FLAG_RESULT_NEEDED);
+  }
+  if (sub_type == NODE_LVALUE_EXPRESSION)
+    ((LSLLValueExpression *)node)->setIsFoldable(flags & NODE_FLAG_FOLDABLE);
+  if (sub_type == NODE_JUMP_STATEMENT) {
+    auto *jump = (LSLJumpStatement *)node;
+    jump->setIsBreakLike(flags & NODE_FLAG_BREAK_LIKE);
+    jump->setIsContinueLike(flags & NODE_FLAG_CONTINUE_LIKE);
+  }
+  node->setType(type);
+  node->setLoc(&loc);
+  node->setSynthesized(flags & NODE_FLAG_SYNTHESIZED);
+  node->setConstantPrecluded(flags & NODE_FLAG_CONSTANT_PRECLUDED);
+  node->setDeclarationAllowed(flags & NODE_FLAG_DECLARATION_ALLOWED);
+  _mNodes[node_idx] = node;
+  return node;
+}
+
+/// Make a node with the given children through the same constructor the parser would've used.
+/// Children are cast to whatever the constructor expects, so check they really are that kind of node.
+LSLASTNode *ScriptDeserializer::constructNode(uint8_t node_type, uint8_t sub_type, std::vector<LSLASTNode *> &children) {
+  auto &c = children;
+  auto *a = _mAllocator;
+  LSLASTNode *list_node = nullptr;
+  // every child must be a `child_type` node
+  LSLNodeType child_type = NODE_NODE;
+
+  auto is = [](LSLASTNode *node, LSLNodeType type) { return node->getNodeType() == type; };
+  // optional parts of a node are filled in with a null node
+  auto is_opt = [&](LSLASTNode *node, LSLNodeType type) { return is(node, type) || is(node, NODE_NULL); };
+  auto is_list_of = [&](LSLASTNode *node, LSLNodeType type) {
+    if (!is(node, NODE_AST_NODE_LIST))
+      return false;
+    for (auto *child : *node) {
+      if (!is(child, type))
+        return false;
+    }
+    return true;
+  };
+  auto exprs = [&](size_t expected) {
+    if (c.size() != expected)
+      return false;
+    for (auto *child : c) {
+      if (!is(child, NODE_EXPRESSION))
+        return false;
+    }
+    return true;
+  };
+  auto is_ident = [&](size_t idx) { return is(c[idx], NODE_IDENTIFIER); };
+  auto is_stmt = [&](size_t idx) { return is(c[idx], NODE_STATEMENT); };
+  auto is_expr = [&](size_t idx) { return is(c[idx], NODE_EXPRESSION); };
+
+  switch (node_type) {
+    case NODE_NULL:
+      return c.empty() ? a->newTracked<LSLASTNullNode>() : nullptr;
+    case NODE_AST_NODE_LIST:
+      // what the elements should be depends on the list's parent, which checks them.
+      list_node = a->newTracked<LSLASTNodeList<LSLASTNode>>();
+      break;
+    case NODE_SCRIPT:
+      if (c.size() != 2 || !is(c[0], NODE_AST_NODE_LIST) || !is_list_of(c[1], NODE_STATE))
+        return nullptr;
+      for (auto *global : *c[0]) {
+        if (!is(global, NODE_GLOBAL_VARIABLE) && !is(global, NODE_GLOBAL_FUNCTION))
+          return nullptr;
+      }
+      return a->newTracked<LSLScript>((LSLASTNodeList<LSLASTNode> *)c[0], (LSLASTNodeList<LSLState> *)c[1]);
+    case NODE_GLOBAL_VARIABLE:
+      if (c.size() != 2 || !is_ident(0) || !is_opt(c[1], NODE_EXPRESSION))
+        return nullptr;
+      return a->newTracked<LSLGlobalVariable>((LSLIdentifier *)c[0], (LSLExpression *)c[1]);
+    case NODE_GLOBAL_FUNCTION:
+      if (c.size() != 3 || !is_ident(0) || !is(c[1], NODE_FUNCTION_DEC) || !is_stmt(2))
+        return nullptr;
+      return a->newTracked<LSLGlobalFunction>((LSLIdentifier *)c[0], (LSLFunctionDec *)c[1], (LSLStatement *)c[2]);
+    case NODE_FUNCTION_DEC:
+      list_node = a->newTracked<LSLFunctionDec>();
+      child_type = NODE_IDENTIFIER;
+      break;
+    case NODE_EVENT_DEC:
+      list_node = a->newTracked<LSLEventDec>();
+      child_type = NODE_IDENTIFIER;
+      break;
+    case NODE_STATE:
+      if (c.size() != 2 || !is_ident(0) || !is_list_of(c[1], NODE_EVENT_HANDLER))
+        return nullptr;
+      return a->newTracked<LSLState>((LSLIdentifier *)c[0], (LSLASTNodeList<LSLEventHandler> *)c[1]);
+    case NODE_EVENT_HANDLER:
+      if (c.size() != 3 || !is_ident(0) || !is(c[1], NODE_EVENT_DEC) || !is_stmt(2))
+        return nullptr;
+      return a->newTracked<LSLEventHandler>((LSLIdentifier *)c[0], (LSLEventDec *)c[1], (LSLStatement *)c[2]);
+    case NODE_STATEMENT:
+      switch (sub_type) {
+        case NODE_NOP_STATEMENT:
+          return c.empty() ? a->newTracked<LSLNopStatement>() : nullptr;
+        case NODE_COMPOUND_STATEMENT:
+          list_node = a->newTracked<LSLCompoundStatement>(nullptr);
+          child_type = NODE_STATEMENT;
+          break;
+        case NODE_EXPRESSION_STATEMENT:
+          return exprs(1) ? a->newTracked<LSLExpressionStatement>((LSLExpression *)c[0]) : nullptr;
+        case NODE_RETURN_STATEMENT:
+          if (c.size() != 1 || !is_opt(c[0], NODE_EXPRESSION))
+            return nullptr;
+          return a->newTracked<LSLReturnStatement>((LSLExpression *)c[0]);
+        case NODE_LABEL:
+          return c.size() == 1 && is_ident(0) ? a->newTracked<LSLLabel>((LSLIdentifier *)c[0]) : nullptr;
+        case NODE_JUMP_STATEMENT:
+          return c.size() == 1 && is_ident(0) ? a->newTracked<LSLJumpStatement>((LSLIdentifier *)c[0]) : nullptr;
+        case NODE_STATE_STATEMENT:
+          return c.size() == 1 && is_ident(0) ? a->newTracked<LSLStateStatement>((LSLIdentifier *)c[0]) : nullptr;
+        case NODE_IF_STATEMENT:
+          if (c.size() != 3 || !is_expr(0) || !is_stmt(1) || !is_opt(c[2], NODE_STATEMENT))
+            return nullptr;
+          return a->newTracked<LSLIfStatement>((LSLExpression *)c[0], (LSLStatement *)c[1], (LSLStatement *)c[2]);
+        case NODE_FOR_STATEMENT:
+          if (c.size() != 4 || !is_list_of(c[0], NODE_EXPRESSION) || !is_expr(1)
+              || !is_list_of(c[2], NODE_EXPRESSION) || !is_stmt(3))
+            return nullptr;
+          return a->newTracked<LSLForStatement>(
+              (LSLASTNodeList<LSLExpression> *)c[0], (LSLExpression *)c[1],
+              (LSLASTNodeList<LSLExpression> *)c[2], (LSLStatement *)c[3]
+          );
+        case NODE_DO_STATEMENT:
+          if (c.size() != 2 || !is_stmt(0) || !is_expr(1))
+            return nullptr;
+          return a->newTracked<LSLDoStatement>((LSLStatement *)c[0], (LSLExpression *)c[1]);
+        case NODE_WHILE_STATEMENT:
+          if (c.size() != 2 || !is_expr(0) || !is_stmt(1))
+            return nullptr;
+          return a->newTracked<LSLWhileStatement>((LSLExpression *)c[0], (LSLStatement *)c[1]);
+        case NODE_DECLARATION:
+          if (c.size() != 2 || !is_ident(0) || !is_opt(c[1], NODE_EXPRESSION))
+            return nullptr;
+          return a->newTracked<LSLDeclaration>((LSLIdentifier *)c[0], (LSLExpression *)c[1]);
+        default:
+          return nullptr;
+      }
+      break;
+    case NODE_EXPRESSION:
+      switch (sub_type) {
+        case NODE_CONSTANT_EXPRESSION:
+          if (c.size() != 1 || !is(c[0], NODE_CONSTANT))
+            return nullptr;
+          return a->newTracked<LSLConstantExpression>((LSLConstant *)c[0]);
+        case NODE_PARENTHESIS_EXPRESSION:
+          return exprs(1) ? a->newTracked<LSLParenthesisExpression>((LSLExpression *)c[0]) : nullptr;
+        case NODE_BINARY_EXPRESSION:
+          if (!exprs(2))
+            return nullptr;
+          return a->newTracked<LSLBinaryExpression>((LSLExpression *)c[0], OP_NONE, (LSLExpression *)c[1]);
+        case NODE_UNARY_EXPRESSION:
+          return exprs(1) ? a->newTracked<LSLUnaryExpression>((LSLExpression *)c[0], OP_NONE) : nullptr;
+        case NODE_TYPECAST_EXPRESSION:
+          // the real type gets filled in with the rest of the node's fields
+          return exprs(1) ? a->newTracked<LSLTypecastExpression>(nullptr, (LSLExpression *)c[0]) : nullptr;
+        case NODE_BOOL_CONVERSION_EXPRESSION:
+          return exprs(1) ? a->newTracked<LSLBoolConversionExpression>((LSLExpression *)c[0]) : nullptr;
+        case NODE_PRINT_EXPRESSION:
+          return exprs(1) ? a->newTracked<LSLPrintExpression>((LSLExpression *)c[0]) : nullptr;
+        case NODE_FUNCTION_EXPRESSION:
+          if (c.size() != 2 || !is_ident(0) || !is_list_of(c[1], NODE_EXPRESSION))
+            return nullptr;
+          return a->newTracked<LSLFunctionExpression>((LSLIdentifier *)c[0], (LSLASTNodeList<LSLExpression> *)c[1]);
+        case NODE_VECTOR_EXPRESSION:
+          if (!exprs(3))
+            return nullptr;
+          return a->newTracked<LSLVectorExpression>((LSLExpression *)c[0], (LSLExpression *)c[1], (LSLExpression *)c[2]);
+        case NODE_QUATERNION_EXPRESSION:
+          if (!exprs(4))
+            return nullptr;
+          return a->newTracked<LSLQuaternionExpression>(
+              (LSLExpression *)c[0], (LSLExpression *)c[1], (LSLExpression *)c[2], (LSLExpression *)c[3]
+          );
+        case NODE_LIST_EXPRESSION:
+          list_node = a->newTracked<LSLListExpression>(nullptr);
+          child_type = NODE_EXPRESSION;
+          break;
+        case NODE_LVALUE_EXPRESSION:
+          if (c.size() != 2 || !is_ident(0) || !is_opt(c[1], NODE_IDENTIFIER))
+            return nullptr;
+          return a->newTracked<LSLLValueExpression>((LSLIdentifier *)c[0], (LSLIdentifier *)c[1]);
+        default:
+          return nullptr;
+      }
+      break;
+    default:
+      return nullptr;
+  }
+
+  for (auto *child : children) {
+    if (child_type != NODE_NODE && !is(child, child_type))
+      return nullptr;
+    list_node->pushChild(child);
+  }
+  return list_node;
+}
+
+bool ScriptDeserializer::readSymbol() {
+  auto *name = readString();
+  LSLType *type = nullptr;
+  readType(&type);
+  auto sym_type = readRaw<uint8_t>();
+  auto sub_type = readRaw<uint8_t>();
+  auto flags = readRaw<uint8_t>();
+  auto loc = readLoc();
+  auto *function_decl = readNodeRef();
+  auto *var_decl = readNodeRef();
+  auto *label_decl = readNodeRef();
+  auto constant_ref = readConstantRef();
+  auto references = readVarInt();
+  auto assignments = readVarInt();
+  if (_mFailed || !name || sym_type > SYM_EVENT || sub_type > SYM_EVENT_PARAMETER)
+    return fail();
+  if (function_decl && function_decl->getNodeType() != NODE_FUNCTION_DEC && function_decl->getNodeType() != NODE_EVENT_DEC)
+    return fail();
+  if (label_decl && label_decl->getNodeSubType() != NODE_LABEL)
+    return fail();
+
+  auto *sym = _mAllocator->newTracked<LSLSymbol>(
+      name, type, (LSLSymbolType)sym_type, (LSLSymbolSubType)sub_type, &loc,
+      (LSLParamList *)function_decl, var_decl, (LSLLabel *)label_decl
+  );
+  sym->setConstantPrecluded(flags & SYMBOL_FLAG_CONSTANT_PRECLUDED);
+  sym->setAllPathsReturn(flags & SYMBOL_FLAG_ALL_PATHS_RETURN);
+  sym->setHasJumps(flags & SYMBOL_FLAG_HAS_JUMPS);
+  sym->setHasUnstructuredJumps(flags & SYMBOL_FLAG_HAS_UNSTRUCTURED_JUMPS);
+  sym->setPure(flags & SYMBOL_FLAG_PURE);
+  sym->_mReferences = (int)references;
+  sym->_mAssignments = (int)assignments;
+  _mSymbols.push_back(sym);
+  _mSymbolConstants.push_back(constant_ref);
+  return true;
+}
+
+bool ScriptDeserializer::readSymbolTable() {
+  auto table_type = readRaw<uint8_t>();
+  if (table_type >= SYMTAB_BUILTINS)
+    return fail();
+  auto *table = _mAllocator->newTracked<LSLSymbolTable>((LSLSymbolTableType)table_type);
+  auto num_symbols = readVarInt();
+  for (uint64_t i = 0; i < num_symbols && !_mFailed; ++i) {
+    auto sym_kind = readRaw<uint8_t>();
+    LSLSymbol *sym = nullptr;
+    if (sym_kind == SYMBOL_REF_BUILTIN) {
+      auto *sym_name = readString();
+      auto sym_type = (LSLSymbolType)readRaw<uint8_t>();
+      if (sym_name)
+        sym = _mContext->builtins->lookup(sym_name, sym_type);
+    } else if (sym_kind == SYMBOL_REF_SCRIPT) {
+      auto sym_idx = readVarInt();
+      if (sym_idx < _mSymbols.size())
+        sym = _mSymbols[sym_idx];
+    }
+    if (!sym)
+      return fail();
+    table->define(sym);
+  }
+  if (table_type == SYMTAB_FUNCTION) {
+    std::vector<LSLLabel *> labels;
+    auto num_labels = readVarInt();
+    for (uint64_t i = 0; i < num_labels && !_mFailed; ++i) {
+      auto *label = readNodeRef();
+      if (!label || label->getNodeSubType() != NODE_LABEL)
+        return fail();
+      labels.push_back((LSLLabel *)label);
+    }
+    table->setLabels(labels);
+  }
+  _mTables.push_back(table);
+  return !_mFailed;
+}
+
+uint64_t ScriptDeserializer::readConstantRef() {
+  auto ref = readVarInt();
+  // builtins are referred to by name, swap in the string's index
+  if (ref == CONSTANT_REF_BUILTIN)
+    ref = (readVarInt() << CONSTANT_REF_KIND_BITS) | CONSTANT_REF_BUILTIN;
+  return ref;
+}
+
+LSLConstant *ScriptDeserializer::resolveConstantRef(uint64_t ref) {
+  auto payload = ref >> CONSTANT_REF_KIND_BITS;
+  switch (ref & ((1 << CONSTANT_REF_KIND_BITS) - 1)) {
+    case CONSTANT_REF_NONE:
+      return nullptr;
+    case CONSTANT_REF_NODE:
+      if (payload < _mNodes.size() && _mNodes[payload]->getNodeType() == NODE_CONSTANT)
+        return (LSLConstant *)_mNodes[payload];
+      break;
+    case CONSTANT_REF_TYPE_DEFAULT:
+      if (payload < LST_MAX && TYPE((LSLIType)payload)->getDefaultValue())
+        return TYPE((LSLIType)payload)->getDefaultValue();
+      break;
+    case CONSTANT_REF_TYPE_ONE:
+      if (payload < LST_MAX && TYPE((LSLIType)payload)->getOneValue())
+        return TYPE((LSLIType)payload)->getOneValue();
+      break;
+    case CONSTANT_REF_BUILTIN: {
+      if (payload >= _mStrings.size())
+        break;
+      auto *sym = _mContext->builtins->lookup(_mStrings[payload], SYM_VARIABLE);
+      if (sym && sym->getConstantValue())
+        return sym->getConstantValue();
+      break;
+    }
+    default:
+      break;
+  }
+  fail();
+  return nullptr;
+}
+
+LSLASTNode *ScriptDeserializer::readNodeRef() {
+  auto ref = readVarInt();
+  if (!ref)
+    return nullptr;
+  if (ref > _mNodes.size()) {
+    fail();
+    return nullptr;
+  }
+  return _mNodes[ref - 1];
+}
+
+YYLTYPE ScriptDeserializer::readLoc() {
+  YYLTYPE loc {};
+  loc.first_line = (int)readSignedVarInt();
+  loc.first_column = (int)readSignedVarInt();
+  loc.last_line = (int)readSignedVarInt();
+  loc.last_column = (int)readSignedVarInt();
+  return loc;
+}
+
+bool ScriptDeserializer::readType(LSLType **type) {
+  auto itype = readRaw<uint8_t>();
+  if (itype == NO_TYPE) {
+    *type = nullptr;
+    return true;
+  }
+  if (itype >= LST_MAX)
+    return fail();
+  *type = TYPE((LSLIType)itype);
+  return true;
+}
+
+uint64_t ScriptDeserializer::readVarInt() {
+  uint64_t val = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (_mPos >= _mEnd)
+      break;
+    auto byte = (uint8_t)*_mPos++;
+    val |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return val;
+  }
+  fail();
+  return 0;
+}
+
+int64_t ScriptDeserializer::readSignedVarInt() {
+  auto val = readVarInt();
+  return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+const char *ScriptDeserializer::readString() {
+  auto idx = readVarInt();
+  if (idx >= _mStrings.size()) {
+    fail();
+    return nullptr;
+  }
+  return _mStrings[idx];
+}
+
+template<typename T>
+T ScriptDeserializer::readRaw() {
+  T val {};
+  if ((size_t)(_mEnd - _mPos) < sizeof(T)) {
+    fail();
+    return val;
+  }
+  memcpy(&val, _mPos, sizeof(T));
+  _mPos += sizeof(T);
+  return val;
+}
+
+}
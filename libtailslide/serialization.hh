@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "lslmini.hh"
+
+namespace Tailslide {
+
+/// bump whenever the layout changes or a node grows a new field
+const uint32_t SERIALIZED_SCRIPT_VERSION = 1;
+
+/// Writes an analyzed script out in a compact binary form that can be loaded
+/// back into an equivalent tree without re-running the parser or any of the
+/// semantic passes.
+///
+/// The layout is a header with the format and builtins versions, a string table,
+/// the tree's nodes flattened in preorder (followed by any constant values that
+/// live outside of it), then the symbols and symbol tables. Everything refers
+/// to strings, nodes and symbols by their index in those tables.
+///
+/// Builtin symbols and the static constants owned by types and builtins are
+/// stored by name, loading maps them back onto the current builtins, which is
+/// why stale files from a different builtins table get rejected.
+class ScriptSerializer {
+  public:
+    /// returns an empty string if the tree references something that can't be serialized.
+    std::string serialize(LSLScript *script, bool ast_sane);
+
+  protected:
+    void indexNode(LSLASTNode *node);
+    void indexConstant(LSLConstant *constant);
+    void indexSymbolTable(LSLSymbolTable *table);
+    void indexSymbol(LSLSymbol *sym);
+    void writeNode(LSLASTNode *node);
+    void writeSymbol(LSLSymbol *sym);
+    void writeSymbolTable(LSLSymbolTable *table);
+    void writeSymbolRef(LSLSymbol *sym);
+    void writeConstantRef(LSLConstant *constant);
+    void writeNodeRef(LSLASTNode *node);
+    void writeLoc(const YYLTYPE *loc);
+    void writeType(class LSLType *type);
+    void writeVarInt(uint64_t val);
+    void writeSignedVarInt(int64_t val);
+    void writeString(const char *str);
+    template<typename T> void writeRaw(T val);
+
+    std::string _mOut {};
+    bool _mFailed = false;
+    std::vector<std::string> _mStrings {};
+    std::unordered_map<std::string, uint32_t> _mStringIds {};
+    std::unordered_map<LSLASTNode *, uint32_t> _mNodeIds {};
+    std::vector<LSLConstant *> _mDetachedConstants {};
+    std::vector<LSLSymbol *> _mSymbols {};
+    std::unordered_map<LSLSymbol *, uint32_t> _mSymbolIds {};
+    std::vector<LSLSymbolTable *> _mTables {};
+    std::unordered_map<LSLSymbolTable *, uint32_t> _mTableIds {};
+    // event handlers get symbols marked as builtins too, only these are shared with the builtins table.
+    std::unordered_set<LSLSymbol *> _mBuiltinSymbols {};
+    std::unordered_map<LSLConstant *, const char *> _mBuiltinConstants {};
+};
+
+/// Rebuilds a tree written by `ScriptSerializer` within `ctx`, every read is
+/// bounds checked so truncated or corrupt input just fails to load.
+class ScriptDeserializer {
+  public:
+    explicit ScriptDeserializer(ScriptContext *ctx): _mContext(ctx), _mAllocator(ctx->allocator) {};
+    /// returns nullptr if the data isn't a script serialized against the current builtins.
+    LSLScript *deserialize(const char *buf, size_t buf_len, bool *ast_sane);
+
+  protected:
+    LSLASTNode *readNode();
+    LSLASTNode *constructNode(uint8_t node_type, uint8_t sub_type, std::vector<LSLASTNode *> &children);
+    bool readSymbol();
+    bool readSymbolTable();
+    uint64_t readConstantRef();
+    LSLConstant *resolveConstantRef(uint64_t ref);
+    LSLASTNode *readNodeRef();
+    YYLTYPE readLoc();
+    bool readType(class LSLType **type);
+    uint64_t readVarInt();
+    int64_t readSignedVarInt();
+    const char *readString();
+    template<typename T> T readRaw();
+    bool fail() { _mFailed = true; return false; }
+
+    ScriptContext *_mContext;
+    ScriptAllocator *_mAllocator;
+    const char *_mPos = nullptr;
+    const char *_mEnd = nullptr;
+    bool _mFailed = false;
+
+    std::vector<const char *> _mStrings {};
+    std::vector<LSLASTNode *> _mNodes {};
+    std::vector<LSLSymbol *> _mSymbols {};
+    std::vector<LSLSymbolTable *> _mTables {};
+    // references that can only be resolved once everything they point at exists
+    std::vector<uint64_t> _mNodeConstants {};
+    std::vector<uint64_t> _mNodeTables {};
+    std::vector<uint64_t> _mSymbolConstants {};
+    std::vector<std::pair<LSLIdentifier *, uint64_t>> _mIdentifierSymbols {};
+};
+
+}
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cstring>
+
+#include "sha256.hh"
+
+namespace Tailslide {
+
+static const uint32_t SHA256_ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t val, int bits) {
+  return (val >> bits) | (val << (32 - bits));
+}
+
+void SHA256::reset() {
+  _mState = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  _mBufferLen = 0;
+  _mTotalLen = 0;
+}
+
+void SHA256::compress(const uint8_t *block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+        | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; ++i) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = _mState[0], b = _mState[1], c = _mState[2], d = _mState[3];
+  uint32_t e = _mState[4], f = _mState[5], g = _mState[6], h = _mState[7];
+  for (int i = 0; i < 64; ++i) {
+    uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t temp1 = h + s1 + ch + SHA256_ROUND_CONSTANTS[i] + w[i];
+    uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t temp2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + temp2;
+  }
+  _mState[0] += a; _mState[1] += b; _mState[2] += c; _mState[3] += d;
+  _mState[4] += e; _mState[5] += f; _mState[6] += g; _mState[7] += h;
+}
+
+void SHA256::update(const void *data, size_t len) {
+  auto *bytes = (const uint8_t *)data;
+  _mTotalLen += len;
+  if (_mBufferLen) {
+    size_t to_copy = std::min(len, sizeof(_mBuffer) - _mBufferLen);
+    memcpy(_mBuffer + _mBufferLen, bytes, to_copy);
+    _mBufferLen += to_copy;
+    bytes += to_copy;
+    len -= to_copy;
+    if (_mBufferLen < sizeof(_mBuffer))
+      return;
+    compress(_mBuffer);
+    _mBufferLen = 0;
+  }
+  // whole blocks don't need to go through the buffer
+  for (; len >= sizeof(_mBuffer); bytes += sizeof(_mBuffer), len -= sizeof(_mBuffer))
+    compress(bytes);
+  memcpy(_mBuffer, bytes, len);
+  _mBufferLen = len;
+}
+
+SHA256::Digest SHA256::finish() {
+  uint64_t bit_len = _mTotalLen * 8;
+  const uint8_t pad_start = 0x80;
+  update(&pad_start, 1);
+  const uint8_t zero = 0;
+  while (_mBufferLen != 56)
+    update(&zero, 1);
+  uint8_t len_bytes[8];
+  for (int i = 0; i < 8; ++i)
+    len_bytes[i] = (uint8_t)(bit_len >> (56 - i * 8));
+  update(len_bytes, sizeof(len_bytes));
+
+  Digest digest;
+  for (int i = 0; i < 8; ++i) {
+    digest[i * 4] = (uint8_t)(_mState[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(_mState[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(_mState[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)_mState[i];
+  }
+  return digest;
+}
+
+std::string SHA256::toHex(const Digest &digest) {
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(digest.size() * 2);
+  for (auto byte : digest) {
+    hex += HEX_DIGITS[byte >> 4];
+    hex += HEX_DIGITS[byte & 0xF];
+  }
+  return hex;
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace Tailslide {
+
+/// Incremental SHA-256, for content-addressing things that need to
+/// stay stable between runs and machines.
+class SHA256 {
+  public:
+    using Digest = std::array<uint8_t, 32>;
+
+    SHA256() { reset(); }
+    void reset();
+    void update(const void *data, size_t len);
+    void update(std::string_view str) { update(str.data(), str.size()); }
+    /// pad out the message and return its digest, call `reset()` before reusing.
+    Digest finish();
+
+    static std::string toHex(const Digest &digest);
+
+  protected:
+    void compress(const uint8_t *block);
+
+    std::array<uint32_t, 8> _mState {};
+    uint8_t _mBuffer[64] {};
+    size_t _mBufferLen = 0;
+    uint64_t _mTotalLen = 0;
+};
+
+}
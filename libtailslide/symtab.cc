@@ -43,19 +43,29 @@ void LSLSymbolTable::checkSymbols() {
 }
 
 bool LSLSymbolTable::remove(LSLSymbol *symbol) {
+  // this is a linear scan, so count what we look at towards the walked nodes.
+  // pruning every symbol in a table one-by-one is quadratic in its size.
+  uint64_t scanned = 0;
+  bool found = false;
   for (auto iter = _mSymbols.begin(); iter != _mSymbols.end(); ++iter) {
+    ++scanned;
     if (iter->second == symbol) {
       _mSymbols.erase(iter);
-      return true;
+      found = true;
+      break;
     }
   }
-  return false;
+  if (mContext && mContext->stats)
+    mContext->stats->countWalk(scanned);
+  return found;
 }
 
 void LSLSymbolTable::resetTracking() {
   for (auto &symbol: _mSymbols) {
     symbol.second->resetTracking();
   }
+  if (mContext && mContext->stats)
+    mContext->stats->countWalk(_mSymbols.size());
 }
 
 /* Oddly enough, using shorter names in globals saves bytecode space. */
@@ -83,6 +83,10 @@ class LSLSymbol: public TrackableObject {
     bool getHasUnstructuredJumps() const { return _mHasUnstructuredJumps; }
     void setHasUnstructuredJumps(bool unstructured_jumps) { _mHasUnstructuredJumps = unstructured_jumps; }
 
+    // builtin function whose result depends only on its arguments, with no side-effects
+    bool getPure() const { return _mPure; }
+    void setPure(bool pure) { _mPure = pure; }
+
   private:
     const char          *_mName;
     class LSLType  *_mType;
@@ -101,6 +105,10 @@ class LSLSymbol: public TrackableObject {
     bool _mHasJumps = false;
     // if the function contains jumps that are not break-like or continue-like
     bool _mHasUnstructuredJumps = false;
+    bool _mPure = false;
+
+  friend class TreeCloner;
+  friend class ScriptDeserializer;
 };
 
 class LSLSymbolTable: public TrackableObject {
@@ -118,6 +126,8 @@ class LSLSymbolTable: public TrackableObject {
     std::vector<class LSLLabel *> _mLabels;
     LSLSymbolTableType _mSymbolTableType;
 
+  friend class TreeCloner;
+
   public:
     UnorderedCStrMap<LSLSymbol*> &getMap() {return _mSymbols;}
     LSLSymbolTableType getTableType() { return _mSymbolTableType; }
@@ -138,8 +148,11 @@ class LSLSymbolTableManager {
   public:
     explicit LSLSymbolTableManager(ScriptAllocator *allocator) {_mAllocator = allocator;};
     void registerTable(LSLSymbolTable *table) {_mTables.push_back(table);};
+    const std::vector<LSLSymbolTable *> &getTables() const { return _mTables; }
     void setMangledNames();
     void resetTracking();
+    /// forget all registered tables, for when they've been freed
+    void clear() { _mTables.clear(); }
   protected:
     std::vector<LSLSymbolTable *> _mTables {};
     ScriptAllocator *_mAllocator;
@@ -1,7 +1,18 @@
+#include <fstream>
+#include <iterator>
 #include <string>
 
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
 #include "tailslide.hh"
 #include "lslmini.tab.hh"
+#include "serialization.hh"
+#include "passes/tree_cloner.hh"
 
 int tailslide_lex_init_extra(Tailslide::ScriptContext *, void **);
 void tailslide_set_in(FILE *, void *);
@@ -58,6 +69,79 @@ LSLScript *ScopedScriptParser::parseLSLBytes(const char *buf, int buf_len) {
   return script;
 }
 
+std::string ScopedScriptParser::serializeScript() {
+  if (!script)
+    return "";
+  ScriptSerializer serializer;
+  return serializer.serialize(script, ast_sane);
+}
+
+LSLScript *ScopedScriptParser::loadSerializedBytes(const char *buf, size_t buf_len) {
+  assert(!script);
+  allocator.setContext(&context);
+  ScriptDeserializer deserializer(&context);
+  bool loaded_ast_sane = false;
+  script = deserializer.deserialize(buf, buf_len, &loaded_ast_sane);
+  if (script) {
+    ast_sane = context.ast_sane = loaded_ast_sane;
+    context.script = script;
+  }
+  return script;
+}
+
+LSLScript *ScopedScriptParser::loadSerializedFile(const std::string &filename) {
+#ifndef _WIN32
+  // everything gets copied out into the tree, so just map the file while we read it.
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return nullptr;
+  }
+  void *mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+  loadSerializedBytes((const char *)mapping, (size_t)st.st_size);
+  munmap(mapping, (size_t)st.st_size);
+  return script;
+#else
+  std::ifstream f(filename, std::ios::binary);
+  if (!f)
+    return nullptr;
+  std::string contents((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  return loadSerializedBytes(contents.data(), contents.size());
+#endif
+}
+
+std::unique_ptr<ScopedScriptParser> ScopedScriptParser::fork() {
+  auto forked = std::make_unique<ScopedScriptParser>(context.builtins);
+  forked->allocator.setContext(&forked->context);
+  forked->ast_sane = ast_sane;
+  forked->context.ast_sane = context.ast_sane;
+  if (script) {
+    TreeCloner cloner(&forked->allocator);
+    forked->script = cloner.cloneAs(script);
+    forked->context.script = forked->script;
+  }
+  return forked;
+}
+
+void ScopedScriptParser::reset() {
+  allocator.reset();
+  logger.reset();
+  table_manager.clear();
+  script = nullptr;
+  ast_sane = false;
+  context.script = nullptr;
+  context.ast_sane = true;
+  context.parsing = false;
+  context.glloc = {0};
+  context.scanner = nullptr;
+}
+
 void ScopedScriptParser::initScanner() {
   assert(!script);
   // ScopedScriptParser owns the allocator and context instance because we can't
@@ -71,9 +155,12 @@ void ScopedScriptParser::initScanner() {
 
 void ScopedScriptParser::parseInternal() {
   // parse
-  context.parsing = true;
-  tailslide_parse(context.scanner);
-  context.parsing = false;
+  {
+    ScopedPassTimer timer(&context, "parse");
+    context.parsing = true;
+    tailslide_parse(context.scanner);
+    context.parsing = false;
+  }
 
   // clean up flex
   tailslide_lex_destroy(context.scanner);
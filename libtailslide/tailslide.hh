@@ -1,6 +1,7 @@
 #ifndef LIBTAILSLIDE_HH
 #define LIBTAILSLIDE_HH
 
+#include <memory>
 #include <string>
 
 // This is the header for the public API, don't let any internal
@@ -26,6 +27,25 @@ struct ScopedScriptParser {
     LSLScript *parseLSLFile(const std::string &filename);
     LSLScript *parseLSLBytes(const char *buf, int buf_len);
 
+    /// Serialize the analyzed script so it can be loaded again without re-parsing it.
+    /// Diagnostics aren't included. Returns an empty string if it can't be serialized.
+    std::string serializeScript();
+    /// Load a script written by `serializeScript()` in place of parsing one, returns
+    /// nullptr if it's corrupt or was serialized against different builtins.
+    LSLScript *loadSerializedBytes(const char *buf, size_t buf_len);
+    LSLScript *loadSerializedFile(const std::string &filename);
+
+    /// Make an independent copy of the script with its own allocator, logger and
+    /// symbol tables. The fork can be optimized and compiled without affecting
+    /// this one, even on another thread. Names are still shared with this parser,
+    /// so it must outlive all of its forks.
+    std::unique_ptr<ScopedScriptParser> fork();
+
+    /// Free the script and everything allocated for it so another one can be
+    /// parsed, without giving up the parser's buffers. Whatever was attached to
+    /// the context (builtins, budget, stats) stays attached. Invalidates any forks.
+    void reset();
+
   protected:
     void initScanner();
     void parseInternal();
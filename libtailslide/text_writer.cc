@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <cerrno>
+#include <clocale>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#  include <io.h>
+#  define TS_WRITE_FD _write
+#else
+#  include <unistd.h>
+#  define TS_WRITE_FD ::write
+#endif
+
+#include "text_writer.hh"
+
+namespace Tailslide {
+
+size_t format_float(char *buf, size_t buf_len, double val, int precision, bool keep_trailing_zeros) {
+  if (precision <= 0)
+    precision = 1;
+#if defined(__cpp_lib_to_chars)
+  // Figure out which style "%g" would pick based on the exponent the value
+  // would have in "%e" form, then write it in that style.
+  char *end = buf + buf_len;
+  auto res = std::to_chars(buf, end, val, std::chars_format::scientific, precision - 1);
+  if (res.ec != std::errc())
+    return 0;
+  char *exp_pos = (char *)memchr(buf, 'e', res.ptr - buf);
+  // infinity or NaN, nothing else to do.
+  if (!exp_pos)
+    return res.ptr - buf;
+  int exponent = 0;
+  std::from_chars(exp_pos + (exp_pos[1] == '+' ? 2 : 1), res.ptr, exponent);
+  if (exponent >= -4 && exponent < precision) {
+    res = std::to_chars(buf, end, val, std::chars_format::fixed, precision - 1 - exponent);
+    if (res.ec != std::errc())
+      return 0;
+    exp_pos = nullptr;
+  }
+
+  char *ptr = res.ptr;
+  char *mantissa_end = exp_pos ? exp_pos : ptr;
+  bool has_point = memchr(buf, '.', mantissa_end - buf) != nullptr;
+  if (keep_trailing_zeros) {
+    // "%#g" always has a decimal point
+    if (!has_point && ptr < end) {
+      memmove(mantissa_end + 1, mantissa_end, ptr - mantissa_end);
+      *mantissa_end = '.';
+      ++ptr;
+    }
+  } else if (has_point) {
+    char *trim_pos = mantissa_end;
+    while (trim_pos[-1] == '0')
+      --trim_pos;
+    if (trim_pos[-1] == '.')
+      --trim_pos;
+    memmove(trim_pos, mantissa_end, ptr - mantissa_end);
+    ptr -= mantissa_end - trim_pos;
+  }
+  return ptr - buf;
+#else
+  int len = snprintf(buf, buf_len, keep_trailing_zeros ? "%#.*g" : "%.*g", precision, val);
+  if (len < 0 || (size_t)len >= buf_len)
+    return 0;
+  // snprintf follows the locale's decimal point, we never want that.
+  const char locale_point = *localeconv()->decimal_point;
+  if (locale_point != '.')
+    std::replace(buf, buf + len, locale_point, '.');
+  return len;
+#endif
+}
+
+TextWriter::TextWriter(TextWriter &&other) noexcept
+    : _mChunks(std::move(other._mChunks)), _mSize(other._mSize), _mFD(other._mFD), _mFailed(other._mFailed) {
+  other._mChunks.clear();
+  other._mSize = 0;
+  other._mFD = -1;
+  other._mFailed = false;
+}
+
+TextWriter &TextWriter::operator=(TextWriter &&other) noexcept {
+  if (this != &other) {
+    _mChunks = std::move(other._mChunks);
+    _mSize = other._mSize;
+    _mFD = other._mFD;
+    _mFailed = other._mFailed;
+    other._mChunks.clear();
+    other._mSize = 0;
+    other._mFD = -1;
+    other._mFailed = false;
+  }
+  return *this;
+}
+
+TextWriter::~TextWriter() {
+  try {
+    flush();
+  } catch (const std::runtime_error &) {
+    // can't throw from here, it's left in `hasFailed()` for anyone who kept a reference.
+    // Whoever cares about the output should have called flush() themselves.
+  }
+}
+
+void TextWriter::setOutputFD(int fd) {
+  _mFD = fd;
+  flush();
+}
+
+void TextWriter::flush() {
+  if (_mFD < 0)
+    return;
+  writeChunks();
+  // hang on to one chunk so we don't need to allocate another
+  if (_mChunks.size() > 1)
+    _mChunks.resize(1);
+  if (!_mChunks.empty())
+    _mChunks.front().clear();
+}
+
+void TextWriter::writeChunks() {
+  // part of the output is already gone, anything else we wrote would be garbage.
+  if (_mFailed)
+    throw std::runtime_error("Failed to write output");
+  for (const auto &chunk : _mChunks) {
+    const char *data = chunk.data();
+    size_t remaining = chunk.size();
+    // writes may be cut short, or interrupted before writing anything
+    while (remaining) {
+      auto written = TS_WRITE_FD(_mFD, data, (unsigned int)remaining);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0) {
+        _mFailed = true;
+        throw std::runtime_error(std::string("Failed to write output: ") + strerror(written < 0 ? errno : EIO));
+      }
+      data += written;
+      remaining -= written;
+    }
+  }
+}
+
+void TextWriter::write(const char *data, size_t len) {
+  _mSize += len;
+  while (len) {
+    if (_mChunks.empty() || _mChunks.back().size() == CHUNK_SIZE) {
+      if (_mFD >= 0 && !_mChunks.empty()) {
+        flush();
+      } else {
+        _mChunks.emplace_back();
+        _mChunks.back().reserve(CHUNK_SIZE);
+      }
+    }
+    auto &chunk = _mChunks.back();
+    size_t to_copy = std::min(len, CHUNK_SIZE - chunk.size());
+    chunk.append(data, to_copy);
+    data += to_copy;
+    len -= to_copy;
+  }
+}
+
+std::string TextWriter::str() const {
+  std::string out;
+  size_t total = 0;
+  for (const auto &chunk : _mChunks)
+    total += chunk.size();
+  out.reserve(total);
+  for (const auto &chunk : _mChunks)
+    out += chunk;
+  return out;
+}
+
+}
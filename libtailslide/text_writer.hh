@@ -0,0 +1,81 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace Tailslide {
+
+/// Format `val` like printf's "%.*g" (or "%#.*g" with `keep_trailing_zeros`),
+/// always using '.' as the decimal point regardless of locale.
+/// returns the number of characters written, `buf` should have room for at least 32.
+size_t format_float(char *buf, size_t buf_len, double val, int precision=6, bool keep_trailing_zeros=false);
+
+/// Append-only buffer for generated text. Kept as a list of fixed-size chunks
+/// so growing it never copies what's already been written, and numbers are
+/// formatted without going through iostreams or the locale. When given a file
+/// descriptor, each chunk gets written out as it fills rather than kept around.
+class TextWriter {
+  public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    TextWriter() = default;
+    explicit TextWriter(int fd): _mFD(fd) {}
+    TextWriter(TextWriter &&other) noexcept;
+    TextWriter &operator=(TextWriter &&other) noexcept;
+    TextWriter(const TextWriter &other) = delete;
+    ~TextWriter();
+
+    /// start writing everything out to `fd`, including anything already buffered.
+    /// the caller keeps ownership of the descriptor.
+    void setOutputFD(int fd);
+    /// write any buffered text out to the file descriptor, if we have one.
+    /// throws if it couldn't all be written, as will any later writes.
+    void flush();
+    /// whether writing to the file descriptor has failed. Failures while
+    /// flushing from the destructor can't be thrown, so check this first.
+    bool hasFailed() const { return _mFailed; }
+
+    void write(const char *data, size_t len);
+
+    TextWriter &operator<<(std::string_view str) {
+      write(str.data(), str.size());
+      return *this;
+    }
+    TextWriter &operator<<(const char *str) { return *this << std::string_view(str); }
+    TextWriter &operator<<(const std::string &str) { return *this << std::string_view(str); }
+    TextWriter &operator<<(char c) {
+      write(&c, 1);
+      return *this;
+    }
+    template<typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+    TextWriter &operator<<(T val) {
+      char buf[24];
+      auto res = std::to_chars(buf, buf + sizeof(buf), val);
+      write(buf, res.ptr - buf);
+      return *this;
+    }
+    TextWriter &operator<<(double val) {
+      char buf[32];
+      write(buf, format_float(buf, sizeof(buf), val));
+      return *this;
+    }
+
+    /// total number of bytes written, including any already flushed to the file descriptor
+    size_t size() const { return _mSize; }
+    /// everything that's been written and not yet flushed out
+    std::string str() const;
+
+  protected:
+    void writeChunks();
+
+    std::vector<std::string> _mChunks {};
+    size_t _mSize = 0;
+    int _mFD = -1;
+    bool _mFailed = false;
+};
+
+}
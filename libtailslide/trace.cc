@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "trace.hh"
+
+namespace Tailslide {
+
+std::atomic<bool> gTracing {false};
+
+static const size_t TRACE_CHUNK_EVENTS = 1024;
+static const size_t TRACE_LABEL_SIZE = 48;
+
+struct TraceEvent {
+  const char *name;
+  const char *category;
+  uint64_t ts_ns;
+  char phase;
+  char label[TRACE_LABEL_SIZE];
+};
+
+struct TraceChunk {
+  TraceEvent events[TRACE_CHUNK_EVENTS];
+  /// events that are safe to read, only ever increases
+  std::atomic<size_t> count {0};
+  std::atomic<TraceChunk *> next {nullptr};
+};
+
+/// Events from a single thread during one session. Only the owning thread
+/// appends, anyone may read what's been published so far.
+class TraceBuffer {
+  public:
+    TraceBuffer(uint32_t tid, uint64_t session, std::string thread_name)
+        : mTID(tid), mSession(session), _mTail(&_mHead), _mThreadName(std::move(thread_name)) {}
+    ~TraceBuffer() {
+      TraceChunk *chunk = _mHead.next.load(std::memory_order_acquire);
+      while (chunk) {
+        TraceChunk *next = chunk->next.load(std::memory_order_acquire);
+        delete chunk;
+        chunk = next;
+      }
+    }
+    TraceBuffer(const TraceBuffer &other) = delete;
+    TraceBuffer &operator=(const TraceBuffer &other) = delete;
+
+    void append(const TraceEvent &event) {
+      size_t count = _mTail->count.load(std::memory_order_relaxed);
+      if (count == TRACE_CHUNK_EVENTS) {
+        auto *chunk = new TraceChunk();
+        _mTail->next.store(chunk, std::memory_order_release);
+        _mTail = chunk;
+        count = 0;
+      }
+      _mTail->events[count] = event;
+      _mTail->count.store(count + 1, std::memory_order_release);
+    }
+
+    template <typename Func>
+    void forEach(Func func) const {
+      for (const TraceChunk *chunk = &_mHead; chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+        size_t count = chunk->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; ++i)
+          func(chunk->events[i]);
+      }
+    }
+
+    size_t getBytes() const {
+      size_t bytes = sizeof(*this);
+      for (auto *chunk = _mHead.next.load(std::memory_order_acquire); chunk; chunk = chunk->next.load(std::memory_order_acquire))
+        bytes += sizeof(*chunk);
+      return bytes;
+    }
+
+    void setThreadName(std::string_view name) {
+      std::lock_guard<std::mutex> lock(_mNameMutex);
+      _mThreadName = name;
+    }
+    std::string getThreadName() {
+      std::lock_guard<std::mutex> lock(_mNameMutex);
+      return _mThreadName;
+    }
+
+    const uint32_t mTID;
+    const uint64_t mSession;
+
+  private:
+    TraceChunk _mHead;
+    TraceChunk *_mTail;
+    std::mutex _mNameMutex;
+    std::string _mThreadName;
+};
+
+static const auto gTraceOrigin = std::chrono::steady_clock::now();
+static std::atomic<uint64_t> gTraceStart {0};
+// bumped by every `start_tracing()`, buffers from older sessions get replaced
+static std::atomic<uint64_t> gTraceSession {0};
+static std::atomic<uint32_t> gNextTraceTID {1};
+// only taken the first time a thread records something in a session, and when exporting
+static std::mutex gTraceBuffersMutex;
+// the current session's buffers, including those of threads that have since exited
+static std::vector<std::shared_ptr<TraceBuffer>> gTraceBuffers;
+static thread_local std::shared_ptr<TraceBuffer> tTraceBuffer;
+static thread_local uint32_t tTraceTID = 0;
+static thread_local std::string tTraceThreadName;
+
+static uint64_t trace_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gTraceOrigin).count();
+}
+
+static TraceBuffer *get_trace_buffer() {
+  if (!tTraceBuffer || tTraceBuffer->mSession != gTraceSession.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(gTraceBuffersMutex);
+    if (!tTraceTID)
+      tTraceTID = gNextTraceTID++;
+    // replacing our reference frees the old session's buffer unless an export is reading it
+    tTraceBuffer = std::make_shared<TraceBuffer>(
+        tTraceTID, gTraceSession.load(std::memory_order_relaxed), tTraceThreadName
+    );
+    gTraceBuffers.push_back(tTraceBuffer);
+  }
+  return tTraceBuffer.get();
+}
+
+void start_tracing() {
+  {
+    std::lock_guard<std::mutex> lock(gTraceBuffersMutex);
+    ++gTraceSession;
+    // threads that have exited go with these, the rest replace theirs when they next record
+    gTraceBuffers.clear();
+  }
+  gTraceStart.store(trace_now(), std::memory_order_relaxed);
+  gTracing.store(true, std::memory_order_relaxed);
+}
+
+void stop_tracing() {
+  gTracing.store(false, std::memory_order_relaxed);
+}
+
+void record_trace_event(const char *name, const char *category, char phase, std::string_view label) {
+  TraceEvent event {name, category, trace_now(), phase, {}};
+  size_t len = std::min(label.size(), TRACE_LABEL_SIZE - 1);
+  // don't cut a UTF-8 sequence in half
+  while (len < label.size() && len && ((unsigned char)label[len] & 0xC0) == 0x80)
+    --len;
+  memcpy(event.label, label.data(), len);
+  event.label[len] = '\0';
+  get_trace_buffer()->append(event);
+}
+
+void set_trace_thread_name(std::string_view name) {
+  // names usually get set well before tracing starts, remember it for when it does.
+  tTraceThreadName = name;
+  if (tTraceBuffer && tTraceBuffer->mSession == gTraceSession.load(std::memory_order_relaxed))
+    tTraceBuffer->setThreadName(name);
+}
+
+static void append_json_string(std::string &out, const char *str) {
+  out += '"';
+  for (const char *c = str; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      out += '\\';
+      out += *c;
+    } else if ((unsigned char)*c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", *c);
+      out += buf;
+    } else {
+      out += *c;
+    }
+  }
+  out += '"';
+}
+
+std::string format_chrome_trace() {
+  std::vector<std::shared_ptr<TraceBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(gTraceBuffersMutex);
+    buffers = gTraceBuffers;
+  }
+  uint64_t start = gTraceStart.load(std::memory_order_relaxed);
+
+  std::string out = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  bool first = true;
+  char buf[128];
+  for (const auto &buffer : buffers) {
+    // the ends of spans that started before this session aren't of any use
+    uint32_t depth = 0;
+    buffer->forEach([&](const TraceEvent &event) {
+      if (event.ts_ns < start)
+        return;
+      if (event.phase == 'B') {
+        ++depth;
+      } else if (event.phase == 'E') {
+        if (!depth)
+          return;
+        --depth;
+      }
+      out += first ? "" : ",\n";
+      first = false;
+      out += "{\"name\": ";
+      append_json_string(out, event.name);
+      out += ", \"cat\": ";
+      append_json_string(out, event.category);
+      snprintf(buf, sizeof(buf), ", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %u",
+               event.phase, (double)(event.ts_ns - start) / 1000.0, buffer->mTID);
+      out += buf;
+      if (event.label[0]) {
+        out += ", \"args\": {\"label\": ";
+        append_json_string(out, event.label);
+        out += "}";
+      }
+      out += "}";
+    });
+    auto thread_name = buffer->getThreadName();
+    if (!thread_name.empty()) {
+      out += first ? "" : ",\n";
+      first = false;
+      snprintf(buf, sizeof(buf), "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ",
+               buffer->mTID);
+      out += buf;
+      append_json_string(out, thread_name.c_str());
+      out += "}}";
+    }
+  }
+  out += "\n]}\n";
+  return out;
+}
+
+size_t get_trace_buffer_bytes() {
+  std::lock_guard<std::mutex> lock(gTraceBuffersMutex);
+  size_t bytes = 0;
+  for (const auto &buffer : gTraceBuffers)
+    bytes += buffer->getBytes();
+  return bytes;
+}
+
+bool write_chrome_trace(const std::string &path) {
+  std::ofstream f(path, std::ios::binary);
+  if (!f)
+    return false;
+  auto trace = format_chrome_trace();
+  f.write(trace.data(), (std::streamsize)trace.size());
+  return (bool)f;
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace Tailslide {
+
+/// Process-wide tracing of the compile pipeline, exported as Chrome trace-event
+/// JSON for loading into chrome://tracing or Perfetto.
+///
+/// Each thread records into its own buffer without taking any locks, so tracing
+/// a server full of workers doesn't serialize them. Buffers only grow while
+/// tracing is on, and are kept after their thread exits so they can still be
+/// exported. Starting a new session lets go of the old session's buffers.
+
+extern std::atomic<bool> gTracing;
+
+inline bool is_tracing() {
+  return gTracing.load(std::memory_order_relaxed);
+}
+
+/// Start recording events. Anything recorded by an earlier session is dropped.
+void start_tracing();
+void stop_tracing();
+
+/// Name the calling thread in exported traces, may be called before tracing starts.
+void set_trace_thread_name(std::string_view name);
+
+/// Record a begin (`'B'`) or end (`'E'`) event on the calling thread. `name`
+/// and `category` must outlive the trace, `label` is copied and may be
+/// truncated.
+void record_trace_event(const char *name, const char *category, char phase, std::string_view label = {});
+
+/// Everything recorded since tracing last started, as Chrome trace JSON.
+/// Safe to call while other threads are still recording, their newest
+/// events just might not make it in.
+std::string format_chrome_trace();
+bool write_chrome_trace(const std::string &path);
+/// how much memory the current session's events are taking up
+size_t get_trace_buffer_bytes();
+
+/// Records a span covering its lifetime, if tracing is on when it's created.
+class TraceScope {
+  public:
+    TraceScope(const char *name, const char *category, std::string_view label = {})
+        : _mName(name), _mCategory(category), _mActive(is_tracing()) {
+      if (_mActive)
+        record_trace_event(name, category, 'B', label);
+    }
+    ~TraceScope() {
+      if (_mActive)
+        record_trace_event(_mName, _mCategory, 'E');
+    }
+    TraceScope(const TraceScope &other) = delete;
+    TraceScope &operator=(const TraceScope &other) = delete;
+
+  protected:
+    const char *_mName;
+    const char *_mCategory;
+    bool _mActive;
+};
+
+}
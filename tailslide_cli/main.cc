@@ -1,9 +1,15 @@
+#include <atomic>
 #include <iostream>
+#include <csignal>
 #include <cstdio>
+#include <fstream>
+#include <memory>
 
 #include "cxxopt.hh"
 
 #include "tailslide.hh"
+#include "compile_cache.hh"
+#include "compile_server.hh"
 #include "passes/pretty_print.hh"
 #include "passes/tree_print.hh"
 #include "passes/tree_simplifier.hh"
@@ -19,6 +25,32 @@ void version() {
 }
 
 
+static std::atomic<CompileServer *> gServer {nullptr};
+
+/// writes out the trace however we end up leaving main()
+class TraceFileWriter {
+  public:
+    explicit TraceFileWriter(std::string path) : _mPath(std::move(path)) {
+      set_trace_thread_name("main");
+      start_tracing();
+    }
+    ~TraceFileWriter() {
+      stop_tracing();
+      if (!write_chrome_trace(_mPath))
+        fprintf(stderr, "couldn't write trace to %s\n", _mPath.c_str());
+    }
+
+  protected:
+    std::string _mPath;
+};
+
+static void stop_server(int) {
+  // `stop()` is safe to call from here, it only flips a flag and shuts down the socket
+  if (CompileServer *server = gServer)
+    server->stop();
+}
+
+
 int main(int argc, char **argv) {
   FILE *yyin = nullptr;
   bool show_tree = false;
@@ -49,14 +81,55 @@ int main(int argc, char **argv) {
       ("prune-globals", "Prune unused globals")
       ("prune-locals", "Prune unused locals")
       ("prune-funcs", "Prune unused functions")
+      ("cse", "Eliminate common subexpressions within basic blocks")
+      ("mono-costs", "Weigh optimizations by what they cost under Mono rather than LSO, "
+                     "implied when only compiling for Mono")
       ("lint", "Only lint the file for errors, don't optimize or pretty print.")
       ("show-tree", "Show the AST after optimizations")
+      ("fingerprint", "Print a hash of the script that ignores formatting and user-defined names")
       ("check-asserts", "check assert comments and suppress errors based on matches")
   ;
 
   options.add_options("Compilation")
       ("lso-compile", "Compile to LSO and write to file", cxxopts::value<std::string>())
       ("mono-compile", "Compile to Mono CIL and write to file", cxxopts::value<std::string>())
+      ("mono-assemble", "Compile to a loadable Mono assembly and write to file", cxxopts::value<std::string>())
+      ("mono-exact-stack", "Declare the exact stack depth each CIL method needs")
+      ("mono-reuse-slots", "Let CIL locals in disjoint scopes share slots")
+      ("mono-switch-dispatch", "Compile long if / else if chains over one variable to jump tables")
+      ("mono-flatten-concat", "Concatenate chains of strings with a single call")
+      ("mono-preallocate-lists", "Create lists with room for all their elements up front")
+      ("mono-cache-lists", "Build constant lists once when the script starts rather than every time they're used")
+      ("lso-peephole", "Optimize emitted LSO bytecode, output won't match LL's compiler")
+      ("lso-share-constants", "Share identical heap constants between LSO globals")
+      ("lso-reuse-slots", "Let LSO locals in disjoint scopes share stack slots")
+      ("mono-peephole", "Optimize emitted CIL, output won't match LL's compiler")
+  ;
+
+  options.add_options("Caching")
+      ("cache-dir", "Reuse the outputs of earlier runs on identical scripts, kept in this directory",
+          cxxopts::value<std::string>())
+      ("cache-size", "Evict the least recently used cache entries past this many megabytes (default 256)",
+          cxxopts::value<uint64_t>())
+  ;
+
+  options.add_options("Limits")
+      ("max-time", "Give up on compiles that take longer than this many milliseconds", cxxopts::value<uint64_t>())
+      ("max-memory", "Give up on compiles that allocate more than this many megabytes", cxxopts::value<uint64_t>())
+      ("max-nodes", "Give up on compiles that create more than this many AST nodes", cxxopts::value<uint64_t>())
+  ;
+
+  options.add_options("Instrumentation")
+      ("time-passes", "Report how long each pass took")
+      ("mem-report", "Report what each pass allocated, and how many nodes and symbols it left behind")
+      ("trace", "Write a Chrome trace of every phase of the compile to this file", cxxopts::value<std::string>())
+  ;
+
+  options.add_options("Server")
+      ("serve", "Serve compile requests over a UNIX domain socket at this path", cxxopts::value<std::string>())
+      ("serve-stdio", "Serve compile requests framed over stdin and stdout")
+      ("threads", "How many requests to compile at once when serving (default one per core)",
+          cxxopts::value<unsigned int>())
   ;
 
   options.add_options()
@@ -87,7 +160,7 @@ int main(int argc, char **argv) {
 
   if (vm.count("script")) {
     std::string filename = vm["script"].as<std::string>();
-    yyin = fopen(filename.c_str(), "r");
+    yyin = fopen(filename.c_str(), "rb");
     if (yyin == nullptr) {
       fprintf(stderr, "couldn't open %s\n", filename.c_str());
       return 1;
@@ -109,6 +182,11 @@ int main(int argc, char **argv) {
     optim_ctx.prune_unused_globals = vm.count("prune-globals") != 0;
     optim_ctx.prune_unused_functions = vm.count("prune-funcs") != 0;
     optim_ctx.prune_unused_locals = vm.count("prune-locals") != 0;
+    optim_ctx.eliminate_common_subexpressions = vm.count("cse") != 0;
+    // temporaries are only introduced where they pay off for the target backend,
+    // LSO's costs are assumed unless we know we're only targeting Mono.
+    bool mono_only = (vm.count("mono-compile") || vm.count("mono-assemble")) && !vm.count("lso-compile");
+    optim_ctx.mono_semantics = vm.count("mono-costs") || mono_only;
 
     if (vm.count("O2")) {
       optim_ctx.prune_unused_globals = true;
@@ -121,6 +199,7 @@ int main(int argc, char **argv) {
       optim_ctx.prune_unused_locals = true;
       optim_ctx.prune_unused_functions = true;
       optim_ctx.fold_constants = true;
+      optim_ctx.eliminate_common_subexpressions = true;
       // the length of global vars / functions and their params has an impact on bytecode size
       pretty_opts.mangle_global_names = true;
       pretty_opts.mangle_func_names = true;
@@ -137,22 +216,162 @@ int main(int argc, char **argv) {
       pretty_opts.show_unmangled = false;
     }
   }
+  LSOCompilationOptions lso_options;
+  lso_options.optimize_bytecode = vm.count("lso-peephole");
+  lso_options.share_heap_constants = vm.count("lso-share-constants");
+  lso_options.reuse_local_slots = vm.count("lso-reuse-slots");
+
+  MonoCompilationOptions mono_options;
+  mono_options.peephole_optimize = vm.count("mono-peephole");
+  mono_options.emit_assembly = vm.count("mono-assemble");
+  mono_options.exact_max_stack = vm.count("mono-exact-stack");
+  mono_options.reuse_local_slots = vm.count("mono-reuse-slots");
+  mono_options.switch_dispatch = vm.count("mono-switch-dispatch");
+  mono_options.flatten_string_concat = vm.count("mono-flatten-concat");
+  mono_options.preallocate_lists = vm.count("mono-preallocate-lists");
+  mono_options.cache_constant_lists = vm.count("mono-cache-lists");
+  // nothing uses the tree after the last backend runs, so that one can lower it directly.
+  mono_options.lower_in_place = true;
+  lso_options.lower_in_place = !vm.count("mono-compile") && !vm.count("mono-assemble");
+
+  CompileLimits limits;
+  if (vm.count("max-time"))
+    limits.max_time = std::chrono::milliseconds(vm["max-time"].as<uint64_t>());
+  if (vm.count("max-memory"))
+    limits.max_bytes = vm["max-memory"].as<uint64_t>() * 1024 * 1024;
+  if (vm.count("max-nodes"))
+    limits.max_nodes = vm["max-nodes"].as<uint64_t>();
+
   tailslide_init_builtins(nullptr);
+
+  std::unique_ptr<TraceFileWriter> trace_writer;
+  if (vm.count("trace"))
+    trace_writer = std::make_unique<TraceFileWriter>(vm["trace"].as<std::string>());
+
+  if (vm.count("serve") || vm.count("serve-stdio")) {
+    // options for each compile come in with the requests, only the shared ones matter here.
+    CompileServerOptions server_options;
+    if (vm.count("threads"))
+      server_options.num_threads = vm["threads"].as<unsigned int>();
+    if (vm.count("cache-dir"))
+      server_options.cache_dir = vm["cache-dir"].as<std::string>();
+    if (vm.count("cache-size"))
+      server_options.cache_max_bytes = vm["cache-size"].as<uint64_t>() * 1024 * 1024;
+    server_options.limits = limits;
+    server_options.log = stderr;
+    CompileServer server(server_options);
+
+    if (vm.count("serve-stdio"))
+      return server.serve(fileno(stdin), fileno(stdout)) ? 0 : 1;
+
+    gServer = &server;
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    auto socket_path = vm["serve"].as<std::string>();
+    fprintf(stderr, "listening on %s with %u threads\n", socket_path.c_str(), server.getNumThreads());
+    bool listened = server.listen(socket_path);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    gServer = nullptr;
+    if (!listened) {
+      fprintf(stderr, "couldn't listen on %s\n", socket_path.c_str());
+      return 1;
+    }
+    return 0;
+  }
+
+  bool collect_stats = vm.count("time-passes") || vm.count("mem-report");
+
+  // The tree dump is only for debugging, don't bother caching it.
+  // There's nothing to measure if we're replaying a cached compile either.
+  std::unique_ptr<CompileCache> cache;
+  std::string cache_key;
+  std::string source;
+  if (vm.count("cache-dir") && yyin && !show_tree && !collect_stats) {
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), yyin)) > 0)
+      source.append(buf, len);
+    fclose(yyin);
+    yyin = nullptr;
+
+    CompileCacheKey key(source);
+    key.addFlag("pretty_print", pretty_print)
+        .addFlag("check_assertions", check_assertions)
+        .addFlag("fingerprint", vm.count("fingerprint"))
+        .add(optim_ctx)
+        .add(pretty_opts)
+        .addFlag("lso", vm.count("lso-compile"))
+        .addFlag("cil", vm.count("mono-compile"));
+    if (vm.count("lso-compile"))
+      key.add(lso_options);
+    if (vm.count("mono-compile") || vm.count("mono-assemble"))
+      key.add(mono_options);
+    cache_key = key.finish();
+
+    uint64_t max_bytes = CompileCache::DEFAULT_MAX_BYTES;
+    if (vm.count("cache-size"))
+      max_bytes = vm["cache-size"].as<uint64_t>() * 1024 * 1024;
+    cache = std::make_unique<CompileCache>(vm["cache-dir"].as<std::string>(), max_bytes);
+
+    if (auto cached = cache->lookup(cache_key)) {
+      // replay everything the original run would have output
+      auto fingerprint = cached->get("fingerprint");
+      fwrite(fingerprint.data(), 1, fingerprint.size(), stdout);
+      auto pretty = cached->get("pretty");
+      fwrite(pretty.data(), 1, pretty.size(), stdout);
+      auto report = cached->get("report");
+      fwrite(report.data(), 1, report.size(), stderr);
+      const std::pair<const char *, const char *> file_outputs[] = {
+          {"lso-compile", "lso"}, {"mono-compile", "cil"}, {"mono-assemble", "assembly"},
+      };
+      for (const auto &file_output : file_outputs) {
+        if (!vm.count(file_output.first) || !cached->has(file_output.second))
+          continue;
+        auto contents = cached->get(file_output.second);
+        std::ofstream f(vm[file_output.first].as<std::string>(), std::ios::binary);
+        f.write(contents.data(), (std::streamsize) contents.size());
+      }
+      return atoi(std::string(cached->get("errors")).c_str());
+    }
+  }
+
+  std::string script_name = vm.count("script") ? vm["script"].as<std::string>() : "<stdin>";
+  TraceScope trace("compile", "cli", script_name);
+
   // set up the allocator and logger
+  CompileBudget budget(limits);
+  CompileStats stats;
   ScopedScriptParser parser(nullptr);
+  if (limits)
+    parser.context.budget = &budget;
+  if (collect_stats)
+    parser.context.stats = &stats;
   Logger *logger = &parser.logger;
   bool mono_semantics = !vm.count("lso-compile");
 
   if (check_assertions)
     logger->setCheckAssertions(true);
 
-  auto script = parser.parseLSLFile(yyin);
-  if (yyin != nullptr)
-    fclose(yyin);
+  LSLScript *script;
+  if (cache) {
+    script = parser.parseLSLBytes(source.data(), (int) source.size());
+  } else {
+    script = parser.parseLSLFile(yyin);
+    if (yyin != nullptr)
+      fclose(yyin);
+  }
+
+  // whatever we output, so it can be stored in the cache
+  std::string fingerprint_output, pretty_output, report_output, lso_output, cil_output, assembly_output;
 
   if (script) {
     script->collectSymbols();
     script->determineTypes();
+    if (vm.count("fingerprint") && !logger->getErrors()) {
+      fingerprint_output = "fingerprint: " + script->getSemanticFingerprint() + "\n";
+      std::cout << fingerprint_output;
+    }
     script->recalculateReferenceData();
     script->propagateValues();
     script->finalPass();
@@ -170,17 +389,20 @@ int main(int argc, char **argv) {
       script->validateGlobals(mono_semantics);
       script->checkSymbols();
       if (pretty_print) {
+        ScopedPassTimer timer(&parser.context, "pretty_print");
         parser.table_manager.setMangledNames();
 
         PrettyPrintVisitor print_visitor(pretty_opts);
         script->visit(&print_visitor);
-        std::cout << print_visitor.mStream.str() << "\n";
+        pretty_output = print_visitor.mStream.str() + "\n";
+        std::cout << pretty_output;
       }
     } else {
       script->validateGlobals(mono_semantics);
       script->checkSymbols();
     }
-    logger->printReport();
+    report_output = logger->formatReport();
+    std::cerr << report_output;
     if (show_tree) {
       std::cout << "Tree:" << std::endl;
       TreePrintingVisitor visitor;
@@ -188,26 +410,89 @@ int main(int argc, char **argv) {
       std::cout << visitor.mStream.str();
     }
   } else {
-    logger->printReport();
+    report_output = logger->formatReport();
+    std::cerr << report_output;
   }
 
   if (!logger->getErrors()) {
     if (vm.count("lso-compile")) {
       auto lso_dest = vm["lso-compile"].as<std::string>();
-      LSOScriptCompiler lso_visitor(&parser.allocator);
+      LSOScriptCompiler lso_visitor(&parser.allocator, lso_options);
       script->visit(&lso_visitor);
 
       std::ofstream f(lso_dest, std::ios::binary);
       f.write((const char *) lso_visitor.mScriptBS.data(), (std::streamsize) lso_visitor.mScriptBS.size());
-    } else if (vm.count("mono-compile")) {
-      auto lso_dest = vm["mono-compile"].as<std::string>();
-      MonoScriptCompiler mono_visitor(&parser.allocator);
-      script->visit(&mono_visitor);
-
-      std::ofstream f(lso_dest, std::ios::binary);
-      std::string cil_code {mono_visitor.mCIL.str()};
-      f.write(cil_code.c_str(), (std::streamsize) cil_code.size());
+      if (cache)
+        lso_output.assign((const char *) lso_visitor.mScriptBS.data(), lso_visitor.mScriptBS.size());
     }
+    // LSO lowers a copy of the tree when Mono still needs it, so one parse can feed both.
+    if (vm.count("mono-compile") || vm.count("mono-assemble")) {
+      MonoScriptCompiler mono_visitor(&parser.allocator, mono_options);
+      // stream the CIL out as it's generated rather than holding all of it in memory,
+      // unless it needs to go in the cache too.
+      FILE *cil_file = nullptr;
+      std::string cil_dest;
+      if (vm.count("mono-compile")) {
+        cil_dest = vm["mono-compile"].as<std::string>();
+        cil_file = fopen(cil_dest.c_str(), "wb");
+        if (!cil_file) {
+          fprintf(stderr, "Couldn't open %s for writing\n", cil_dest.c_str());
+          return 1;
+        }
+        if (!cache)
+          mono_visitor.mCIL.setOutputFD(fileno(cil_file));
+      }
+      bool cil_written = true;
+      try {
+        script->visit(&mono_visitor);
+        if (cil_file) {
+          if (cache) {
+            cil_output = mono_visitor.mCIL.str();
+            cil_written = fwrite(cil_output.data(), 1, cil_output.size(), cil_file) == cil_output.size();
+          } else {
+            mono_visitor.mCIL.flush();
+          }
+        }
+      } catch (const std::runtime_error &e) {
+        // CIL is written out as it's generated, so this can happen mid-compile.
+        if (mono_visitor.mCIL.hasFailed())
+          fprintf(stderr, "Couldn't write %s: %s\n", cil_dest.c_str(), e.what());
+        else
+          fprintf(stderr, "Couldn't compile to Mono: %s\n", e.what());
+        if (cil_file)
+          fclose(cil_file);
+        return 1;
+      }
+      if (cil_file && (fclose(cil_file) != 0 || !cil_written)) {
+        fprintf(stderr, "Couldn't write %s\n", cil_dest.c_str());
+        return 1;
+      }
+      if (vm.count("mono-assemble")) {
+        std::ofstream f(vm["mono-assemble"].as<std::string>(), std::ios::binary);
+        f.write((const char *) mono_visitor.mAssemblyBS.data(), (std::streamsize) mono_visitor.mAssemblyBS.size());
+        if (cache)
+          assembly_output.assign((const char *) mono_visitor.mAssemblyBS.data(), mono_visitor.mAssemblyBS.size());
+      }
+    }
+  }
+
+  // running out of budget isn't a property of the script, try again next time.
+  if (cache && budget.getExceeded() == BUDGET_OK) {
+    auto errors = std::to_string(logger->getErrors());
+    CompileCacheSections sections {
+        {"fingerprint", fingerprint_output}, {"pretty", pretty_output}, {"report", report_output}, {"errors", errors},
+    };
+    if (vm.count("lso-compile") && !logger->getErrors())
+      sections.emplace_back("lso", lso_output);
+    if (vm.count("mono-compile") && !logger->getErrors())
+      sections.emplace_back("cil", cil_output);
+    if (vm.count("mono-assemble") && !logger->getErrors())
+      sections.emplace_back("assembly", assembly_output);
+    cache->store(cache_key, sections);
   }
+  if (vm.count("time-passes"))
+    std::cerr << stats.formatTimeReport();
+  if (vm.count("mem-report"))
+    std::cerr << stats.formatMemoryReport();
   return logger->getErrors();
 }
@@ -1,3 +1,6 @@
+#include <cstring>
+#include <thread>
+
 #include "passes/desugaring.hh"
 #include "testutils.hh"
 
@@ -136,4 +139,93 @@ TEST_CASE("desugaring.lsl") {
   });
 }
 
+static std::string prettyPrint(LSLScript *script) {
+  PrettyPrintVisitor visitor({});
+  script->visit(&visitor);
+  return visitor.mStream.str();
+}
+
+TEST_CASE("Forked scripts are independent") {
+  auto parser = runConformance("constprop.lsl");
+  parser->logger.finalize();
+  CHECK_EQ(parser->logger.getErrors(), 0);
+  const std::string original_output = prettyPrint(parser->script);
+
+  auto optimized_fork = parser->fork();
+  auto desugared_fork = parser->fork();
+
+  std::string optimized_output, desugared_output;
+  std::thread optimize_thread([&]() {
+    OptimizationOptions ctx {
+      .fold_constants = true,
+      .prune_unused_locals = true,
+      .prune_unused_globals = true,
+      .prune_unused_functions = true,
+    };
+    optimized_fork->script->optimize(ctx);
+    optimized_output = prettyPrint(optimized_fork->script);
+  });
+  std::thread desugar_thread([&]() {
+    LLConformantDeSugaringVisitor visitor(&desugared_fork->allocator, false);
+    desugared_fork->script->visit(&visitor);
+    desugared_output = prettyPrint(desugared_fork->script);
+  });
+  optimize_thread.join();
+  desugar_thread.join();
+
+  CHECK_EQ(optimized_output, readExpectedOutput(nullptr, "constprop.lsl"));
+  CHECK_NE(desugared_output, original_output);
+  // none of that should have had any effect on the original
+  CHECK_EQ(prettyPrint(parser->script), original_output);
+  CHECK_EQ(prettyPrint(parser->fork()->script), original_output);
+}
+
+TEST_CASE("Builtin symbols aren't reference counted") {
+  // Builtins are shared by every script, and forks of a script may be
+  // analyzed on different threads. Counting references to them would race.
+  auto parser = runConformance("constprop.lsl");
+  auto *builtin = parser->context.builtins->lookup("llFrand", SYM_FUNCTION);
+  REQUIRE(builtin);
+  CHECK_EQ(builtin->getReferences(), 0);
+
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<ScopedScriptParser>> forks;
+  for (int i = 0; i < 4; ++i)
+    forks.emplace_back(parser->fork());
+  for (auto &fork : forks)
+    threads.emplace_back([&fork]() { fork->script->recalculateReferenceData(); });
+  for (auto &thread : threads)
+    thread.join();
+  CHECK_EQ(builtin->getReferences(), 0);
+
+  // user-defined symbols are still counted, pruning depends on it
+  auto *user_sym = forks[0]->script->getSymbolTable()->lookup("s", SYM_VARIABLE);
+  REQUIRE(user_sym);
+  CHECK_GT(user_sym->getReferences(), 0);
+}
+
+TEST_CASE("Parsers can be reused after a reset") {
+  const char *broken = "default { state_entry() { integer i = \"foo\"; } }";
+  const char *valid = "default { state_entry() { integer i = 1 + 2; llOwnerSay((string)i); } }";
+
+  CompileStats stats;
+  ScopedScriptParser parser(nullptr);
+  parser.context.stats = &stats;
+  REQUIRE(analyzeScriptBytes(&parser, broken));
+  CHECK_GT(parser.logger.getErrors(), 0);
+
+  parser.reset();
+  CHECK_FALSE(parser.script);
+  CHECK_EQ(parser.logger.getErrors(), 0);
+  CHECK(parser.table_manager.getTables().empty());
+  // anything attached to the context sticks around
+  CHECK_EQ(parser.context.stats, &stats);
+
+  auto *script = analyzeScriptBytes(&parser, valid);
+  REQUIRE(script);
+  CHECK_EQ(parser.logger.getErrors(), 0);
+  ScopedScriptParser fresh_parser(nullptr);
+  CHECK_EQ(prettyPrint(script), prettyPrint(analyzeScriptBytes(&fresh_parser, valid)));
+}
+
 TEST_SUITE_END();
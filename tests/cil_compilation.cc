@@ -1,4 +1,8 @@
+#include <map>
+#include <set>
+
 #include "doctest.hh"
+#include "passes/lso/script_compiler.hh"
 #include "passes/mono/script_compiler.hh"
 #include "testutils.hh"
 
@@ -42,6 +46,513 @@ TEST_CASE("push_omission.lsl") {
       .omit_unnecessary_pushes = true
   });
 }
+TEST_CASE("cil_peephole.lsl") {
+  checkCILOutput("cil_peephole.lsl", {
+      .optimize_sutractions = false,
+      .omit_unnecessary_pushes = false,
+      .peephole_optimize = true
+  });
+}
+TEST_CASE("local_slot_reuse.lsl") {
+  checkCILOutput("local_slot_reuse.lsl", {
+      .exact_max_stack = true,
+      .reuse_local_slots = true
+  });
+}
+TEST_CASE("switch_dispatch.lsl") {
+  checkCILOutput("switch_dispatch.lsl", {.switch_dispatch = true});
+}
+TEST_CASE("string_concat.lsl") {
+  checkCILOutput("string_concat.lsl", {.flatten_string_concat = true});
+}
+TEST_CASE("list_construction.lsl") {
+  checkCILOutput("list_construction.lsl", {.preallocate_lists = true, .cache_constant_lists = true});
+}
+
+static void checkBothBackends(const char *name) {
+  auto parser = runConformance(name);
+  parser->logger.finalize();
+  CHECK_EQ(parser->logger.getErrors(), 0);
+  parser->logger.reset();
+  auto *script = parser->script;
+  script->validateGlobals(true);
+  script->checkSymbols();
+  parser->table_manager.setMangledNames();
+
+  TreePrintingVisitor before_visitor;
+  script->visit(&before_visitor);
+
+  // each backend lowers its own copy, so the order shouldn't matter
+  LSOScriptCompiler lso_visitor(&parser->allocator);
+  script->visit(&lso_visitor);
+  MonoScriptCompiler mono_visitor(&parser->allocator);
+  script->visit(&mono_visitor);
+
+  std::string lso_output {(const char*)lso_visitor.mScriptBS.data(), lso_visitor.mScriptBS.size()};
+  CHECK(lso_output == readExpectedOutput("lso", name));
+  CHECK_EQ(mono_visitor.mCIL.str(), readExpectedOutput("cil", name));
+
+  // and neither of them should have touched the original tree
+  TreePrintingVisitor after_visitor;
+  script->visit(&after_visitor);
+  CHECK_EQ(before_visitor.mStream.str(), after_visitor.mStream.str());
+
+  // the last backend to run may as well lower the original
+  for (bool mono : {false, true}) {
+    auto fork = parser->fork();
+    std::string output;
+    if (mono) {
+      MonoScriptCompiler in_place_visitor(&fork->allocator, {.lower_in_place = true});
+      fork->script->visit(&in_place_visitor);
+      output = in_place_visitor.mCIL.str();
+    } else {
+      LSOScriptCompiler in_place_visitor(&fork->allocator, {.lower_in_place = true});
+      fork->script->visit(&in_place_visitor);
+      output.assign((const char*)in_place_visitor.mScriptBS.data(), in_place_visitor.mScriptBS.size());
+    }
+    CHECK(output == (mono ? mono_visitor.mCIL.str() : lso_output));
+  }
+}
+
+TEST_CASE("Single parse compiled by both backends") {
+  checkBothBackends("casts.lsl");
+  checkBothBackends("assignments.lsl");
+  checkBothBackends("lsl_conformance.lsl");
+}
+
+/// Just enough of a PE / ECMA-335 metadata reader to check the assembled
+/// output structurally, there's no runtime around to actually load it with.
+class AssemblyReader {
+  public:
+    explicit AssemblyReader(const BitStream &bs): _mImage((const char *)bs.data(), bs.size()) {
+      parseHeaders();
+      parseTables();
+    }
+
+    uint32_t u8(uint32_t off) const {
+      REQUIRE(off < _mImage.size());
+      return (uint8_t)_mImage[off];
+    }
+    uint32_t u16(uint32_t off) const { return u8(off) | (u8(off + 1) << 8); }
+    uint32_t u32(uint32_t off) const { return u16(off) | (u16(off + 2) << 16); }
+
+    uint32_t rvaToOffset(uint32_t rva) const {
+      for (auto &section : _mSections) {
+        if (rva >= section[0] && rva < section[0] + section[1])
+          return rva - section[0] + section[2];
+      }
+      FAIL("RVA " << rva << " isn't in any section");
+      return 0;
+    }
+
+    uint32_t rows(int table) const { return _mTables[table].rows; }
+    uint32_t cell(int table, uint32_t row, int column) const {
+      auto &info = _mTables[table];
+      REQUIRE(row >= 1);
+      REQUIRE(row <= info.rows);
+      uint32_t off = info.offset + (row - 1) * info.row_size;
+      for (int i = 0; i < column; ++i)
+        off += info.column_sizes[i];
+      return info.column_sizes[column] == 4 ? u32(off) : u16(off);
+    }
+    std::string string(uint32_t idx) const {
+      REQUIRE(idx < _mStringsSize);
+      return {_mImage.c_str() + _mStringsOffset + idx};
+    }
+    std::u16string userString(uint32_t idx) const {
+      REQUIRE(idx < _mUserStringsSize);
+      uint32_t off = _mUserStringsOffset + idx;
+      uint32_t len = u8(off);
+      if ((len & 0x80) == 0) {
+        off += 1;
+      } else {
+        REQUIRE((len & 0xC0) == 0x80);
+        len = ((len & 0x3F) << 8) | u8(off + 1);
+        off += 2;
+      }
+      // odd length because of the trailing flag byte
+      REQUIRE(len % 2 == 1);
+      std::u16string str;
+      for (uint32_t i = 0; i + 1 < len; i += 2)
+        str += (char16_t)u16(off + i);
+      return str;
+    }
+    uint32_t userStringsSize() const { return _mUserStringsSize; }
+
+    enum {MODULE = 0x00, TYPEREF = 0x01, TYPEDEF = 0x02, FIELD = 0x04, METHODDEF = 0x06,
+          PARAM = 0x08, MEMBERREF = 0x0A, STANDALONESIG = 0x11, ASSEMBLY = 0x20, ASSEMBLYREF = 0x23};
+
+  protected:
+    void parseHeaders() {
+      REQUIRE(_mImage.substr(0, 2) == "MZ");
+      uint32_t pe_off = u32(0x3C);
+      REQUIRE(_mImage.substr(pe_off, 4) == std::string("PE\0\0", 4));
+      CHECK_EQ(u16(pe_off + 4), 0x014C);
+      uint32_t num_sections = u16(pe_off + 6);
+      uint32_t opt_size = u16(pe_off + 20);
+      // DLL flag
+      CHECK_NE(u16(pe_off + 22) & 0x2000, 0);
+      uint32_t opt_off = pe_off + 24;
+      CHECK_EQ(u16(opt_off), 0x010B);
+      uint32_t section_off = opt_off + opt_size;
+      for (uint32_t i = 0; i < num_sections; ++i) {
+        uint32_t header = section_off + i * 40;
+        uint32_t raw_size = u32(header + 16), raw_off = u32(header + 20);
+        CHECK_LE(raw_off + raw_size, _mImage.size());
+        _mSections.push_back({u32(header + 12), u32(header + 8), raw_off});
+      }
+      // entry point should be the stub jumping through the IAT
+      uint32_t entry = rvaToOffset(u32(opt_off + 16));
+      CHECK_EQ(u16(entry), 0x25FF);
+
+      // data directory 14 is the CLI header
+      uint32_t cli_off = rvaToOffset(u32(opt_off + 96 + 14 * 8));
+      CHECK_EQ(u32(cli_off), 72);
+      uint32_t metadata_off = rvaToOffset(u32(cli_off + 8));
+      uint32_t metadata_size = u32(cli_off + 12);
+      REQUIRE_EQ(u32(metadata_off), 0x424A5342);
+      uint32_t version_len = u32(metadata_off + 12);
+      uint32_t num_streams = u16(metadata_off + 16 + version_len + 2);
+      uint32_t stream_header = metadata_off + 16 + version_len + 4;
+      for (uint32_t i = 0; i < num_streams; ++i) {
+        uint32_t off = u32(stream_header), size = u32(stream_header + 4);
+        CHECK_LE(off + size, metadata_size);
+        std::string stream_name {_mImage.c_str() + stream_header + 8};
+        stream_header += 8 + (((uint32_t)stream_name.size() + 4) & ~3u);
+        if (stream_name == "#~") {
+          _mTablesOffset = metadata_off + off;
+        } else if (stream_name == "#Strings") {
+          _mStringsOffset = metadata_off + off;
+          _mStringsSize = size;
+        } else if (stream_name == "#US") {
+          _mUserStringsOffset = metadata_off + off;
+          _mUserStringsSize = size;
+        } else if (stream_name == "#Blob") {
+          _mBlobSize = size;
+        }
+      }
+      REQUIRE(_mTablesOffset);
+      REQUIRE(_mStringsOffset);
+    }
+
+    void parseTables() {
+      // a column is either a fixed size, a heap index, a table index or a coded index
+      enum ColumnKind {FIXED2, FIXED4, STRING, GUID, BLOB, INDEX, CODED};
+      struct Column { ColumnKind kind; std::vector<int> tables {}; int tag_bits = 0; };
+      const Column TYPE_DEF_OR_REF {CODED, {TYPEDEF, TYPEREF, 0x1B}, 2};
+      const Column RESOLUTION_SCOPE {CODED, {MODULE, 0x1A, ASSEMBLYREF, TYPEREF}, 2};
+      const Column MEMBER_REF_PARENT {CODED, {TYPEDEF, TYPEREF, 0x1A, METHODDEF, 0x1B}, 3};
+      const std::map<int, std::vector<Column>> schemas {
+          {MODULE, {{FIXED2}, {STRING}, {GUID}, {GUID}, {GUID}}},
+          {TYPEREF, {RESOLUTION_SCOPE, {STRING}, {STRING}}},
+          {TYPEDEF, {{FIXED4}, {STRING}, {STRING}, TYPE_DEF_OR_REF, {INDEX, {FIELD}}, {INDEX, {METHODDEF}}}},
+          {FIELD, {{FIXED2}, {STRING}, {BLOB}}},
+          {METHODDEF, {{FIXED4}, {FIXED2}, {FIXED2}, {STRING}, {BLOB}, {INDEX, {PARAM}}}},
+          {PARAM, {{FIXED2}, {FIXED2}, {STRING}}},
+          {MEMBERREF, {MEMBER_REF_PARENT, {STRING}, {BLOB}}},
+          {STANDALONESIG, {{BLOB}}},
+          {ASSEMBLY, {{FIXED4}, {FIXED2}, {FIXED2}, {FIXED2}, {FIXED2}, {FIXED4}, {BLOB}, {STRING}, {STRING}}},
+          {ASSEMBLYREF, {{FIXED2}, {FIXED2}, {FIXED2}, {FIXED2}, {FIXED4}, {BLOB}, {STRING}, {STRING}, {BLOB}}},
+      };
+
+      uint32_t heap_sizes = u8(_mTablesOffset + 6);
+      uint64_t valid = u32(_mTablesOffset + 8) | ((uint64_t)u32(_mTablesOffset + 12) << 32);
+      uint32_t off = _mTablesOffset + 24;
+      for (int table = 0; table < 64; ++table) {
+        if (!(valid & ((uint64_t)1 << table)))
+          continue;
+        REQUIRE_MESSAGE(schemas.count(table), "unexpected table " << table);
+        _mTables[table].rows = u32(off);
+        off += 4;
+      }
+
+      for (auto &schema : schemas) {
+        auto &info = _mTables[schema.first];
+        for (auto &column : schema.second) {
+          int size = 2;
+          switch (column.kind) {
+            case FIXED2: size = 2; break;
+            case FIXED4: size = 4; break;
+            case STRING: size = heap_sizes & 0x01 ? 4 : 2; break;
+            case GUID: size = heap_sizes & 0x02 ? 4 : 2; break;
+            case BLOB: size = heap_sizes & 0x04 ? 4 : 2; break;
+            case INDEX:
+            case CODED: {
+              uint32_t max_rows = 0;
+              for (int table : column.tables)
+                max_rows = std::max(max_rows, _mTables[table].rows);
+              size = max_rows >= (1u << (16 - column.tag_bits)) ? 4 : 2;
+              break;
+            }
+          }
+          info.column_sizes.push_back(size);
+          info.row_size += size;
+        }
+      }
+      for (int table = 0; table < 64; ++table) {
+        if (!_mTables[table].rows)
+          continue;
+        _mTables[table].offset = off;
+        off += _mTables[table].rows * _mTables[table].row_size;
+      }
+      CHECK_LE(off, _mImage.size());
+    }
+
+    struct TableInfo {
+      uint32_t rows = 0;
+      uint32_t offset = 0;
+      uint32_t row_size = 0;
+      std::vector<int> column_sizes {};
+    };
+
+    std::string _mImage;
+    /// (rva, virtual size, file offset)
+    std::vector<std::array<uint32_t, 3>> _mSections {};
+    TableInfo _mTables[64] {};
+    uint32_t _mTablesOffset = 0;
+    uint32_t _mStringsOffset = 0;
+    uint32_t _mStringsSize = 0;
+    uint32_t _mUserStringsOffset = 0;
+    uint32_t _mUserStringsSize = 0;
+    uint32_t _mBlobSize = 0;
+};
+
+struct TextMethod {
+  std::string name;
+  int max_stack = -1;
+  bool has_locals = false;
+  /// (opcode, operand)
+  std::vector<std::pair<std::string, std::string>> instructions {};
+};
+
+static std::string unquote(std::string name) {
+  if (name.size() >= 2 && name.front() == '\'' && name.back() == '\'')
+    return name.substr(1, name.size() - 2);
+  return name;
+}
+
+/// assemble `name` and check the result against the textual CIL for the same script
+static void checkAssembly(const char *name, MonoCompilationOptions options = {}) {
+  auto parser = runConformance(name);
+  parser->logger.finalize();
+  REQUIRE_EQ(parser->logger.getErrors(), 0);
+  parser->logger.reset();
+  auto *script = parser->script;
+  script->validateGlobals(true);
+  script->checkSymbols();
+  parser->table_manager.setMangledNames();
+
+  options.emit_assembly = true;
+  MonoScriptCompiler mono_visitor(&parser->allocator, options);
+  script->visit(&mono_visitor);
+
+  // pull the class, fields and method bodies back out of the text
+  std::string class_name;
+  std::vector<std::string> fields;
+  std::vector<TextMethod> methods;
+  std::istringstream cil(mono_visitor.mCIL.str());
+  std::string line;
+  bool in_method = false;
+  while (std::getline(cil, line)) {
+    if (line.rfind(".class ", 0) == 0) {
+      auto name_end = line.find(" extends ");
+      class_name = line.substr(line.rfind(' ', name_end - 1) + 1, name_end - line.rfind(' ', name_end - 1) - 1);
+    } else if (line.rfind(".field ", 0) == 0) {
+      fields.push_back(unquote(line.substr(line.rfind(' ') + 1)));
+    } else if (line.rfind(".method ", 0) == 0) {
+      auto name_end = line.find_last_not_of(' ', line.find('(') - 1) + 1;
+      auto name_start = line.rfind(' ', name_end - 1) + 1;
+      methods.push_back({unquote(line.substr(name_start, name_end - name_start))});
+      in_method = true;
+    } else if (in_method && line == "}") {
+      in_method = false;
+    } else if (in_method && line.rfind(".maxstack ", 0) == 0) {
+      methods.back().max_stack = std::stoi(line.substr(10));
+    } else if (in_method && line.rfind(".locals", 0) == 0) {
+      methods.back().has_locals = true;
+    } else if (in_method && !line.empty() && line[0] != '.' && line[0] != '{' && line.back() != ':') {
+      auto space = line.find(' ');
+      methods.back().instructions.emplace_back(
+          line.substr(0, space), space == std::string::npos ? "" : line.substr(space + 1));
+    }
+  }
+
+  AssemblyReader reader(mono_visitor.mAssemblyBS);
+  REQUIRE_EQ(reader.rows(AssemblyReader::TYPEDEF), 2);
+  CHECK_EQ(reader.string(reader.cell(AssemblyReader::TYPEDEF, 2, 1)), class_name);
+  CHECK_EQ(reader.string(reader.cell(AssemblyReader::ASSEMBLY, 1, 7)), class_name);
+
+  REQUIRE_EQ(reader.rows(AssemblyReader::FIELD), fields.size());
+  for (uint32_t i = 0; i < fields.size(); ++i)
+    CHECK_EQ(reader.string(reader.cell(AssemblyReader::FIELD, i + 1, 1)), fields[i]);
+
+  // every token an instruction uses has to point at a row that actually exists
+  auto check_token = [&](uint32_t token, std::initializer_list<int> tables) {
+    int table = (int)(token >> 24);
+    if (table == 0x70) {
+      CHECK_LT(token & 0xFFFFFF, reader.userStringsSize());
+      return;
+    }
+    CHECK_MESSAGE(std::find(tables.begin(), tables.end(), table) != tables.end(), "token " << token);
+    CHECK_GE(token & 0xFFFFFF, 1);
+    CHECK_LE(token & 0xFFFFFF, reader.rows(table));
+  };
+
+  REQUIRE_EQ(reader.rows(AssemblyReader::METHODDEF), methods.size());
+  for (uint32_t i = 0; i < methods.size(); ++i) {
+    auto &method = methods[i];
+    CAPTURE(method.name);
+    CHECK_EQ(reader.string(reader.cell(AssemblyReader::METHODDEF, i + 1, 3)), method.name);
+
+    uint32_t off = reader.rvaToOffset(reader.cell(AssemblyReader::METHODDEF, i + 1, 0));
+    uint32_t code_size, locals_token = 0;
+    uint32_t code_off;
+    if ((reader.u8(off) & 3) == 2) {
+      code_size = reader.u8(off) >> 2;
+      code_off = off + 1;
+      // tiny headers imply a max stack of 8
+      if (options.exact_max_stack)
+        CHECK_LE(method.max_stack, 8);
+    } else {
+      REQUIRE_EQ(reader.u16(off) & 3, 3);
+      CHECK_EQ(off % 4, 0);
+      CHECK_EQ(reader.u16(off) >> 12, 3);
+      // the assembler always works out the exact depth
+      if (options.exact_max_stack)
+        CHECK_EQ(reader.u16(off + 2), method.max_stack);
+      code_size = reader.u32(off + 4);
+      locals_token = reader.u32(off + 8);
+      code_off = off + 12;
+    }
+    CHECK_EQ(locals_token != 0, method.has_locals);
+    if (locals_token)
+      check_token(locals_token, {AssemblyReader::STANDALONESIG});
+
+    std::set<uint32_t> starts;
+    std::vector<uint32_t> branch_targets;
+    size_t insn_idx = 0;
+    uint32_t pos = code_off;
+    while (pos < code_off + code_size) {
+      starts.insert(pos - code_off);
+      uint16_t value = reader.u8(pos++);
+      if (value == 0xFE)
+        value = 0xFE00 | reader.u8(pos++);
+      auto *info = lookup_cil_opcode(value);
+      REQUIRE_MESSAGE(info, "unknown opcode " << value);
+      REQUIRE_LT(insn_idx, method.instructions.size());
+      auto &text_insn = method.instructions[insn_idx++];
+      // short branches may have been widened if they didn't reach
+      CHECK_MESSAGE((text_insn.first == info->name || text_insn.first == std::string(info->name) + ".s"),
+                    text_insn.first << " assembled as " << info->name);
+
+      switch (info->operand) {
+        case CIL_OPERAND_NONE: break;
+        case CIL_OPERAND_INT8: pos += 1; break;
+        case CIL_OPERAND_VAR8:
+        case CIL_OPERAND_VAR16: {
+          bool is_short = info->operand == CIL_OPERAND_VAR8;
+          uint32_t idx = is_short ? reader.u8(pos) : reader.u16(pos);
+          if (!text_insn.second.empty() && isdigit(text_insn.second[0]))
+            CHECK_EQ(idx, std::stoul(text_insn.second));
+          pos += is_short ? 1 : 2;
+          break;
+        }
+        case CIL_OPERAND_INT32: pos += 4; break;
+        case CIL_OPERAND_FLOAT64: pos += 8; break;
+        case CIL_OPERAND_BRANCH8:
+          branch_targets.push_back(pos + 1 - code_off + (int8_t)reader.u8(pos));
+          pos += 1;
+          break;
+        case CIL_OPERAND_BRANCH32:
+          branch_targets.push_back(pos + 4 - code_off + (int32_t)reader.u32(pos));
+          pos += 4;
+          break;
+        case CIL_OPERAND_METHOD:
+          check_token(reader.u32(pos), {AssemblyReader::METHODDEF, AssemblyReader::MEMBERREF});
+          pos += 4;
+          break;
+        case CIL_OPERAND_FIELD:
+          check_token(reader.u32(pos), {AssemblyReader::FIELD, AssemblyReader::MEMBERREF});
+          pos += 4;
+          break;
+        case CIL_OPERAND_TYPE:
+          check_token(reader.u32(pos), {AssemblyReader::TYPEDEF, AssemblyReader::TYPEREF});
+          pos += 4;
+          break;
+        case CIL_OPERAND_SWITCH: {
+          uint32_t count = reader.u32(pos);
+          CHECK_EQ(count, cil_switch_targets(text_insn.second).size());
+          uint32_t table_end = pos + 4 + 4 * count;
+          for (uint32_t j = 0; j < count; ++j)
+            branch_targets.push_back(table_end - code_off + (int32_t)reader.u32(pos + 4 + 4 * j));
+          pos = table_end;
+          break;
+        }
+        case CIL_OPERAND_STRING: {
+          uint32_t token = reader.u32(pos);
+          REQUIRE_EQ(token >> 24, 0x70);
+          auto str = reader.userString(token & 0xFFFFFF);
+          // only bother comparing the literals that don't need unescaping
+          const auto &literal = text_insn.second;
+          if (literal.find('\\') == std::string::npos)
+            CHECK_EQ(std::string(str.begin(), str.end()), literal.substr(1, literal.size() - 2));
+          pos += 4;
+          break;
+        }
+      }
+    }
+    CHECK_EQ(pos, code_off + code_size);
+    CHECK_EQ(insn_idx, method.instructions.size());
+    // the text output has unreachable jumps to labels right at the end of a method, allow those too.
+    starts.insert(code_size);
+    for (auto target : branch_targets)
+      CHECK_MESSAGE(starts.count(target), "branch into the middle of an instruction at " << target);
+  }
+
+  // and make sure the MemberRefs we did emit point at real types
+  for (uint32_t i = 1; i <= reader.rows(AssemblyReader::MEMBERREF); ++i) {
+    uint32_t parent = reader.cell(AssemblyReader::MEMBERREF, i, 0);
+    CHECK_EQ(parent & 7, 1);
+    CHECK_LE(parent >> 3, reader.rows(AssemblyReader::TYPEREF));
+    CHECK_FALSE(reader.string(reader.cell(AssemblyReader::MEMBERREF, i, 1)).empty());
+  }
+}
+
+TEST_CASE("Assembled output matches textual CIL") {
+  for (const char *name : {
+      "event_handler_order.lsl", "two_states.lsl", "various_globals.lsl", "simple_function_defs.lsl",
+      "lso_jump_behavior.lsl", "constant_expressions.lsl", "function_calls.lsl", "branching.lsl",
+      "simple_declarations.lsl", "lvalue.lsl", "casts.lsl", "assignments.lsl", "vector_ambiguity.lsl",
+      "simple_binops.lsl", "binary_expressions.lsl", "xnary_expressions.lsl", "print_expression.lsl",
+      "state_change.lsl", "lsl_conformance.lsl", "lsl_conformance2.lsl", "deprecated_function.lsl",
+      "event_handlers.lsl", "sub_replacement.lsl", "push_omission.lsl"}) {
+    CAPTURE(name);
+    checkAssembly(name);
+  }
+  // too many locals for the short forms to reach them all
+  checkAssembly("many_locals.lsl");
+  checkAssembly("cil_peephole.lsl", {.peephole_optimize = true});
+  checkAssembly("local_slot_reuse.lsl", {.exact_max_stack = true, .reuse_local_slots = true});
+  checkAssembly("lsl_conformance.lsl", {.peephole_optimize = true, .exact_max_stack = true, .reuse_local_slots = true});
+  checkAssembly("switch_dispatch.lsl", {.switch_dispatch = true});
+  checkAssembly("switch_dispatch.lsl", {.peephole_optimize = true, .exact_max_stack = true, .switch_dispatch = true});
+  checkAssembly("string_concat.lsl", {.exact_max_stack = true, .flatten_string_concat = true});
+  checkAssembly("list_construction.lsl", {.exact_max_stack = true, .preallocate_lists = true, .cache_constant_lists = true});
+  checkAssembly("lsl_conformance.lsl", {.preallocate_lists = true, .cache_constant_lists = true});
+}
+
+TEST_CASE("Assembled output is reproducible") {
+  auto assemble = [] {
+    auto parser = runConformance("lsl_conformance.lsl");
+    parser->script->validateGlobals(true);
+    parser->script->checkSymbols();
+    parser->table_manager.setMangledNames();
+    MonoScriptCompiler mono_visitor(&parser->allocator, {.emit_assembly = true});
+    parser->script->visit(&mono_visitor);
+    return std::string((const char *)mono_visitor.mAssemblyBS.data(), mono_visitor.mAssemblyBS.size());
+  };
+  CHECK_EQ(assemble(), assemble());
+}
 
 TEST_SUITE_END();
 
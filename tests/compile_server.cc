@@ -0,0 +1,418 @@
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <thread>
+
+#ifndef _WIN32
+#  include <csignal>
+#  include <pthread.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#endif
+
+#include "doctest.hh"
+#include "compile_server.hh"
+#include "trace.hh"
+#include "testutils.hh"
+
+using namespace Tailslide;
+
+TEST_SUITE_BEGIN("Compile server");
+
+static std::string read_script(const char *name) {
+  std::string path = __FILE__;
+  path.erase(path.find_last_of("\\/"));
+  path += "/scripts/";
+  path += name;
+  std::ifstream in(path, std::ios::binary);
+  std::stringstream sstr;
+  sstr << in.rdbuf();
+  return sstr.str();
+}
+
+static CompileRequest make_request(uint64_t id, CompileAction action, const char *name) {
+  CompileRequest request;
+  request.id = id;
+  request.action = action;
+  request.source = read_script(name);
+  return request;
+}
+
+TEST_CASE("Compile requests round trip through their encoding") {
+  auto request = make_request(42, COMPILE_CIL, "lsl_conformance.lsl");
+  CHECK(request.setFlag("fold-constants"));
+  CHECK(request.setFlag("mono-peephole"));
+  CHECK_FALSE(request.setFlag("no-such-flag"));
+
+  CompileRequest decoded;
+  std::string failure;
+  REQUIRE(CompileRequest::decode(request.encode(), &decoded, &failure));
+  CHECK_EQ(decoded.id, 42);
+  CHECK_EQ(decoded.action, COMPILE_CIL);
+  CHECK(decoded.optimization.fold_constants);
+  CHECK(decoded.mono.peephole_optimize);
+  CHECK_FALSE(decoded.mono.exact_max_stack);
+  CHECK_EQ(decoded.source, request.source);
+
+  auto encoded = request.encode();
+  CHECK_FALSE(CompileRequest::decode(encoded.substr(0, encoded.size() - 1), &decoded, &failure));
+}
+
+TEST_CASE("Served compiles match direct ones") {
+  CompileServer server({2});
+  auto response = server.compile(make_request(1, COMPILE_CIL, "lsl_conformance.lsl"));
+  CHECK_EQ(response.id, 1);
+  CHECK(response.failure.empty());
+  CHECK_EQ(response.errors, 0);
+  CHECK_EQ(response.output, readExpectedOutput("cil", "lsl_conformance.lsl"));
+
+  // errors come back in the report rather than failing the request
+  response = server.compile(make_request(2, COMPILE_LINT, "error1.lsl"));
+  CHECK(response.failure.empty());
+  CHECK_GT(response.errors, 0);
+  CHECK_NE(response.report.find("TOTAL:: Errors"), std::string::npos);
+  CHECK(response.output.empty());
+}
+
+TEST_CASE("Submitted requests run concurrently") {
+  const char *names[] = {"lsl_conformance.lsl", "lsl_conformance2.lsl", "constprop.lsl", "desugaring.lsl"};
+  CompileServer server({4});
+  CHECK_EQ(server.getNumThreads(), 4);
+
+  std::map<std::string, std::string> expected;
+  for (const char *name : names)
+    expected[name] = server.compile(make_request(0, COMPILE_LSO, name)).output;
+
+  std::vector<std::pair<const char *, std::future<CompileResponse>>> futures;
+  for (int i = 0; i < 8; ++i) {
+    for (const char *name : names)
+      futures.emplace_back(name, server.submit(make_request(i, COMPILE_LSO, name)));
+  }
+  for (auto &future : futures) {
+    auto response = future.second.get();
+    CHECK_EQ(response.errors, 0);
+    CHECK_EQ(response.output, expected[future.first]);
+    CHECK_GE(response.latency_us, response.queue_us);
+  }
+  CHECK_EQ(server.getRequestsServed(), futures.size() + std::size(names));
+}
+
+TEST_CASE("Optimization costs follow the request, not the action") {
+  CompileServer server({1});
+  CompileRequest request;
+  request.action = COMPILE_OPTIMIZE;
+  request.source = "default{state_entry(){string s = llGetObjectName();"
+                   "llOwnerSay(s + \"x\");llOwnerSay(s + \"x\");}}";
+  request.setFlag("cse");
+  // concatenation is cheap enough under LSO to leave alone
+  auto lso_costs = server.compile(request);
+  CHECK_EQ(lso_costs.output.find("_cse"), std::string::npos);
+
+  CHECK(request.setFlag("mono-costs"));
+  auto mono_costs = server.compile(request);
+  CHECK_NE(mono_costs.output.find("_cse"), std::string::npos);
+}
+
+TEST_CASE("Identical requests are served from the cache") {
+  auto dir = std::filesystem::temp_directory_path() / ("tailslide_server_cache_" + std::to_string(std::random_device()()));
+  std::filesystem::remove_all(dir);
+  {
+    CompileServerOptions options;
+    options.num_threads = 1;
+    options.cache_dir = dir.string();
+    CompileServer server(options);
+    auto request = make_request(1, COMPILE_OPTIMIZE, "constprop.lsl");
+    request.setFlag("fold-constants");
+    auto first = server.compile(request);
+    auto second = server.compile(request);
+    CHECK_FALSE(first.cached);
+    CHECK(second.cached);
+    CHECK_EQ(first.output, second.output);
+    CHECK_EQ(first.report, second.report);
+  }
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Requests that go over budget aren't cached") {
+  auto dir = std::filesystem::temp_directory_path() / ("tailslide_server_cache_" + std::to_string(std::random_device()()));
+  std::filesystem::remove_all(dir);
+  {
+    CompileServerOptions options;
+    options.num_threads = 1;
+    options.cache_dir = dir.string();
+    options.limits.max_nodes = 100;
+    CompileServer server(options);
+    auto request = make_request(1, COMPILE_CIL, "lsl_conformance.lsl");
+    auto first = server.compile(request);
+    CHECK(first.over_budget);
+    CHECK_EQ(first.errors, 1);
+    CHECK_NE(first.report.find("[E10038]"), std::string::npos);
+    CHECK(first.output.empty());
+    CHECK_FALSE(server.compile(request).cached);
+
+    // and they still come across the wire
+    CompileResponse decoded;
+    REQUIRE(CompileResponse::decode(first.encode(), &decoded));
+    CHECK(decoded.over_budget);
+  }
+  std::filesystem::remove_all(dir);
+}
+
+static size_t count_occurrences(const std::string &haystack, const std::string &needle) {
+  size_t count = 0;
+  for (auto pos = haystack.find(needle); pos != std::string::npos; pos = haystack.find(needle, pos + 1))
+    ++count;
+  return count;
+}
+
+TEST_CASE("Traces show which worker compiled what") {
+  CompileServer server({3});
+  start_tracing();
+  std::vector<std::future<CompileResponse>> futures;
+  for (int i = 0; i < 6; ++i)
+    futures.push_back(server.submit(make_request(i, COMPILE_CIL, "constprop.lsl")));
+  for (auto &future : futures)
+    future.get();
+  stop_tracing();
+
+  auto trace = format_chrome_trace();
+  CHECK_EQ(trace.rfind("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", 0), 0);
+  for (int i = 0; i < 6; ++i)
+    CHECK_EQ(count_occurrences(trace, "\"label\": \"request " + std::to_string(i) + " (cil)\""), 1);
+  CHECK_NE(trace.find("\"args\": {\"name\": \"worker 0\"}"), std::string::npos);
+  CHECK_EQ(count_occurrences(trace, "\"name\": \"request\""), 12);
+  CHECK_EQ(count_occurrences(trace, "\"name\": \"mono_compile\""), 12);
+  CHECK_EQ(count_occurrences(trace, "\"name\": \"functions\", \"cat\": \"mono\""), 12);
+  CHECK_EQ(count_occurrences(trace, "\"ph\": \"B\""), count_occurrences(trace, "\"ph\": \"E\""));
+
+  // a new session leaves out whatever came before
+  start_tracing();
+  stop_tracing();
+  CHECK_EQ(format_chrome_trace().find("\"name\": \"request\""), std::string::npos);
+}
+
+TEST_CASE("Traces can be exported while other threads are recording") {
+  start_tracing();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([]() {
+      // enough to need more than one chunk
+      for (int j = 0; j < 5000; ++j)
+        TraceScope scope("busy", "test", "some label");
+    });
+  }
+  for (int i = 0; i < 3; ++i) {
+    auto trace = format_chrome_trace();
+    CHECK_EQ(trace.substr(trace.size() - 4), "\n]}\n");
+  }
+  for (auto &thread : threads)
+    thread.join();
+  stop_tracing();
+  CHECK_EQ(count_occurrences(format_chrome_trace(), "\"name\": \"busy\""), 4 * 5000 * 2);
+}
+
+TEST_CASE("Starting a new trace lets go of the old one") {
+  start_tracing();
+  std::thread([]() {
+    set_trace_thread_name("short lived");
+    for (int j = 0; j < 5000; ++j)
+      TraceScope scope("busy", "test");
+  }).join();
+  stop_tracing();
+  // the thread's gone, but its events are still around to export
+  CHECK_GT(get_trace_buffer_bytes(), 5000 * 2 * sizeof(const char *));
+  CHECK_NE(format_chrome_trace().find("\"args\": {\"name\": \"short lived\"}"), std::string::npos);
+
+  start_tracing();
+  CHECK_EQ(get_trace_buffer_bytes(), 0);
+  stop_tracing();
+  CHECK_EQ(format_chrome_trace().find("short lived"), std::string::npos);
+
+  // naming a thread while tracing is off doesn't record anything
+  std::thread([]() { set_trace_thread_name("idle"); }).join();
+  CHECK_EQ(get_trace_buffer_bytes(), 0);
+}
+
+#ifndef _WIN32
+
+// just enough of a client to talk to a server over a socket
+class TestCompileClient {
+  public:
+    explicit TestCompileClient(int fd): _mFD(fd) {}
+    ~TestCompileClient() { close(_mFD); }
+
+    static std::unique_ptr<TestCompileClient> connectTo(const std::string &path) {
+      sockaddr_un addr {};
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+      // the server might not be listening quite yet
+      for (int attempt = 0; attempt < 200; ++attempt) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0)
+          return std::make_unique<TestCompileClient>(fd);
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      return nullptr;
+    }
+
+    bool send(const CompileRequest &request) { return write_compile_frame(_mFD, request.encode()); }
+    bool sendRaw(std::string_view payload) { return write_compile_frame(_mFD, payload); }
+    bool receive(CompileResponse *response) {
+      std::string payload;
+      return read_compile_frame(_mFD, &payload) && CompileResponse::decode(payload, response);
+    }
+    /// let the server know we're done sending
+    void finishSending() { shutdown(_mFD, SHUT_WR); }
+
+  protected:
+    int _mFD;
+};
+
+TEST_CASE("Serving requests over a socket") {
+  auto socket_path = (std::filesystem::temp_directory_path()
+      / ("tailslide_server_" + std::to_string(getpid()) + ".sock")).string();
+  CompileServer server({4});
+  bool listened = false;
+  std::thread listen_thread([&]() { listened = server.listen(socket_path); });
+
+  const char *names[] = {"lsl_conformance.lsl", "constprop.lsl", "error1.lsl"};
+  {
+    auto client = TestCompileClient::connectTo(socket_path);
+    REQUIRE(client);
+    uint64_t id = 0;
+    for (int i = 0; i < 4; ++i) {
+      for (const char *name : names)
+        CHECK(client->send(make_request(id++, COMPILE_CIL, name)));
+    }
+    CompileRequest bad_request;
+    bad_request.id = 1000;
+    auto bad_payload = bad_request.encode();
+    // unknown action names are rejected without taking the connection down
+    auto action_pos = bad_payload.find("lint");
+    bad_payload.replace(action_pos, 4, "lunt");
+    CHECK(client->sendRaw(bad_payload));
+    client->finishSending();
+
+    // responses come back as they finish, match them up by id
+    std::map<uint64_t, CompileResponse> responses;
+    CompileResponse response;
+    while (client->receive(&response)) {
+      responses[response.id] = response;
+      response = {};
+    }
+    REQUIRE_EQ(responses.size(), id + 1);
+    for (uint64_t i = 0; i < id; ++i) {
+      const char *name = names[i % std::size(names)];
+      auto expected = server.compile(make_request(i, COMPILE_CIL, name));
+      CHECK_EQ(responses[i].errors, expected.errors);
+      CHECK_EQ(responses[i].output, expected.output);
+    }
+    CHECK_EQ(responses[1000].failure, "unknown action lunt");
+  }
+
+  server.stop();
+  listen_thread.join();
+  CHECK(listened);
+  CHECK_FALSE(std::filesystem::exists(socket_path));
+}
+
+TEST_CASE("Stopping the server doesn't wait on idle clients") {
+  auto socket_path = (std::filesystem::temp_directory_path()
+      / ("tailslide_server_idle_" + std::to_string(getpid()) + ".sock")).string();
+  CompileServer server({2});
+  bool listened = false;
+  std::thread listen_thread([&]() { listened = server.listen(socket_path); });
+
+  auto idle_client = TestCompileClient::connectTo(socket_path);
+  REQUIRE(idle_client);
+  auto busy_client = TestCompileClient::connectTo(socket_path);
+  REQUIRE(busy_client);
+  CHECK(busy_client->send(make_request(3, COMPILE_LINT, "constprop.lsl")));
+  CompileResponse response;
+  REQUIRE(busy_client->receive(&response));
+  CHECK_EQ(response.id, 3);
+
+  // neither client ever closes its end, listen() has to return anyway.
+  server.stop();
+  listen_thread.join();
+  CHECK(listened);
+  // and both connections get closed on them
+  CHECK_FALSE(idle_client->receive(&response));
+  CHECK_FALSE(busy_client->receive(&response));
+}
+
+static std::atomic<CompileServer *> gSignalledServer {nullptr};
+
+TEST_CASE("Stopping the server from a signal handler") {
+  auto socket_path = (std::filesystem::temp_directory_path()
+      / ("tailslide_server_signal_" + std::to_string(getpid()) + ".sock")).string();
+  CompileServer server({2});
+  gSignalledServer = &server;
+  auto old_handler = signal(SIGUSR1, [](int) { gSignalledServer.load()->stop(); });
+  bool listened = false;
+  std::thread listen_thread([&]() { listened = server.listen(socket_path); });
+
+  auto idle_client = TestCompileClient::connectTo(socket_path);
+  REQUIRE(idle_client);
+  // deliver it on the listening thread itself, which may be holding the connection lock
+  pthread_kill(listen_thread.native_handle(), SIGUSR1);
+  listen_thread.join();
+  signal(SIGUSR1, old_handler);
+  gSignalledServer = nullptr;
+  CHECK(listened);
+  CompileResponse response;
+  CHECK_FALSE(idle_client->receive(&response));
+}
+
+TEST_CASE("Serving requests over a pipe") {
+  int to_server[2], from_server[2];
+  REQUIRE_EQ(pipe(to_server), 0);
+  REQUIRE_EQ(pipe(from_server), 0);
+
+  CompileServer server({2});
+  std::thread serve_thread([&]() {
+    server.serve(to_server[0], from_server[1]);
+    close(from_server[1]);
+  });
+
+  CHECK(write_compile_frame(to_server[1], make_request(7, COMPILE_OPTIMIZE, "constprop.lsl").encode()));
+  close(to_server[1]);
+
+  std::string payload;
+  CompileResponse response;
+  REQUIRE(read_compile_frame(from_server[0], &payload));
+  REQUIRE(CompileResponse::decode(payload, &response));
+  CHECK_EQ(response.id, 7);
+  CHECK_EQ(response.errors, 0);
+  CHECK_FALSE(response.output.empty());
+  // and nothing else
+  CHECK_FALSE(read_compile_frame(from_server[0], &payload));
+
+  serve_thread.join();
+  close(to_server[0]);
+  close(from_server[0]);
+}
+
+TEST_CASE("Compiles for a client that hung up are abandoned") {
+  int fds[2];
+  REQUIRE_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  for (uint64_t id = 0; id < 8; ++id)
+    CHECK(write_compile_frame(fds[1], make_request(id, COMPILE_CIL, "lsl_conformance.lsl").encode()));
+  // gone before the first response could be written
+  shutdown(fds[1], SHUT_RDWR);
+
+  CompileServer server({1});
+  server.serve(fds[0], fds[0]);
+  // the first failed write gives the rest of them up
+  CHECK_EQ(server.getRequestsServed(), 1);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+#endif
+
+TEST_SUITE_END();
@@ -1,6 +1,14 @@
+#include <chrono>
+#include <thread>
+
 #include "tailslide.hh"
 #include "doctest.hh"
 #include "passes/pretty_print.hh"
+#include "passes/subexpression_elimination.hh"
+#include "passes/tree_simplifier.hh"
+#include "passes/lso/script_compiler.hh"
+#include "passes/mono/script_compiler.hh"
+#include "script_generator.hh"
 #include "testutils.hh"
 
 using namespace Tailslide;
@@ -264,6 +272,14 @@ TEST_CASE("key_inlining.lsl") {
   checkPrettyPrintOutput("key_inlining.lsl", ctx, pretty_ctx);
 }
 
+TEST_CASE("cse.lsl") {
+  OptimizationOptions ctx {
+      .eliminate_common_subexpressions = true,
+  };
+  PrettyPrintOpts pretty_ctx {};
+  checkPrettyPrintOutput("cse.lsl", ctx, pretty_ctx);
+}
+
 TEST_CASE("num_literals.lsl") {
   OptimizationOptions ctx {};
   PrettyPrintOpts pretty_ctx {};
@@ -311,4 +327,489 @@ TEST_CASE("Parse script buffer") {
   CHECK_EQ(0, parser->logger.getErrors());
 }
 
+static std::string fingerprint_script(const std::string &src) {
+  auto parser = analyzeScriptBytes(src);
+  REQUIRE_NE(nullptr, parser->script);
+  REQUIRE_EQ(0, parser->logger.getErrors());
+  return parser->script->getSemanticFingerprint();
+}
+
+TEST_CASE("Semantic fingerprints") {
+  auto fingerprint = fingerprint_script(
+      "integer gCount = 1;\n"
+      "integer inc(integer amount) { gCount += amount; return gCount; }\n"
+      "default { state_entry() { llOwnerSay((string)inc(2) + \"x\"); state other; } }\n"
+      "state other { on_rez(integer param) { llSay(0, (string)<1,2,3>); } }\n"
+  );
+  // whitespace, comments, redundant parentheses and user-defined names don't matter
+  CHECK_EQ(fingerprint, fingerprint_script(
+      "integer n=1; // counter\n"
+      "integer bump(integer by){n+=(by);return n;}\n"
+      "default{state_entry(){llOwnerSay(((string)bump(2))+\"x\");state two;}}\n"
+      "state two{on_rez(integer p){llSay(0,(string)<1,2,3>);}}"
+  ));
+  // but constants, builtins, types, operators and event handlers do
+  const char *different[] = {
+      "integer gCount = 2;\n"
+      "integer inc(integer amount) { gCount += amount; return gCount; }\n"
+      "default { state_entry() { llOwnerSay((string)inc(2) + \"x\"); state other; } }\n"
+      "state other { on_rez(integer param) { llSay(0, (string)<1,2,3>); } }\n",
+
+      "integer gCount = 1;\n"
+      "integer inc(integer amount) { gCount += amount; return gCount; }\n"
+      "default { state_entry() { llOwnerSay((string)inc(2) + \"x\"); state other; } }\n"
+      "state other { on_rez(integer param) { llShout(0, (string)<1,2,3>); } }\n",
+
+      "float gCount = 1;\n"
+      "integer inc(integer amount) { gCount += amount; return (integer)gCount; }\n"
+      "default { state_entry() { llOwnerSay((string)inc(2) + \"x\"); state other; } }\n"
+      "state other { on_rez(integer param) { llSay(0, (string)<1,2,3>); } }\n",
+
+      "integer gCount = 1;\n"
+      "integer inc(integer amount) { gCount -= amount; return gCount; }\n"
+      "default { state_entry() { llOwnerSay((string)inc(2) + \"x\"); state other; } }\n"
+      "state other { on_rez(integer param) { llSay(0, (string)<1,2,3>); } }\n",
+
+      "integer gCount = 1;\n"
+      "integer inc(integer amount) { gCount += amount; return gCount; }\n"
+      "default { state_entry() { llOwnerSay((string)inc(2) + \"x\"); state other; } }\n"
+      "state other { changed(integer param) { llSay(0, (string)<1,2,3>); } }\n",
+
+      // same names, but the symbols they refer to are swapped around
+      "integer gCount = 1;\n"
+      "integer inc(integer amount) { integer gCount = amount; return gCount; }\n"
+      "default { state_entry() { llOwnerSay((string)inc(2) + \"x\"); state other; } }\n"
+      "state other { on_rez(integer param) { llSay(0, (string)<1,2,3>); } }\n",
+  };
+  for (const char *src : different)
+    CHECK_NE(fingerprint, fingerprint_script(src));
+}
+
+TEST_SUITE_END();
+
+
+TEST_SUITE_BEGIN("Serialization");
+
+static std::string dump_tree(LSLScript *script) {
+  TreePrintingVisitor tree_visitor;
+  script->visit(&tree_visitor);
+  return tree_visitor.mStream.str();
+}
+
+// everything downstream of analysis should behave the same on the loaded tree
+static std::string optimize_and_compile(ScopedScriptParser *parser) {
+  OptimizationOptions opts;
+  opts.fold_constants = true;
+  opts.prune_unused_locals = true;
+  opts.prune_unused_globals = true;
+  opts.prune_unused_functions = true;
+  auto *script = parser->script;
+  script->optimize(opts);
+  script->validateGlobals(true);
+  script->checkSymbols();
+  parser->table_manager.setMangledNames();
+
+  PrettyPrintOpts pretty_opts;
+  pretty_opts.mangle_local_names = true;
+  pretty_opts.mangle_global_names = true;
+  pretty_opts.mangle_func_names = true;
+  PrettyPrintVisitor pretty_visitor(pretty_opts);
+  script->visit(&pretty_visitor);
+  LSOScriptCompiler lso_visitor(&parser->allocator);
+  script->visit(&lso_visitor);
+  MonoScriptCompiler cil_visitor(&parser->allocator);
+  script->visit(&cil_visitor);
+  return pretty_visitor.mStream.str()
+      + std::string((const char *)lso_visitor.mScriptBS.data(), lso_visitor.mScriptBS.size())
+      + cil_visitor.mCIL.str();
+}
+
+static void check_round_trip(const char *name) {
+  auto original = runConformance(name);
+  assertNoLintErrors(&original->logger, name);
+  auto serialized = original->serializeScript();
+  REQUIRE_FALSE(serialized.empty());
+
+  ParserRef loaded(new ScopedScriptParser(nullptr));
+  REQUIRE_NE(loaded->loadSerializedBytes(serialized.data(), serialized.size()), nullptr);
+  CHECK_EQ(loaded->ast_sane, original->ast_sane);
+  CHECK_EQ(dump_tree(loaded->script), dump_tree(original->script));
+  CHECK_EQ(loaded->serializeScript().size(), serialized.size());
+  CHECK_EQ(optimize_and_compile(loaded.get()), optimize_and_compile(original.get()));
+}
+
+TEST_CASE("Serialization round trips") {
+  const char *names[] = {
+      "lsl_conformance.lsl",
+      "lsl_conformance2.lsl",
+      "jump_kinds.lsl",
+      "constprop.lsl",
+      "desugaring.lsl",
+      "list_construction.lsl",
+      "switch_dispatch.lsl",
+      "tltp/exporter.lsl",
+  };
+  for (const char *name : names) {
+    SUBCASE(name) {
+      check_round_trip(name);
+    }
+  }
+}
+
+TEST_CASE("Serialized scripts reject bad input") {
+  auto original = runConformance("lsl_conformance.lsl");
+  auto serialized = original->serializeScript();
+  REQUIRE_FALSE(serialized.empty());
+
+  // every possible truncation has to fail cleanly
+  for (size_t len = 0; len < serialized.size(); len += 1 + len / 16) {
+    ScopedScriptParser loaded(nullptr);
+    CHECK_EQ(loaded.loadSerializedBytes(serialized.data(), len), nullptr);
+  }
+
+  // serialized against some other builtins, the header has the builtins hash after the magic and version
+  auto stale = serialized;
+  stale[8 + 4 + 1] ^= 1;
+  ScopedScriptParser loaded(nullptr);
+  CHECK_EQ(loaded.loadSerializedBytes(stale.data(), stale.size()), nullptr);
+}
+
+TEST_CASE("Serialized scripts reject mismatched node types") {
+  auto original = analyzeScriptBytes("default { state_entry() { llOwnerSay(\"hi\"); } }");
+  REQUIRE(original->script);
+  auto serialized = original->serializeScript();
+  REQUIRE_FALSE(serialized.empty());
+
+  // find the header of the only expression statement
+  const char header[] = {(char)NODE_STATEMENT, (char)NODE_EXPRESSION_STATEMENT};
+  auto pos = serialized.find(header, 0, sizeof(header));
+  REQUIRE_NE(pos, std::string::npos);
+  REQUIRE_EQ(serialized.find(header, pos + 1, sizeof(header)), std::string::npos);
+  {
+    ScopedScriptParser loaded(nullptr);
+    CHECK_NE(loaded.loadSerializedBytes(serialized.data(), serialized.size()), nullptr);
+  }
+
+  // all of these take a single child, but not an expression.
+  for (auto sub_type : {NODE_LABEL, NODE_JUMP_STATEMENT, NODE_STATE_STATEMENT, NODE_COMPOUND_STATEMENT}) {
+    auto corrupted = serialized;
+    corrupted[pos + 1] = (char)sub_type;
+    ScopedScriptParser loaded(nullptr);
+    CHECK_EQ(loaded.loadSerializedBytes(corrupted.data(), corrupted.size()), nullptr);
+  }
+}
+
+TEST_SUITE_END();
+
+
+TEST_SUITE_BEGIN("Compile budgets");
+
+static int count_errors(Logger *logger, ErrorCode code) {
+  int count = 0;
+  for (auto *message : logger->getMessages()) {
+    if (message->getError() == code)
+      ++count;
+  }
+  return count;
+}
+
+TEST_CASE("Scripts within budget aren't affected") {
+  CompileLimits limits;
+  limits.max_time = std::chrono::milliseconds(60000);
+  limits.max_bytes = 512 * 1024 * 1024;
+  limits.max_nodes = 1000000;
+  CompileBudget budget(limits);
+  auto parser = analyzeScriptFile("lsl_conformance.lsl", &budget);
+  assertNoLintErrors(&parser->logger, "lsl_conformance.lsl");
+  CHECK_EQ(budget.getExceeded(), BUDGET_OK);
+  CHECK_GT(budget.getNodes(), 1000);
+  CHECK_GT(budget.getBytes(), budget.getNodes());
+}
+
+TEST_CASE("Parsing stops once the node budget is used up") {
+  CompileLimits limits;
+  limits.max_nodes = 2000;
+  CompileBudget budget(limits);
+  auto parser = analyzeScriptFile("parserstackdepth2.lsl", &budget);
+  CHECK_EQ(budget.getExceeded(), BUDGET_NODES);
+  CHECK_FALSE(parser->ast_sane);
+  // reported once, without the syntax error from cutting the script short
+  CHECK_EQ(count_errors(&parser->logger, E_COMPILE_BUDGET_EXCEEDED), 1);
+  CHECK_EQ(count_errors(&parser->logger, E_SYNTAX_ERROR), 0);
+  // the parser may have stopped well before the limit was hit
+  CHECK_LT(budget.getNodes(), 2100);
+}
+
+TEST_CASE("Parsing stops once the memory budget is used up") {
+  CompileLimits limits;
+  limits.max_bytes = 64 * 1024;
+  CompileBudget budget(limits);
+  auto parser = analyzeScriptFile("lsl_conformance.lsl", &budget);
+  CHECK_EQ(budget.getExceeded(), BUDGET_MEMORY);
+  CHECK_EQ(count_errors(&parser->logger, E_COMPILE_BUDGET_EXCEEDED), 1);
+}
+
+TEST_CASE("Cancelled compiles stop at the next check") {
+  CompileBudget budget;
+  auto parser = analyzeScriptFile("lsl_conformance.lsl", &budget);
+  REQUIRE_EQ(parser->logger.getErrors(), 0);
+  auto *script = parser->script;
+
+  // from another thread in practice
+  budget.cancel();
+  OptimizationOptions opts;
+  opts.fold_constants = true;
+  opts.prune_unused_locals = true;
+  script->optimize(opts);
+  script->validateGlobals(true);
+  CHECK_EQ(budget.getExceeded(), BUDGET_CANCELLED);
+  CHECK_EQ(count_errors(&parser->logger, E_COMPILE_BUDGET_EXCEEDED), 1);
+}
+
+TEST_CASE("Cancelled compiles stop inside the optimizer walks") {
+  OptimizationOptions opts;
+  opts.fold_constants = true;
+  SUBCASE("Folding") {
+    CompileBudget budget;
+    auto parser = analyzeScriptFile("constprop.lsl", &budget);
+    REQUIRE_EQ(parser->logger.getErrors(), 0);
+    budget.cancel();
+    // what `optimize()` would do for each round, minus its own check before starting one
+    TreeSimplifyingVisitor folding_visitor(opts);
+    parser->script->visit(&folding_visitor);
+    CHECK_EQ(folding_visitor.mFoldedLevel, 0);
+    CHECK_EQ(count_errors(&parser->logger, E_COMPILE_BUDGET_EXCEEDED), 1);
+  }
+  SUBCASE("Subexpression elimination") {
+    CompileBudget budget;
+    auto parser = analyzeScriptFile("cse.lsl", &budget);
+    REQUIRE_EQ(parser->logger.getErrors(), 0);
+    budget.cancel();
+    SubexpressionEliminatingVisitor cse_visitor(&parser->allocator, false);
+    parser->script->visit(&cse_visitor);
+    CHECK_EQ(cse_visitor.mEliminatedCount, 0);
+    CHECK_EQ(count_errors(&parser->logger, E_COMPILE_BUDGET_EXCEEDED), 1);
+  }
+}
+
+TEST_CASE("Polling only reads the clock every so often") {
+  CompileLimits limits;
+  limits.max_time = std::chrono::milliseconds(1);
+  CompileBudget budget(limits);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  bool polled_ok = true;
+  for (uint32_t i = 1; i < CompileBudget::POLL_INTERVAL; ++i)
+    polled_ok = budget.poll() && polled_ok;
+  CHECK(polled_ok);
+  CHECK_FALSE(budget.poll());
+  CHECK_EQ(budget.getExceeded(), BUDGET_TIME);
+}
+
+TEST_CASE("Cancelled compiles stop in the backends") {
+  CompileBudget budget;
+  auto parser = analyzeScriptFile("lsl_conformance.lsl", &budget);
+  REQUIRE_EQ(parser->logger.getErrors(), 0);
+  parser->script->validateGlobals(true);
+  REQUIRE_EQ(parser->logger.getErrors(), 0);
+
+  SUBCASE("LSO") {
+    budget.cancel();
+    LSOScriptCompiler lso_visitor(&parser->allocator);
+    parser->script->visit(&lso_visitor);
+    CHECK_EQ(lso_visitor.mScriptBS.size(), 0);
+  }
+  SUBCASE("Mono") {
+    budget.cancel();
+    MonoScriptCompiler mono_visitor(&parser->allocator);
+    parser->script->visit(&mono_visitor);
+    // stopped before any of the functions were written
+    CHECK_EQ(mono_visitor.mCIL.str().find("gtestPassed"), std::string::npos);
+  }
+  CHECK_EQ(budget.getExceeded(), BUDGET_CANCELLED);
+  CHECK_EQ(count_errors(&parser->logger, E_COMPILE_BUDGET_EXCEEDED), 1);
+}
+
+TEST_SUITE_END();
+
+
+TEST_SUITE_BEGIN("Pass instrumentation");
+
+static std::string compile_with_stats(const char *name, CompileStats *stats) {
+  auto parser = analyzeScriptFile(name, nullptr, stats);
+  auto *script = parser->script;
+  REQUIRE(script);
+  OptimizationOptions opts;
+  opts.fold_constants = true;
+  opts.prune_unused_locals = true;
+  opts.prune_unused_globals = true;
+  opts.prune_unused_functions = true;
+  opts.eliminate_common_subexpressions = true;
+  opts.mono_semantics = true;
+  script->optimize(opts);
+  script->validateGlobals(true);
+  MonoScriptCompiler mono_visitor(&parser->allocator);
+  script->visit(&mono_visitor);
+  REQUIRE_EQ(parser->logger.getErrors(), 0);
+  return mono_visitor.mCIL.str();
+}
+
+static const PassStats *find_pass(const CompileStats &stats, const char *name) {
+  for (const auto &pass : stats.getPasses()) {
+    if (!strcmp(pass.name, name))
+      return &pass;
+  }
+  return nullptr;
+}
+
+TEST_CASE("Each pass records what it cost") {
+  CompileStats stats;
+  compile_with_stats("lsl_conformance.lsl", &stats);
+
+  const auto &passes = stats.getPasses();
+  REQUIRE_FALSE(passes.empty());
+  CHECK_EQ(std::string(passes[0].name), "parse");
+  CHECK_GT(passes[0].nodes_created, 1000);
+  CHECK_EQ(passes[0].nodes, passes[0].nodes_created);
+
+  const char *expected[] = {
+      "collect_symbols", "determine_types", "reference_data", "propagate_values", "final_pass",
+      "optimize", "eliminate_subexpressions", "validate_globals", "mono_compile",
+  };
+  for (const char *name : expected) {
+    INFO(name);
+    REQUIRE(find_pass(stats, name));
+  }
+  CHECK_GT(find_pass(stats, "collect_symbols")->symbols, 0);
+  const auto *optimize = find_pass(stats, "optimize");
+  CHECK_GE(optimize->iterations, 1);
+  // pruning only ever shrinks the tree
+  CHECK_LT(optimize->nodes, passes[0].nodes);
+  // run from inside optimize() as well as on its own
+  const auto *reference_data = find_pass(stats, "reference_data");
+  CHECK_GT(reference_data->calls, 1);
+  CHECK(reference_data->outermost);
+  CHECK_FALSE(find_pass(stats, "eliminate_subexpressions")->outermost);
+  CHECK_GT(find_pass(stats, "mono_compile")->allocations, 0);
+
+  // nested passes aren't counted twice
+  const auto &total = stats.getTotal();
+  std::chrono::steady_clock::duration outer_time {};
+  uint64_t allocations = 0;
+  for (const auto &pass : passes) {
+    allocations += pass.allocations;
+    if (pass.outermost && strcmp(pass.name, "reference_data") != 0)
+      outer_time += pass.time;
+  }
+  CHECK_LE(outer_time, total.time);
+  CHECK_LT(total.allocations, allocations);
+
+  CHECK_NE(stats.formatTimeReport().find("optimize"), std::string::npos);
+  CHECK_NE(stats.formatMemoryReport().find("mono_compile"), std::string::npos);
+}
+
+TEST_CASE("Walked nodes grow with the size of the script") {
+  ScriptShape shape;
+  shape.functions = 1;
+  shape.statements_per_function = 200;
+  uint64_t walked[2];
+  for (int i = 0; i < 2; ++i) {
+    CompileStats stats;
+    auto parser = analyzeScriptBytes(generate_script(shape), nullptr, &stats);
+    REQUIRE(parser->script);
+    CHECK_GT(find_pass(stats, "parse")->nodes_walked, 0);
+    CHECK_GT(find_pass(stats, "reference_data")->nodes_walked, 0);
+    walked[i] = stats.getTotal().nodes_walked;
+    shape.statements_per_function *= 2;
+  }
+  // twice the code shouldn't mean much more than twice the work
+  CHECK_GT(walked[1], walked[0] * 3 / 2);
+  CHECK_LT(walked[1], walked[0] * 5 / 2);
+}
+
+static uint64_t optimize_walked(const ScriptShape &shape, const OptimizationOptions &opts) {
+  CompileStats stats;
+  auto parser = analyzeScriptBytes(generate_script(shape), nullptr, &stats);
+  REQUIRE(parser->script);
+  parser->script->optimize(opts);
+  return find_pass(stats, "optimize")->nodes_walked;
+}
+
+TEST_CASE("Walked nodes show when a pass is quadratic") {
+  ScriptShape shape;
+  OptimizationOptions opts;
+  opts.mono_semantics = true;
+  SUBCASE("Eliminating subexpressions in one long block") {
+    shape.statements_per_function = 1000;
+    opts.eliminate_common_subexpressions = true;
+  }
+  SUBCASE("Pruning lots of unused globals") {
+    shape.globals = 400;
+    shape.statements_per_function = 1;
+    opts.prune_unused_globals = true;
+  }
+  uint64_t walked[2];
+  for (int i = 0; i < 2; ++i) {
+    walked[i] = optimize_walked(shape, opts);
+    shape.statements_per_function *= 2;
+    shape.globals *= 2;
+  }
+  // these rescan the whole block or symbol table each time, make sure that
+  // shows up in the numbers so the complexity fuzzer can see it.
+  CHECK_GT(walked[1], walked[0] * 9 / 4);
+}
+
+TEST_CASE("Collecting stats doesn't change the output") {
+  CompileStats stats;
+  CHECK_EQ(compile_with_stats("constprop.lsl", &stats), compile_with_stats("constprop.lsl", nullptr));
+}
+
+TEST_SUITE_END();
+
+
+TEST_SUITE_BEGIN("Script generator");
+
+TEST_CASE("Generated scripts are valid") {
+  std::vector<ScriptShapePreset> presets = script_shape_presets();
+  ScriptShape everything;
+  everything.globals = 50;
+  everything.functions = 5;
+  everything.expression_depth = 10000;
+  everything.list_length = 1000;
+  everything.states = 4;
+  everything.handlers_per_state = 100;
+  everything.jumps = 5;
+  presets.push_back({"everything", everything});
+
+  for (auto &preset : presets) {
+    for (uint32_t seed = 0; seed < 3; ++seed) {
+      INFO(preset.name, " with seed ", seed);
+      preset.shape.seed = seed;
+      auto parser = analyzeScriptBytes(generate_script(preset.shape));
+      REQUIRE(parser->script);
+      assertNoLintErrors(&parser->logger, preset.name);
+      OptimizationOptions opts;
+      opts.fold_constants = true;
+      opts.prune_unused_locals = true;
+      opts.prune_unused_globals = true;
+      opts.prune_unused_functions = true;
+      opts.mono_semantics = true;
+      parser->script->optimize(opts);
+      parser->script->validateGlobals(true);
+      parser->script->checkSymbols();
+      MonoScriptCompiler mono_visitor(&parser->allocator);
+      parser->script->visit(&mono_visitor);
+      CHECK_EQ(parser->logger.getErrors(), 0);
+    }
+  }
+}
+
+TEST_CASE("Generated scripts only depend on their shape") {
+  ScriptShape shape = script_shape_presets()[0].shape;
+  shape.statements_per_function = 50;
+  auto first = generate_script(shape);
+  CHECK_EQ(first, generate_script(shape));
+  shape.seed = 1;
+  CHECK_NE(first, generate_script(shape));
+}
+
 TEST_SUITE_END();
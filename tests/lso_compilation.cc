@@ -1,5 +1,6 @@
 #include "doctest.hh"
 #include "passes/lso/bytecode_format.hh"
+#include "passes/lso/peephole.hh"
 #include "passes/lso/script_compiler.hh"
 #include "tailslide.hh"
 #include "testutils.hh"
@@ -124,6 +125,149 @@ TEST_CASE("Stack-Heap Collision") {
   CHECK_FALSE(script->logger.getErrors());
 }
 
+TEST_CASE("Shared heap constants") {
+  ScopedScriptParser parser(nullptr);
+  LSOHeapManager heap_manager(true);
+  auto *str_const = parser.allocator.newTracked<LSLStringConstant>("foo");
+  auto *key_const = parser.allocator.newTracked<LSLKeyConstant>("foo");
+  auto *list_const = parser.allocator.newTracked<LSLListConstant>(nullptr);
+  list_const->pushChild(parser.allocator.newTracked<LSLStringConstant>("foo"));
+
+  CHECK_EQ(heap_manager.writeConstant(str_const), 1);
+  // keys are written as strings, so they can share with an identical string
+  CHECK_EQ(heap_manager.writeConstant(key_const), 1);
+  uint32_t list_idx = heap_manager.writeConstant(list_const);
+  CHECK_EQ(list_idx, 12);
+  CHECK_EQ(heap_manager.writeConstant(list_const), list_idx);
+
+  LSOBitStream heap_bs(std::move(heap_manager.mHeapBS));
+  // one string, one list, and the list's own copy of its element
+  CHECK_EQ(heap_bs.size(), 11 + 15 + 11);
+  uint32_t size;
+  LSLIType type;
+  uint16_t ref_count;
+  heap_bs.moveTo(0);
+  heap_bs >> size >> type >> ref_count;
+  CHECK_EQ(ref_count, 2);
+  heap_bs.moveTo(list_idx - 1);
+  heap_bs >> size >> type >> ref_count;
+  CHECK_EQ(type, LST_LIST);
+  CHECK_EQ(ref_count, 2);
+}
+
+TEST_CASE("Shared heap constants avoid stack-heap collisions") {
+  {
+    auto script = runConformance("shared_heap_constants.lsl");
+    LSOScriptCompiler visitor(&script->allocator);
+    script->script->visit(&visitor);
+    script->logger.finalize();
+    CHECK(script->logger.getErrors());
+  }
+  {
+    auto script = runConformance("shared_heap_constants.lsl");
+    LSOScriptCompiler visitor(&script->allocator, {.share_heap_constants=true});
+    script->script->visit(&visitor);
+    script->logger.finalize();
+    CHECK_FALSE(script->logger.getErrors());
+  }
+}
+
+TEST_CASE("Oversized code doesn't leave a partial image") {
+  std::string src = "default{state_entry(){";
+  for (int i = 0; i < 200; ++i)
+    src += "llOwnerSay(\"" + std::string(100, 'a') + "\");";
+  src += "}}";
+  auto parser = analyzeScriptBytes(src);
+  REQUIRE(parser->script);
+
+  LSOScriptCompiler visitor(&parser->allocator);
+  parser->script->visit(&visitor);
+  parser->logger.finalize();
+  CHECK(parser->logger.getErrors());
+  // code is written straight into the image, so a failure has to throw the whole thing away
+  CHECK_EQ(visitor.mScriptBS.size(), 0);
+}
+
+TEST_CASE("Local slot reuse") {
+  auto script = runConformance("local_slot_reuse.lsl");
+  auto *handlers = ((LSLState *) script->script->getStates()->getChild(0))->getEventHandlers();
+  auto *state_entry_sym = handlers->getChild(0)->getSymbol();
+  auto *touch_start_sym = handlers->getChild(1)->getSymbol();
+  auto *timer_sym = handlers->getChild(2)->getSymbol();
+
+  LSOSymbolDataMap conformant_data;
+  LSOResourceVisitor conformant_visitor(&conformant_data);
+  script->script->visit(&conformant_visitor);
+  CHECK_EQ(conformant_data[state_entry_sym].size, 44);
+  CHECK_EQ(conformant_data[state_entry_sym].locals.size(), 7);
+
+  LSOSymbolDataMap reused_data;
+  LSOResourceVisitor reusing_visitor(&reused_data, true);
+  script->script->visit(&reusing_visitor);
+  // `t` and `w` take over the slots of `s` and `v`
+  CHECK_EQ(reused_data[state_entry_sym].size, 28);
+  CHECK_EQ(reused_data[state_entry_sym].locals.size(), 5);
+  // nested scopes can't share with their parents
+  CHECK_EQ(reused_data[touch_start_sym].size, conformant_data[touch_start_sym].size);
+  // `t`'s declaration can be jumped over, so it can't inherit `secret`'s slot
+  CHECK_EQ(reused_data[timer_sym].locals.size(), 2);
+  CHECK_EQ(reused_data[timer_sym].size, conformant_data[timer_sym].size);
+
+  LSOScriptCompiler visitor(&script->allocator, {.reuse_local_slots=true});
+  script->script->visit(&visitor);
+  script->logger.finalize();
+  CHECK_FALSE(script->logger.getErrors());
+}
+
+TEST_CASE("Peephole rewrites") {
+  LSOBitStream code(ENDIAN_BIG);
+  // integer i = 1; while (TRUE) { i = 2; }
+  code << LOPC_PUSHARGI << (int32_t)1 << LOPC_LOADP << (int32_t)-8;
+  code << LOPC_PUSHARGI << (int32_t)1 << LOPC_JUMPNIF << LST_INTEGER << (int32_t)16;
+  code << LOPC_PUSHARGI << (int32_t)2 << LOPC_STORE << (int32_t)-8 << LOPC_POP;
+  code << LOPC_JUMP << (int32_t)-27;
+  code << LOPC_JUMP << (int32_t)0;
+  code << LOPC_RETURN;
+
+  LSOPeepholeOptimizer optimizer;
+  CHECK(optimizer.optimize(code));
+
+  LSOBitStream expected(ENDIAN_BIG);
+  expected << LOPC_PUSHARGI << (int32_t)1 << LOPC_LOADP << (int32_t)-8;
+  expected << LOPC_PUSHARGI << (int32_t)2 << LOPC_LOADP << (int32_t)-8;
+  // the constant condition is gone, and everything after the loop is unreachable
+  expected << LOPC_JUMP << (int32_t)-15;
+  CHECK_EQ(code.size(), expected.size());
+  CHECK(!memcmp(code.data(), expected.data(), expected.size()));
+}
+
+TEST_CASE("Peephole leaves undecodable code alone") {
+  LSOBitStream code(ENDIAN_BIG);
+  // jumps into the middle of the PUSHARGI's operand
+  code << LOPC_PUSHARGI << (int32_t)1 << LOPC_POP << LOPC_JUMP << (int32_t)-8 << LOPC_RETURN;
+  LSOPeepholeOptimizer optimizer;
+  CHECK_FALSE(optimizer.optimize(code));
+  CHECK_EQ(code.size(), 12);
+}
+
+TEST_CASE("Peephole-optimized script compilation") {
+  auto script = runConformance("lsl_conformance.lsl");
+  LSOScriptCompiler conformant_visitor(&script->allocator);
+  script->script->visit(&conformant_visitor);
+  LSOScriptCompiler visitor(&script->allocator, {.optimize_bytecode=true});
+  script->script->visit(&visitor);
+  script->logger.finalize();
+  CHECK_FALSE(script->logger.getErrors());
+
+  // the heap starts right after the code, so smaller code means a lower heap register.
+  uint32_t conformant_hr, optimized_hr;
+  conformant_visitor.mScriptBS.moveTo(LSO_REGISTER_OFFSETS[LREG_HR]);
+  conformant_visitor.mScriptBS >> conformant_hr;
+  visitor.mScriptBS.moveTo(LSO_REGISTER_OFFSETS[LREG_HR]);
+  visitor.mScriptBS >> optimized_hr;
+  CHECK_LT(optimized_hr, conformant_hr);
+}
+
 TEST_SUITE_END();
 
 TEST_SUITE_BEGIN("LSO conformance");
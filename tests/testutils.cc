@@ -4,12 +4,49 @@
 
 using namespace Tailslide;
 
-ParserRef runConformance(const char *name, bool allow_syntax_errors)
-{
+static std::string scriptPath(const char *name) {
   std::string path = __FILE__;
   path.erase(path.find_last_of("\\/"));
   path += "/scripts/";
   path += name;
+  return path;
+}
+
+static void analyzeScript(LSLScript *script) {
+  if (!script)
+    return;
+  script->collectSymbols();
+  script->determineTypes();
+  script->recalculateReferenceData();
+  script->propagateValues();
+  script->finalPass();
+}
+
+ParserRef analyzeScriptFile(const char *name, CompileBudget *budget, CompileStats *stats) {
+  ParserRef parser(new ScopedScriptParser(nullptr));
+  parser->context.budget = budget;
+  parser->context.stats = stats;
+  analyzeScript(parser->parseLSLFile(scriptPath(name)));
+  return parser;
+}
+
+ParserRef analyzeScriptBytes(const std::string &source, CompileBudget *budget, CompileStats *stats) {
+  ParserRef parser(new ScopedScriptParser(nullptr));
+  parser->context.budget = budget;
+  parser->context.stats = stats;
+  analyzeScriptBytes(parser.get(), source);
+  return parser;
+}
+
+LSLScript *analyzeScriptBytes(ScopedScriptParser *parser, const std::string &source) {
+  auto *script = parser->parseLSLBytes(source.data(), (int)source.size());
+  analyzeScript(script);
+  return script;
+}
+
+ParserRef runConformance(const char *name, bool allow_syntax_errors)
+{
+  std::string path = scriptPath(name);
 
   ParserRef parser(new ScopedScriptParser(nullptr));
   Logger *logger = &parser->logger;
@@ -25,11 +62,7 @@ ParserRef runConformance(const char *name, bool allow_syntax_errors)
       FAIL(message);
     }
   } else {
-    script->collectSymbols();
-    script->determineTypes();
-    script->recalculateReferenceData();
-    script->propagateValues();
-    script->finalPass();
+    analyzeScript(script);
     script->validateGlobals(true);
     script->checkSymbols();
   }
@@ -95,6 +128,23 @@ class ScriptCILCompiler: public ScriptFormatter {
   MonoCompilationOptions _mOptions;
 };
 
+std::string readExpectedOutput(const char *expected_prefix, const char *name) {
+  std::string path = __FILE__;
+  path.erase(path.find_last_of("\\/"));
+  path += "/scripts/expected/";
+  if (expected_prefix != nullptr) {
+    path += expected_prefix;
+    path += "/";
+  }
+  path += name;
+
+  std::ifstream in;
+  in.open(path, std::ifstream::in | std::ifstream::binary);
+  std::stringstream sstr;
+  sstr << in.rdbuf();
+  return sstr.str();
+}
+
 static void checkStringOutput(
     const char *name,
     const char *expected_prefix,
@@ -123,21 +173,7 @@ static void checkStringOutput(
 
   std::string prettified = formatter.format(parser->script);
 
-  std::string path = __FILE__;
-  path.erase(path.find_last_of("\\/"));
-  path += "/scripts/expected/";
-  if (expected_prefix != nullptr) {
-    path += expected_prefix;
-    path += "/";
-  }
-  path += name;
-
-  std::ifstream in;
-  in.open(path, std::ifstream::in | std::ifstream::binary);
-  std::stringstream sstr;
-  sstr << in.rdbuf();
-  const std::string expected(sstr.str());
-  in.close();
+  const std::string expected(readExpectedOutput(expected_prefix, name));
   if (expected != prettified) {
     size_t diff_pos;
     for(diff_pos=0; diff_pos < std::min(expected.length(), prettified.length()); ++diff_pos) {
@@ -24,8 +24,25 @@ using ParserRef = std::unique_ptr<Tailslide::ScopedScriptParser>;
 
 ParserRef runConformance(const char *name, bool allow_syntax_errors=false);
 
+/// Parse a script and run the analysis passes every compile does before optimizing,
+/// with an optional budget and stats attached. `script` is null if parsing failed.
+ParserRef analyzeScriptFile(
+    const char *name,
+    Tailslide::CompileBudget *budget = nullptr,
+    Tailslide::CompileStats *stats = nullptr
+);
+ParserRef analyzeScriptBytes(
+    const std::string &source,
+    Tailslide::CompileBudget *budget = nullptr,
+    Tailslide::CompileStats *stats = nullptr
+);
+/// same, but with a parser that's already set up
+Tailslide::LSLScript *analyzeScriptBytes(Tailslide::ScopedScriptParser *parser, const std::string &source);
+
 void assertNoLintErrors(Tailslide::Logger *logger, const std::string& name);
 
+std::string readExpectedOutput(const char *expected_prefix, const char *name);
+
 void checkPrettyPrintOutput(
         const char *name,
         const Tailslide::OptimizationOptions &ctx,
@@ -1,6 +1,16 @@
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
 #include "tailslide.hh"
 #include "doctest.hh"
 #include "bitstream.hh"
+#include "text_writer.hh"
+#include "compile_cache.hh"
+#include "passes/mono/script_compiler.hh"
+#include "sha256.hh"
 
 using namespace Tailslide;
 
@@ -122,6 +132,280 @@ TEST_CASE("Bitstream read_only")
   CHECK(bs2.isReadOnly());
 }
 
+TEST_CASE("Bitstream grows geometrically") {
+  BitStream bs;
+  uint32_t num_reallocs = 0;
+  size_t last_alloc = bs.allocatedSize();
+  for (uint32_t i = 0; i < 1000000; ++i) {
+    bs << (uint8_t)i;
+    if (bs.allocatedSize() != last_alloc) {
+      last_alloc = bs.allocatedSize();
+      ++num_reallocs;
+    }
+  }
+  CHECK_EQ(bs.size(), 1000000);
+  CHECK_LT(num_reallocs, 32);
+
+  // growing within the existing allocation shouldn't expose old data
+  bs.resize(1);
+  bs.resize(2);
+  CHECK_EQ(bs.data()[1], 0);
+}
+
+TEST_CASE("Bitstream reserve") {
+  BitStream bs;
+  bs.reserve(100);
+  auto *old_data = bs.data();
+  CHECK_GE(bs.allocatedSize(), 100);
+  for (uint32_t i = 0; i < 25; ++i)
+    bs << i;
+  CHECK_EQ(bs.data(), old_data);
+  CHECK_EQ(bs.size(), 100);
+  // never shrinks
+  bs.reserve(10);
+  CHECK_GE(bs.allocatedSize(), 100);
+}
+
+TEST_CASE("Bitstream span writes") {
+  const int32_t vals[] = {1, 2, 3};
+  BitStream bs(ENDIAN_BIG);
+  bs.writeSpan(vals, 3);
+  CHECK_EQ(bs.size(), 12);
+  CHECK_EQ(bs.data()[3], 0x01);
+  CHECK_EQ(bs.data()[11], 0x03);
+
+  const uint8_t bytes[] = {4, 5};
+  bs.writeSpan(bytes, 2);
+  CHECK_EQ(bs.size(), 14);
+  CHECK_EQ(bs.data()[13], 0x05);
+}
+
+TEST_CASE("Bitstream child streams") {
+  BitStream parent(ENDIAN_BIG);
+  parent << (uint8_t)1;
+  {
+    auto child = parent.makeChild(8);
+    child << (int32_t)2;
+    child.writeSpan((const uint8_t *)"ab", 2);
+    CHECK_EQ(child.size(), 6);
+    // the bytes land in the parent's buffer without being copied
+    CHECK_EQ(parent.data()[4], 0x02);
+    CHECK_EQ(parent.data()[5], 'a');
+    // and the child can't grow past the region it was given
+    CHECK_THROWS_AS(child << (int32_t)3, std::length_error);
+
+    // shrinking the child shouldn't leave its old bytes behind in the parent
+    child.resize(4);
+    CHECK_EQ(parent.data()[5], 0);
+    parent.moveBy(child.size());
+  }
+  CHECK_EQ(parent.pos(), 5);
+  parent << (uint8_t)3;
+  CHECK_EQ(parent.data()[5], 3);
+}
+
+TEST_CASE("Float formatting matches printf") {
+  const double vals[] = {
+      0.0, -0.0, 1.0, -1.5, 0.1, 100000.0, 1000000.0, 123456.5, 1e-4, 1.5e-5,
+      3.14159265358979, 1e38, -2.5e-40, 999999.4, 0.00012345678,
+  };
+  char expected[64], actual[64];
+  for (auto val : vals) {
+    for (bool alt : {false, true}) {
+      snprintf(expected, sizeof(expected), alt ? "%#.6g" : "%.6g", val);
+      size_t len = format_float(actual, sizeof(actual), val, 6, alt);
+      CHECK_EQ(std::string(actual, len), std::string(expected));
+    }
+  }
+}
+
+TEST_CASE("TextWriter chunking") {
+  TextWriter writer;
+  std::string expected;
+  for (int i = 0; i < 20000; ++i) {
+    writer << "line " << i << ' ' << (uint64_t)i * 3 << '\n';
+    expected += "line " + std::to_string(i) + " " + std::to_string((uint64_t)i * 3) + "\n";
+  }
+  CHECK_GT(expected.size(), TextWriter::CHUNK_SIZE);
+  CHECK_EQ(writer.size(), expected.size());
+  CHECK_EQ(writer.str(), expected);
+}
+
+TEST_CASE("TextWriter streaming to a file descriptor") {
+  FILE *f = tmpfile();
+  REQUIRE(f != nullptr);
+  std::string expected;
+  {
+    TextWriter writer;
+    writer << "before ";
+    writer.setOutputFD(fileno(f));
+    for (int i = 0; i < 20000; ++i)
+      writer << i << '\n';
+    // only ever holds onto a single chunk
+    CHECK_LE(writer.str().size(), TextWriter::CHUNK_SIZE);
+    writer.flush();
+    CHECK(writer.str().empty());
+  }
+  expected = "before ";
+  for (int i = 0; i < 20000; ++i)
+    expected += std::to_string(i) + "\n";
+
+  std::string actual(expected.size() + 1, '\0');
+  fseek(f, 0, SEEK_SET);
+  actual.resize(fread(actual.data(), 1, actual.size(), f));
+  fclose(f);
+  CHECK_EQ(actual, expected);
+}
+
+#ifndef _WIN32
+TEST_CASE("TextWriter reports failed writes") {
+  // can't write to a descriptor that was only opened for reading
+  FILE *f = fopen("/dev/null", "rb");
+  REQUIRE(f != nullptr);
+  {
+    TextWriter writer(fileno(f));
+    writer << "hello";
+    CHECK_FALSE(writer.hasFailed());
+    CHECK_THROWS_AS(writer.flush(), std::runtime_error);
+    CHECK(writer.hasFailed());
+    // and nothing more gets written after part of the output went missing
+    CHECK_THROWS_AS(writer.flush(), std::runtime_error);
+  }
+  fclose(f);
+}
+#endif
+
+TEST_CASE("SHA256 known digests") {
+  SHA256 hash;
+  CHECK_EQ(SHA256::toHex(hash.finish()), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  hash.reset();
+  hash.update("abc");
+  CHECK_EQ(SHA256::toHex(hash.finish()), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+  // spans multiple blocks, fed in pieces that don't line up with them
+  hash.reset();
+  std::string million_a(1000000, 'a');
+  for (size_t i = 0; i < million_a.size(); i += 999)
+    hash.update(std::string_view(million_a).substr(i, 999));
+  CHECK_EQ(SHA256::toHex(hash.finish()), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST_CASE("Compile cache keys") {
+  auto key_for = [](std::string_view source, const MonoCompilationOptions &options) {
+    return CompileCacheKey(source).add(options).finish();
+  };
+  MonoCompilationOptions options {};
+  MonoCompilationOptions other_options {};
+  other_options.peephole_optimize = true;
+
+  CHECK_EQ(key_for("default{}", options), key_for("default{}", options));
+  CHECK_NE(key_for("default{}", options), key_for("default {}", options));
+  CHECK_NE(key_for("default{}", options), key_for("default{}", other_options));
+  // field boundaries can't be shifted around to make the same key
+  CHECK_NE(CompileCacheKey("").add("ab", "c").finish(), CompileCacheKey("").add("a", "bc").finish());
+}
+
+static std::filesystem::path make_cache_dir() {
+  std::random_device rd;
+  auto dir = std::filesystem::temp_directory_path() / ("tailslide_cache_test_" + std::to_string(rd()));
+  std::filesystem::remove_all(dir);
+  return dir;
+}
+
+TEST_CASE("Compile cache round trip") {
+  auto dir = make_cache_dir();
+  CompileCache cache(dir.string());
+  auto key = CompileCacheKey("default{}").finish();
+  CHECK_EQ(cache.lookup(key), nullptr);
+
+  std::string binary("\0\1\2\xff", 4);
+  REQUIRE(cache.store(key, {{"cil", ".assembly foo"}, {"assembly", binary}, {"empty", ""}}));
+  auto cached = cache.lookup(key);
+  REQUIRE(cached != nullptr);
+  CHECK_EQ(cached->get("cil"), ".assembly foo");
+  CHECK_EQ(cached->get("assembly"), binary);
+  CHECK(cached->has("empty"));
+  CHECK_FALSE(cached->has("lso"));
+  CHECK_EQ(cached->getSections().size(), 3);
+
+  // only keys that could've come from `CompileCacheKey` are allowed
+  CHECK_FALSE(cache.store("../escaped", {{"cil", ""}}));
+  CHECK_EQ(cache.lookup("../escaped"), nullptr);
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Compile cache ignores corrupt entries") {
+  auto dir = make_cache_dir();
+  CompileCache cache(dir.string());
+  auto key = CompileCacheKey("default{}").finish();
+  REQUIRE(cache.store(key, {{"cil", ".assembly foo"}}));
+  auto path = dir / (key + ".tsc");
+  auto size = std::filesystem::file_size(path);
+  std::filesystem::resize_file(path, size - 1);
+  CHECK_EQ(cache.lookup(key), nullptr);
+  CHECK_FALSE(std::filesystem::exists(path));
+
+  std::ofstream(path, std::ios::binary) << "not a cache entry";
+  CHECK_EQ(cache.lookup(key), nullptr);
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Compile cache evicts least recently used entries") {
+  auto dir = make_cache_dir();
+  std::string contents(1000, 'x');
+  CompileCache cache(dir.string(), 2500);
+  auto first = CompileCacheKey("first").finish();
+  auto second = CompileCacheKey("second").finish();
+  auto third = CompileCacheKey("third").finish();
+
+  REQUIRE(cache.store(first, {{"cil", contents}}));
+  REQUIRE(cache.store(second, {{"cil", contents}}));
+  // make sure the entries' times differ regardless of filesystem timestamp resolution
+  auto now = std::filesystem::file_time_type::clock::now();
+  std::filesystem::last_write_time(dir / (first + ".tsc"), now - std::chrono::hours(2));
+  std::filesystem::last_write_time(dir / (second + ".tsc"), now - std::chrono::hours(1));
+  // using the first entry should make the second the oldest
+  CHECK_NE(cache.lookup(first), nullptr);
+
+  REQUIRE(cache.store(third, {{"cil", contents}}));
+  CHECK_NE(cache.lookup(first), nullptr);
+  CHECK_EQ(cache.lookup(second), nullptr);
+  CHECK_NE(cache.lookup(third), nullptr);
+  CHECK_LE(cache.evict(), 2500);
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Compile cache only rescans once over its limit") {
+  auto dir = make_cache_dir();
+  std::string contents(1000, 'x');
+  CompileCache cache(dir.string(), 2500);
+  auto first = CompileCacheKey("first").finish();
+  auto second = CompileCacheKey("second").finish();
+  auto third = CompileCacheKey("third").finish();
+
+  // replacing an entry shouldn't count it twice
+  for (int i = 0; i < 4; ++i)
+    REQUIRE(cache.store(first, {{"cil", contents}}));
+  // pretend another process added an entry, this one hasn't seen it yet.
+  auto foreign_path = dir / (CompileCacheKey("foreign").finish() + ".tsc");
+  std::ofstream(foreign_path, std::ios::binary) << contents;
+
+  REQUIRE(cache.store(second, {{"cil", contents}}));
+  CHECK(std::filesystem::exists(foreign_path));
+  auto now = std::filesystem::file_time_type::clock::now();
+  std::filesystem::last_write_time(dir / (first + ".tsc"), now - std::chrono::hours(3));
+  std::filesystem::last_write_time(foreign_path, now - std::chrono::hours(2));
+  std::filesystem::last_write_time(dir / (second + ".tsc"), now - std::chrono::hours(1));
+
+  // going over the tracked limit rescans, which finds the foreign entry too.
+  REQUIRE(cache.store(third, {{"cil", contents}}));
+  CHECK_FALSE(std::filesystem::exists(foreign_path));
+  CHECK_EQ(cache.lookup(first), nullptr);
+  CHECK_NE(cache.lookup(second), nullptr);
+  CHECK_NE(cache.lookup(third), nullptr);
+  std::filesystem::remove_all(dir);
+}
+
 TEST_CASE("LLoc comparison works correctly") {
   TailslideLType smaller {0, 1, 2, 3};
   TailslideLType bigger {1, 1, 2, 3};